@@ -293,6 +293,9 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
     if (!params.tensor_buft_overrides.empty()) {
         params.tensor_buft_overrides.push_back({nullptr, nullptr});
     }
+    if (!params.cache_type_overrides.empty()) {
+        params.cache_type_overrides.push_back({nullptr, GGML_TYPE_COUNT});
+    }
 
     if (!params.chat_template.empty() && !common_chat_verify_template(params.chat_template, params.use_jinja)) {
         throw std::runtime_error(string_format(
@@ -322,7 +325,27 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
     return true;
 }
 
+static ggml_type kv_cache_type_from_str(const std::string & s);
+
 namespace {
+bool parse_cache_type_overrides(const std::string& value, std::vector<llama_kv_cache_type_override>& overrides) {
+    for (const auto & override : string_split<std::string>(value, ',')) {
+        std::string::size_type pos = override.rfind('=');
+        if (pos == std::string::npos) {
+            fprintf(stderr, "Invalid cache type override argument %s\n", value.c_str());
+            return false;
+        }
+        ggml_type type;
+        try {
+            type = kv_cache_type_from_str(override.substr(pos + 1));
+        } catch (const std::runtime_error & e) {
+            fprintf(stderr, "%s\n", e.what());
+            return false;
+        }
+        overrides.push_back({strdup(override.substr(0, pos).c_str()), type});
+    }
+    return true;
+}
 bool parse_buft_overrides(const std::string& value, std::vector<llama_model_tensor_buft_override>& overrides) {
     /* static */ std::map<std::string, ggml_backend_buffer_type_t> buft_list;
     if (buft_list.empty()) {
@@ -596,6 +619,20 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.defrag_thold = std::stof(argv[i]);
         return true;
     }
+    if (arg == "--kv-block-size") {
+        CHECK_ARG
+        params.kv_block_size = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--defrag-max-cells") {
+        CHECK_ARG
+        params.defrag_max_cells = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--swa-full") {
+        params.swa_full = true;
+        return true;
+    }
     if (arg == "--samplers") {
         CHECK_ARG
         const auto sampler_names = string_split(argv[i], ";");
@@ -970,6 +1007,14 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.cache_type_v = argv[++i];
         return true;
     }
+    if (arg == "-cto" || arg == "--cache-type-override") {
+        CHECK_ARG
+        if (!parse_cache_type_overrides(std::string{ argv[i] }, params.cache_type_overrides)) {
+            fprintf(stderr, "error: Invalid cache type override: %s\n", argv[i]);
+            invalid_param = true;
+        }
+        return true;
+    }
     if (arg == "-ctkd" || arg == "--cache-type-k-draft") {
         params.cache_type_k_draft = argv[++i];
         return true;
@@ -1188,6 +1233,7 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
         else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
         else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+        else if (value == "partition") { params.numa = GGML_NUMA_STRATEGY_PARTITION; }
         else { invalid_param = true; }
         return true;
     }
@@ -1232,6 +1278,41 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.lookup_cache_dynamic = argv[i];
         return true;
     }
+    if (arg == "--profile") {
+        CHECK_ARG
+        params.profile_file = argv[i];
+        return true;
+    }
+    if (arg == "--profile-sample") {
+        CHECK_ARG
+        params.profile_sample = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--expert-stats") {
+        params.expert_stats = true;
+        return true;
+    }
+    if (arg == "--expert-stats-file") {
+        CHECK_ARG
+        params.expert_stats_file = argv[i];
+        params.expert_stats = true;
+        return true;
+    }
+    if (arg == "--hot-experts") {
+        CHECK_ARG
+        params.hot_experts_file = argv[i];
+        return true;
+    }
+    if (arg == "--hot-experts-n") {
+        CHECK_ARG
+        params.n_hot_experts = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--expert-prefetch") {
+        CHECK_ARG
+        params.expert_prefetch = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--save-all-logits" || arg == "--kl-divergence-base") {
         CHECK_ARG
         params.logits_file = argv[i];
@@ -1452,6 +1533,11 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.n_threads_http = std::stoi(argv[i]);
         return true;
     }
+    if (arg == "--threads-sampling") {
+        CHECK_ARG
+        params.n_threads_sampling = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-spf" || arg == "--system-prompt-file") {
         CHECK_ARG
         std::ifstream file(argv[i]);
@@ -1498,6 +1584,29 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         }
         return true;
     }
+    if (arg == "--slot-save-compress") {
+        params.slot_save_compress = true;
+        return true;
+    }
+    if (arg == "--kv-pool-size") {
+        CHECK_ARG
+        params.kv_pool_size = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--prefix-cache") {
+        CHECK_ARG
+        params.prefix_cache = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--step-budget") {
+        CHECK_ARG
+        params.step_budget = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--decode-pipeline") {
+        params.decode_pipeline = true;
+        return true;
+    }
     if (arg == "--reasoning-budget") {
         CHECK_ARG
         params.reasoning_budget = std::stoi(argv[i]);
@@ -1788,6 +1897,15 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "path to static lookup cache to use for lookup decoding (not updated by generation)" });
     options.push_back({ "*",           "-lcd,  --lookup-cache-dynamic FNAME",
                                                                         "path to dynamic lookup cache to use for lookup decoding (updated by generation)" });
+    options.push_back({ "*",           "       --profile FNAME",        "write per-op CPU timings as Chrome trace JSON (open in Perfetto)" });
+    options.push_back({ "*",           "       --profile-sample N",     "profile every N-th graph (default: %d)", params.profile_sample });
+    options.push_back({ "*",           "       --expert-stats",         "count how often each expert of a MoE model is selected (server: /metrics)" });
+    options.push_back({ "*",           "       --expert-stats-file FNAME",
+                                                                        "count expert usage and write the counts to FNAME on exit" });
+    options.push_back({ "*",           "       --hot-experts FNAME",    "lock the most used experts according to FNAME (from --expert-stats-file) in RAM" });
+    options.push_back({ "*",           "       --hot-experts-n N",      "number of experts per layer locked with --hot-experts (default: %d)", params.n_hot_experts });
+    options.push_back({ "*",           "       --expert-prefetch N",    "readahead of mmap-ed expert weights: 0 = off, 1 = selected experts,\n"
+                                                                        "2 = also the likely experts of the next layer (default: %d)", params.expert_prefetch });
 
     options.push_back({ "*",           "-c,    --ctx-size N",           "size of the prompt context (default: %d, 0 = loaded from model)", params.n_ctx });
     options.push_back({ "*",           "-cd,   --ctx-size-draft N",     "size of the prompt context for the draft model (default: %d, 0 = loaded from model)", params.n_ctx_draft });
@@ -1913,6 +2031,9 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "*",           "-nkvo, --no-kv-offload",        "disable KV offload" });
     options.push_back({ "*",           "-ctk,  --cache-type-k TYPE",    "KV cache data type for K (default: %s)", params.cache_type_k.c_str() });
     options.push_back({ "*",           "-ctv,  --cache-type-v TYPE",    "KV cache data type for V (default: %s)", params.cache_type_v.c_str() });
+    options.push_back({ "*",           "-cto,  --cache-type-override PATTERN=TYPE,...",
+                                                                        "KV cache data type for the layers whose cache tensor name matches the regex\n"
+                                                                        "(cache_k_l<il>, cache_v_l<il>), e.g. \"cache_[kv]_l([4-9]|[1-5][0-9])$=q4_0\"" });
     options.push_back({ "*",           "-ctkd, --cache-type-k-draft TYPE", "KV cache data type for K for the draft model" });
     options.push_back({ "*",           "-ctvd, --cache-type-v-draft TYPE", "KV cache data type for V for the draft model" });
 
@@ -1932,6 +2053,12 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
 
     options.push_back({ "parallel" });
     options.push_back({ "*",           "-dt,   --defrag-thold N",       "KV cache defragmentation threshold (default: %.1f, < 0 - disabled)", (double)params.defrag_thold });
+    options.push_back({ "*",           "       --kv-block-size N",      "allocate the KV cache in blocks of N cells per sequence, requires -fa and a KV cache\n"
+                                                                        "in RAM (default: %d, 0 = contiguous)", params.kv_block_size });
+    options.push_back({ "*",           "       --defrag-max-cells N",   "move at most N KV cells per decode when defragmenting, spreading the defragmentation\n"
+                                                                        "over several decodes (default: %d, 0 = all at once)", params.defrag_max_cells });
+    options.push_back({ "*",           "       --swa-full",             "use a full-size KV cache for the sliding-window attention layers instead of one that\n"
+                                                                        "only holds the window of each sequence (default: %s)", params.swa_full ? "enabled" : "disabled" });
     options.push_back({ "*",           "-np,   --parallel N",           "number of parallel sequences to decode (default: %d)", params.n_parallel });
     options.push_back({ "*",           "-ns,   --sequences N",          "number of sequences to decode (default: %d)", params.n_sequences });
     options.push_back({ "*",           "-cb,   --cont-batching",        "enable continuous batching (a.k.a dynamic batching) (default: %s)", params.cont_batching ? "enabled" : "disabled" });
@@ -1957,6 +2084,8 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "  - distribute: spread execution evenly over all nodes\n"
                                                                         "  - isolate: only spawn threads on CPUs on the node that execution started on\n"
                                                                         "  - numactl: use the CPU map provided by numactl\n"
+                                                                        "  - partition: distribute, and place the rows of each weight matrix on the node whose threads use them\n"
+                                                                        "    (the weights are then loaded into anonymous memory instead of using mmap)\n"
                                                                         "if run without this previously, it is recommended to drop the system page cache before using this\n"
                                                                         "see https://github.com/ggerganov/llama.cpp/issues/1437" });
 
@@ -2042,6 +2171,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "server",      "       --ssl-cert-file FNAME",  "path to file a PEM-encoded SSL certificate" });
     options.push_back({ "server",      "       --timeout N",            "server read/write timeout in seconds (default: %d)", params.timeout_read });
     options.push_back({ "server",      "       --threads-http N",       "number of threads used to process HTTP requests (default: %d)", params.n_threads_http });
+    options.push_back({ "server",      "       --threads-sampling N",   "number of threads sampling the slots in parallel (default: %d, -1 = min(--parallel, --threads))", params.n_threads_sampling });
     options.push_back({ "server",      "       --system-prompt-file FNAME",
                                                                         "set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications" });
     options.push_back({ "server",      "       --log-format {text,json}",
@@ -2049,6 +2179,15 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "server",      "       --metrics",              "enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --no-slots",             "disables slots monitoring endpoint (default: %s)", params.endpoint_slots ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --slot-save-path PATH",  "path to save slot kv cache (default: disabled)" });
+    options.push_back({ "server",      "       --slot-save-compress",   "compress the saved slot kv cache (restore detects the format)" });
+    options.push_back({ "server",      "       --kv-pool-size N",       "size in MiB of the host memory pool that takes the compressed KV cache of idle slots when the KV cache is full;\n"
+                                                                        "slots can then use the whole context (default: %d, 0 = disabled)", params.kv_pool_size });
+    options.push_back({ "server",      "       --prefix-cache N",       "max number of prompt prefixes kept in the KV cache, a new prompt reuses the longest\n"
+                                                                        "cached prefix from any slot (default: %d, 0 = disabled)", params.prefix_cache });
+    options.push_back({ "server",      "       --step-budget N",        "max number of tokens decoded per step while slots are generating, long prompts are then\n"
+                                                                        "processed in chunks between the generation steps (default: %d, 0 = n_batch)", params.step_budget });
+    options.push_back({ "server",      "       --decode-pipeline",      "decode the next step of the generating slots while the tokens of the last one are\n"
+                                                                        "post-processed and sent (default: %s)", params.decode_pipeline ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --chat-template JINJA_TEMPLATE",
                                                                         "set custom jinja chat template (default: template taken from model's metadata)\n"
                                                                         "only commonly used templates are accepted:\n"
@@ -2671,6 +2810,10 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.repack_tensors  = params.repack_tensors;
     mparams.use_thp         = params.use_thp;
     mparams.validate_quants = params.validate_quants;
+    if (!params.hot_experts_file.empty()) {
+        mparams.hot_experts_file = params.hot_experts_file.c_str();
+        mparams.n_hot_experts    = params.n_hot_experts;
+    }
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -2748,6 +2891,9 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.defrag_max_cells  = std::max(0, params.defrag_max_cells);
+    cparams.swa_full          = params.swa_full;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -2762,8 +2908,20 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
 
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
+    if (!params.cache_type_overrides.empty()) {
+        GGML_ASSERT(params.cache_type_overrides.back().pattern == nullptr && "Cache type overrides not terminated with empty pattern");
+        cparams.kv_type_overrides = params.cache_type_overrides.data();
+    }
 
     if (!params.offload_policy.empty()) cparams.offload_policy = (void *)&params.offload_policy;
+    if (!params.profile_file.empty()) {
+        cparams.profile_file   = params.profile_file.c_str();
+        cparams.profile_sample = params.profile_sample;
+    }
+    if (params.expert_stats) {
+        cparams.expert_stats_file = params.expert_stats_file.c_str();
+    }
+    cparams.expert_prefetch = params.expert_prefetch;
 
     return cparams;
 }
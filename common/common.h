@@ -144,6 +144,11 @@ struct gpt_params {
     int32_t grp_attn_n            =     1; // group-attention factor
     int32_t grp_attn_w            =   512; // group-attention width
     int32_t n_print               =    -1; // print token count every n tokens (-1 = disabled)
+    int32_t profile_sample        =     1; // profile every N-th CPU graph (with --profile)
+    int32_t n_hot_experts         =    16; // number of most used experts per layer to lock in RAM (with --hot-experts)
+    int32_t expert_prefetch       =     0; // readahead of mmap-ed expert weights (0 = off, 1 = selected, 2 = also predicted)
+    int32_t kv_block_size         =     0; // cells per block of a paged KV cache (0 = contiguous KV cache)
+    int32_t defrag_max_cells      =     0; // max KV cells moved per decode by the defragmentation (0 = all at once)
     float   rope_freq_base        =  0.0f; // RoPE base frequency
     float   rope_freq_scale       =  0.0f; // RoPE frequency scaling factor
     float   yarn_ext_factor       = -1.0f; // YaRN extrapolation mix factor
@@ -183,6 +188,9 @@ struct gpt_params {
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding
     std::string logits_file          = ""; // file for saving *all* logits
+    std::string profile_file         = ""; // Chrome trace JSON file for per-op CPU timings
+    std::string expert_stats_file    = ""; // file for the expert usage counts written on exit
+    std::string hot_experts_file     = ""; // expert usage counts used to lock the hot experts in RAM
     std::string rpc_servers          = ""; // comma separated list of RPC servers
 
     std::vector<std::string> in_files;   // all input files
@@ -243,11 +251,13 @@ struct gpt_params {
     bool logits_all        = false; // return logits for all tokens in the batch
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool expert_stats      = false; // count expert usage (implied by --expert-stats-file)
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool display_prompt    = true;  // print prompt before generation
     bool infill            = false; // use infill mode
     bool dump_kv_cache     = false; // dump the KV cache contents for debugging purposes
     bool no_kv_offload     = false; // disable KV offloading
+    bool swa_full          = false; // full-size KV cache for the sliding-window attention layers
     bool warmup            = true;  // warmup run
     bool batch_warmup      = false; // batch warmup run
     bool check_tensors     = false; // validate tensor data
@@ -260,6 +270,7 @@ struct gpt_params {
     std::string cache_type_v = "f16"; // KV cache data type for the V
     std::string cache_type_k_draft = ""; // KV cache data type for K for the draft model
     std::string cache_type_v_draft = ""; // KV cache data type for V for the draft model
+    std::vector<llama_kv_cache_type_override> cache_type_overrides; // per-layer KV cache data types
 
     // multimodal models (see examples/mtmd)
     model_paths mmproj;
@@ -278,6 +289,7 @@ struct gpt_params {
     int32_t timeout_read   = 600;          // http read timeout in seconds
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests
+    int32_t n_threads_sampling = -1;       // number of threads sampling the server slots in parallel (-1 = min(n_parallel, n_threads))
     bool    send_done      = false;        // send done message as required for OAI compatibility
 
     std::string hostname      = "127.0.0.1";
@@ -306,6 +318,11 @@ struct gpt_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    bool        slot_save_compress = false; // save the slots with llama_state_seq_save_file_compressed
+    int32_t     kv_pool_size = 0; // host memory pool for the KV cache of idle slots in MiB (0 = disabled)
+    int32_t     prefix_cache = 0; // max number of token prefixes kept in the KV cache for reuse by any slot (0 = disabled)
+    int32_t     step_budget  = 0; // max number of tokens decoded per step while slots are generating (0 = n_batch)
+    bool        decode_pipeline = false; // process the sampled tokens of a step while the next one is decoded
     std::string sql_save_file;
     std::string sqlite_zstd_ext_file;
 
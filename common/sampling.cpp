@@ -391,7 +391,7 @@ static void sampler_queue(
             case llama_sampler_type::TYPICAL_P  : llama_sample_typical  (ctx_main, &cur_p, typical_p, min_keep); break;
             case llama_sampler_type::TOP_P      : llama_sample_top_p    (ctx_main, &cur_p, top_p,     min_keep); break;
             case llama_sampler_type::MIN_P      : llama_sample_min_p    (ctx_main, &cur_p, min_p,     min_keep); break;
-            case llama_sampler_type::XTC        : llama_sample_xtc      (ctx_main, &cur_p, xtc_probability, xtc_threshold, min_keep); break;
+            case llama_sampler_type::XTC        : llama_sample_xtc_with_rng(ctx_main, &cur_p, xtc_probability, xtc_threshold, min_keep, ctx_sampling->rng); break;
             case llama_sampler_type::TOP_N_SIGMA: llama_sample_top_n_sigma(ctx_main, &cur_p, top_n_sigma); break;
             case llama_sampler_type::TEMPERATURE:
                 if (dynatemp_range > 0) {
@@ -438,10 +438,10 @@ static llama_token llama_sampling_sample_impl(
         if (mirostat == 1) {
             const int mirostat_m = 100;
             llama_sample_temp(ctx_main, &cur_p, temp);
-            id = llama_sample_token_mirostat(ctx_main, &cur_p, mirostat_tau, mirostat_eta, mirostat_m, &ctx_sampling->mirostat_mu);
+            id = llama_sample_token_mirostat_with_rng(ctx_main, &cur_p, mirostat_tau, mirostat_eta, mirostat_m, &ctx_sampling->mirostat_mu, ctx_sampling->rng);
         } else if (mirostat == 2) {
             llama_sample_temp(ctx_main, &cur_p, temp);
-            id = llama_sample_token_mirostat_v2(ctx_main, &cur_p, mirostat_tau, mirostat_eta, &ctx_sampling->mirostat_mu);
+            id = llama_sample_token_mirostat_v2_with_rng(ctx_main, &cur_p, mirostat_tau, mirostat_eta, &ctx_sampling->mirostat_mu, ctx_sampling->rng);
         } else {
             // temperature sampling
             size_t min_keep = std::max(1, params.min_keep);
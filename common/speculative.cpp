@@ -266,9 +266,15 @@ std::vector<llama_token> llama_speculative_gen_draft(
         }
 
         if (reuse_n < (int) prompt_dft.size()) {
-            llama_kv_cache_seq_rm (ctx_dft, 0, reuse_n, -1);
-
-            prompt_dft.erase(prompt_dft.begin() + reuse_n, prompt_dft.end());
+            if (llama_kv_cache_seq_rm(ctx_dft, 0, reuse_n, -1)) {
+                prompt_dft.erase(prompt_dft.begin() + reuse_n, prompt_dft.end());
+            } else {
+                // the windowed SWA cache no longer holds the window before reuse_n: evaluate the prompt again
+                llama_kv_cache_clear(ctx_dft);
+
+                prompt_dft.clear();
+                reuse_n = 0;
+            }
         }
     }
 
@@ -0,0 +1,136 @@
+#include "ggml.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Micro-benchmark of the CPU thread synchronization in ggml_graph_compute().
+// Every node of the test graph is a tiny op, so the time per node is dominated by the barrier that follows it.
+
+struct benchmark_params_struct {
+    int32_t n_threads    = std::thread::hardware_concurrency();
+    int32_t n_nodes      = 1000;
+    int32_t n_iterations = 20;
+};
+
+static void print_usage(int /*argc*/, char ** argv, struct benchmark_params_struct params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -t N, --threads N     maximum number of threads, powers of 2 up to N are tested (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  -n N, --nodes N       number of nodes in the graph (default: %d)\n", params.n_nodes);
+    fprintf(stderr, "  -i N, --iter N        number of iterations per thread count (default: %d)\n", params.n_iterations);
+    fprintf(stderr, "\n");
+}
+
+static double run_graph(ggml_cgraph * graph, int n_threads, ggml_threadpool * threadpool, int n_iterations) {
+    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
+    std::vector<uint8_t> work(plan.work_size);
+    plan.work_data  = work.data();
+    plan.threadpool = threadpool;
+
+    // warm-up
+    ggml_graph_compute(graph, &plan);
+
+    const int64_t t_start = ggml_time_us();
+    for (int i = 0; i < n_iterations; ++i) {
+        ggml_graph_compute(graph, &plan);
+    }
+    const int64_t t_end = ggml_time_us();
+
+    return double(t_end - t_start)/n_iterations;
+}
+
+int main(int argc, char ** argv) {
+    struct benchmark_params_struct params;
+
+    bool invalid_param = false;
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-t" || arg == "--threads") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_threads = std::stoi(argv[i]);
+        } else if (arg == "-n" || arg == "--nodes") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_nodes = std::stoi(argv[i]);
+        } else if (arg == "-i" || arg == "--iter") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_iterations = std::stoi(argv[i]);
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv, params);
+            exit(0);
+        } else {
+            invalid_param = true;
+            break;
+        }
+    }
+    if (invalid_param || params.n_threads < 1 || params.n_nodes < 1 || params.n_iterations < 1) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv, params);
+        exit(1);
+    }
+
+    ggml_time_init();
+
+    struct ggml_init_params ctx_params = {
+        /*.mem_size   =*/ ggml_graph_overhead_custom(params.n_nodes + 1, false) + (params.n_nodes + 1)*(ggml_tensor_overhead() + 64*sizeof(float)),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(ctx_params);
+
+    // a chain of tiny additions: only the first thread has work, all others go straight to the barrier
+    struct ggml_tensor * x = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 16);
+    ggml_set_f32(x, 1.0f);
+    struct ggml_tensor * cur = x;
+    for (int i = 0; i < params.n_nodes; ++i) {
+        cur = ggml_add(ctx, cur, x);
+    }
+
+    struct ggml_cgraph * graph = ggml_new_graph_custom(ctx, params.n_nodes + 1, false);
+    ggml_build_forward_expand(graph, cur);
+
+    printf("| %8s | %14s | %14s | %14s |\n", "threads", "graph (us)", "barrier (us)", "no pool (us)");
+    printf("| -------: | -------------: | -------------: | -------------: |\n");
+
+    ggml_threadpool * threadpool = ggml_threadpool_new(params.n_threads);
+
+    for (int n_threads = 1; ; n_threads = std::min(2*n_threads, params.n_threads)) {
+        const double t_pool    = run_graph(graph, n_threads, threadpool, params.n_iterations);
+        const double t_no_pool = run_graph(graph, n_threads, nullptr,    params.n_iterations);
+
+        printf("| %8d | %14.1f | %14.3f | %14.3f |\n", n_threads, t_pool, t_pool/graph->n_nodes, t_no_pool/graph->n_nodes);
+
+        if (n_threads == params.n_threads) {
+            break;
+        }
+    }
+
+    const float expected = params.n_nodes + 1.0f;
+    const float result   = ggml_get_f32_1d(cur, 0);
+    if (result != expected) {
+        fprintf(stderr, "error: got %g, expected %g\n", result, expected);
+        return 1;
+    }
+
+    ggml_threadpool_free(threadpool);
+    ggml_free(ctx);
+
+    return 0;
+}
@@ -42,6 +42,10 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // the rejected n-grams are cut from the KV cache after every step, which a windowed SWA cache cannot always
+    // do (llama_kv_cache_seq_rm() returns false), and the sequences of the lookahead tree cannot be rebuilt
+    params.swa_full = true;
+
     const int W = 15; // lookahead window
     const int N = 5;  // n-gram size
     const int G = 15; // max verification n-grams
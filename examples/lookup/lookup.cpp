@@ -194,7 +194,11 @@ int main(int argc, char ** argv){
 
         // KV cache management
         // clean the cache of draft tokens that weren't accepted
-        llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+        if (!llama_kv_cache_seq_rm(ctx, 0, n_past, -1)) {
+            // the windowed SWA cache no longer holds the window before n_past: evaluate the accepted tokens again
+            llama_kv_cache_clear(ctx);
+            llama_decode(ctx, llama_batch_get_one(inp.data(), n_past, 0, 0));
+        }
 
         llama_batch_clear(batch_tgt);
         llama_batch_add(batch_tgt, draft[0], n_past, { 0 }, true);
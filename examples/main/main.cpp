@@ -366,7 +366,13 @@ int main(int argc, char ** argv) {
         }
 
         // remove any "future" tokens that we might have inherited from the previous session
-        llama_kv_cache_seq_rm(ctx, -1, n_matching_session_tokens, -1);
+        if (!llama_kv_cache_seq_rm(ctx, -1, n_matching_session_tokens, -1)) {
+            // the windowed SWA cache no longer holds the window before the cut: evaluate the whole prompt again
+            LOG_TEE("%s: cannot reuse part of the session, reevaluating the prompt\n", __func__);
+            llama_kv_cache_clear(ctx);
+            n_matching_session_tokens = 0;
+            session_tokens.clear();
+        }
     }
 
     LOGLN(
@@ -399,7 +399,10 @@ int main(int argc, char ** argv) {
             }
             if (line == "/clear") {
                 ctx.n_past = 0;
-                llama_kv_cache_seq_rm(ctx.lctx, 0, 1, -1);
+                if (!llama_kv_cache_seq_rm(ctx.lctx, 0, 1, -1)) {
+                    // the windowed SWA cache no longer holds the BOS window
+                    llama_kv_cache_clear(ctx.lctx);
+                }
                 //llama_memory_seq_rm(llama_get_memory(ctx.lctx), 0, 1, -1); // keep BOS
                 LOG_TEE("Chat history cleared\n\n");
                 continue;
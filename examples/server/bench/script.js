@@ -56,6 +56,7 @@ const llamacpp_completion_tokens = new Trend('llamacpp_completion_tokens')
 
 const llamacpp_tokens_second = new Trend('llamacpp_tokens_second')
 const llamacpp_prompt_processing_second = new Trend('llamacpp_prompt_processing_second')
+const llamacpp_token_delivery_ms = new Trend('llamacpp_token_delivery_ms', true)
 
 const llamacpp_prompt_tokens_total_counter = new Counter('llamacpp_prompt_tokens_total_counter')
 const llamacpp_completion_tokens_total_counter = new Counter('llamacpp_completion_tokens_total_counter')
@@ -98,14 +99,19 @@ export default function () {
 
     const startTime = new Date()
     let promptEvalEndTime = null
+    let lastEventTime = null
     let prompt_tokens = 0
     let completions_tokens = 0
     let finish_reason = null
     const res = sse.open(`${server_url}/chat/completions`, params, function (client) {
         client.on('event', function (event) {
+            const eventTime = new Date()
             if (promptEvalEndTime == null) {
-                promptEvalEndTime = new Date()
+                promptEvalEndTime = eventTime
+            } else {
+                llamacpp_token_delivery_ms.add(eventTime - lastEventTime)
             }
+            lastEventTime = eventTime
 
             let chunk = JSON.parse(event.data)
             let choice = chunk.choices[0]
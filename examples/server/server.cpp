@@ -29,9 +29,13 @@
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
+#include <deque>
+#include <map>
 #include <set>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
+#include <unordered_map>
 #include <signal.h>
 #include <memory>
 #include <random>
@@ -146,6 +150,12 @@ struct server_task {
 
     bool infill    = false;
     bool embedding = false;
+    int  priority  = 0; // the tasks with a higher priority get a slot and are prompt-processed first
+
+    // the prompt of a completion task, tokenized by the HTTP thread that creates the task (see tokenize_task)
+    std::vector<llama_token> prompt_tokens;
+    bool prompt_tokenized   = false;
+    bool prompt_add_special = false; // BOS is added only if there is no system prompt
 };
 
 struct server_task_result {
@@ -186,6 +196,7 @@ struct server_task_result {
 
     bool post_sampling_probs = false;
     std::vector<completion_token_output> probs_output;
+    bool probs_pending = false; // data["completion_probabilities"] is still to be made from probs_output, see server_response::recv
     std::vector<std::string>  response_fields;
 
     //slot_params generation_params;
@@ -577,6 +588,91 @@ struct slot_params {
     
 };
 
+// the inter-token latencies of a slot, the quantiles are over its last n_window tokens
+struct server_latency_window {
+    static constexpr size_t n_window = 1024;
+
+    std::vector<double> samples; // ms, ring buffer
+    size_t next = 0;
+
+    double   sum   = 0.0; // ms
+    uint64_t count = 0;
+
+    void add(double t) {
+        if (samples.size() < n_window) {
+            samples.push_back(t);
+        } else {
+            samples[next] = t;
+            next = (next + 1) % n_window;
+        }
+        sum += t;
+        count++;
+    }
+
+    double quantile(double q) const {
+        if (samples.empty()) {
+            return 0.0;
+        }
+        std::vector<double> v = samples;
+        const size_t k = std::min(v.size() - 1, (size_t) (q * v.size()));
+        std::nth_element(v.begin(), v.begin() + k, v.end());
+        return v[k];
+    }
+};
+
+// latencies recorded without a lock by any thread, in buckets of powers of 2 microseconds
+struct server_latency_histogram {
+    static constexpr int n_buckets = 40;
+
+    std::atomic<uint64_t> buckets[n_buckets] = {}; // bucket i counts the latencies in [2^(i-1), 2^i) us, 0: below 1 us
+    std::atomic<uint64_t> sum_us{0};
+    std::atomic<uint64_t> count{0};
+
+    void add(int64_t t_us) {
+        const uint64_t t = t_us > 0 ? (uint64_t) t_us : 0;
+        int i = 0;
+        while (i < n_buckets - 1 && (t >> i) != 0) {
+            i++;
+        }
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(t, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // ms, interpolated within the bucket that holds the quantile
+    double quantile(double q) const {
+        uint64_t counts[n_buckets];
+        uint64_t n = 0;
+        for (int i = 0; i < n_buckets; ++i) {
+            counts[i] = buckets[i].load(std::memory_order_relaxed);
+            n += counts[i];
+        }
+        if (n == 0) {
+            return 0.0;
+        }
+        const double k = q * n;
+        uint64_t below = 0;
+        for (int i = 0; i < n_buckets; ++i) {
+            if (counts[i] > 0 && below + counts[i] >= k) {
+                const double lo = i == 0 ? 0.0 : (double) (1ull << (i - 1));
+                const double hi = (double) (1ull << i);
+                return (lo + (hi - lo) * (k - below) / counts[i]) / 1e3;
+            }
+            below += counts[i];
+        }
+        return (double) (1ull << (n_buckets - 1)) / 1e3;
+    }
+};
+
+struct server_slot;
+
+// a token sampled for a slot, with --decode-pipeline it is processed (stop strings, responses) while the next step computes
+struct server_pending_token {
+    server_slot * slot;
+    int id_task;
+    completion_token_output result;
+};
+
 struct server_slot {
     int id;
     int id_task = -1;
@@ -590,6 +686,9 @@ struct server_slot {
     // used to determine the slot that has been used the longest
     int64_t t_last_used = -1;
 
+    int64_t t_last_token = 0; // time of the last generated token
+    server_latency_window itl; // inter-token latencies
+
     // generation props
     int32_t n_ctx       = 0;  // context size per slot
     int32_t n_past      = 0;
@@ -605,14 +704,19 @@ struct server_slot {
 
     // when a task is submitted, we first tokenize the prompt and store it here
     std::vector<llama_token> prompt_tokens;
+    bool prompt_pretokenized = false; // prompt_tokens come from the task and still have to be loaded
 
     std::string generated_text;
     std::vector<llama_token> cache_tokens;
+    bool kv_evicted = false; // the KV of the slot was moved to the KV pool (see server_kv_pool)
+    bool kv_shared  = false; // the KV cells of the slot may be shared with the prefix cache or other slots
+    llama_seq_id prefix_seq = -1; // prefix cache entry used by the current task
     std::vector<completion_token_output> generated_token_probs;
     common_chat_msg chat_msg;
 
     bool infill         = false;
     bool embedding      = false;
+    int  priority       = 0;
     bool has_next_token = true;
     bool truncated      = false;
     bool stopped_eos    = false;
@@ -891,6 +995,340 @@ struct server_metrics {
     }
 };
 
+// host memory pool for the KV cache of idle slots (--kv-pool-size)
+// when the KV cache has no room left for a batch, the KV of the least recently used idle slot is compressed into the pool
+// and removed from the cache; it is restored when the slot gets its next request. Entries are dropped in LRU order when
+// the pool would exceed its budget, a slot that lost its entry recomputes its prompt.
+struct server_kv_pool {
+    struct entry {
+        std::vector<uint8_t>     data;   // llama_state_seq_get_data_compressed() of the slot sequence
+        std::vector<llama_token> tokens; // cache_tokens of the slot
+        int64_t                  t_evicted  = 0;
+        bool                     compressed = true; // false if the data did not shrink and is stored as is
+    };
+
+    size_t budget = 0; // bytes, 0 = disabled
+    size_t size   = 0; // bytes in use
+
+    std::map<int, entry> entries; // by slot id
+
+    uint64_t n_evictions = 0; // slots moved to the pool
+    uint64_t n_hits      = 0; // slots restored from the pool
+    uint64_t n_misses    = 0; // evicted slots that had to recompute their prompt
+    uint64_t n_dropped   = 0; // entries dropped to stay within the budget
+
+    bool enabled() const {
+        return budget > 0;
+    }
+
+    void erase(int id_slot) {
+        auto it = entries.find(id_slot);
+        if (it != entries.end()) {
+            size -= it->second.data.size();
+            entries.erase(it);
+        }
+    }
+
+    // make room for n bytes by dropping the least recently evicted entries
+    bool reserve(size_t n) {
+        if (n > budget) {
+            return false;
+        }
+        while (size + n > budget) {
+            auto lru = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->second.t_evicted < lru->second.t_evicted) {
+                    lru = it;
+                }
+            }
+            erase(lru->first);
+            n_dropped++;
+        }
+        return true;
+    }
+};
+
+// radix tree of the token prefixes kept in the KV cache for reuse by any slot (--prefix-cache)
+// every entry owns a sequence that shares the KV cells of the slot it was taken from (llama_kv_cache_seq_cp does not
+// copy data). A new prompt copies the longest cached prefix into its slot instead of recomputing it. Entries used by a
+// running task are referenced, the others are evicted in LRU order when the tree or the KV cache is full.
+struct server_prefix_cache {
+    struct node {
+        std::vector<llama_token> tokens; // edge from the parent
+        std::map<llama_token, std::unique_ptr<node>> children;
+        node * parent = nullptr;
+
+        llama_seq_id seq_id      = -1; // sequence holding the prefix that ends here, -1 if none
+        int32_t      n_ref       = 0;  // tasks using the entry
+        int64_t      t_last_used = 0;
+    };
+
+    node root;
+
+    std::map<llama_seq_id, node *> entries;  // by sequence
+    std::vector<llama_seq_id>      seq_free; // sequences available for new entries
+
+    uint64_t n_hits      = 0; // prompts that reused a cached prefix
+    uint64_t n_tokens    = 0; // prompt tokens reused from the cache
+    uint64_t n_evictions = 0;
+
+    void init(llama_seq_id seq_first, int32_t n_max) {
+        for (int32_t i = n_max - 1; i >= 0; --i) {
+            seq_free.push_back(seq_first + i);
+        }
+    }
+
+    bool enabled() const {
+        return !seq_free.empty() || !entries.empty();
+    }
+
+    // longest prefix of tokens[0, n) that is in the tree, returns an entry that contains it
+    node * match(const std::vector<llama_token> & tokens, size_t n, size_t & n_match) {
+        node * cur = &root;
+        n_match = 0;
+        while (n_match < n) {
+            auto it = cur->children.find(tokens[n_match]);
+            if (it == cur->children.end()) {
+                break;
+            }
+            node * child = it->second.get();
+            size_t k = 0;
+            while (k < child->tokens.size() && n_match < n && child->tokens[k] == tokens[n_match]) {
+                k++;
+                n_match++;
+            }
+            cur = child;
+            if (k < child->tokens.size()) {
+                break;
+            }
+        }
+        // every leaf holds an entry, so does some node below the one where the match ended
+        while (cur != &root && cur->seq_id < 0) {
+            cur = cur->children.begin()->second.get();
+        }
+        return cur == &root ? nullptr : cur;
+    }
+
+    // add the entry tokens[0, n) -> seq_id, the entries that are a prefix of it are removed and their sequences
+    // returned in seq_rm, their references move to the new entry
+    void insert(const std::vector<llama_token> & tokens, size_t n, llama_seq_id seq_id, std::vector<llama_seq_id> & seq_rm) {
+        node * cur = &root;
+        size_t i = 0;
+        int32_t n_ref = 0;
+        while (i < n) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto leaf = std::make_unique<node>();
+                leaf->tokens.assign(tokens.begin() + i, tokens.begin() + n);
+                leaf->parent = cur;
+                node * next = leaf.get();
+                cur->children[tokens[i]] = std::move(leaf);
+                cur = next;
+                break;
+            }
+            node * child = it->second.get();
+            size_t k = 0;
+            while (k < child->tokens.size() && i < n && child->tokens[k] == tokens[i]) {
+                k++;
+                i++;
+            }
+            if (k < child->tokens.size()) {
+                // split the edge
+                auto mid = std::make_unique<node>();
+                mid->tokens.assign(child->tokens.begin(), child->tokens.begin() + k);
+                mid->parent = cur;
+                child->tokens.erase(child->tokens.begin(), child->tokens.begin() + k);
+                child->parent = mid.get();
+                mid->children[child->tokens[0]] = std::move(it->second);
+                node * next = mid.get();
+                it->second = std::move(mid);
+                child = next;
+            }
+            cur = child;
+            if (i < n && cur->seq_id >= 0) {
+                // strict prefix of the new entry
+                seq_rm.push_back(cur->seq_id);
+                n_ref += cur->n_ref;
+                entries.erase(cur->seq_id);
+                cur->seq_id = -1;
+                cur->n_ref  = 0;
+            }
+        }
+        GGML_ASSERT(cur->seq_id < 0);
+        cur->seq_id      = seq_id;
+        cur->n_ref       = n_ref;
+        cur->t_last_used = ggml_time_us();
+        entries[seq_id] = cur;
+    }
+
+    void erase(llama_seq_id seq_id) {
+        auto it = entries.find(seq_id);
+        if (it == entries.end()) {
+            return;
+        }
+        node * cur = it->second;
+        entries.erase(it);
+        seq_free.push_back(seq_id);
+        cur->seq_id = -1;
+        cur->n_ref  = 0;
+
+        // remove the nodes that lead to no entry and merge the chains left behind
+        while (cur != &root && cur->seq_id < 0 && cur->children.empty()) {
+            node * parent = cur->parent;
+            parent->children.erase(cur->tokens[0]);
+            cur = parent;
+        }
+        if (cur != &root && cur->seq_id < 0 && cur->children.size() == 1) {
+            std::unique_ptr<node> child = std::move(cur->children.begin()->second);
+            cur->children.clear();
+            cur->tokens.insert(cur->tokens.end(), child->tokens.begin(), child->tokens.end());
+            cur->seq_id      = child->seq_id;
+            cur->n_ref       = child->n_ref;
+            cur->t_last_used = child->t_last_used;
+            cur->children    = std::move(child->children);
+            for (auto & c : cur->children) {
+                c.second->parent = cur;
+            }
+            if (cur->seq_id >= 0) {
+                entries[cur->seq_id] = cur;
+            }
+        }
+    }
+
+    void acquire(llama_seq_id seq_id) {
+        auto it = entries.find(seq_id);
+        if (it != entries.end()) {
+            it->second->n_ref++;
+            it->second->t_last_used = ggml_time_us();
+        }
+    }
+
+    void release(llama_seq_id seq_id) {
+        auto it = entries.find(seq_id);
+        if (it != entries.end() && it->second->n_ref > 0) {
+            it->second->n_ref--;
+        }
+    }
+
+    // entries referenced by running tasks
+    size_t n_used() const {
+        size_t n = 0;
+        for (const auto & e : entries) {
+            n += e.second->n_ref > 0;
+        }
+        return n;
+    }
+
+    // least recently used entry that no task references, -1 if none
+    llama_seq_id lru() const {
+        const node * best = nullptr;
+        for (const auto & e : entries) {
+            if (e.second->n_ref == 0 && (best == nullptr || e.second->t_last_used < best->t_last_used)) {
+                best = e.second;
+            }
+        }
+        return best ? best->seq_id : -1;
+    }
+
+    void clear() {
+        for (const auto & e : entries) {
+            seq_free.push_back(e.first);
+        }
+        entries.clear();
+        root.children.clear();
+    }
+};
+
+// a pool of threads that calls a function for each index in [0, n), each index is handled by exactly one thread
+struct server_worker_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable condition_work;
+    std::condition_variable condition_done;
+
+    std::function<void(int)> func;
+    std::atomic<int> next{0};
+    int      n_items    = 0;
+    int      n_wake     = 0; // workers that may still join the current run
+    int      n_busy     = 0;
+    uint64_t generation = 0;
+    bool     stop       = false;
+
+    // n_threads includes the thread that calls run
+    void init(int n_threads) {
+        for (int i = 1; i < n_threads; ++i) {
+            workers.emplace_back([this] { worker(); });
+        }
+    }
+
+    ~server_worker_pool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        condition_work.notify_all();
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    void run(int n, std::function<void(int)> f) {
+        if (workers.empty() || n <= 1) {
+            for (int i = 0; i < n; ++i) {
+                f(i);
+            }
+            return;
+        }
+        // the calling thread takes one item, only as many workers as there are items left are woken up
+        const int n_workers = std::min(n - 1, (int) workers.size());
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            func    = std::move(f);
+            n_items = n;
+            n_wake  = n_workers;
+            n_busy  = n_workers;
+            next    = 0;
+            generation++;
+        }
+        for (int i = 0; i < n_workers; ++i) {
+            condition_work.notify_one();
+        }
+        work();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        condition_done.wait(lock, [this] { return n_busy == 0; });
+        func = nullptr;
+    }
+
+    void work() {
+        for (int i = next++; i < n_items; i = next++) {
+            func(i);
+        }
+    }
+
+    void worker() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            condition_work.wait(lock, [&] { return stop || (generation != seen && n_wake > 0); });
+            if (stop) {
+                return;
+            }
+            seen = generation;
+            n_wake--;
+
+            lock.unlock();
+            work();
+            lock.lock();
+
+            if (--n_busy == 0) {
+                condition_done.notify_one();
+            }
+        }
+    }
+};
+
 struct server_queue {
     int id = 0;
     bool running;
@@ -954,6 +1392,23 @@ struct server_queue {
     void notify_slot_changed() {
         // move deferred tasks back to main loop
         std::unique_lock<std::mutex> lock(mutex_tasks);
+
+        // the completions with a higher priority get the free slots first, the other tasks keep their place
+        std::vector<size_t> idx;
+        std::vector<server_task> completions;
+        for (size_t i = 0; i < queue_tasks_deferred.size(); ++i) {
+            if (queue_tasks_deferred[i].type == SERVER_TASK_TYPE_COMPLETION) {
+                idx.push_back(i);
+                completions.push_back(std::move(queue_tasks_deferred[i]));
+            }
+        }
+        std::stable_sort(completions.begin(), completions.end(), [](const server_task & a, const server_task & b) {
+            return a.priority > b.priority;
+        });
+        for (size_t i = 0; i < idx.size(); ++i) {
+            queue_tasks_deferred[idx[i]] = std::move(completions[i]);
+        }
+
         for (auto & task : queue_tasks_deferred) {
             queue_tasks.push_back(std::move(task));
         }
@@ -1059,50 +1514,76 @@ struct server_response {
     typedef std::function<void(int, int, server_task_result &)> callback_multitask_t;
     callback_multitask_t callback_update_multitask;
 
-    // for keeping track of all tasks waiting for the result
-    std::set<int> waiting_task_ids;
+    // the results of one waiting task, only its consumer waits on the condition
+    struct channel {
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<std::pair<server_task_result, int64_t>> results; // with the time they were sent (us)
+    };
+
+    // all tasks waiting for a result, by id
+    // the map is only locked exclusively when a task starts or stops waiting, sending a result only looks up the channel
+    std::unordered_map<int, std::shared_ptr<channel>> channels;
+    std::shared_mutex mutex_channels;
 
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+    // time between sending a result and its consumer picking it up, the HTTP threads record it without a shared lock
+    server_latency_histogram delivery_latency;
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+    // to format the token probabilities of the results on the threads that receive them
+    const llama_context * ctx = nullptr;
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
         LOG_VERBOSE("waiting for task id", {{"id_task", id_task}});
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        std::unique_lock<std::shared_mutex> lock(mutex_channels);
+        auto & ch = channels[id_task];
+        if (!ch) {
+            ch = std::make_shared<channel>();
+        }
     }
 
     // when the request is finished, we can remove task associated with it
     void remove_waiting_task_id(int id_task) {
         LOG_VERBOSE("remove waiting for task id", {{"id_task", id_task}});
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        std::unique_lock<std::shared_mutex> lock(mutex_channels);
+        channels.erase(id_task);
     }
 
     // This function blocks the thread until there is a response for this id_task
     server_task_result recv(int id_task) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
-
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (queue_results[i].id == id_task) {
-                    assert(queue_results[i].id_multi == -1);
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        std::shared_ptr<channel> ch = find_channel(id_task);
+        if (!ch) {
+            add_waiting_task_id(id_task);
+            ch = find_channel(id_task);
         }
 
-        // should never reach here
+        std::unique_lock<std::mutex> lock(ch->mutex);
+        ch->condition.wait(lock, [&]{
+            return !ch->results.empty();
+        });
+
+        auto res = std::move(ch->results.front());
+        ch->results.pop_front();
+        lock.unlock();
+
+        assert(res.first.id_multi == -1);
+
+        delivery_latency.add(ggml_time_us() - res.second);
+
+        add_probs(res.first);
+
+        return std::move(res.first);
+    }
+
+    // add the token probabilities to the JSON of the result, this is left to the receiving thread so that the main loop
+    // does not spend time on it
+    void add_probs(server_task_result & result) const {
+        if (result.probs_pending) {
+            result.data["completion_probabilities"] = probs_vector_to_json(ctx, result.probs_output);
+            result.probs_pending = false;
+        }
     }
 
     // Register the function to update multitask
@@ -1114,23 +1595,40 @@ struct server_response {
     void send(server_task_result result) {
         LOG_VERBOSE("send new result", {{"id_task", result.id}});
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            // LOG_TEE("waiting task id %i \n", id_task);
-            // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
-            if (result.id_multi == id_task) {
-                LOG_VERBOSE("callback_update_multitask", {{"id_task", id_task}});
-                callback_update_multitask(id_task, result.id, result);
-                continue;
-            }
+        // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
+        if (result.id_multi != -1 && find_channel(result.id_multi)) {
+            LOG_VERBOSE("callback_update_multitask", {{"id_task", result.id_multi}});
+            add_probs(result);
+            callback_update_multitask(result.id_multi, result.id, result);
+        }
 
-            if (result.id == id_task) {
-                LOG_VERBOSE("queue_results.push_back", {{"id_task", id_task}});
-                queue_results.push_back(result);
-                condition_results.notify_all();
-                return;
-            }
+        std::shared_ptr<channel> ch = find_channel(result.id);
+        if (!ch) {
+            return;
         }
+
+        LOG_VERBOSE("queue_results.push_back", {{"id_task", result.id}});
+        {
+            std::lock_guard<std::mutex> lock(ch->mutex);
+            ch->results.emplace_back(std::move(result), ggml_time_us());
+        }
+        ch->condition.notify_one();
+    }
+
+    // p50, p99, sum (ms) and count of the delivery latency
+    json delivery_latency_data() const {
+        return json {
+            {"p50_ms", delivery_latency.quantile(0.50)},
+            {"p99_ms", delivery_latency.quantile(0.99)},
+            {"sum_ms", delivery_latency.sum_us.load(std::memory_order_relaxed) / 1e3},
+            {"count",  delivery_latency.count.load(std::memory_order_relaxed)},
+        };
+    }
+
+    std::shared_ptr<channel> find_channel(int id_task) {
+        std::shared_lock<std::shared_mutex> lock(mutex_channels);
+        auto it = channels.find(id_task);
+        return it == channels.end() ? nullptr : it->second;
     }
 };
 
@@ -1157,6 +1655,7 @@ struct server_context {
     bool system_need_update = false;
 
     std::string              system_prompt;
+    std::atomic<bool>        system_prompt_empty{true}; // for the HTTP threads, which tokenize without the main loop
     std::vector<llama_token> system_tokens;
 
     // slots / clients
@@ -1168,6 +1667,15 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_kv_pool kv_pool;
+
+    server_prefix_cache prefix_cache;
+
+    server_worker_pool sampling_pool; // samples the slots in parallel after each decode
+
+    std::vector<server_pending_token> pending_tokens; // sampled in the last step, not processed yet
+    std::vector<std::pair<llama_seq_id, llama_pos>> pending_trims; // the KV cells to remove once the step is decoded
+
     common_chat_templates_ptr chat_templates;
     oaicompat_parser_options  oai_parser_opt;
     // Necessary similarity of prompt for slot selection
@@ -1281,7 +1789,13 @@ struct server_context {
 
 
     void init() {
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+        kv_pool.budget = size_t(std::max(0, params.kv_pool_size)) << 20;
+
+        // with a KV pool, the idle slots make room for the others, so every slot can use the whole context
+        const int32_t n_ctx_slot = kv_pool.enabled() ? n_ctx : n_ctx / params.n_parallel;
+
+        // sequence 0 is the system prompt and 1..n_parallel are the slots, the prefix cache entries come after them
+        prefix_cache.init(params.n_parallel + 1, std::max(0, params.prefix_cache));
 
         LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
 
@@ -1359,6 +1873,10 @@ struct server_context {
 
         metrics.init();
 
+        sampling_pool.init(params.n_threads_sampling > 0 ? params.n_threads_sampling : std::min(params.n_parallel, params.n_threads));
+
+        queue_results.ctx = ctx;
+
         // thinking is enabled if:
         // 1. It's not explicitly disabled (reasoning_budget == 0)
         // 2. The chat template supports it
@@ -1418,6 +1936,82 @@ struct server_context {
         return prompt_tokens;
     }
 
+    std::vector<llama_token> tokenize_infill(const json & input_prefix, const json & input_suffix) const {
+        const bool add_bos = llama_should_add_bos_token(model);
+        const bool suff_rm_leading_spc = !(params.input_suffix.find_first_of(' ') == 0 && params.input_suffix.size() > 1);
+
+        auto prefix_tokens = tokenize(input_prefix, false);
+        auto suffix_tokens = tokenize(input_suffix, false);
+
+        const int space_token = 29871; // TODO: this should not be hardcoded
+        if (suff_rm_leading_spc && !suffix_tokens.empty() && suffix_tokens[0] == space_token) {
+            suffix_tokens.erase(suffix_tokens.begin());
+        }
+
+        prefix_tokens.insert(prefix_tokens.begin(), llama_token_prefix(model));
+        suffix_tokens.insert(suffix_tokens.begin(), llama_token_suffix(model));
+
+        auto embd_inp = params.spm_infill ? suffix_tokens : prefix_tokens;
+        auto embd_end = params.spm_infill ? prefix_tokens : suffix_tokens;
+        if (add_bos) {
+            embd_inp.insert(embd_inp.begin(), llama_token_bos(model));
+        }
+        embd_inp.insert(embd_inp.end(), embd_end.begin(), embd_end.end());
+
+        const llama_token middle_token = llama_token_middle(model);
+        if (middle_token >= 0) {
+            embd_inp.push_back(middle_token);
+        }
+
+        return embd_inp;
+    }
+
+    // tokenize the prompt of a completion task on the thread that creates it, so that the main loop does not stall
+    // the other slots while a long prompt is tokenized
+    // prompts that cannot be tokenized here are left to the slot, which reports them as before, and so are prompts
+    // tokenized for a system prompt that changed before the task was launched
+    void tokenize_task(server_task & task) const {
+        const json & data = task.data;
+        const slot_params default_params;
+
+        try {
+            if (task.infill) {
+                task.prompt_tokens = tokenize_infill(
+                        json_value(data, "input_prefix", default_params.input_prefix),
+                        json_value(data, "input_suffix", default_params.input_suffix));
+                task.prompt_tokenized = true;
+                return;
+            }
+
+            const auto prompt = data.find("prompt");
+            if (prompt == data.end()) {
+                return;
+            }
+
+            // the same forms as accepted by launch_slot_with_task
+            const json * p = nullptr;
+            if ((prompt->is_string()) ||
+                (prompt->is_array() &&  prompt->size() == 1 && prompt->at(0).is_string()) ||
+                (prompt->is_array() && !prompt->empty()     && prompt->at(0).is_number_integer())) {
+                p = &*prompt;
+            } else if (prompt->is_array() && prompt->size() == 1 && prompt->at(0).is_array()) {
+                p = &prompt->at(0);
+            } else {
+                return;
+            }
+
+            // a system prompt sent with the task replaces the current one before the task is launched
+            task.prompt_add_special = data.contains("system_prompt")
+                ? json_value(data, "system_prompt", std::string()).empty()
+                : system_prompt_empty.load();
+            task.prompt_tokens    = tokenize(*p, task.prompt_add_special);
+            task.prompt_tokenized = true;
+        } catch (const std::exception &) {
+            task.prompt_tokens.clear();
+            task.prompt_tokenized = false;
+        }
+    }
+
     server_slot * get_slot_by_id(int id) {
         for (server_slot & slot : slots) {
             if (slot.id == id) {
@@ -1859,6 +2453,12 @@ struct server_context {
 
         slot.command = SLOT_COMMAND_LOAD_PROMPT;
         slot.prompt_tokens.clear();
+        slot.prompt_pretokenized = false;
+
+        if (task.prompt_tokenized && (task.infill || task.prompt_add_special == system_prompt.empty())) {
+            slot.prompt_tokens       = task.prompt_tokens;
+            slot.prompt_pretokenized = true;
+        }
 
         LOG_INFO("slot is processing task", {
             {"id_slot", slot.id},
@@ -1874,6 +2474,289 @@ struct server_context {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        prefix_cache.clear();
+        for (server_slot & slot : slots) {
+            slot.prefix_seq = -1;
+        }
+    }
+
+    // move the KV of the least recently used idle slot into the KV pool, returns false if no idle slot holds KV
+    bool kv_pool_evict() {
+        server_slot * lru = nullptr;
+        for (server_slot & slot : slots) {
+            if (slot.available() && !slot.kv_evicted && !slot.cache_tokens.empty() && (lru == nullptr || slot.t_last_used < lru->t_last_used)) {
+                lru = &slot;
+            }
+        }
+        if (lru == nullptr) {
+            return false;
+        }
+
+        const llama_seq_id seq_id = lru->id + 1;
+        const size_t       n_data = llama_state_seq_get_size(ctx, seq_id);
+
+        server_kv_pool::entry entry;
+        entry.data.resize(n_data);
+        size_t n_stored = llama_state_seq_get_data_compressed(ctx, entry.data.data(), n_data, seq_id);
+        if (n_stored == 0) {
+            entry.compressed = false;
+            n_stored = llama_state_seq_get_data(ctx, entry.data.data(), n_data, seq_id) == n_data ? n_data : 0;
+        }
+
+        bool stored = false;
+        if (n_stored > 0 && kv_pool.reserve(n_stored)) {
+            entry.data.resize(n_stored);
+            entry.data.shrink_to_fit();
+            entry.tokens    = lru->cache_tokens;
+            entry.t_evicted = ggml_time_us();
+            kv_pool.size += n_stored;
+            kv_pool.entries[lru->id] = std::move(entry);
+            stored = true;
+        }
+
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        lru->cache_tokens.clear();
+        lru->kv_evicted = true;
+        lru->kv_shared  = false;
+        kv_pool.n_evictions++;
+
+        LOG_INFO("slot KV evicted", {
+            {"id_slot",      lru->id},
+            {"n_bytes",      n_data},
+            {"n_stored",     n_stored},
+            {"stored",       stored},
+            {"kv_pool_size", kv_pool.size},
+        });
+
+        return true;
+    }
+
+    // bring back the KV of a slot that was evicted into the KV pool, before its new prompt is matched against it
+    // with prompt_tokens, the KV is only restored when the new prompt shares enough of it (as for slot_prompt_similarity),
+    // otherwise the entry is dropped
+    void kv_pool_restore(server_slot & slot, const std::vector<llama_token> * prompt_tokens = nullptr) {
+        if (!slot.kv_evicted) {
+            return;
+        }
+        slot.kv_evicted = false;
+
+        bool wanted   = true;
+        bool restored = false;
+        auto it = kv_pool.entries.find(slot.id);
+        if (it != kv_pool.entries.end()) {
+            server_kv_pool::entry entry = std::move(it->second);
+            kv_pool.size -= entry.data.size();
+            kv_pool.entries.erase(it);
+
+            if (prompt_tokens != nullptr) {
+                const size_t n_lcp = common_part(entry.tokens, *prompt_tokens);
+                wanted = n_lcp > 0 && (float) n_lcp / entry.tokens.size() > slot_prompt_similarity;
+            }
+
+            if (wanted && slot.params.cache_prompt) {
+                // make room by evicting other idle slots, if needed
+                do {
+                    const size_t n_read = entry.compressed
+                        ? llama_state_seq_set_data_compressed(ctx, entry.data.data(), entry.data.size(), slot.id + 1)
+                        : llama_state_seq_set_data           (ctx, entry.data.data(), entry.data.size(), slot.id + 1);
+                    restored = n_read == entry.data.size();
+                } while (!restored && kv_pool_evict());
+            }
+            if (restored) {
+                slot.cache_tokens = std::move(entry.tokens);
+            }
+        }
+
+        if (restored) {
+            kv_pool.n_hits++;
+        } else {
+            if (wanted) {
+                kv_pool.n_misses++;
+            }
+            if (!system_tokens.empty()) {
+                // the eviction also removed the system prompt from the slot sequence
+                llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
+            }
+        }
+
+        LOG_INFO("slot KV restored", {
+            {"id_slot",  slot.id},
+            {"wanted",   wanted},
+            {"restored", restored},
+            {"n_tokens", slot.cache_tokens.size()},
+        });
+    }
+
+    // remove the least recently used prefix cache entry that no task uses, returns false if there is none
+    bool prefix_cache_evict() {
+        const llama_seq_id seq_id = prefix_cache.lru();
+        if (seq_id < 0) {
+            return false;
+        }
+
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        prefix_cache.erase(seq_id);
+        prefix_cache.n_evictions++;
+
+        LOG_VERBOSE("prefix cache entry evicted", {
+            {"seq_id",    seq_id},
+            {"n_entries", prefix_cache.entries.size()},
+        });
+
+        return true;
+    }
+
+    // the references of running tasks to the prefix cache entry seq_id move to seq_new (-1: the entry is gone)
+    void prefix_cache_repoint(llama_seq_id seq_id, llama_seq_id seq_new) {
+        for (server_slot & slot : slots) {
+            if (slot.prefix_seq == seq_id) {
+                slot.prefix_seq = seq_new;
+            }
+        }
+    }
+
+    // keep the KV of a finished task in the prefix cache
+    void prefix_cache_insert(server_slot & slot) {
+        prefix_cache.release(slot.prefix_seq);
+        slot.prefix_seq = -1;
+
+        if (!prefix_cache.enabled() || !slot.params.cache_prompt || slot.ga_n != 1) {
+            return;
+        }
+
+        // the last sampled token is not in the KV cache
+        const int n_system = system_tokens.size();
+        const int n = std::min((int) slot.cache_tokens.size(), llama_kv_cache_seq_pos_max(ctx, slot.id + 1) + 1 - n_system);
+        if (n <= 0) {
+            return;
+        }
+
+        size_t n_match = 0;
+        server_prefix_cache::node * entry = prefix_cache.match(slot.cache_tokens, n, n_match);
+        if (entry != nullptr && (int) n_match == n) {
+            // already cached
+            entry->t_last_used = ggml_time_us();
+            return;
+        }
+
+        if (prefix_cache.seq_free.empty() && !prefix_cache_evict()) {
+            return;
+        }
+
+        const llama_seq_id seq_id = prefix_cache.seq_free.back();
+        prefix_cache.seq_free.pop_back();
+
+        llama_kv_cache_seq_cp(ctx, slot.id + 1, seq_id, 0, n_system + n);
+
+        std::vector<llama_seq_id> seq_rm;
+        prefix_cache.insert(slot.cache_tokens, n, seq_id, seq_rm);
+        for (llama_seq_id s : seq_rm) {
+            llama_kv_cache_seq_rm(ctx, s, -1, -1);
+            prefix_cache.seq_free.push_back(s);
+            prefix_cache_repoint(s, seq_id);
+        }
+
+        slot.kv_shared = true;
+
+        LOG_VERBOSE("prefix cache entry added", {
+            {"id_slot",   slot.id},
+            {"seq_id",    seq_id},
+            {"n_tokens",  n},
+            {"n_entries", prefix_cache.entries.size()},
+        });
+    }
+
+    // start the slot from the longest cached prefix of its prompt when it is longer than what the slot already has
+    void prefix_cache_reuse(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        size_t n_match = 0;
+        server_prefix_cache::node * entry = prefix_cache.match(prompt_tokens, prompt_tokens.size(), n_match);
+        if (entry == nullptr || (int) n_match <= slot.n_past) {
+            return;
+        }
+
+        const int n_system = system_tokens.size();
+
+        // a windowed SWA cache only holds the last positions of the entry, a shorter prefix of it misses its window
+        if (!llama_kv_cache_seq_has_window(ctx, entry->seq_id, n_system + n_match)) {
+            LOG_VERBOSE("prefix cache entry has no SWA window for the prefix", {
+                {"id_slot",  slot.id},
+                {"seq_id",   entry->seq_id},
+                {"n_tokens", n_match},
+            });
+            return;
+        }
+
+        if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, n_system, -1)) {
+            // the windowed SWA cache of the slot no longer has the end of the system prompt, copy it again
+            llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+            if (n_system > 0) {
+                llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
+            }
+        }
+        llama_kv_cache_seq_cp(ctx, entry->seq_id, slot.id + 1, n_system, n_system + n_match);
+
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_match);
+        slot.n_past     = n_match;
+        slot.kv_shared  = true;
+        slot.prefix_seq = entry->seq_id;
+        prefix_cache.acquire(entry->seq_id);
+
+        prefix_cache.n_hits++;
+        prefix_cache.n_tokens += n_match;
+
+        LOG_INFO("prefix cache hit", {
+            {"id_slot",  slot.id},
+            {"id_task",  slot.id_task},
+            {"seq_id",   entry->seq_id},
+            {"n_tokens", n_match},
+        });
+    }
+
+    // a context shift moves the KV cells of the slot from position p_shift on, so they must not be shared anymore:
+    // drop the prefix cache entries and the cache of idle slots that may use them. Returns the position up to which a
+    // running slot may share the cells, the shift has to discard the cells before it
+    int prefix_cache_unshare(server_slot & slot, int p_shift) {
+        if (!slot.kv_shared) {
+            return p_shift;
+        }
+
+        const int n_system = system_tokens.size();
+
+        size_t n_match = 0;
+        server_prefix_cache::node * entry;
+        while ((entry = prefix_cache.match(slot.cache_tokens, slot.cache_tokens.size(), n_match)) != nullptr && n_system + (int) n_match > p_shift) {
+            const llama_seq_id seq_id = entry->seq_id;
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            prefix_cache.erase(seq_id);
+            prefix_cache_repoint(seq_id, -1);
+        }
+
+        int p_shared = p_shift;
+        for (server_slot & other : slots) {
+            if (&other == &slot || !other.kv_shared) {
+                continue;
+            }
+            const int p_common = n_system + (int) common_part(other.cache_tokens, slot.cache_tokens);
+            if (p_common <= p_shift) {
+                continue;
+            }
+            if (other.available()) {
+                if (llama_kv_cache_seq_rm(ctx, other.id + 1, p_shift, -1)) {
+                    other.cache_tokens.resize(p_shift - n_system);
+                } else {
+                    llama_kv_cache_seq_rm(ctx, other.id + 1, -1, -1);
+                    if (n_system > 0) {
+                        llama_kv_cache_seq_cp(ctx, 0, other.id + 1, -1, -1);
+                    }
+                    other.cache_tokens.clear();
+                }
+            } else {
+                p_shared = std::max(p_shared, p_common);
+            }
+        }
+
+        return p_shared;
     }
 
     void system_prompt_update() {
@@ -1925,6 +2808,7 @@ struct server_context {
 
     bool system_prompt_set(const std::string & sys_prompt) {
         system_prompt = sys_prompt;
+        system_prompt_empty = system_prompt.empty();
 
         LOG_VERBOSE("system prompt process", {
             {"system_prompt",  system_prompt},
@@ -1939,6 +2823,46 @@ struct server_context {
         return true;
     }
 
+    // process the tokens sampled in the last step, while the context may be decoding the next one:
+    // only the model is read here (detokenization), not the context
+    // queued: the tokens are already in the batch being decoded, a slot that stops must then drop its token again, so that
+    // its cache ends up as without the pipeline (the KV cells are removed by trim_pending_tokens after the decode)
+    void process_pending_tokens(bool queued) {
+        for (auto & pending : pending_tokens) {
+            server_slot & slot = *pending.slot;
+
+            // the task was cancelled or the slot reused in the meantime
+            if (slot.id_task != pending.id_task || slot.state != SLOT_STATE_PROCESSING || slot.command == SLOT_COMMAND_RELEASE) {
+                continue;
+            }
+
+            if (!process_token(pending.result, slot)) {
+                if (queued) {
+                    slot.n_past -= 1;
+                    if (slot.params.cache_prompt && !slot.cache_tokens.empty()) {
+                        slot.cache_tokens.pop_back();
+                    }
+                    pending_trims.push_back({ slot.id + 1, (llama_pos) (system_tokens.size() + slot.n_past) });
+                }
+
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+            }
+        }
+
+        pending_tokens.clear();
+    }
+
+    void trim_pending_tokens() {
+        for (const auto & [seq_id, pos] : pending_trims) {
+            llama_kv_cache_seq_rm(ctx, seq_id, pos, -1);
+        }
+
+        pending_trims.clear();
+    }
+
     bool process_token(completion_token_output & result, server_slot & slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
         const std::string token_str = llama_token_to_piece(ctx, result.tok, params.special);
@@ -2207,7 +3131,7 @@ struct server_context {
         // populate res.probs_output
         if (slot.sparams.n_probs > 0) {
             res.probs_output = {tkn}; // copy the token probs
-            res.data["completion_probabilities"] = probs_vector_to_json(ctx, res.probs_output);
+            res.probs_pending = true;
         }
 
         if (slot.oaicompat) {
@@ -2275,7 +3199,7 @@ struct server_context {
                         slot.generated_token_probs.begin(),
                         slot.generated_token_probs.end());
             }
-            res.data["completion_probabilities"] = probs_vector_to_json(ctx, res.probs_output);
+            res.probs_pending = true;
         }
 
         if (slot.oaicompat) {
@@ -2338,6 +3262,7 @@ struct server_context {
         task.data      = std::move(data);
         task.infill    = infill;
         task.embedding = embedding;
+        task.priority  = json_value(task.data, "priority", 0);
         task.type      = SERVER_TASK_TYPE_COMPLETION;
 
         // when a completion task's prompt array is not a singleton, we split it into multiple requests
@@ -2358,12 +3283,14 @@ struct server_context {
             // if there are numbers, it needs to be treated like a single prompt,
             // queue_tasks handles a mix of strings and numbers just fine.
             if (numbers) {
-                queue_tasks.post(task);
+                tokenize_task(task);
+                queue_tasks.post(std::move(task));
             } else {
                 split_multiprompt_task(id_task, task);
             }
         } else {
-            queue_tasks.post(task);
+            tokenize_task(task);
+            queue_tasks.post(std::move(task));
         }
     }
 
@@ -2449,6 +3376,7 @@ struct server_context {
                     slot->id_multi  = task.id_multi;
                     slot->infill    = task.infill;
                     slot->embedding = task.embedding;
+                    slot->priority  = task.priority;
 
                     if (!launch_slot_with_task(*slot, task)) {
                         LOG_ERROR("error while launching slot", task.data);
@@ -2491,6 +3419,12 @@ struct server_context {
                             {"stopped_limit",  slot.stopped_limit},
                             {"stopping_word",  slot.stopping_word},
                         };
+                        slot_data["inter_token_latency"] = {
+                            {"p50_ms", slot.itl.quantile(0.50)},
+                            {"p99_ms", slot.itl.quantile(0.99)},
+                            {"sum_ms", slot.itl.sum},
+                            {"count",  slot.itl.count},
+                        };
 
                         if (slot_data["state"] == SLOT_STATE_IDLE) {
                             n_idle_slots++;
@@ -2537,9 +3471,33 @@ struct server_context {
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
+                        { "kv_pool_size",                    kv_pool.size},
+                        { "kv_pool_budget",                  kv_pool.budget},
+                        { "kv_pool_entries",                 kv_pool.entries.size()},
+                        { "kv_pool_evictions",               kv_pool.n_evictions},
+                        { "kv_pool_hits",                    kv_pool.n_hits},
+                        { "kv_pool_misses",                  kv_pool.n_misses},
+                        { "kv_pool_dropped",                 kv_pool.n_dropped},
+
+                        { "prefix_cache_entries",            prefix_cache.entries.size()},
+                        { "prefix_cache_entries_used",       prefix_cache.n_used()},
+                        { "prefix_cache_hits",               prefix_cache.n_hits},
+                        { "prefix_cache_tokens",             prefix_cache.n_tokens},
+                        { "prefix_cache_evictions",          prefix_cache.n_evictions},
+
                         { "slots",                           slots_data },
                     };
 
+                    json expert_counts = json::array();
+                    for (int il = 0; il < llama_n_layer(model); ++il) {
+                        const uint64_t * counts = llama_get_expert_counts(ctx, il);
+                        if (counts == nullptr) {
+                            break;
+                        }
+                        expert_counts.push_back(std::vector<uint64_t>(counts, counts + llama_n_expert(model)));
+                    }
+                    res.data["expert_counts"] = expert_counts;
+
                     if (json_value(task.data, "reset_bucket", false)) {
                         metrics.reset_bucket();
                     }
@@ -2560,13 +3518,17 @@ struct server_context {
                         break;
                     }
 
+                    kv_pool_restore(*slot);
+
                     const size_t token_count = slot->cache_tokens.size();
                     const int64_t t_start = ggml_time_us();
 
                     std::string filename = task.data.at("filename");
                     std::string filepath = task.data.at("filepath");
 
-                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), token_count);
+                    const size_t nwrite = params.slot_save_compress
+                        ? llama_state_seq_save_file_compressed(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), token_count)
+                        : llama_state_seq_save_file(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), token_count);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_save_ms = (t_end - t_start) / 1000.0;
@@ -2606,6 +3568,9 @@ struct server_context {
                     std::string filename = task.data.at("filename");
                     std::string filepath = task.data.at("filepath");
 
+                    kv_pool.erase(slot->id);
+                    slot->kv_evicted = false;
+
                     slot->cache_tokens.resize(slot->n_ctx);
                     size_t token_count = 0;
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
@@ -2653,6 +3618,9 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_cache_seq_rm(ctx, slot->id + 1, -1, -1);
                     slot->cache_tokens.clear();
+                    kv_pool.erase(slot->id);
+                    slot->kv_evicted = false;
+                    slot->kv_shared  = false;
 
                     server_task_result result;
                     result.id = task.id;
@@ -2697,6 +3665,7 @@ struct server_context {
 
     void update_slots() {
         if (system_need_update) {
+            process_pending_tokens(false);
             system_prompt_update();
         }
 
@@ -2707,6 +3676,8 @@ struct server_context {
                 slot.command     = SLOT_COMMAND_NONE;
                 slot.t_last_used = ggml_time_us();
 
+                prefix_cache_insert(slot);
+
                 LOG_INFO("slot released", {
                     {"id_slot",         slot.id},
                     {"id_task",         slot.id_task},
@@ -2733,15 +3704,22 @@ struct server_context {
             }
 
             if (all_idle) {
+                pending_tokens.clear();
+
                 LOG_INFO("all slots are idle", {});
                 if (system_prompt.empty() && clean_kv_cache) {
                     kv_cache_clear();
                 }
 
+                // don't let the CPU workers spin while waiting for new requests
+                llama_threadpool_pause(ctx);
+
                 return;
             }
         }
 
+        llama_threadpool_resume(ctx);
+
         {
             LOG_VERBOSE("posting NEXT_RESPONSE", {});
 
@@ -2760,7 +3738,22 @@ struct server_context {
                     // Shift context
                     const int n_keep    = slot.params.n_keep + add_bos_token;
                     const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
-                    const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+                    int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+
+                    if (prefix_cache.enabled()) {
+                        // the cells shared with a running slot cannot move, discard them from this one
+                        n_discard = std::max(n_discard, prefix_cache_unshare(slot, n_keep + n_discard) - n_keep);
+                        if (n_discard >= n_left) {
+                            LOG_WARNING("slot context shift not possible, the context is shared with another slot", {
+                                {"id_slot", slot.id},
+                                {"id_task", slot.id_task},
+                            });
+                            slot.truncated = true;
+                            slot.release();
+                            send_final_response(slot);
+                            continue;
+                        }
+                    }
 
                     LOG_INFO("slot context shift", {
                         {"id_slot",         slot.id},
@@ -2839,15 +3832,33 @@ struct server_context {
         // -1: none, 0: non-embedding, 1: embedding
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
-        // next, batch any pending prompts without exceeding n_batch
+        // with a step budget, the pending prompts get what the generating slots leave of it (but at least a quarter),
+        // so that a long prompt is processed in chunks between the generation steps instead of holding them up
+        int32_t n_batch_max = n_batch;
+        if (params.step_budget > 0 && batch.n_tokens > 0) {
+            n_batch_max = std::min(n_batch, std::max(params.step_budget, batch.n_tokens + std::max(params.step_budget / 4, 1)));
+        }
+
+        // the prompts of the higher priority tasks are batched first
+        std::vector<server_slot *> slots_by_priority;
+        for (auto & slot : slots) {
+            slots_by_priority.push_back(&slot);
+        }
+        std::stable_sort(slots_by_priority.begin(), slots_by_priority.end(), [](const server_slot * a, const server_slot * b) {
+            return a->priority > b->priority;
+        });
+
+        // next, batch any pending prompts without exceeding n_batch_max
         if (params.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            for (server_slot * slot_ptr : slots_by_priority) {
+                auto & slot = *slot_ptr;
+
                 // this slot still has a prompt to be processed
                 if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
-                    // we haven't tokenized the prompt yet - do it now:
-                    if (prompt_tokens.empty()) {
+                    // we haven't tokenized the prompt yet - do it now, unless it was tokenized with the task:
+                    if (prompt_tokens.empty() || slot.prompt_pretokenized) {
                         LOG_VERBOSE("tokenizing prompt", {
                             {"id_slot", slot.id},
                             {"id_task", slot.id_task}
@@ -2856,38 +3867,10 @@ struct server_context {
                         slot.t_start_process_prompt = ggml_time_us();
                         slot.t_start_generation = 0;
 
-                        if (slot.infill) {
-                            const bool add_bos = llama_should_add_bos_token(model);
-                            bool suff_rm_leading_spc = true;
-                            if (params.input_suffix.find_first_of(' ') == 0 && params.input_suffix.size() > 1) {
-                                params.input_suffix.erase(0, 1);
-                                suff_rm_leading_spc = false;
-                            }
-
-                            auto prefix_tokens = tokenize(slot.params.input_prefix, false);
-                            auto suffix_tokens = tokenize(slot.params.input_suffix, false);
-
-                            const int space_token = 29871; // TODO: this should not be hardcoded
-                            if (suff_rm_leading_spc && !suffix_tokens.empty() && suffix_tokens[0] == space_token) {
-                                suffix_tokens.erase(suffix_tokens.begin());
-                            }
-
-                            prefix_tokens.insert(prefix_tokens.begin(), llama_token_prefix(model));
-                            suffix_tokens.insert(suffix_tokens.begin(), llama_token_suffix(model));
-
-                            auto embd_inp = params.spm_infill ? suffix_tokens : prefix_tokens;
-                            auto embd_end = params.spm_infill ? prefix_tokens : suffix_tokens;
-                            if (add_bos) {
-                                embd_inp.insert(embd_inp.begin(), llama_token_bos(model));
-                            }
-                            embd_inp.insert(embd_inp.end(), embd_end.begin(), embd_end.end());
-
-                            const llama_token middle_token = llama_token_middle(model);
-                            if (middle_token >= 0) {
-                                embd_inp.push_back(middle_token);
-                            }
-
-                            prompt_tokens = embd_inp;
+                        if (slot.prompt_pretokenized) {
+                            slot.prompt_pretokenized = false;
+                        } else if (slot.infill) {
+                            prompt_tokens = tokenize_infill(slot.params.input_prefix, slot.params.input_suffix);
                         } else {
                             prompt_tokens = tokenize(slot.prompt, system_prompt.empty()); // add BOS if there isn't system prompt
                         }
@@ -2919,6 +3902,8 @@ struct server_context {
                             continue;
                         }
 
+                        kv_pool_restore(slot, &prompt_tokens);
+
                         if (slot.embedding) {
                             // this prompt is too large to process - discard it
                             if (slot.n_prompt_tokens > n_ubatch) {
@@ -2979,6 +3964,10 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
+                                if (prefix_cache.enabled()) {
+                                    prefix_cache_reuse(slot, prompt_tokens);
+                                }
+
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
                                     llama_sampling_accept(slot.ctx_sampling, ctx, slot.cache_tokens[i], false);
@@ -3004,6 +3993,7 @@ struct server_context {
 
                     if (slot.embedding) {
                         // cannot fit the prompt in the current batch - will try next iter
+                        // the step budget does not apply, the prompt of an embedding cannot be split
                         if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
                             continue;
                         }
@@ -3054,7 +4044,7 @@ struct server_context {
 
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < (slot.embedding ? n_batch : n_batch_max); ++slot.n_past) {
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -3110,7 +4100,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_max) {
                     break;
                 }
             }
@@ -3118,6 +4108,7 @@ struct server_context {
 
         if (batch.n_tokens == 0) {
             LOG_VERBOSE("no tokens to decode", {});
+            process_pending_tokens(false);
             return;
         }
 
@@ -3172,7 +4163,23 @@ struct server_context {
                 0, 0, 0, // unused
             };
 
-            const int ret = llama_decode(ctx, batch_view);
+            int ret;
+            if (!pending_tokens.empty()) {
+                // the tokens of the ongoing sequences are already known, compute the next step while the last one
+                // is post-processed
+                llama_decode_async(ctx, batch_view);
+                process_pending_tokens(true);
+                ret = llama_decode_wait(ctx);
+            } else {
+                ret = llama_decode(ctx, batch_view);
+            }
+
+            if (ret > 0 && (prefix_cache_evict() || (kv_pool.enabled() && kv_pool_evict()))) {
+                // a prefix cache entry or an idle slot made room in the KV cache - retry the same chunk
+                i -= n_batch;
+
+                continue; // continue loop of n_batch
+            }
 
             if (ret != 0) {
                 if (n_batch == 1 || ret < 0) {
@@ -3204,11 +4211,18 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            std::vector<server_slot *> slots_sampled;
             for (auto & slot : slots) {
                 if (slot.state != SLOT_STATE_PROCESSING || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
                 }
 
+                // the slot stopped while this step was computed
+                if (slot.command == SLOT_COMMAND_RELEASE) {
+                    slot.i_batch = -1;
+                    continue; // continue loop of slots
+                }
+
                 // prompt evaluated for embedding
                 if (slot.embedding) {
                     send_embedding(slot, batch_view);
@@ -3217,12 +4231,36 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
-                completion_token_output result;
+                slots_sampled.push_back(&slot);
+            }
+
+            // sample the slots in parallel, a slot only uses its own sampling context (and RNG), so the result
+            // does not depend on the number of threads
+            // (the context is synchronized here, so that the workers only read its outputs)
+            llama_synchronize(ctx);
+
+            std::vector<completion_token_output> results(slots_sampled.size());
+            sampling_pool.run(slots_sampled.size(), [&](int k) {
+                server_slot & slot = *slots_sampled[k];
+                completion_token_output & result = results[k];
+
                 const int tok_idx = slot.i_batch - i;
                 const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, tok_idx);
 
                 llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
 
+                result.tok = id;
+                result.prob = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
+                result.text_to_send = llama_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+
+                if (slot.sparams.n_probs > 0) {
+                    populate_token_probs(slot, result, slot.params.post_sampling_probs, params.special, tok_idx);
+                }
+            });
+
+            for (size_t k = 0; k < slots_sampled.size(); ++k) {
+                server_slot & slot = *slots_sampled[k];
+
                 slot.n_decoded += 1;
 
                 const int64_t t_current = ggml_time_us();
@@ -3231,26 +4269,29 @@ struct server_context {
                     slot.t_start_generation = ggml_time_us();
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
+                } else {
+                    slot.itl.add((t_current - slot.t_last_token) / 1e3);
                 }
+                slot.t_last_token = t_current;
 
                 slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
 
-                result.tok = id;
-                result.prob = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
-                result.text_to_send = llama_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                slot.i_batch = -1;
 
-                if (slot.sparams.n_probs > 0) {
-                    populate_token_probs(slot, result, slot.params.post_sampling_probs, params.special, tok_idx);
+                // the speculative decoding below needs the token processed now, and with self-extend the position
+                // of the token to drop on stop is not n_past
+                if (params.decode_pipeline && !slot.spec && slot.ga_n == 1) {
+                    slot.sampled = results[k].tok;
+                    pending_tokens.push_back({ &slot, slot.id_task, std::move(results[k]) });
+                    continue;
                 }
 
-                if (!process_token(result, slot)) {
+                if (!process_token(results[k], slot)) {
                     slot.release();
                     slot.print_timings();
                     send_final_response(slot);
                     metrics.on_prediction(slot);
                 }
-
-                slot.i_batch = -1;
             }
 
             // Do speculative decoding
@@ -3370,6 +4411,9 @@ struct server_context {
             }
         }
 
+        // the slots that stopped while the batch was decoded do not keep their last token
+        trim_pending_tokens();
+
         LOG_VERBOSE("run slots completed", {});
     }
 
@@ -3972,6 +5016,34 @@ int main(int argc, char ** argv) {
                     {"name",  "tokens_predicted_seconds_total"},
                     {"help",  "Predict process time"},
                     {"value",  (uint64_t) data.at("t_tokens_generation_total") / 1.e3}
+            }, {
+                    {"name",  "kv_pool_evictions_total"},
+                    {"help",  "Number of idle slots whose KV cache was moved to the KV pool."},
+                    {"value",  (uint64_t) data.at("kv_pool_evictions")}
+            }, {
+                    {"name",  "kv_pool_hits_total"},
+                    {"help",  "Number of slots whose KV cache was restored from the KV pool."},
+                    {"value",  (uint64_t) data.at("kv_pool_hits")}
+            }, {
+                    {"name",  "kv_pool_misses_total"},
+                    {"help",  "Number of evicted slots that had to recompute their prompt."},
+                    {"value",  (uint64_t) data.at("kv_pool_misses")}
+            }, {
+                    {"name",  "kv_pool_dropped_total"},
+                    {"help",  "Number of KV pool entries dropped to stay within the budget."},
+                    {"value",  (uint64_t) data.at("kv_pool_dropped")}
+            }, {
+                    {"name",  "prefix_cache_hits_total"},
+                    {"help",  "Number of prompts that reused a prefix from the prefix cache."},
+                    {"value",  (uint64_t) data.at("prefix_cache_hits")}
+            }, {
+                    {"name",  "prefix_cache_tokens_total"},
+                    {"help",  "Number of prompt tokens reused from the prefix cache."},
+                    {"value",  (uint64_t) data.at("prefix_cache_tokens")}
+            }, {
+                    {"name",  "prefix_cache_evictions_total"},
+                    {"help",  "Number of prefix cache entries evicted."},
+                    {"value",  (uint64_t) data.at("prefix_cache_evictions")}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3989,6 +5061,26 @@ int main(int argc, char ** argv) {
                     {"name",  "kv_cache_tokens"},
                     {"help",  "KV-cache tokens."},
                     {"value",  (uint64_t) data.at("kv_cache_tokens_count")}
+            },{
+                    {"name",  "kv_pool_bytes"},
+                    {"help",  "Memory used by the KV pool of idle slots."},
+                    {"value",  (uint64_t) data.at("kv_pool_size")}
+            },{
+                    {"name",  "kv_pool_budget_bytes"},
+                    {"help",  "Memory budget of the KV pool of idle slots."},
+                    {"value",  (uint64_t) data.at("kv_pool_budget")}
+            },{
+                    {"name",  "kv_pool_entries"},
+                    {"help",  "Number of idle slots with their KV cache in the KV pool."},
+                    {"value",  (uint64_t) data.at("kv_pool_entries")}
+            },{
+                    {"name",  "prefix_cache_entries"},
+                    {"help",  "Number of token prefixes in the prefix cache."},
+                    {"value",  (uint64_t) data.at("prefix_cache_entries")}
+            },{
+                    {"name",  "prefix_cache_entries_used"},
+                    {"help",  "Number of prefix cache entries used by running tasks."},
+                    {"value",  (uint64_t) data.at("prefix_cache_entries_used")}
             },{
                     {"name",  "requests_processing"},
                     {"help",  "Number of request processing."},
@@ -4017,6 +5109,51 @@ int main(int argc, char ** argv) {
             }
         }
 
+        // per-slot inter-token latency
+        const json & slots_data = data.at("slots");
+        prometheus << "# HELP llamacpp:inter_token_latency_seconds Time between two generated tokens of a slot, quantiles over its last "
+                   << server_latency_window::n_window << " tokens.\n"
+                   << "# TYPE llamacpp:inter_token_latency_seconds summary\n";
+        for (const auto & slot : slots_data) {
+            const int id = slot.at("id");
+            const json & itl = slot.at("inter_token_latency");
+            const uint64_t count = itl.at("count");
+            if (count > 0) {
+                prometheus << "llamacpp:inter_token_latency_seconds{slot=\"" << id << "\",quantile=\"0.5\"} "  << itl.at("p50_ms").get<double>() / 1.e3 << "\n"
+                           << "llamacpp:inter_token_latency_seconds{slot=\"" << id << "\",quantile=\"0.99\"} " << itl.at("p99_ms").get<double>() / 1.e3 << "\n";
+            }
+            prometheus << "llamacpp:inter_token_latency_seconds_sum{slot=\""   << id << "\"} " << itl.at("sum_ms").get<double>() / 1.e3 << "\n"
+                       << "llamacpp:inter_token_latency_seconds_count{slot=\"" << id << "\"} " << count << "\n";
+        }
+
+        // time for a result to reach its HTTP thread
+        {
+            const json delivery = ctx_server.queue_results.delivery_latency_data();
+            prometheus << "# HELP llamacpp:result_delivery_latency_seconds Time between sending a result and its HTTP thread receiving it, quantiles "
+                          "over all results, estimated from buckets of powers of 2 microseconds.\n"
+                       << "# TYPE llamacpp:result_delivery_latency_seconds summary\n"
+                       << "llamacpp:result_delivery_latency_seconds{quantile=\"0.5\"} "  << delivery.at("p50_ms").get<double>() / 1.e3 << "\n"
+                       << "llamacpp:result_delivery_latency_seconds{quantile=\"0.99\"} " << delivery.at("p99_ms").get<double>() / 1.e3 << "\n"
+                       << "llamacpp:result_delivery_latency_seconds_sum "   << delivery.at("sum_ms").get<double>() / 1.e3 << "\n"
+                       << "llamacpp:result_delivery_latency_seconds_count " << delivery.at("count").get<uint64_t>() << "\n";
+        }
+
+        // per-expert counters, only with --expert-stats
+        const json & expert_counts = data.at("expert_counts");
+        if (!expert_counts.empty()) {
+            prometheus << "# HELP llamacpp:expert_selections_total Number of tokens routed to each expert of each MoE layer.\n"
+                       << "# TYPE llamacpp:expert_selections_total counter\n";
+            for (size_t il = 0; il < expert_counts.size(); ++il) {
+                const auto & counts = expert_counts[il];
+                for (size_t ie = 0; ie < counts.size(); ++ie) {
+                    const uint64_t n = counts[ie];
+                    if (n > 0) {
+                        prometheus << "llamacpp:expert_selections_total{layer=\"" << il << "\",expert=\"" << ie << "\"} " << n << "\n";
+                    }
+                }
+            }
+        }
+
         const int64_t t_start = data.at("t_start");
         res.set_header("Process-Start-Time-Unix", std::to_string(t_start));
 
@@ -4667,14 +5804,19 @@ int main(int argc, char ** argv) {
                 std::ifstream file(entry.path(), std::ios::binary);
                 if (!file) continue;
 
-                uint32_t magic, version, n_token_count;
+                uint32_t magic, version, flags = 0, n_token_count;
                 file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
                 file.read(reinterpret_cast<char*>(&version), sizeof(version));
+                if (version > 2) {
+                    // version 3 added the flags (compressed or not)
+                    file.read(reinterpret_cast<char*>(&flags), sizeof(flags));
+                }
                 file.read(reinterpret_cast<char*>(&n_token_count), sizeof(n_token_count));
+                const size_t header_size = version > 2 ? 16 : 12;
 
                 if (magic != LLAMA_STATE_SEQ_MAGIC ||
-                    version != LLAMA_STATE_SEQ_VERSION ||
-                    entry.file_size() < (12 + (n_token_count * sizeof(llama_token)))) {
+                    (version != LLAMA_STATE_SEQ_VERSION && version != 2) ||
+                    entry.file_size() < (header_size + (n_token_count * sizeof(llama_token)))) {
                     continue;
                 }
 
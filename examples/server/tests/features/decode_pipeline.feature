@@ -0,0 +1,34 @@
+@llama.cpp
+@decode_pipeline
+Feature: Decode pipeline
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/split/stories15M-00001-of-00003.gguf from HF repo ggml-org/models
+    And   a model file test-model-00001-of-00003.gguf
+    And   42 as server seed
+    And   128 as batch size
+    And   256 KV cache size
+    And   2 slots
+    And   continuous batching
+    And   decode pipeline
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Multi users completion with stop strings
+    Given a prompt:
+      """
+      Once upon a time
+      """
+    And a prompt:
+      """
+      One day, a little girl
+      """
+    And 64 max tokens to predict
+    And 0.0 temperature
+    And a stop string "."
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are stopped by the stop string
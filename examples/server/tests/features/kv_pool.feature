@@ -0,0 +1,37 @@
+@llama.cpp
+@kv_pool
+Feature: KV pool for idle slots
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   42 as server seed
+    And   256 KV cache size
+    And   2 slots
+    And   a KV pool of 16 MiB
+    And   prompt caching is enabled
+    And   8 max tokens to predict
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Evict an idle slot and restore it on a matching prompt
+    Given a prompt of 40 tokens
+    And   using slot id 0
+    And   a completion request with no api error
+    Then  40 prompt tokens are processed
+    # the cells of slot 0 are needed for this prompt: its KV moves to the pool
+    Given a prompt of 220 tokens
+    And   using slot id 1
+    And   a completion request with no api error
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:kv_pool_evictions is 1
+    And   metric llamacpp:kv_pool_entries is 1
+    # the same prompt brings the KV of slot 0 back (evicting slot 1 to make room), only the last token is decoded again
+    Given a prompt of 40 tokens
+    And   using slot id 0
+    And   a completion request with no api error
+    Then  1 prompt tokens are processed
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:kv_pool_hits is 1
+    And   metric llamacpp:kv_pool_misses is 0
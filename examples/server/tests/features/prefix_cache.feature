@@ -0,0 +1,44 @@
+@llama.cpp
+@prefix_cache
+Feature: Prefix cache
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/split/stories15M-00001-of-00003.gguf from HF repo ggml-org/models
+    And   a model file test-model-00001-of-00003.gguf
+    And   42 as server seed
+    And   128 as batch size
+    And   512 KV cache size
+    And   2 slots
+    And   continuous batching
+    And   a prefix cache of 4 entries
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Overlapping prompts on parallel slots
+    # the KV of the prompt alone is cached: only the sampled token is not decoded
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And   1 max tokens to predict
+    And   prompt caching is enabled
+    And   a completion request with no api error
+    # both prompts extend the cached one, the first finished task swallows its entry while the other still uses it
+    Given a prompt:
+      """
+      Write a very long story about AI. It was a sunny day.
+      """
+    And   a prompt:
+      """
+      Write a very long story about AI. It was a rainy day.
+      """
+    And   32 max tokens to predict
+    Given concurrent completion requests
+    Then  the server is busy
+    Then  the server is idle
+    And   all slots are idle
+    Then  all prompts are predicted
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:prefix_cache_entries_used is 0
@@ -0,0 +1,61 @@
+@llama.cpp
+@scheduling
+Feature: Scheduling of the tasks
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/split/stories15M-00001-of-00003.gguf from HF repo ggml-org/models
+    And   a model file test-model-00001-of-00003.gguf
+    And   42 as server seed
+    And   128 as batch size
+    And   512 KV cache size
+    And   continuous batching
+    And   a step budget of 16 tokens
+
+  Scenario: Deferred completions are served by priority
+    Given 1 slots
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And   128 max tokens to predict
+    Given concurrent completion requests
+    Then  the server is busy
+    # both wait for the only slot, the one with the higher priority gets it first
+    Given a prompt:
+      """
+      Write another very long music lyrics.
+      """
+    And   a priority 0
+    Given concurrent completion requests
+    Given a prompt:
+      """
+      Write a very long poem.
+      """
+    And   a priority 10
+    Given concurrent completion requests
+    Then  the server is idle
+    Then  all prompts are predicted by decreasing priority
+
+  Scenario: Prompts are processed in chunks between generation steps
+    Given 2 slots
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And   64 max tokens to predict
+    Given concurrent completion requests
+    Then  the server is busy
+    # the prompt is longer than the step budget
+    Given a prompt:
+      """
+      Write a very long book about a boy who lives in a small house near the sea with his father, his mother and his
+      little sister, and who dreams of sailing around the world on a big ship.
+      """
+    Given concurrent completion requests
+    Then  the server is idle
+    Then  all prompts are predicted with 64 tokens
@@ -55,6 +55,9 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.n_prompts = 0
     context.n_server_predict = None
     context.slot_save_path = None
+    context.prefix_cache = None
+    context.kv_pool_size = None
+    context.step_budget = None
     context.id_slot = None
     context.cache_prompt = None
     context.n_slots = None
@@ -62,6 +65,7 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.prompt_suffix = None
     context.server_api_key = None
     context.server_continuous_batching = False
+    context.server_decode_pipeline = False
     context.server_embeddings = False
     context.server_metrics = False
     context.server_process = None
@@ -71,6 +75,8 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.user_api_key = None
     context.response_format = None
     context.temperature = None
+    context.stop = None
+    context.priority = None
     context.lora_file = None
 
     context.tasks_result = []
@@ -151,6 +157,21 @@ def step_slot_save_path(context, slot_save_path: str):
     context.slot_save_path = slot_save_path
 
 
+@step('a prefix cache of {prefix_cache:d} entries')
+def step_prefix_cache(context, prefix_cache: int):
+    context.prefix_cache = prefix_cache
+
+
+@step('a KV pool of {kv_pool_size:d} MiB')
+def step_kv_pool_size(context, kv_pool_size: int):
+    context.kv_pool_size = kv_pool_size
+
+
+@step('a step budget of {step_budget:d} tokens')
+def step_step_budget(context, step_budget: int):
+    context.step_budget = step_budget
+
+
 @step('using slot id {id_slot:d}')
 def step_id_slot(context, id_slot: int):
     context.id_slot = id_slot
@@ -166,6 +187,11 @@ def step_server_continuous_batching(context):
     context.server_continuous_batching = True
 
 
+@step('decode pipeline')
+def step_server_decode_pipeline(context):
+    context.server_decode_pipeline = True
+
+
 @step('embeddings extraction')
 def step_server_embeddings(context):
     context.server_embeddings = True
@@ -260,7 +286,8 @@ async def step_request_completion(context, api_error: Literal['raised'] | str):
                                           id_slot=context.id_slot,
                                           expect_api_error=expect_api_error,
                                           user_api_key=context.user_api_key,
-                                          temperature=context.temperature)
+                                          temperature=context.temperature,
+                                          stop=context.stop)
     context.tasks_result.append(completion)
     if context.debug:
         print(f"Completion response: {completion}")
@@ -354,6 +381,16 @@ def step_temperature(context, temperature):
     context.temperature = temperature
 
 
+@step('a stop string "{stop}"')
+def step_stop(context, stop):
+    context.stop = [stop]
+
+
+@step('a priority {priority:d}')
+def step_priority(context, priority):
+    context.priority = priority
+
+
 @step('streaming is {enable_streaming}')
 def step_streaming(context, enable_streaming):
     context.enable_streaming = enable_streaming == 'enabled'
@@ -502,6 +539,13 @@ def step_a_prompt(context):
     context.n_prompts = len(context.prompts)
 
 
+@step('a prompt of {n_tokens:d} tokens')
+def step_a_prompt_of_tokens(context, n_tokens: int):
+    # token ids, so that the number of KV cells a request needs does not depend on the tokenizer
+    context.prompts.append([10 + i % 100 for i in range(n_tokens)])
+    context.n_prompts = len(context.prompts)
+
+
 @step('a prompt {prompt}')
 def step_a_prompt_prompt(context, prompt):
     context.prompts.append(prompt)
@@ -530,8 +574,11 @@ async def step_concurrent_completion_requests(context):
         prompt_prefix=context.prompt_prefix,
         prompt_suffix=context.prompt_suffix,
         n_predict=context.n_predict if hasattr(context, 'n_predict') else None,
+        cache_prompt=context.cache_prompt,
         user_api_key=context.user_api_key if hasattr(context, 'user_api_key') else None,
         temperature=context.temperature,
+        stop=context.stop,
+        priority=context.priority,
     )
 
 
@@ -597,6 +644,30 @@ async def all_prompts_are_predicted(context, expected_predicted_n=None):
     assert len(context.concurrent_tasks) == 0, f"{len(context.concurrent_tasks)} pending requests"
 
 
+@step('all prompts are predicted by decreasing priority')
+@async_run_until_complete
+async def step_all_prompts_are_predicted_by_priority(context):
+    n_completions = await gather_tasks_results(context)
+    assert n_completions > 0
+    completions = [context.tasks_result.pop() for _ in range(n_completions)]
+    completions = [c for c in completions if 'priority' in c]
+    completions.sort(key=lambda c: c['t_done'])
+    priorities = [c['priority'] for c in completions]
+    assert priorities == sorted(priorities, reverse=True), f"completions not predicted by decreasing priority: {priorities}"
+
+
+@step('all prompts are stopped by the stop string')
+@async_run_until_complete
+async def step_all_prompts_are_stopped(context):
+    n_completions = await gather_tasks_results(context)
+    assert n_completions > 0
+    for i in range(n_completions):
+        completion = context.tasks_result.pop()
+        assert completion['stopping_word'] == context.stop[0], f"completion not stopped by {context.stop}: {completion['content']}"
+        assert context.stop[0] not in completion['content']
+    assert len(context.concurrent_tasks) == 0, f"{len(context.concurrent_tasks)} pending requests"
+
+
 @step('embeddings are computed for')
 @async_run_until_complete
 async def step_compute_embedding(context):
@@ -884,7 +955,9 @@ async def request_completion(prompt,
                              id_slot=None,
                              expect_api_error=None,
                              user_api_key=None,
-                             temperature=None) -> int | dict[str, Any]:
+                             temperature=None,
+                             stop=None,
+                             priority=None) -> int | dict[str, Any]:
     if debug:
         print(f"Sending completion request: {prompt}")
     origin = "my.super.domain"
@@ -908,13 +981,20 @@ async def request_completion(prompt,
                                     "seed": seed if seed is not None else 42,
                                     "temperature": temperature if temperature is not None else 0.8,
                                     "n_probs": 2,
+                                    "stop": stop if stop is not None else [],
+                                    "priority": priority if priority is not None else 0,
                                 },
                                 headers=headers,
                                 timeout=3600) as response:
             if expect_api_error is None or not expect_api_error:
                 assert response.status == 200
                 assert response.headers['Access-Control-Allow-Origin'] == origin
-                return await response.json()
+                completion = await response.json()
+                if priority is not None:
+                    # to check the order in which the tasks are served
+                    completion['priority'] = priority
+                    completion['t_done'] = time.monotonic()
+                return completion
             else:
                 return response.status
 
@@ -1323,6 +1403,8 @@ def start_server_background(context):
         server_args.extend(['--draft', context.draft])
     if context.server_continuous_batching:
         server_args.append('--cont-batching')
+    if context.server_decode_pipeline:
+        server_args.append('--decode-pipeline')
     if context.server_embeddings:
         server_args.append('--embedding')
     if context.server_metrics:
@@ -1337,6 +1419,12 @@ def start_server_background(context):
         server_args.extend(['--n-predict', context.n_server_predict])
     if context.slot_save_path:
         server_args.extend(['--slot-save-path', context.slot_save_path])
+    if context.prefix_cache:
+        server_args.extend(['--prefix-cache', context.prefix_cache])
+    if context.kv_pool_size:
+        server_args.extend(['--kv-pool-size', context.kv_pool_size])
+    if context.step_budget:
+        server_args.extend(['--step-budget', context.step_budget])
     if context.server_api_key:
         server_args.extend(['--api-key', context.server_api_key])
     if context.n_ga:
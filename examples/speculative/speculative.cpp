@@ -37,6 +37,10 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // the rejected drafts are cut from the KV caches after every step, which a windowed SWA cache cannot always
+    // do (llama_kv_cache_seq_rm() returns false), and the draft tree cannot be rebuilt
+    params.swa_full = true;
+
     // max number of parallel drafting sequences (i.e. tree branches)
     const int n_seq_dft = params.n_parallel;
 
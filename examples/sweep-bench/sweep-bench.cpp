@@ -32,6 +32,10 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // the generated tokens are cut from the KV cache at every context size, which a windowed SWA cache cannot do
+    // once it has pruned the window before the cut (llama_kv_cache_seq_rm() returns false)
+    params.swa_full = true;
+
     // init LLM
 
     llama_backend_init();
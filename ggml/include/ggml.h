@@ -382,6 +382,8 @@ extern "C" {
 
     struct ggml_object;
     struct ggml_context;
+    struct ggml_threadpool;
+    struct ggml_profiler;
 
     // NOTE: always add types at the end of the enum to keep backward compatibility
     enum ggml_type {
@@ -726,6 +728,7 @@ extern "C" {
         GGML_TENSOR_FLAG_OUTPUT = 2,
         GGML_TENSOR_FLAG_PARAM  = 4,
         GGML_TENSOR_FLAG_LOSS   = 8, // ...defines loss for numerical optimization (multiple loss tensors add up)
+        GGML_TENSOR_FLAG_NUMA_ROWS = 16, // ...rows are partitioned across NUMA nodes, see ggml_numa_partition_rows()
     };
 
     // ggml object
@@ -795,6 +798,12 @@ extern "C" {
 
         int n_threads;
 
+        // persistent worker threads to run the graph on (optional, see ggml_threadpool_new())
+        struct ggml_threadpool * threadpool;
+
+        // per-op timing of sampled graphs (optional, see ggml_profiler_new())
+        struct ggml_profiler * profiler;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
@@ -850,6 +859,7 @@ extern "C" {
         GGML_NUMA_STRATEGY_ISOLATE    = 2,
         GGML_NUMA_STRATEGY_NUMACTL    = 3,
         GGML_NUMA_STRATEGY_MIRROR     = 4,
+        GGML_NUMA_STRATEGY_PARTITION  = 5, // distribute threads, place weight rows on the node whose threads compute them
         GGML_NUMA_STRATEGY_COUNT
     };
 
@@ -868,6 +878,7 @@ extern "C" {
     GGML_API void    ggml_time_init(void); // call this once at the beginning of the program
     GGML_API int64_t ggml_time_ms(void);
     GGML_API int64_t ggml_time_us(void);
+    GGML_API int64_t ggml_time_ns(void);
     GGML_API int64_t ggml_cycles(void);
     GGML_API int64_t ggml_cycles_per_ms(void);
 
@@ -877,6 +888,17 @@ extern "C" {
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // GGML_NUMA_STRATEGY_PARTITION: bind contiguous blocks of rows of a 2D host tensor to the NUMA nodes,
+    // matrix multiplications with it are then split such that each node's threads only read node-local rows
+    // the binding sets the memory policy of the pages, so it has to be done before the data is written to anonymous
+    // memory; pages of a file mapping stay where the page cache put them
+    GGML_API bool    ggml_numa_partition_enabled(void); // the strategy is partition and there is more than one node
+    GGML_API bool    ggml_numa_can_partition_rows(const struct ggml_tensor * tensor);
+    // returns the number of bytes bound to their node (pages shared by two blocks are not), 0 if mbind() failed
+    GGML_API size_t  ggml_numa_partition_rows(struct ggml_tensor * tensor);
+    // the number of bytes of the resident pages of a partitioned tensor that are on the node of their block of rows
+    GGML_API size_t  ggml_numa_rows_local_bytes(const struct ggml_tensor * tensor);
+
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
 
@@ -2506,6 +2528,24 @@ extern "C" {
     GGML_API size_t ggml_graph_overhead(void);
     GGML_API size_t ggml_graph_overhead_custom(size_t size, bool grads);
 
+    // persistent thread pool for ggml_graph_compute()
+    // when cplan.threadpool is set, the graph runs on the pool's parked workers instead of on freshly created threads
+    // any n_threads up to the pool size can be used, ggml_threadpool_pause() stops idle workers from spinning
+    GGML_API struct ggml_threadpool * ggml_threadpool_new          (int n_threads);
+    GGML_API void                     ggml_threadpool_free         (struct ggml_threadpool * threadpool);
+    GGML_API int                      ggml_threadpool_get_n_threads(struct ggml_threadpool * threadpool);
+    GGML_API void                     ggml_threadpool_pause        (struct ggml_threadpool * threadpool);
+    GGML_API void                     ggml_threadpool_resume       (struct ggml_threadpool * threadpool);
+
+    // per-op CPU profiler
+    // every sample_every-th graph computed with cplan.profiler set records the start/end time of each node and of
+    // the barrier after it for every thread; these are appended to fname as Chrome trace JSON (open in Perfetto)
+    // the "imbalance" arg of an op is the max/avg time of the threads on it, "groups" the number of expert-parallel
+    // thread groups of a MoE matrix multiplication
+    // a profiler must not be shared by graphs that are computed concurrently
+    GGML_API struct ggml_profiler * ggml_profiler_new (const char * fname, int sample_every);
+    GGML_API void                   ggml_profiler_free(struct ggml_profiler * profiler);
+
     // ggml_graph_plan() has to be called before ggml_graph_compute()
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
     GGML_API struct ggml_cplan ggml_graph_plan   (const struct ggml_cgraph * cgraph, int n_threads /*= GGML_DEFAULT_N_THREADS*/);
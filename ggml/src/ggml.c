@@ -100,6 +100,14 @@ static LONG atomic_fetch_add(atomic_int * ptr, LONG inc) {
 static LONG atomic_fetch_sub(atomic_int * ptr, LONG dec) {
     return atomic_fetch_add(ptr, -(dec));
 }
+static bool atomic_compare_exchange_strong(atomic_int * ptr, int * expected, int desired) {
+    LONG old = InterlockedCompareExchange(ptr, desired, *expected);
+    if (old == *expected) {
+        return true;
+    }
+    *expected = old;
+    return false;
+}
 static atomic_bool atomic_flag_test_and_set(atomic_flag * ptr) {
     return InterlockedExchange(ptr, 1);
 }
@@ -552,6 +560,12 @@ int64_t ggml_time_us(void) {
     QueryPerformanceCounter(&t);
     return ((t.QuadPart-timer_start) * 1000000) / timer_freq;
 }
+int64_t ggml_time_ns(void) {
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    const int64_t dt = t.QuadPart - timer_start;
+    return (dt / timer_freq) * 1000000000 + ((dt % timer_freq) * 1000000000) / timer_freq;
+}
 #else
 void ggml_time_init(void) {}
 int64_t ggml_time_ms(void) {
@@ -565,6 +579,12 @@ int64_t ggml_time_us(void) {
     clock_gettime(CLOCK_MONOTONIC, &ts);
     return (int64_t)ts.tv_sec*1000000 + (int64_t)ts.tv_nsec/1000;
 }
+
+int64_t ggml_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + (int64_t)ts.tv_nsec;
+}
 #endif
 
 int64_t ggml_cycles(void) {
@@ -2784,6 +2804,53 @@ struct ggml_context_container {
     struct ggml_context context;
 };
 
+// ggml_barrier() uses a combining tree instead of a single arrival counter above this many threads
+#define GGML_BARRIER_TREE_MIN_THREADS 16
+#define GGML_BARRIER_TREE_ARITY        8
+
+// how long (in us) a thread waiting in ggml_barrier() spins before parking on a futex
+// with a thread pool the budget adapts to the average compute time per node of the previous graph
+#define GGML_BARRIER_SPIN_US_DEFAULT 1000
+#define GGML_BARRIER_SPIN_US_MIN       50
+#define GGML_BARRIER_SPIN_US_MAX     5000
+
+// after spinning, a waiting thread yields this many times before parking, so that with more threads than cores
+// the threads that still have to arrive get the core without paying for a futex wake-up
+#define GGML_BARRIER_YIELDS 16
+
+// node of the barrier combining tree: the last of its n_children threads (or sub-trees) to arrive
+// moves on to the parent, the last one to arrive at the root releases all threads
+struct ggml_barrier_node {
+    atomic_int n_arrived;
+    int        n_children;
+    int        parent; // -1 for the root
+
+    char padding[CACHE_LINE_SIZE - sizeof(atomic_int) - 2*sizeof(int)];
+};
+
+// Rows of the iqk matrix multiplications are handed out dynamically in chunks, so that threads that got
+// a slower core (SMT sibling busy, E-core, ...) do not hold up all others at the following barrier.
+// Each multiplication in a run of fused multiplications has its own slot. The last thread to run out of
+// chunks resets the slot, which is guaranteed to happen before the next barrier.
+#define GGML_MUL_MAT_CHUNK_SLOTS 4
+
+struct ggml_mul_mat_chunks {
+    atomic_int next;   // next chunk - nth (the first chunk of each thread is ith)
+    atomic_int n_done; // threads that ran out of chunks
+
+    char padding[CACHE_LINE_SIZE - 2*sizeof(atomic_int)];
+};
+
+// timing of one node on one thread, see ggml_profiler_new()
+struct ggml_profile_event {
+    int64_t t_start;   // 0 for no-op nodes and nodes fused into the previous node; set for every other node, even if
+                       // the thread got no rows of it
+    int64_t t_end;
+    int64_t t_barrier; // end of the barrier after the node, t_end if there was none
+    int32_t n_fused;   // number of following nodes computed together with this one
+    int32_t n_groups;  // thread groups of a MoE matrix multiplication (set on thread 0), 0 for other ops
+};
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan * cplan;
@@ -2793,11 +2860,19 @@ struct ggml_compute_state_shared {
     // synchronization primitives
     atomic_int n_barrier;
     atomic_int n_barrier_passed;
+    atomic_int n_barrier_sleeping; // threads parked in ggml_barrier()
+
+    int64_t barrier_spin_us;
+    int64_t barrier_us; // time thread 0 spent in ggml_barrier() during the graph, measured with a thread pool
+    struct ggml_barrier_node * barrier_tree; // NULL: all threads arrive on n_barrier
 
     ggml_abort_callback abort_callback; // abort ggml_graph_compute when true
     void * abort_callback_data;
 
     atomic_int current_chunk; // currently processing chunk during mul_mat, shared between all the threads
+    struct ggml_mul_mat_chunks mul_mat_chunks[GGML_MUL_MAT_CHUNK_SLOTS];
+
+    struct ggml_profile_event * profile_events; // [n_threads][n_nodes], NULL if the graph is not profiled
 
     enum ggml_status ec;
 };
@@ -2806,6 +2881,7 @@ struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * threadpool; // NULL unless the thread is a persistent pool worker
 };
 
 struct ggml_compute_params {
@@ -2817,6 +2893,9 @@ struct ggml_compute_params {
     void * wdata;
 
     struct ggml_compute_state_shared * shared;
+
+    // the profile event of the current node on this thread, NULL if the graph is not profiled
+    struct ggml_profile_event * profile;
 };
 
 //
@@ -4417,47 +4496,178 @@ inline static void ggml_critical_section_start(void) {
     }
 }
 
+#ifndef GGML_USE_OPENMP
+//
+// futex-style parking of threads on a 32-bit atomic
+//
+// ggml_futex_wait() blocks while *addr == expected, ggml_futex_wake() wakes all waiters on addr
+// the caller must change *addr before calling ggml_futex_wake()
+//
+
+#if defined(__gnu_linux__)
+#include <linux/futex.h>
+
+static void ggml_futex_wait(atomic_int * addr, int expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void ggml_futex_wake(atomic_int * addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#elif defined(_WIN32)
+// waits only happen when threads go idle, so a single process-wide lock is good enough
+static SRWLOCK            g_futex_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE g_futex_cond = CONDITION_VARIABLE_INIT;
+
+static void ggml_futex_wait(atomic_int * addr, int expected) {
+    AcquireSRWLockExclusive(&g_futex_lock);
+    while (atomic_load(addr) == expected) {
+        SleepConditionVariableSRW(&g_futex_cond, &g_futex_lock, INFINITE, 0);
+    }
+    ReleaseSRWLockExclusive(&g_futex_lock);
+}
+
+static void ggml_futex_wake(atomic_int * addr) {
+    UNUSED(addr);
+    AcquireSRWLockExclusive(&g_futex_lock);
+    WakeAllConditionVariable(&g_futex_cond);
+    ReleaseSRWLockExclusive(&g_futex_lock);
+}
+#else
+static pthread_mutex_t g_futex_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_futex_cond  = PTHREAD_COND_INITIALIZER;
+
+static void ggml_futex_wait(atomic_int * addr, int expected) {
+    pthread_mutex_lock(&g_futex_mutex);
+    while (atomic_load(addr) == expected) {
+        pthread_cond_wait(&g_futex_cond, &g_futex_mutex);
+    }
+    pthread_mutex_unlock(&g_futex_mutex);
+}
+
+static void ggml_futex_wake(atomic_int * addr) {
+    UNUSED(addr);
+    pthread_mutex_lock(&g_futex_mutex);
+    pthread_cond_broadcast(&g_futex_cond);
+    pthread_mutex_unlock(&g_futex_mutex);
+}
+#endif
+
+static inline void ggml_cpu_relax(void) {
+#if defined(__SSE3__)
+    _mm_pause();
+#elif defined __ARM_NEON
+    __asm__ __volatile__("isb\n");
+#endif
+}
+#endif
+
 #ifdef GGML_USE_OPENMP
-static void ggml_barrier(struct ggml_compute_state_shared * shared) {
-    if (shared->n_threads == 1) {
+static void ggml_barrier(const struct ggml_compute_params * params) {
+    if (params->shared->n_threads == 1) {
         return;
     }
 
     #pragma omp barrier
 }
 #else
-static void ggml_barrier(struct ggml_compute_state_shared * shared) {
-    if (shared->n_threads == 1) {
-        return;
+static int ggml_barrier_tree_n_nodes(int n_threads) {
+    int n_nodes = 0;
+    for (int n = n_threads; n > 1; n = (n + GGML_BARRIER_TREE_ARITY - 1)/GGML_BARRIER_TREE_ARITY) {
+        n_nodes += (n + GGML_BARRIER_TREE_ARITY - 1)/GGML_BARRIER_TREE_ARITY;
+    }
+    return MAX(n_nodes, 1);
+}
+
+// thread ith arrives at leaf ith/GGML_BARRIER_TREE_ARITY, the nodes of each level follow the ones of the level below
+static void ggml_barrier_tree_init(struct ggml_barrier_node * nodes, int n_threads) {
+    int first = 0;
+    int n     = n_threads;
+    while (true) {
+        const int n_level = (n + GGML_BARRIER_TREE_ARITY - 1)/GGML_BARRIER_TREE_ARITY;
+        for (int i = 0; i < n_level; ++i) {
+            atomic_store(&nodes[first + i].n_arrived, 0);
+            nodes[first + i].n_children = MIN(GGML_BARRIER_TREE_ARITY, n - i*GGML_BARRIER_TREE_ARITY);
+            nodes[first + i].parent     = n_level > 1 ? first + n_level + i/GGML_BARRIER_TREE_ARITY : -1;
+        }
+        if (n_level == 1) {
+            break;
+        }
+        first += n_level;
+        n      = n_level;
     }
+}
 
-    atomic_int * n_barrier = &shared->n_barrier;
+static void ggml_barrier_release(struct ggml_compute_state_shared * shared) {
+    atomic_fetch_add(&shared->n_barrier_passed, 1);
+    if (atomic_load(&shared->n_barrier_sleeping) > 0) {
+        ggml_futex_wake(&shared->n_barrier_passed);
+    }
+}
+
+static void ggml_barrier_wait(struct ggml_compute_state_shared * shared, int passed_old) {
     atomic_int * n_barrier_passed = &shared->n_barrier_passed;
 
-    int n_threads = shared->n_threads;
-    int passed_old = atomic_load(n_barrier_passed);
+    // spin first: most waits are shorter than a node, while waking up a parked thread costs several us
+    int64_t t_deadline = 0;
+    for (int i = 1; ; ++i) {
+        if (atomic_load(n_barrier_passed) != passed_old) {
+            return;
+        }
+        ggml_cpu_relax();
+        if (i % 64 == 0) {
+            const int64_t t_now = ggml_time_us();
+            if (t_deadline == 0) {
+                t_deadline = t_now + shared->barrier_spin_us;
+            } else if (t_now >= t_deadline) {
+                break;
+            }
+        }
+    }
 
-    if (atomic_fetch_add(n_barrier, 1) == n_threads - 1) {
-        // last thread
-        atomic_store(n_barrier, 0);
-        atomic_fetch_add(n_barrier_passed, 1);
-    } else {
-        // wait for other threads
-        const int n_spin_before_sleep = 100000;
-        while (true) {
-            for (int i = 0; i < n_spin_before_sleep; i++) {
-                if (atomic_load(n_barrier_passed) != passed_old) {
-                    return;
-                }
-            #if defined(__SSE3__)
-                _mm_pause();
-            #elif defined __ARM_NEON
-                __asm__ __volatile__("isb\n");
-            #endif
+    for (int i = 0; i < GGML_BARRIER_YIELDS; ++i) {
+        if (atomic_load(n_barrier_passed) != passed_old) {
+            return;
+        }
+        sched_yield();
+    }
+
+    atomic_fetch_add(&shared->n_barrier_sleeping, 1);
+    while (atomic_load(n_barrier_passed) == passed_old) {
+        ggml_futex_wait(n_barrier_passed, passed_old);
+    }
+    atomic_fetch_sub(&shared->n_barrier_sleeping, 1);
+}
+
+static void ggml_barrier(const struct ggml_compute_params * params) {
+    struct ggml_compute_state_shared * shared = params->shared;
+
+    if (shared->n_threads == 1) {
+        return;
+    }
+
+    const int passed_old = atomic_load(&shared->n_barrier_passed);
+
+    if (shared->barrier_tree) {
+        struct ggml_barrier_node * tree = shared->barrier_tree;
+        int node = params->ith/GGML_BARRIER_TREE_ARITY;
+        while (atomic_fetch_add(&tree[node].n_arrived, 1) == tree[node].n_children - 1) {
+            // last to arrive at this node
+            atomic_store(&tree[node].n_arrived, 0);
+            if (tree[node].parent < 0) {
+                ggml_barrier_release(shared);
+                return;
             }
-            sched_yield();
+            node = tree[node].parent;
         }
+    } else if (atomic_fetch_add(&shared->n_barrier, 1) == shared->n_threads - 1) {
+        // last thread
+        atomic_store(&shared->n_barrier, 0);
+        ggml_barrier_release(shared);
+        return;
     }
+
+    ggml_barrier_wait(shared, passed_old);
 }
 #endif
 
@@ -4574,6 +4784,135 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// rows of partitioned tensors are split into per-node blocks that are a multiple of this
+// (a multiple of the row interleaving of all repacked quantization types)
+#define GGML_NUMA_ROW_ALIGN 64
+
+static void ggml_numa_row_range(int64_t nrows, int node, int n_nodes, int64_t * ir0, int64_t * ir1) {
+    const int64_t nblocks = (nrows + GGML_NUMA_ROW_ALIGN - 1)/GGML_NUMA_ROW_ALIGN;
+    *ir0 = MIN(nrows, GGML_NUMA_ROW_ALIGN*(nblocks*node/n_nodes));
+    *ir1 = MIN(nrows, GGML_NUMA_ROW_ALIGN*(nblocks*(node + 1)/n_nodes));
+}
+
+// the rows of src0 that thread ith (out of nth) computes when src0 is partitioned across the NUMA nodes
+// threads are distributed round-robin over the nodes (see set_numa_thread_affinity()), so the threads of
+// node k are k, k + n_nodes, ... and they split the rows of block k among themselves
+static bool ggml_numa_mul_mat_rows(const struct ggml_tensor * src0, int ith, int nth,
+        int64_t * ir0, int64_t * ir1, int * ith_node, int * nth_node) {
+    const int n_nodes = g_state.numa.n_nodes;
+    if (!(src0->flags & GGML_TENSOR_FLAG_NUMA_ROWS) || nth < n_nodes || src0->ne[2] != 1 || src0->ne[3] != 1) {
+        return false;
+    }
+    const int node = ith % n_nodes;
+    ggml_numa_row_range(src0->ne[1], node, n_nodes, ir0, ir1);
+    *ith_node = ith / n_nodes;
+    *nth_node = (nth - node + n_nodes - 1) / n_nodes;
+    return true;
+}
+
+#if defined(__gnu_linux__)
+// avoid a dependency on libnuma for the mbind() constants
+#define GGML_MPOL_BIND     2
+#define GGML_MPOL_MF_MOVE  (1 << 1)
+#endif
+
+bool ggml_numa_partition_enabled(void) {
+    return g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_PARTITION && g_state.numa.n_nodes > 1;
+}
+
+bool ggml_numa_can_partition_rows(const struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__)
+    return ggml_numa_partition_enabled() && tensor->data && ggml_n_dims(tensor) == 2 &&
+        tensor->ne[1] >= (int64_t) g_state.numa.n_nodes*GGML_NUMA_ROW_ALIGN;
+#else
+    UNUSED(tensor);
+    return false;
+#endif
+}
+
+#if defined(__gnu_linux__)
+// the page-aligned part of the block of rows of node, pages shared with the neighbouring blocks are left out
+static void ggml_numa_node_pages(const struct ggml_tensor * tensor, int node, uintptr_t * p0, uintptr_t * p1) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    int64_t ir0, ir1;
+    ggml_numa_row_range(tensor->ne[1], node, g_state.numa.n_nodes, &ir0, &ir1);
+
+    *p0 = GGML_PAD((uintptr_t)tensor->data + ir0*tensor->nb[1], page_size);
+    *p1 = ((uintptr_t)tensor->data + ir1*tensor->nb[1]) & ~(uintptr_t)(page_size - 1);
+}
+#endif
+
+size_t ggml_numa_partition_rows(struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__)
+    if (!ggml_numa_can_partition_rows(tensor)) {
+        return 0;
+    }
+
+    size_t n_bound = 0;
+
+    for (int node = 0; node < (int) g_state.numa.n_nodes; ++node) {
+        uintptr_t p0, p1;
+        ggml_numa_node_pages(tensor, node, &p0, &p1);
+        if (p1 <= p0) {
+            continue;
+        }
+
+        unsigned long nodemask = 1ul << node;
+        if (syscall(SYS_mbind, (void *)p0, p1 - p0, GGML_MPOL_BIND, &nodemask, 8*sizeof(nodemask), GGML_MPOL_MF_MOVE) != 0) {
+            return 0;
+        }
+        n_bound += p1 - p0;
+    }
+
+    tensor->flags |= GGML_TENSOR_FLAG_NUMA_ROWS;
+
+    return n_bound;
+#else
+    UNUSED(tensor);
+    return 0;
+#endif
+}
+
+size_t ggml_numa_rows_local_bytes(const struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__) && defined(SYS_move_pages)
+    if (!(tensor->flags & GGML_TENSOR_FLAG_NUMA_ROWS)) {
+        return 0;
+    }
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    enum { n_batch = 1024 };
+    void * pages[n_batch];
+    int    status[n_batch];
+
+    size_t n_local = 0;
+
+    for (int node = 0; node < (int) g_state.numa.n_nodes; ++node) {
+        uintptr_t p0, p1;
+        ggml_numa_node_pages(tensor, node, &p0, &p1);
+
+        // move_pages() without target nodes only reports the node of each page (negative if not resident)
+        for (uintptr_t p = p0; p < p1; ) {
+            int n = 0;
+            for (; n < n_batch && p < p1; ++n, p += page_size) {
+                pages[n] = (void *)p;
+            }
+            if (syscall(SYS_move_pages, 0, (unsigned long) n, pages, NULL, status, 0) != 0) {
+                return 0;
+            }
+            for (int i = 0; i < n; ++i) {
+                n_local += status[i] == node ? page_size : 0;
+            }
+        }
+    }
+
+    return n_local;
+#else
+    UNUSED(tensor);
+    return 0;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -12660,7 +12999,7 @@ static void ggml_compute_forward_acc_f32(
                 ((char *) src0->data),
                 ggml_nbytes(dst));
         }
-        ggml_barrier(params->shared);
+        ggml_barrier(params);
     }
 
     const int ith = params->ith;
@@ -15534,6 +15873,50 @@ static inline uint32_t simple_gcd(uint32_t a, uint32_t b) {
     return a;
 }
 
+#if GGML_USE_IQK_MULMAT
+struct ggml_mul_mat_chunk_ctx {
+    struct ggml_mul_mat_chunks * slot;
+    int nth;
+};
+
+// iqk_next_chunk_t for the rows of a matrix multiplication, see struct ggml_mul_mat_chunks
+static int ggml_mul_mat_next_chunk(void * data, int nchunk) {
+    struct ggml_mul_mat_chunk_ctx * ctx = data;
+    const int chunk = ctx->nth + atomic_fetch_add(&ctx->slot->next, 1);
+    if (chunk < nchunk) {
+        return chunk;
+    }
+    if (atomic_fetch_add(&ctx->slot->n_done, 1) == ctx->nth - 1) {
+        atomic_store(&ctx->slot->next, 0);
+        atomic_store(&ctx->slot->n_done, 0);
+    }
+    return -1;
+}
+
+// iqk_mul_mat_4d() of src0 with B into dst. If src0 is partitioned across NUMA nodes, each thread only touches
+// the rows that live on its own node. Otherwise, if a chunk slot is given, the rows are distributed dynamically.
+static bool ggml_iqk_mul_mat(const struct ggml_tensor * src0, struct ggml_tensor * dst, long Ny, long ne12, long ne13,
+        long nb12, long nb13, int typeB, const void * B, long strideB, struct ggml_mul_mat_chunks * chunks, int ith, int nth) {
+    float * C = (float *)dst->data;
+    const long stride_C = dst->nb[1]/sizeof(float);
+    const long nb2 = dst->nb[2]/sizeof(float);
+    const long nb3 = dst->nb[3]/sizeof(float);
+
+    int64_t ir0, ir1;
+    int ith_node, nth_node;
+    if (ne12 == 1 && ne13 == 1 && ggml_numa_mul_mat_rows(src0, ith, nth, &ir0, &ir1, &ith_node, &nth_node)) {
+        return iqk_mul_mat_4d(ir1 - ir0, Ny, src0->ne[0], 1, 1, 1, 1, src0->nb[2], src0->nb[3], nb12, nb13, nb2, nb3,
+                src0->type, (const char *)src0->data + ir0*src0->nb[1], src0->nb[1],
+                typeB, B, strideB, C + ir0, stride_C, ith_node, nth_node);
+    }
+
+    struct ggml_mul_mat_chunk_ctx ctx = { chunks, nth };
+    return iqk_mul_mat_4d_chunked(src0->ne[1], Ny, src0->ne[0], src0->ne[2], src0->ne[3], ne12, ne13,
+            src0->nb[2], src0->nb[3], nb12, nb13, nb2, nb3, src0->type, src0->data, src0->nb[1], typeB, B, strideB,
+            C, stride_C, ith, nth, chunks ? ggml_mul_mat_next_chunk : NULL, &ctx);
+}
+#endif
+
 static int ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst,
@@ -15592,11 +15975,8 @@ static int ggml_compute_forward_mul_mat(
         }
     }
     if (dst->type == GGML_TYPE_F32) {
-        if (iqk_mul_mat_4d(ne01, ne11, ne00,
-                    ne02, ne03, ne12, ne13, nb02, nb03, nb12, nb13, nb2/sizeof(float), nb3/sizeof(float),
-                    src0->type, src0->data, nb01,
-                    src1->type, src1->data, nb11,
-                    (float *)dst->data, nb1/sizeof(float), ith, nth)) return node_n;
+        if (ggml_iqk_mul_mat(src0, dst, ne11, ne12, ne13, nb12, nb13, src1->type, src1->data, nb11,
+                    cgraph ? &params->shared->mul_mat_chunks[0] : NULL, ith, nth)) return node_n;
     }
 #endif
 
@@ -15646,7 +16026,7 @@ static int ggml_compute_forward_mul_mat(
             }
         }
 
-        ggml_barrier(params->shared);
+        ggml_barrier(params);
 
 #if IK_PRINT_TIMING
         int64_t t2 = ggml_time_us();
@@ -15659,13 +16039,11 @@ static int ggml_compute_forward_mul_mat(
 
     if (src1->type != vec_dot_type && dst->type == GGML_TYPE_F32) {
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
-        if (iqk_mul_mat_4d(ne01, ne11, ne00,
-                    ne02, ne03, ne12, ne13, nb02, nb03, row_size*ne11, row_size*ne11*ne12,
-                    nb2/sizeof(float), nb3/sizeof(float),
-                    src0->type, src0->data, nb01,
-                    vec_dot_type, wdata, row_size,
-                    (float *)dst->data, nb1/sizeof(float), ith, nth)) {
+        if (ggml_iqk_mul_mat(src0, dst, ne11, ne12, ne13, row_size*ne11, row_size*ne11*ne12, vec_dot_type, wdata, row_size,
+                    cgraph ? &params->shared->mul_mat_chunks[0] : NULL, ith, nth)) {
             if (!cgraph) return node_n;
+            // fused multiplications are not separated by barriers, so each gets its own chunk slot
+            int n_fused = 1;
             while (node_n < cgraph->n_nodes - 1 &&
                    cgraph->nodes[node_n+1]->op == GGML_OP_MUL_MAT &&
                    cgraph->nodes[node_n+1]->src[1] == src1 &&
@@ -15675,13 +16053,11 @@ static int ggml_compute_forward_mul_mat(
                 GGML_ASSERT(dst_next->type == GGML_TYPE_F32);
                 GGML_ASSERT(src0_next->ne[0] == ne00);
                 //if (ith == 0) printf("Fusing %s\n", src0_next->name);
-                if (!iqk_mul_mat_4d(src0_next->ne[1], ne11, ne00,
-                    src0_next->ne[2], src0_next->ne[3], ne12, ne13, src0_next->nb[2], src0_next->nb[3], row_size*ne11, row_size*ne11*ne12,
-                    dst_next->nb[2]/sizeof(float), dst_next->nb[3]/sizeof(float),
-                    src0_next->type, src0_next->data, src0_next->nb[1],
-                    vec_dot_type, wdata, row_size,
-                    (float *)dst_next->data, dst_next->nb[1]/sizeof(float), ith, nth)) break;
+                struct ggml_mul_mat_chunks * chunks = n_fused < GGML_MUL_MAT_CHUNK_SLOTS ? &params->shared->mul_mat_chunks[n_fused] : NULL;
+                if (!ggml_iqk_mul_mat(src0_next, dst_next, ne11, ne12, ne13, row_size*ne11, row_size*ne11*ne12,
+                    vec_dot_type, wdata, row_size, chunks, ith, nth)) break;
                 ++node_n;
+                ++n_fused;
             }
         }
         return node_n;
@@ -15690,7 +16066,7 @@ static int ggml_compute_forward_mul_mat(
     if (ith == 0) {
         atomic_store(&params->shared->current_chunk, nth);
     }
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     // This is the size of the first dimension of the result, so we can iterate that way. (see the ASSERT above, these are the same numbers)
     const int64_t nr0 = ne0;
@@ -15782,6 +16158,134 @@ static int ggml_compute_forward_mul_mat(
 
 // ggml_compute_forward_mul_mat_id
 
+// Expert-parallel schedule of MUL_MAT_ID and MOE_FUSED_UP_GATE.
+// With only a few rows routed to each expert (token generation), letting all threads split the rows of every
+// active expert gives each thread a thin slice of many small matrices. Instead, the active experts are split
+// into groups, and each group is processed by its own range of consecutive threads. A thread then streams whole
+// blocks of fewer experts, at the price of load imbalance when the routing is skewed. Both effects enter a simple
+// cost model, and the number of groups with the lowest estimated time wins (1 group = the old behavior).
+#define GGML_MOE_WEIGHT_COST    8  // cost of streaming the weights of one expert, in units of one routed row
+#define GGML_MOE_VISIT_COST     2  // cost of a thread visiting one more expert, same units
+#define GGML_MOE_GROUP_MAX_ROWS 32 // above this many rows per active expert all threads work on every expert
+
+// The schedule lives in the work buffer after matrix_rows:
+//   int32_t n_groups, thread_start[nth+1], expert_start[nth+1], experts[n_as]
+// followed by the scratch space used to build it.
+static size_t ggml_moe_schedule_size(int n_as, int nth) {
+    return GGML_PAD((3 + 2*nth + n_as)*sizeof(int32_t), sizeof(int64_t))
+         + (n_as + nth)*sizeof(int64_t) + (n_as + 2*nth)*sizeof(int32_t);
+}
+
+struct ggml_moe_group {
+    const int32_t * experts;
+    int n_experts;
+    int ith; // thread index within the group
+    int nth; // threads in the group
+};
+
+static struct ggml_moe_group ggml_moe_thread_group(const void * schedule, int ith, int nth) {
+    const int32_t * thread_start = (const int32_t *)schedule + 1;
+    const int32_t * expert_start = thread_start + nth + 1;
+    const int32_t * experts      = expert_start + nth + 1;
+    int ig = 0;
+    while (thread_start[ig+1] <= ith) ++ig;
+    struct ggml_moe_group group = {
+        experts + expert_start[ig], expert_start[ig+1] - expert_start[ig], ith - thread_start[ig], thread_start[ig+1] - thread_start[ig]
+    };
+    return group;
+}
+
+static int ggml_moe_cmp_desc(const void * a, const void * b) {
+    const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// LPT assignment of the active experts (keys sorted by decreasing cost) to n_groups groups, then threads are handed
+// out one by one to the group with the highest cost per thread. Returns the estimated time of the slowest group.
+static float ggml_moe_assign_groups(const int64_t * keys, int n_active, int n_groups, int nth,
+        int32_t * group_of, int64_t * gcost, int32_t * gthreads, int32_t * gn) {
+    for (int g = 0; g < n_groups; ++g) {
+        gcost[g] = 0; gthreads[g] = 1; gn[g] = 0;
+    }
+    for (int i = 0; i < n_active; ++i) {
+        int best = 0;
+        for (int g = 1; g < n_groups; ++g) {
+            if (gcost[g] < gcost[best]) best = g;
+        }
+        group_of[keys[i] & 0xffff] = best;
+        gcost[best] += GGML_MOE_WEIGHT_COST + (keys[i] >> 16);
+        gn[best] += 1;
+    }
+    for (int it = n_groups; it < nth; ++it) {
+        int best = 0;
+        for (int g = 1; g < n_groups; ++g) {
+            if (gcost[g]*gthreads[best] > gcost[best]*gthreads[g]) best = g;
+        }
+        gthreads[best] += 1;
+    }
+    float t_max = 0;
+    for (int g = 0; g < n_groups; ++g) {
+        const float t = (float)gcost[g]/gthreads[g] + gn[g]*GGML_MOE_VISIT_COST;
+        t_max = MAX(t_max, t);
+    }
+    return t_max;
+}
+
+static void ggml_moe_schedule(const int64_t * counts, int n_as, int nth, void * schedule) {
+    int32_t * sched        = (int32_t *)schedule;
+    int32_t * thread_start = sched + 1;
+    int32_t * expert_start = thread_start + nth + 1;
+    int32_t * experts      = expert_start + nth + 1;
+    int64_t * keys     = (int64_t *)((char *)schedule + GGML_PAD((3 + 2*nth + n_as)*sizeof(int32_t), sizeof(int64_t)));
+    int64_t * gcost    = keys + n_as;
+    int32_t * group_of = (int32_t *)(gcost + nth);
+    int32_t * gthreads = group_of + n_as;
+    int32_t * gn       = gthreads + nth;
+
+    int n_active = 0;
+    int64_t n_rows = 0;
+    for (int e = 0; e < n_as; ++e) {
+        group_of[e] = -1;
+        if (counts[e] > 0) {
+            keys[n_active++] = (counts[e] << 16) | e;
+            n_rows += counts[e];
+        }
+    }
+
+    int n_groups = 1;
+    if (nth > 1 && n_active > 1 && n_rows <= (int64_t)GGML_MOE_GROUP_MAX_ROWS*n_active && n_as <= 0x10000) {
+        qsort(keys, n_active, sizeof(int64_t), ggml_moe_cmp_desc);
+        float t_best = (float)(n_active*GGML_MOE_WEIGHT_COST + n_rows)/nth + n_active*GGML_MOE_VISIT_COST;
+        const int max_groups = MIN(n_active, nth);
+        for (int n = 2; n <= max_groups; n = n < max_groups && 2*n > max_groups ? max_groups : 2*n) {
+            const float t = ggml_moe_assign_groups(keys, n_active, n, nth, group_of, gcost, gthreads, gn);
+            if (t < t_best) {
+                t_best   = t;
+                n_groups = n;
+            }
+        }
+    }
+
+    if (n_groups == 1) {
+        for (int e = 0; e < n_as; ++e) group_of[e] = counts[e] > 0 ? 0 : -1;
+        gthreads[0] = nth;
+    } else {
+        ggml_moe_assign_groups(keys, n_active, n_groups, nth, group_of, gcost, gthreads, gn);
+    }
+
+    // consecutive threads per group, experts of a group in memory order
+    sched[0] = n_groups;
+    thread_start[0] = expert_start[0] = 0;
+    int n = 0;
+    for (int g = 0; g < n_groups; ++g) {
+        for (int e = 0; e < n_as; ++e) {
+            if (group_of[e] == g) experts[n++] = e;
+        }
+        thread_start[g+1] = thread_start[g] + gthreads[g];
+        expert_start[g+1] = n;
+    }
+}
+
 static void ggml_compute_forward_mul_mat_id(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -15882,12 +16386,20 @@ static void ggml_compute_forward_mul_mat_id(
                 matrix_row_counts[i02] += 1;
             }
         }
+
+        ggml_moe_schedule(matrix_row_counts, n_as, nth, matrix_rows + n_as*ne12);
+        if (params->profile) {
+            params->profile->n_groups = *(const int32_t *)(matrix_rows + n_as*ne12);
+        }
     }
 
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
-    // compute each matrix multiplication in sequence
-    for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+    const struct ggml_moe_group group = ggml_moe_thread_group(matrix_rows + n_as*ne12, ith, nth);
+
+    // compute the matrix multiplications of this thread's group of experts in sequence
+    for (int ie = 0; ie < group.n_experts; ++ie) {
+        const int cur_a = group.experts[ie];
         const int64_t cne1 = matrix_row_counts[cur_a];
 
         if (cne1 == 0) {
@@ -15908,15 +16420,15 @@ static void ggml_compute_forward_mul_mat_id(
                        src0->type, (const char *)src0_cur, nb01, ///ggml_type_size(src0->type),
                        vec_dot_type, (const char *)wdata, row_size, ///ggml_type_size(vec_dot_type),
                        (float *)dst->data, nb1, nb2,
-                       matrix_rows + cur_a*ne12, ith, nth)) goto IQK_MulMat_Not_Available;
+                       matrix_rows + cur_a*ne12, group.ith, group.nth)) goto IQK_MulMat_Not_Available;
                 continue;
         }
 IQK_MulMat_Not_Available:;
 #endif
 
         if (((ggml_n_dims(src0) - 1) == 2) && gemv) {
-            int64_t src0_cur_start = (ith * ne01) / nth;
-            int64_t src0_cur_end   = ((ith + 1) * ne01) / nth;
+            int64_t src0_cur_start = (group.ith * ne01) / group.nth;
+            int64_t src0_cur_end   = ((group.ith + 1) * ne01) / group.nth;
             src0_cur_start = (src0_cur_start % matmul_num_cols) ? src0_cur_start + matmul_num_cols - (src0_cur_start % matmul_num_cols): src0_cur_start;
             src0_cur_end   = (src0_cur_end % matmul_num_cols) ? src0_cur_end + matmul_num_cols - (src0_cur_end % matmul_num_cols): src0_cur_end;
             if (src0_cur_start >= src0_cur_end) return;
@@ -15943,8 +16455,8 @@ IQK_MulMat_Not_Available:;
         }
 
         if (((ggml_n_dims(src0) - 1) == 2) && gemv) {
-            int64_t src0_cur_start = (ith * ne01) / nth;
-            int64_t src0_cur_end   = ((ith + 1) * ne01) / nth;
+            int64_t src0_cur_start = (group.ith * ne01) / group.nth;
+            int64_t src0_cur_end   = ((group.ith + 1) * ne01) / group.nth;
             src0_cur_start = (src0_cur_start % matmul_num_cols) ? src0_cur_start + matmul_num_cols - (src0_cur_start % matmul_num_cols): src0_cur_start;
             src0_cur_end   = (src0_cur_end % matmul_num_cols) ? src0_cur_end + matmul_num_cols - (src0_cur_end % matmul_num_cols): src0_cur_end;
             if (src0_cur_start >= src0_cur_end) return;
@@ -15972,11 +16484,11 @@ IQK_MulMat_Not_Available:;
 
         // distribute the thread work across the inner or outer loop based on which one is larger
 
-        const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-        const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+        const int64_t nth0 = nr0 > nr1 ? group.nth : 1; // parallelize by src0 rows
+        const int64_t nth1 = nr0 > nr1 ? 1 : group.nth; // parallelize by src1 rows
 
-        const int64_t ith0 = ith % nth0;
-        const int64_t ith1 = ith / nth0;
+        const int64_t ith0 = group.ith % nth0;
+        const int64_t ith1 = group.ith / nth0;
 
         const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
         const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
@@ -16152,15 +16664,23 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
                 matrix_row_counts[i02] += 1;
             }
         }
+
+        ggml_moe_schedule(matrix_row_counts, n_as, nth, matrix_rows + n_as*ne12);
+        if (params->profile) {
+            params->profile->n_groups = *(const int32_t *)(matrix_rows + n_as*ne12);
+        }
     }
 
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
+
+    const struct ggml_moe_group group = ggml_moe_thread_group(matrix_rows + n_as*ne12, ith, nth);
 
 
     // so GGML_TENSOR_BINARY_OP_LOCALS works
 
-    // compute each matrix multiplication in sequence
-    for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+    // compute the matrix multiplications of this thread's group of experts in sequence
+    for (int ie = 0; ie < group.n_experts; ++ie) {
+        const int cur_a = group.experts[ie];
         const int64_t cne1 = matrix_row_counts[cur_a];
 
         if (cne1 == 0) {
@@ -16183,7 +16703,7 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
                             vec_dot_type, (const char *)wdata, row_size,
                             up_b_cur, gate_b_cur,
                             (float *)dst->data, nb1, nb2,
-                            matrix_rows + cur_a*ne12, ith, nth)) GGML_ABORT("fatal error");
+                            matrix_rows + cur_a*ne12, group.ith, group.nth)) GGML_ABORT("fatal error");
 
 //        if (nth%2 == 0) {
 //            const char * src0_d = ith%2 == 0 ? src0_1_cur : src0_2_cur;
@@ -16267,7 +16787,7 @@ static void ggml_compute_forward_mul_mat_up_gate(
         }
     }
 
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
@@ -16317,7 +16837,7 @@ static void ggml_compute_forward_out_prod_f32(
     if (ith == 0) {
         ggml_vec_set_f32(ne0*ne1*ne2*ne3, dst->data, 0);
     }
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     // dst[:,:,:,:] = 0
     // for i2,i3:
@@ -16435,7 +16955,7 @@ static void ggml_compute_forward_out_prod_q_f32(
     if (ith == 0) {
         ggml_vec_set_f32(ne0*ne1*ne2*ne3, dst->data, 0);
     }
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     // parallelize by last three dimensions
 
@@ -16850,7 +17370,7 @@ static void ggml_compute_forward_set_f32(
                 ((char *) src0->data),
                 ggml_nbytes(dst));
         }
-        ggml_barrier(params->shared);
+        ggml_barrier(params);
     }
 
     const int ith = params->ith;
@@ -17543,7 +18063,7 @@ static void ggml_compute_forward_diag_mask_f32(
                 ((char *) src0->data),
                 ggml_nbytes(dst));
         }
-        ggml_barrier(params->shared);
+        ggml_barrier(params);
     }
 
     // TODO: handle transposed/permuted matrices
@@ -18575,7 +19095,7 @@ static void ggml_compute_forward_conv_transpose_1d_f16_f32(
         // need to zero dst since we are accumulating into it
         memset(dst->data, 0, ggml_nbytes(dst));
     }
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     const int32_t s0 = ((const int32_t*)(dst->op_params))[0];
 
@@ -18663,7 +19183,7 @@ static void ggml_compute_forward_conv_transpose_1d_f32(
         // need to zero dst since we are accumulating into it
         memset(dst->data, 0, ggml_nbytes(dst));
     }
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     const int32_t s0 = ((const int32_t*)(dst->op_params))[0];
 
@@ -19026,7 +19546,7 @@ static void ggml_compute_forward_conv_2d_impl(const struct ggml_compute_params *
             }
         }   // patches handled by this thread
 
-        ggml_barrier(params->shared);
+        ggml_barrier(params);
 
         float * gemm_output = (float *) ((char *) tmp + patches_per_batch * knl_n * traits->type_size);
 
@@ -19035,7 +19555,7 @@ static void ggml_compute_forward_conv_2d_impl(const struct ggml_compute_params *
         // GEMM: patches[patch_n, knl_n] × kernel[knl_n, c_out] = output[patch_n, c_out]
         ggml_call_mul_mat(kernel_type, params, patch_n, c_out, knl_n, tmp, knl_data, gemm_output);
 
-        ggml_barrier(params->shared);
+        ggml_barrier(params);
 
         //permute back [OC, N, OH, OW] to [N, OC, OH, OW]
         const int64_t permute_per_thread = (patch_n + params->nth - 1) / params->nth;
@@ -19299,7 +19819,7 @@ static void ggml_compute_forward_conv_transpose_2d(
 
         memset(dst->data, 0, ggml_nbytes(dst));
     }
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     const int32_t stride = ggml_get_op_params_i32(dst, 0);
 
@@ -19899,6 +20419,8 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     }
 
 #if GGML_USE_IQK_MULMAT
+    // non-const copy of the params for the barrier callback
+    struct ggml_compute_params barrier_params = *params;
     // For now we do not implement sinks in the iqk FA implementation
     if (iqk_flash_attn_noalibi(q->type, mask->type, max_bias,
                 q->ne[3], q->ne[2], q->nb[3], q->nb[2],
@@ -19909,7 +20431,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
                 Dk, Dv, neq1, nek1, q->nb[1], k->nb[1], v->nb[1], mask->nb[1],
                 q->data, k->data, v->data, mask->data, sinks ? sinks->data : NULL,
                 scale, softcap, (float *)dst->data,
-                params->wdata, (barrier_t)ggml_barrier, (void *)params->shared, ith, nth, dst->op_params[4])) return;
+                params->wdata, (barrier_t)ggml_barrier, &barrier_params, ith, nth, dst->op_params[4])) return;
 
 //    if (max_bias <= 0.0f && q->type == GGML_TYPE_F32 && mask && mask->type == GGML_TYPE_F16) {
 //        //if (ith == 0) printf("k: %ld x %ld x %ld, q: %ld x %ld x %ld, v: %ld x %ld x %ld mask: %ld x %ld x %ld\n",
@@ -20183,7 +20705,7 @@ static void ggml_compute_forward_flash_attn_back_f32(
     if (ith == 0) {
         memset(dst->data, 0, nb0*ne0*ne1*ne2*ne3);
     }
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     const int64_t elem_q = ggml_nelements(q);
     const int64_t elem_k = ggml_nelements(k);
@@ -21577,7 +22099,7 @@ static void ggml_compute_forward_add_rel_pos_f32(
         if (params->ith == 0) {
             memcpy((char *) dst->data, (char *) src0->data, ggml_nbytes(dst));
         }
-        ggml_barrier(params->shared);
+        ggml_barrier(params);
     }
     // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L357-L359
 
@@ -21862,7 +22384,7 @@ static void ggml_compute_forward_cross_entropy_loss_f32(
     if (ith == 0) {
         memset(sums, 0, sizeof(float) * (nth + nth * nc));
     }
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     const double eps = 1e-9;
 
@@ -21910,7 +22432,7 @@ static void ggml_compute_forward_cross_entropy_loss_f32(
         }
 #endif
     }
-    ggml_barrier(params->shared);
+    ggml_barrier(params);
 
     if (ith == 0) {
         float * dp = (float *) dst->data;
@@ -23849,6 +24371,7 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_PARTITION:
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
@@ -24143,6 +24666,112 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
     return n_tasks;
 }
 
+//
+// graph stages
+//
+// consecutive nodes that do not depend on each other form a stage and only the last node of a stage is followed
+// by a barrier. the table with one byte per node (1: a barrier is needed before the node) lives at the end of the
+// work buffer, ggml_graph_plan() reserves the space and ggml_graph_compute() fills it in
+//
+
+// upper bound for the number of nodes in a stage (bounds the cost of the dependency checks)
+#define GGML_GRAPH_STAGE_MAX_NODES 8
+
+static size_t ggml_graph_stage_table_size(const struct ggml_cgraph * cgraph, int n_threads) {
+    return n_threads > 1 ? GGML_PAD((size_t)cgraph->n_nodes, CACHE_LINE_SIZE) : 0;
+}
+
+static uint8_t * ggml_graph_stage_table(const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan) {
+    const size_t size = ggml_graph_stage_table_size(cgraph, cplan->n_threads);
+    return size > 0 ? cplan->work_data + cplan->work_size - size : NULL;
+}
+
+// ops that can share a stage with other nodes: every thread only works on its own part of dst, there are no internal
+// barriers and no fusion with following nodes. they must not use the work buffer either: the per-thread slices of
+// params->wdata depend on the node (e.g. ne0 of a ROPE), so the slices of two nodes of a stage could overlap
+static bool ggml_graph_stage_can_share(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+            return !ggml_is_quantized(node->src[0]->type);
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            // f16/bf16 into another type goes through a row of f32 in params->wdata
+            return node->src[0]->type == node->type ||
+                  (node->src[0]->type != GGML_TYPE_F16 && node->src[0]->type != GGML_TYPE_BF16);
+        case GGML_OP_SCALE:
+        case GGML_OP_SOFTCAP:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_FUSED_RMS_NORM:
+        case GGML_OP_FUSED_MUL_UNARY:
+        case GGML_OP_MULTI_ADD:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_UNARY:
+        case GGML_OP_GLU:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool ggml_graph_stage_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (!a->data || !b->data) {
+        return true;
+    }
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// true if node reads what prev writes, or writes what prev reads or writes
+static bool ggml_graph_stage_depends(const struct ggml_tensor * node, const struct ggml_tensor * prev) {
+    if (ggml_graph_stage_overlap(node, prev)) {
+        return true;
+    }
+    for (int k = 0; k < GGML_MAX_SRC; ++k) {
+        if (node->src[k] && ggml_graph_stage_overlap(node->src[k], prev)) {
+            return true;
+        }
+        if (prev->src[k] && ggml_graph_stage_overlap(node, prev->src[k])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ggml_graph_plan_stages(const struct ggml_cgraph * cgraph, uint8_t * node_barrier) {
+    int stage[GGML_GRAPH_STAGE_MAX_NODES];
+    int n_stage = 0;
+    bool can_share_prev = false;
+
+    for (int i = 0; i < cgraph->n_nodes; ++i) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+        node_barrier[i] = 1;
+        if (ggml_is_noop(node)) {
+            continue;
+        }
+
+        const bool can_share = ggml_graph_stage_can_share(node);
+
+        bool join = can_share && can_share_prev && n_stage < GGML_GRAPH_STAGE_MAX_NODES;
+        for (int j = 0; join && j < n_stage; ++j) {
+            join = !ggml_graph_stage_depends(node, cgraph->nodes[stage[j]]);
+        }
+
+        if (join) {
+            node_barrier[i] = 0;
+        } else {
+            n_stage = 0;
+        }
+        stage[n_stage++] = i;
+        can_share_prev = can_share;
+    }
+}
+
 struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threads) {
     if (n_threads <= 0) {
         n_threads = GGML_DEFAULT_N_THREADS;
@@ -24214,6 +24843,7 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                     cur += GGML_PAD(cur, sizeof(int64_t));       // align
                     cur += n_as * sizeof(int64_t);               // matrix_row_counts
                     cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
+                    cur += ggml_moe_schedule_size(n_as, n_tasks); // expert groups
                 } break;
             case GGML_OP_MOE_FUSED_UP_GATE:
                 {
@@ -24228,6 +24858,7 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                     cur += GGML_PAD(cur, sizeof(int64_t));       // align
                     cur += n_as * sizeof(int64_t);               // matrix_row_counts
                     cur += n_as * src2->ne[2] * sizeof(int64_t); // matrix_rows
+                    cur += ggml_moe_schedule_size(n_as, n_tasks); // expert groups
                 } break;
             case GGML_OP_FUSED_UP_GATE:
                 {
@@ -24390,6 +25021,10 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
     }
 
     cplan.n_threads = MIN(max_tasks, n_threads);
+
+    // room for the stage table at the end of the work buffer
+    work_size += ggml_graph_stage_table_size(cgraph, cplan.n_threads);
+
     cplan.work_size = work_size;
     cplan.work_data = NULL;
 
@@ -24404,14 +25039,22 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     set_numa_thread_affinity(state->ith);
 
+    const uint8_t * node_barrier = ggml_graph_stage_table(cgraph, cplan);
+
     struct ggml_compute_params params = {
         /*.ith   =*/ state->ith,
         /*.nth   =*/ state->shared->n_threads,
-        /*.wsize =*/ cplan->work_size,
+        /*.wsize =*/ cplan->work_size - ggml_graph_stage_table_size(cgraph, cplan->n_threads),
         /*.wdata =*/ cplan->work_data,
         /*.shared=*/ state->shared,
+        /*.profile=*/ NULL,
     };
 
+    struct ggml_profile_event * profile = state->shared->profile_events;
+    if (profile) {
+        profile += state->ith*cgraph->n_nodes;
+    }
+
 #if IK_PRINT_TIMING
     int64_t t_start = ggml_time_us();
     int64_t t_eval  = 0;
@@ -24425,17 +25068,49 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 #if IK_PRINT_TIMING
         int64_t tim1 = ggml_time_us();
 #endif
+        const int node_first = node_n;
+        const int64_t t_node = profile ? ggml_time_ns() : 0;
+        params.profile = profile ? &profile[node_n] : NULL;
         node_n = ggml_compute_forward(&params, node, cgraph, node_n);
 #if IK_PRINT_TIMING
         int64_t tim2 = ggml_time_us();
         t_eval += tim2 - tim1;
 #endif
+        if (profile) {
+            struct ggml_profile_event * ev = &profile[node_first];
+            ev->t_start   = t_node;
+            ev->t_end     = ggml_time_ns();
+            ev->t_barrier = ev->t_end;
+            ev->n_fused   = node_n - node_first;
+        }
 
         if (state->ith == 0 && cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
             state->shared->ec = GGML_STATUS_ABORTED;
         }
 
-        ggml_barrier(state->shared);
+        // no barrier if the next node belongs to the same stage (fused nodes always end the stage)
+        if (node_barrier && node_n == node_first) {
+            int next = node_n + 1;
+            while (next < cgraph->n_nodes && ggml_is_noop(cgraph->nodes[next])) {
+                ++next;
+            }
+            if (next < cgraph->n_nodes && !node_barrier[next]) {
+                continue;
+            }
+        }
+
+        // the barrier time of thread 0 is left out of the node duration the spin budget is derived from
+        const bool timed = state->ith == 0 && state->threadpool;
+        const int64_t t_barrier = timed ? ggml_time_us() : 0;
+
+        ggml_barrier(&params);
+
+        if (timed) {
+            state->shared->barrier_us += ggml_time_us() - t_barrier;
+        }
+        if (profile) {
+            profile[node_first].t_barrier = ggml_time_ns();
+        }
 
         if (state->shared->ec != GGML_STATUS_SUCCESS) {
             break;
@@ -24449,11 +25124,390 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     return 0;
 }
 
+//
+// persistent thread pool
+//
+// the workers are created once and parked on a futex between graphs, so that token generation does not pay
+// for creating and joining n_threads threads on every ggml_graph_compute() call
+// (OpenMP builds keep their own thread team, there the pool only records the requested number of threads)
+//
+
+struct ggml_threadpool {
+    int n_threads_max;
+
+#ifndef GGML_USE_OPENMP
+    struct ggml_compute_state_shared shared;
+    struct ggml_compute_state * workers; // [n_threads_max], workers[0] is the thread calling ggml_graph_compute()
+
+    // the futex word the idle workers park on
+    // the low GGML_THREADPOOL_NTH_BITS bits hold the number of threads of the current graph, the rest is a sequence number
+    atomic_int graph_word;
+    atomic_int n_active;   // workers that have not finished the current graph yet
+    atomic_int n_sleeping; // workers parked in ggml_futex_wait()
+    atomic_int stop;
+    atomic_int pause;
+
+    struct ggml_barrier_node * barrier_tree; // sized for n_threads_max
+#endif
+};
+
+#ifndef GGML_USE_OPENMP
+#define GGML_THREADPOOL_NTH_BITS 12
+
+// number of spin iterations an idle worker does before parking on the futex
+// during token generation the next graph typically arrives well within that time
+#define GGML_THREADPOOL_N_SPIN 50000
+
+static int ggml_threadpool_wait_graph(struct ggml_threadpool * tp, int last_word) {
+    int word;
+    if (!atomic_load(&tp->pause)) {
+        for (int i = 0; i < GGML_THREADPOOL_N_SPIN; ++i) {
+            word = atomic_load(&tp->graph_word);
+            if (word != last_word || atomic_load(&tp->pause)) {
+                break;
+            }
+            ggml_cpu_relax();
+        }
+    }
+    while ((word = atomic_load(&tp->graph_word)) == last_word) {
+        atomic_fetch_add(&tp->n_sleeping, 1);
+        ggml_futex_wait(&tp->graph_word, last_word);
+        atomic_fetch_sub(&tp->n_sleeping, 1);
+    }
+    return word;
+}
+
+static thread_ret_t ggml_threadpool_worker(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * tp = state->threadpool;
+
+    int last_word = 0;
+
+    while (true) {
+        last_word = ggml_threadpool_wait_graph(tp, last_word);
+        if (atomic_load(&tp->stop)) {
+            break;
+        }
+
+        // the number of threads comes with the futex word, so a worker that is late to wake up
+        // can never mistake the state of a following graph for the one it was woken for
+        const int n_threads = last_word & ((1 << GGML_THREADPOOL_NTH_BITS) - 1);
+        if (state->ith < n_threads) {
+            ggml_graph_compute_thread(state);
+            atomic_fetch_sub(&tp->n_active, 1);
+        }
+    }
+
+    return 0;
+}
+
+static enum ggml_status ggml_threadpool_compute(struct ggml_threadpool * tp, struct ggml_cgraph * cgraph, struct ggml_cplan * cplan,
+        struct ggml_profile_event * profile_events) {
+    const int n_threads = MIN(cplan->n_threads, tp->n_threads_max);
+
+    tp->shared.cgraph              = cgraph;
+    tp->shared.cplan               = cplan;
+    tp->shared.n_threads           = n_threads;
+    tp->shared.abort_callback      = NULL;
+    tp->shared.abort_callback_data = NULL;
+    tp->shared.ec                  = GGML_STATUS_SUCCESS;
+    atomic_store(&tp->shared.n_barrier, 0);
+    atomic_store(&tp->shared.current_chunk, 0);
+    memset(tp->shared.mul_mat_chunks, 0, sizeof(tp->shared.mul_mat_chunks));
+    tp->shared.profile_events = profile_events;
+    tp->shared.barrier_us     = 0;
+
+    tp->shared.barrier_tree = NULL;
+    if (n_threads > GGML_BARRIER_TREE_MIN_THREADS) {
+        ggml_barrier_tree_init(tp->barrier_tree, n_threads);
+        tp->shared.barrier_tree = tp->barrier_tree;
+    }
+
+    const int64_t t_start = ggml_time_us();
+
+    if (n_threads > 1) {
+        atomic_store(&tp->n_active, n_threads - 1);
+
+        const unsigned seq  = ((unsigned) atomic_load(&tp->graph_word) >> GGML_THREADPOOL_NTH_BITS) + 1;
+        const int      word = (int) (((seq << GGML_THREADPOOL_NTH_BITS) | (unsigned) n_threads) & INT_MAX);
+        atomic_store(&tp->graph_word, word);
+        if (atomic_load(&tp->n_sleeping) > 0) {
+            ggml_futex_wake(&tp->graph_word);
+        }
+    }
+
+    ggml_graph_compute_thread(&tp->workers[0]);
+
+    // all threads are past the last barrier, but the graph and the plan must stay valid
+    // until every worker has left ggml_graph_compute_thread()
+    while (atomic_load(&tp->n_active) > 0) {
+        ggml_cpu_relax();
+    }
+
+    // adapt the barrier spin budget to the average compute time of a node:
+    // a barrier wait that lasts several nodes is better spent parked than spinning
+    // (the time spent in barriers is left out, otherwise long spins would raise the next budget)
+    if (cgraph->n_nodes > 0) {
+        const int64_t t_compute = MAX(0, ggml_time_us() - t_start - tp->shared.barrier_us);
+        const int64_t t_node    = t_compute/cgraph->n_nodes;
+        tp->shared.barrier_spin_us = MAX(GGML_BARRIER_SPIN_US_MIN, MIN(GGML_BARRIER_SPIN_US_MAX, 4*t_node));
+    }
+
+    return tp->shared.ec;
+}
+#endif
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = GGML_DEFAULT_N_THREADS;
+    }
+
+    struct ggml_threadpool * tp = (struct ggml_threadpool *) GGML_ALIGNED_MALLOC(sizeof(struct ggml_threadpool));
+    memset(tp, 0, sizeof(struct ggml_threadpool));
+
+    tp->n_threads_max = n_threads;
+
+#ifndef GGML_USE_OPENMP
+    GGML_ASSERT(n_threads < (1 << GGML_THREADPOOL_NTH_BITS));
+
+    tp->shared.barrier_spin_us = GGML_BARRIER_SPIN_US_DEFAULT;
+    tp->barrier_tree = (struct ggml_barrier_node *) GGML_ALIGNED_MALLOC(sizeof(struct ggml_barrier_node)*ggml_barrier_tree_n_nodes(n_threads));
+
+    tp->workers = (struct ggml_compute_state *) GGML_ALIGNED_MALLOC(sizeof(struct ggml_compute_state)*n_threads);
+
+    for (int j = 0; j < n_threads; ++j) {
+        tp->workers[j] = (struct ggml_compute_state) {
+            .thrd       = 0,
+            .ith        = j,
+            .shared     = &tp->shared,
+            .threadpool = tp,
+        };
+    }
+
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_create(&tp->workers[j].thrd, NULL, ggml_threadpool_worker, &tp->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+#endif
+
+    return tp;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * tp) {
+    if (!tp) {
+        return;
+    }
+
+#ifndef GGML_USE_OPENMP
+    atomic_store(&tp->stop, 1);
+    atomic_fetch_add(&tp->graph_word, 1 << GGML_THREADPOOL_NTH_BITS);
+    ggml_futex_wake(&tp->graph_word);
+
+    for (int j = 1; j < tp->n_threads_max; ++j) {
+        const int rc = ggml_thread_join(tp->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    GGML_ALIGNED_FREE(tp->workers);
+    GGML_ALIGNED_FREE(tp->barrier_tree);
+#endif
+
+    GGML_ALIGNED_FREE(tp);
+}
+
+int ggml_threadpool_get_n_threads(struct ggml_threadpool * tp) {
+    return tp->n_threads_max;
+}
+
+void ggml_threadpool_pause(struct ggml_threadpool * tp) {
+#ifndef GGML_USE_OPENMP
+    atomic_store(&tp->pause, 1);
+#else
+    UNUSED(tp);
+#endif
+}
+
+void ggml_threadpool_resume(struct ggml_threadpool * tp) {
+#ifndef GGML_USE_OPENMP
+    atomic_store(&tp->pause, 0);
+#else
+    UNUSED(tp);
+#endif
+}
+
+//
+// per-op profiler
+//
+
+struct ggml_profiler {
+    FILE * file;
+    int    sample_every;
+
+    int64_t n_graphs; // graphs seen so far
+    int64_t n_events; // events written so far
+
+    struct ggml_profile_event * events;
+    size_t n_events_max;
+
+    float * imbalance; // [n_nodes] max/avg thread time of each node of the graph
+    int     n_nodes_max;
+};
+
+struct ggml_profiler * ggml_profiler_new(const char * fname, int sample_every) {
+    FILE * file = ggml_fopen(fname, "w");
+    if (!file) {
+        GGML_PRINT("%s: failed to open %s\n", __func__, fname);
+        return NULL;
+    }
+    fprintf(file, "[\n");
+
+    struct ggml_profiler * profiler = GGML_CALLOC(1, sizeof(struct ggml_profiler));
+    profiler->file         = file;
+    profiler->sample_every = MAX(1, sample_every);
+
+    return profiler;
+}
+
+void ggml_profiler_free(struct ggml_profiler * profiler) {
+    if (!profiler) {
+        return;
+    }
+    fprintf(profiler->file, "\n]\n");
+    fclose(profiler->file);
+    GGML_FREE(profiler->events);
+    GGML_FREE(profiler->imbalance);
+    GGML_FREE(profiler);
+}
+
+// the event buffer for the graph if it is sampled, NULL otherwise
+static struct ggml_profile_event * ggml_profiler_begin(struct ggml_profiler * profiler, const struct ggml_cgraph * cgraph, int n_threads) {
+    if (!profiler || profiler->n_graphs++ % profiler->sample_every != 0) {
+        return NULL;
+    }
+    const size_t n_events = (size_t)n_threads*cgraph->n_nodes;
+    if (n_events > profiler->n_events_max) {
+        GGML_FREE(profiler->events);
+        profiler->events       = GGML_MALLOC(n_events*sizeof(struct ggml_profile_event));
+        profiler->n_events_max = n_events;
+    }
+    memset(profiler->events, 0, n_events*sizeof(struct ggml_profile_event));
+    return profiler->events;
+}
+
+static void ggml_profiler_write_str(FILE * file, const char * str) {
+    fputc('"', file);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', file);
+        }
+        if ((unsigned char)*str >= 0x20) {
+            fputc(*str, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void ggml_profiler_write_ne(FILE * file, const char * key, const struct ggml_tensor * t) {
+    fprintf(file, ",\"%s\":[%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "]", key, t->ne[0], t->ne[1], t->ne[2], t->ne[3]);
+}
+
+static void ggml_profiler_end(struct ggml_profiler * profiler, const struct ggml_cgraph * cgraph, int n_threads) {
+    FILE * file = profiler->file;
+    const int64_t graph = profiler->n_graphs - 1;
+
+    // with rows handed out dynamically, the threads should finish a matrix multiplication at about the same time
+    if (cgraph->n_nodes > profiler->n_nodes_max) {
+        GGML_FREE(profiler->imbalance);
+        profiler->imbalance   = GGML_MALLOC(cgraph->n_nodes*sizeof(float));
+        profiler->n_nodes_max = cgraph->n_nodes;
+    }
+    for (int i = 0; i < cgraph->n_nodes; ++i) {
+        int64_t t_sum = 0;
+        int64_t t_max = 0;
+        for (int ith = 0; ith < n_threads; ++ith) {
+            const struct ggml_profile_event * ev = &profiler->events[(size_t)ith*cgraph->n_nodes + i];
+            t_sum += ev->t_end - ev->t_start;
+            t_max  = MAX(t_max, ev->t_end - ev->t_start);
+        }
+        profiler->imbalance[i] = t_sum > 0 ? (float)t_max*n_threads/t_sum : 1.0f;
+    }
+
+    for (int ith = 0; ith < n_threads; ++ith) {
+        const struct ggml_profile_event * events = profiler->events + (size_t)ith*cgraph->n_nodes;
+        for (int i = 0; i < cgraph->n_nodes; ++i) {
+            const struct ggml_profile_event * ev = &events[i];
+            if (ev->t_start == 0) {
+                continue;
+            }
+            const struct ggml_tensor * node = cgraph->nodes[i];
+
+            size_t n_bytes = ggml_nbytes(node);
+            for (int j = 0; j < GGML_MAX_SRC; ++j) {
+                if (node->src[j]) {
+                    n_bytes += ggml_nbytes(node->src[j]);
+                }
+            }
+
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"op\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"tensor\":",
+                    profiler->n_events++ > 0 ? ",\n" : "", ggml_op_desc(node), ith,
+                    1e-3*ev->t_start, 1e-3*(ev->t_end - ev->t_start));
+            ggml_profiler_write_str(file, node->name);
+            fprintf(file, ",\"graph\":%" PRId64 ",\"node\":%d,\"fused\":%d,\"type\":\"%s\"", graph, i, ev->n_fused, ggml_type_name(node->type));
+            ggml_profiler_write_ne(file, "ne", node);
+            if (node->src[0]) {
+                fprintf(file, ",\"src0_type\":\"%s\"", ggml_type_name(node->src[0]->type));
+                ggml_profiler_write_ne(file, "src0_ne", node->src[0]);
+            }
+            if (node->src[1]) {
+                fprintf(file, ",\"src1_type\":\"%s\"", ggml_type_name(node->src[1]->type));
+                ggml_profiler_write_ne(file, "src1_ne", node->src[1]);
+            }
+            if (ev->n_groups > 0) {
+                fprintf(file, ",\"groups\":%d", ev->n_groups);
+            }
+            fprintf(file, ",\"bytes\":%zu,\"barrier_us\":%.3f,\"imbalance\":%.3f}}", n_bytes, 1e-3*(ev->t_barrier - ev->t_end),
+                    (double)profiler->imbalance[i]);
+
+            if (ev->t_barrier > ev->t_end) {
+                fprintf(file, ",\n{\"name\":\"barrier\",\"cat\":\"sync\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                        ith, 1e-3*ev->t_end, 1e-3*(ev->t_barrier - ev->t_end));
+                profiler->n_events++;
+            }
+        }
+    }
+    fflush(file);
+}
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     GGML_ASSERT(cplan);
     GGML_ASSERT(cplan->n_threads > 0);
     GGML_ASSERT(cplan->work_size == 0 || cplan->work_data != NULL);
 
+    uint8_t * node_barrier = ggml_graph_stage_table(cgraph, cplan);
+    if (node_barrier) {
+        GGML_ASSERT(cplan->work_size >= ggml_graph_stage_table_size(cgraph, cplan->n_threads));
+        ggml_graph_plan_stages(cgraph, node_barrier);
+    }
+
+    struct ggml_profile_event * profile_events = ggml_profiler_begin(cplan->profiler, cgraph, cplan->n_threads);
+
+#ifndef GGML_USE_OPENMP
+    if (cplan->threadpool) {
+        enum ggml_status ec = ggml_threadpool_compute(cplan->threadpool, cgraph, cplan, profile_events);
+
+        // don't leave affinity set on the main thread
+        clear_numa_thread_affinity();
+
+        if (profile_events) {
+            ggml_profiler_end(cplan->profiler, cgraph, cplan->n_threads);
+        }
+
+        return ec;
+    }
+#endif
+
     int n_threads = cplan->n_threads;
 
     struct ggml_compute_state_shared state_shared = {
@@ -24462,9 +25516,15 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.n_threads               =*/ n_threads,
         /*.n_barrier               =*/ 0,
         /*.n_barrier_passed        =*/ 0,
+        /*.n_barrier_sleeping      =*/ 0,
+        /*.barrier_spin_us         =*/ GGML_BARRIER_SPIN_US_DEFAULT,
+        /*.barrier_us              =*/ 0,
+        /*.barrier_tree            =*/ NULL,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
         /*.current_chunk           =*/ 0,
+        /*.mul_mat_chunks          =*/ { { 0 } },
+        /*.profile_events          =*/ profile_events,
         /*.ec                      =*/ GGML_STATUS_SUCCESS,
     };
 
@@ -24502,6 +25562,11 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         ggml_graph_compute_thread(&worker);
     }
 #else
+    if (n_threads > GGML_BARRIER_TREE_MIN_THREADS) {
+        state_shared.barrier_tree = alloca(sizeof(struct ggml_barrier_node)*ggml_barrier_tree_n_nodes(n_threads));
+        ggml_barrier_tree_init(state_shared.barrier_tree, n_threads);
+    }
+
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
     for (int j = 0; j < n_threads; ++j) {
@@ -24535,6 +25600,10 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
+    if (profile_events) {
+        ggml_profiler_end(cplan->profiler, cgraph, cplan->n_threads);
+    }
+
     return state_shared.ec;
 }
 
@@ -1338,6 +1338,18 @@ struct FlashQKfp32 {
     }
 };
 
+// true if the mask is -INFINITY for all nq rows of the next k_step K rows, i.e., the K block does not contribute
+// to the result and can be skipped. This is the case for blocks past the causal limit of all rows, but also for
+// blocks holding KV cells of other sequences, so we cannot rely on the mask of the last row alone.
+template <int k_step>
+inline bool is_masked_block(int nq, int stride_m, const char * mr) {
+    for (int j = 0; j < nq; ++j) {
+        auto m = (const uint16_t *)(mr + j*stride_m);
+        for (int l = 0; l < k_step; ++l) if (m[l] != 0xfc00) return false;
+    }
+    return true;
+}
+
 template <int Dk, int Dv, int q_step, int k_step, typename KHelper, typename VHelper, typename KQHelper>
 void compute_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, int stride_m, int stride_qkv,
         FlashMS<q_step, k_step>& fms,
@@ -1356,11 +1368,16 @@ void compute_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, in
         KQHelper::convert(q_step, stride_q, q, q_f16);
 #endif
         auto mr = mask;
-        auto Mc = (const uint16_t *)(mr + (q_step - 1)*stride_m);
         int ik = nk1 - k_step;
-        for (; ik >=0 && Mc[ik] != 0; ik -= k_step);
+        for (; ik >=0 && is_masked_block<k_step>(q_step, stride_m, mr + ik*sizeof(ggml_half)); ik -= k_step);
         ik += k_step;
         for (int k1 = 0; k1 < ik/k_step; ++k1) {
+            if (is_masked_block<k_step>(q_step, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
 #ifdef __aarch64__
             KQHelper::multiply_mask_kq(kh, Dk, stride_m, q_f16, mr, fms);
 #else
@@ -1388,6 +1405,12 @@ void compute_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, in
 #endif
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (is_masked_block<k_step>(n_left, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
 #ifdef __aarch64__
             KQHelper::multiply_mask_kq(n_left, kh, Dk, stride_m, q_f16, mr, fms);
 #else
@@ -1420,8 +1443,12 @@ void compute_helper_q(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q,
             HelperQ80::convert<Dk>(q_step, stride_q, q, q8r);
             auto mr = mask;
             for (int k1 = 0; k1 < nk1/k_step; ++k1) {
-                auto Mc = (const uint16_t *)(mr + (q_step - 1)*stride_m);
-                if (Mc[0] != 0) break;
+                if (is_masked_block<k_step>(q_step, stride_m, mr)) {
+                    kh.next_block(k_step);
+                    vh.next_block(k_step);
+                    mr += k_step*sizeof(ggml_half);
+                    continue;
+                }
                 HelperQ80R8<Dk>::repack(k_step, kh.block, kh.stride, q8r8);
                 KQHelper::mul_mask_kq(khr8, stride_m, q8r, mr, fms);
                 fqkv.accumulate_qkv(vh, fms);
@@ -1448,11 +1475,16 @@ void compute_helper_q(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q,
         perf.accum_nolock(0, t1);
 #endif
         auto mr = mask;
-        auto Mc = (const uint16_t *)(mr + (q_step - 1)*stride_m);
         int ik = nk1 - k_step;
-        for (; ik >=0 && Mc[ik] != 0; ik -= k_step);
+        for (; ik >=0 && is_masked_block<k_step>(q_step, stride_m, mr + ik*sizeof(ggml_half)); ik -= k_step);
         ik += k_step;
         for (int k1 = 0; k1 < ik/k_step; ++k1) {
+            if (is_masked_block<k_step>(q_step, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
 #if FA_TIMING
             t1 = Perf::cur_time();
             KQHelper::mul_mask_kq(kh, stride_m, q8, mr, fms);
@@ -1489,6 +1521,12 @@ void compute_helper_q(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q,
         HelperQ80::convert<Dk>(n_left, stride_q, q, q8);
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (is_masked_block<k_step>(n_left, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
             KQHelper::mul_mask_kq(n_left, kh, stride_m, q8, mr, fms);
             fqkv.accumulate_qkv(n_left, vh, fms);
             kh.next_block(k_step);
@@ -1970,11 +2008,16 @@ struct FlashAttnBF16 {
             perf.accum_nolock(0, t1);
 #endif
             auto mr = mask;
-            auto Mc = (const uint16_t *)(mr + (q_step - 1)*stride_m);
             int ik = nk1 - k_step;
-            for (; ik >=0 && Mc[ik] != 0; ik -= k_step);
+            for (; ik >=0 && is_masked_block<k_step>(q_step, stride_m, mr + ik*sizeof(ggml_half)); ik -= k_step);
             ik += k_step;
             for (int k1 = 0; k1 < ik/k_step; ++k1) {
+                if (is_masked_block<k_step>(q_step, stride_m, mr)) {
+                    kh.next_block(k_step);
+                    vh.next_block(k_step);
+                    mr += k_step*sizeof(ggml_half);
+                    continue;
+                }
 #if FA_TIMING
                 //t1 = Perf::cur_time();
                 FlashQKbf16<Dk, q_step, k_step>::multiply_mask_kq(kh, stride_m, q_bf16, mr, fms, perf);
@@ -2010,6 +2053,12 @@ struct FlashAttnBF16 {
             FlashQKbf16<Dk, q_step, k_step>::convert(n_left, stride_q, q, q_bf16);
             auto mr = mask;
             for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+                if (is_masked_block<k_step>(n_left, stride_m, mr)) {
+                    kh.next_block(k_step);
+                    vh.next_block(k_step);
+                    mr += k_step*sizeof(ggml_half);
+                    continue;
+                }
                 FlashQKbf16<Dk, q_step, k_step>::multiply_mask_kq(n_left, kh, stride_m, q_bf16, mr, fms);
                 fqkv.accumulate_qkv(n_left, vh, fms);
                 kh.next_block(k_step);
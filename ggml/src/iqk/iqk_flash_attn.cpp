@@ -43,6 +43,41 @@ inline void accumulate_qkv(int Dv, float& M, float& S, float Mj, float Sj, float
         for (int i = 0; i < Dv; ++i) Racc[i] += c*R[i];
     }
 }
+// A run of consecutive q rows that only attend to the K rows k0...k0+nk-1 (nk is a multiple of 32)
+struct FlashRun {
+    int iq1, nq, k0, nk;
+};
+// When the batch contains tokens of several sequences (e.g., token generation for several server slots), the
+// mask leaves each of them only the KV cells of its own sequence. We split the q rows into runs that start attending
+// at the same K block, so that each run can be processed over its own K range, instead of all rows sharing the
+// union of all ranges. Fully masked K blocks inside a range are then skipped by the kernels.
+// The result is empty when there is nothing to gain (e.g., a single sequence).
+void flash_attn_runs(int nq, int nk, int stride_m, const void * mask, std::vector<FlashRun>& runs) {
+    constexpr int kMinK = 512;
+    runs.clear();
+    if (!mask || nq < 2 || nk < kMinK || nk%32 != 0) return;
+    constexpr uint16_t h_inf = 0xfc00; // -INFINITY as fp16
+    for (int j = 0; j < nq; ++j) {
+        auto m = (const uint16_t *)((const char *)mask + j*stride_m);
+        int first = 0, last = nk;
+        for (; first < nk && m[first] == h_inf; ++first);
+        if (first == nk) {
+            first = 0; // fully masked row, let the kernel deal with it
+        } else {
+            for (; last > first && m[last-1] == h_inf; --last);
+        }
+        int k0 = first & ~31;
+        int k1 = (last + 31) & ~31;
+        if (!runs.empty() && runs.back().k0 == k0) {
+            auto& run = runs.back();
+            ++run.nq;
+            run.nk = std::max(run.nk, k1 - k0);
+        } else {
+            runs.push_back({j, 1, k0, k1 - k0});
+        }
+    }
+    if (runs.size() < 2) runs.clear();
+}
 }
 
 // TODO: get the ggml_type enum here without polution
@@ -116,9 +151,17 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
         }
     }
 
+    thread_local std::vector<FlashRun> runs;
+    flash_attn_runs(neq1, nek1, stride_m, mask, runs);
+    int max_run = neq1;
+    if (!runs.empty()) {
+        max_run = 0;
+        for (auto& run : runs) max_run = std::max(max_run, run.nq);
+    }
+
     int int_type_k = int_type_k_in;
     auto work_buffer = work_buffer_in;
-    if (neq1 >= 8 || (rk2 >= 8 && nek2 > 1)) {
+    if (max_run >= 8 || (rk2 >= 8 && nek2 > 1)) {
         uint64_t row_size = 0;
         work_buffer = iqk_repack_k(int_type_k, Dk, nek1, nek2, nek3, stride_k, nbk2, nbk3, k, work_buffer_in, ith, nth, int_type_k, row_size);
         if (int_type_k != int_type_k_in) {
@@ -312,6 +355,22 @@ extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float
             if (counter++ % (nth/ntg) == ith/ntg) {
                 int iq1 = (ith%ntg)*neq1g;
                 int this_neq1 = std::min(neq1g, neq1-iq1);
+                if (!runs.empty()) {
+                    for (auto& run : runs) {
+                        int r0 = std::max(iq1, run.iq1);
+                        int r1 = std::min(iq1 + this_neq1, run.iq1 + run.nq);
+                        if (r0 >= r1) continue;
+                        if (!iqk_flash_attn_impl(int_type_k, int_type_v,
+                                Dk, Dv, r1 - r0, run.nk, stride_q, stride_k, stride_v, stride_m, ne1*nb1/sizeof(float),
+                                (const float *)((const char *)q + iq2*nbq2 + iq3*nbq3 + r0*stride_q),
+                                (const void  *)((const char *)k + iq2/rk2*nbk2 + iq3/rk3*nbk3 + int64_t(run.k0)*stride_k),
+                                (const void  *)((const char *)v + iq2/rv2*nbv2 + iq3/rv3*nbv3 + int64_t(run.k0)*stride_v),
+                                (const void  *)((const char *)mask + r0*stride_m + run.k0*sizeof(uint16_t)), sinksf, 1,
+                                scale, softcap,
+                                (float *)((char *)qkv + (iq3*ne2*ne1 + iq2 + r0*ne1)*nb1), nullptr, nullptr)) return false;
+                    }
+                    continue;
+                }
                 if (!iqk_flash_attn_impl(int_type_k, int_type_v,
                         Dk, Dv, this_neq1, nek1, stride_q, stride_k, stride_v, stride_m, ne1*nb1/sizeof(float),
                         (const float *)((const char *)q + iq2*nbq2 + iq3*nbq3 + iq1*stride_q),
@@ -493,10 +493,38 @@ extern "C" IQK_API int iqk_dequant_type(int type, int Ny) {
     return MulMat::is_dequant_better(ggml_type(type), Ny);
 }
 
-extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
+namespace {
+
+// Number of chunks for a dynamic distribution of Nx/num_rows blocks of rows between nth threads.
+// Matrix-vector products are memory bound and do fine with small chunks, for matrix-matrix products
+// a chunk should cover at least one full x-tile of mul_mat_NxM() so that the unpacked quants get reused.
+int num_chunks(long nblocks, int num_rows, long Ny, int nth) {
+    int min_rows = Ny >= 16 ? 64 : 16;
+    long min_blocks = std::max(1, min_rows/num_rows);
+    return (int)std::min<long>(4*nth, nblocks/min_blocks);
+}
+
+template <typename F>
+void run_chunks(long nblocks, int num_rows, long Ny, int ith, int nth, iqk_next_chunk_t next_chunk, void * chunk_data, const F& compute) {
+    int nchunk = next_chunk ? num_chunks(nblocks, num_rows, Ny, nth) : 0;
+    if (nchunk <= nth) {
+        auto nrc_x = (nblocks + nth - 1)/nth;
+        auto first_x = ith*nrc_x;
+        if (first_x + nrc_x > nblocks) nrc_x = nblocks - first_x;
+        if (nrc_x > 0) compute(first_x*num_rows, nrc_x*num_rows);
+        return;
+    }
+    for (int chunk = ith; chunk >= 0; chunk = next_chunk(chunk_data, nchunk)) {
+        auto first_x = chunk*nblocks/nchunk;
+        auto last_x  = (chunk + 1)*nblocks/nchunk;
+        compute(first_x*num_rows, (last_x - first_x)*num_rows);
+    }
+}
+
+bool mul_mat_2d(long Nx, long Ny, long ne00,
         int typeA, const void * A, long strideA,
         int typeB, const void * B, long strideB,
-        float * C, long stride_C, int ith, int nth) {
+        float * C, long stride_C, int ith, int nth, iqk_next_chunk_t next_chunk, void * chunk_data) {
 
     MulMat mm;
 
@@ -508,31 +536,28 @@ extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
 
         auto num_rows = MulMat::num_rows(ggml_type(dequant_type));
         GGML_ASSERT(Nx%num_rows == 0);
-        auto nrc_x = (Nx/num_rows + nth - 1)/nth;
-        auto first_x = ith*nrc_x;
-        if (first_x + nrc_x > Nx/num_rows) nrc_x = Nx/num_rows - first_x;
-        first_x *= num_rows;
-        nrc_x   *= num_rows;
 
         size_t row_size_qx = ggml_row_size(dequant_type, ne00);
         size_t row_size_qy = strideB;
 
         //printf("Dequant mul mat %s x %s: ne00 = %d, row_size = %d\n", ggml_type_name(dequant_type), ggml_type_name(ggml_type(typeB)), (int)ne00, (int)row_size_qx);
 
-        DataInfo info{C + first_x, (const char *)B, (size_t)stride_C, row_size_qy, 0, 1, nullptr, 0};
+        run_chunks(Nx/num_rows, num_rows, Ny, ith, nth, next_chunk, chunk_data, [&] (long first_x, long nrc_x) {
+            DataInfo info{C + first_x, (const char *)B, (size_t)stride_C, row_size_qy, 0, 1, nullptr, 0};
 
-        auto& f = thread_local_work_buffer();
+            auto& f = thread_local_work_buffer();
 
-        for (int ix = 0; ix < nrc_x; ix += k_x_step) {
-            auto this_info = info;
-            this_info.s += ix;
-            int this_nrc_x = ix + k_x_step <= nrc_x ? k_x_step : nrc_x - ix;
-            if (f.size() < row_size_qx*this_nrc_x) f.resize(row_size_qx*this_nrc_x);
-            if (!iqk_convert_repack(typeA, ne00, (const char *)A + (first_x + ix)*strideA, strideA, f.data(), ne00, this_nrc_x)) {
-                GGML_ABORT("Fatal error");
+            for (int ix = 0; ix < nrc_x; ix += k_x_step) {
+                auto this_info = info;
+                this_info.s += ix;
+                int this_nrc_x = ix + k_x_step <= nrc_x ? k_x_step : nrc_x - ix;
+                if (f.size() < row_size_qx*this_nrc_x) f.resize(row_size_qx*this_nrc_x);
+                if (!iqk_convert_repack(typeA, ne00, (const char *)A + (first_x + ix)*strideA, strideA, f.data(), ne00, this_nrc_x)) {
+                    GGML_ABORT("Fatal error");
+                }
+                mm.mul_mat_NxM(ne00, f.data(), row_size_qx, this_info, this_nrc_x, Ny);
             }
-            mm.mul_mat_NxM(ne00, f.data(), row_size_qx, this_info, this_nrc_x, Ny);
-        }
+        });
 
         return true;
 
@@ -553,17 +578,24 @@ extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
         GGML_ASSERT(false);
     }
     GGML_ASSERT(Nx%num_rows == 0);
-    auto nrc_x = (Nx/num_rows + nth - 1)/nth;
-    auto first_x = ith*nrc_x;
-    if (first_x + nrc_x > Nx/num_rows) nrc_x = Nx/num_rows - first_x;
-
-    DataInfo info{C + first_x*num_rows, (const char *)B, (size_t)stride_C, row_size_qy, 0, 1, nullptr, 0};
 
-    mm.mul_mat_NxM(ne00, (const char *)A + row_size_qx*first_x*num_rows, row_size_qx, info, nrc_x*num_rows, Ny);
+    run_chunks(Nx/num_rows, num_rows, Ny, ith, nth, next_chunk, chunk_data, [&] (long first_x, long nrc_x) {
+        DataInfo info{C + first_x, (const char *)B, (size_t)stride_C, row_size_qy, 0, 1, nullptr, 0};
+        mm.mul_mat_NxM(ne00, (const char *)A + row_size_qx*first_x, row_size_qx, info, nrc_x, Ny);
+    });
 
     return true;
 }
 
+}
+
+extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, int ith, int nth) {
+    return mul_mat_2d(Nx, Ny, ne00, typeA, A, strideA, typeB, B, strideB, C, stride_C, ith, nth, nullptr, nullptr);
+}
+
 namespace {
 inline uint32_t simple_gcd(uint32_t a, uint32_t b) {
     while (a != b) {
@@ -580,6 +612,21 @@ extern "C" IQK_API bool iqk_mul_mat_4d(long Nx, long Ny, long ne00,
         int typeA, const void * A, long strideA,
         int typeB, const void * B, long strideB,
         float * C, long stride_C, int ith, int nth) {
+    return iqk_mul_mat_4d_chunked(Nx, Ny, ne00, ne02, ne03, ne12, ne13, nb02, nb03, nb12, nb13, nb2, nb3,
+            typeA, A, strideA, typeB, B, strideB, C, stride_C, ith, nth, nullptr, nullptr);
+}
+
+extern "C" IQK_API bool iqk_mul_mat_4d_chunked(long Nx, long Ny, long ne00,
+        long ne02, long ne03, long ne12, long ne13,
+        long nb02, long nb03, long nb12, long nb13, long nb2, long nb3,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, int ith, int nth,
+        iqk_next_chunk_t next_chunk, void * chunk_data) {
+
+    if (ne12*ne13 == 1) {
+        return mul_mat_2d(Nx, Ny, ne00, typeA, A, strideA, typeB, B, strideB, C, stride_C, ith, nth, next_chunk, chunk_data);
+    }
 
     auto r2 = ne12 / ne02;
     auto r3 = ne13 / ne03;
@@ -1391,6 +1438,17 @@ extern "C" IQK_API bool iqk_mul_mat_4d(long /*Nx*/, long /*Ny*/, long /*ne00*/,
     return false;
 }
 
+extern "C" IQK_API bool iqk_mul_mat_4d_chunked(long /*Nx*/, long /*Ny*/, long /*ne00*/,
+        long /*ne02*/, long /*ne03*/, long /*ne12*/, long /*ne13*/,
+        long /*nb02*/, long /*nb03*/, long /*nb12*/, long /*nb13*/, long /*nb2*/, long /*nb3*/,
+        int /*typeA*/, const void * /*A*/, long /*strideA*/,
+        int /*typeB*/, const void * /*B*/, long /*strideB*/,
+        float * /*C*/, long /*stride_C*/, int /*ith*/, int /*nth*/,
+        iqk_next_chunk_t /*next_chunk*/, void * /*chunk_data*/) {
+    GGML_ABORT("Unsupported CPU. You may need to manually set compilation flags\n");
+    return false;
+}
+
 extern "C" IQK_API bool iqk_mul_mat_moe(long, long, long, int, int, const void *, long, int, const void *, long, float *, long, long,
         const void *, int, int) {
     GGML_ABORT("Unsupported CPU. You may need to manually set compilation flags\n");
@@ -24,6 +24,19 @@ IQK_API bool iqk_mul_mat_4d(long Nx, long Ny, long ne00,
         int typeB, const void * B, long strideB,
         float * C, long stride_C, int ith, int nth);
 
+// Dynamic distribution of the rows of A between the threads. The threads start with chunk ith and then get the
+// next chunk to process from next_chunk(chunk_data, nchunk) until it returns a negative value. All nth threads
+// must take part, and each thread calls next_chunk() until it gets the negative value exactly once.
+typedef int (*iqk_next_chunk_t)(void * chunk_data, int nchunk);
+
+IQK_API bool iqk_mul_mat_4d_chunked(long Nx, long Ny, long ne00,
+        long ne02, long ne03, long ne12, long ne13,
+        long nb02, long nb03, long nb12, long nb13, long nb2, long nb3,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, int ith, int nth,
+        iqk_next_chunk_t next_chunk, void * chunk_data);
+
 IQK_API bool iqk_mul_mat_moe(long Nx, long Ny, long ne00, int ne11,
         int typeA, const void * A, long strideA,
         int typeB, const void * B, long strideB,
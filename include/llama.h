@@ -50,7 +50,9 @@
 #define LLAMA_SESSION_VERSION 8
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_VERSION 3
+
+#define LLAMA_STATE_SEQ_FLAG_COMPRESSED 1u // the state data is stored as compressed chunks
 
 #ifdef __cplusplus
 extern "C" {
@@ -341,6 +343,12 @@ extern "C" {
         ggml_backend_buffer_type_t buft;
     };
 
+    // KV cache type for the layers whose cache tensor name ("cache_k_l<il>", "cache_v_l<il>") matches the pattern
+    struct llama_kv_cache_type_override {
+        const char * pattern;
+        enum ggml_type type;
+    };
+
     struct llama_model_params {
         int32_t n_gpu_layers; // number of layers to store in VRAM
         int32_t mla;          // MLA implementation to use (only applicable to DeepSeek models at this point)
@@ -371,6 +379,12 @@ extern "C" {
 
         const struct llama_model_tensor_buft_override * tensor_buft_overrides;
 
+        // expert usage counts written by a previous run (see llama_context_params::expert_stats_file):
+        // the slices of the n_hot_experts most used experts of every MoE layer are locked in RAM,
+        // while the other experts stay pageable
+        const char * hot_experts_file;
+        int32_t      n_hot_experts;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
@@ -412,6 +426,9 @@ extern "C" {
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        // per-layer overrides of type_k/type_v, terminated by an entry with pattern == NULL (NULL = none)
+        const struct llama_kv_cache_type_override * kv_type_overrides;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool logits_all;  // the llama_decode() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
         bool embeddings;  // if true, extract embeddings (together with logits)
@@ -431,6 +448,35 @@ extern "C" {
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
         void *              offload_policy;
+
+        // per-op CPU profiling: if not NULL, every profile_sample-th graph computed on the CPU backend is
+        // written to profile_file as Chrome trace JSON (open with Perfetto)
+        const char * profile_file;
+        int32_t      profile_sample;
+
+        // if not NULL, count how often each expert of each MoE layer is selected (see llama_get_expert_counts)
+        // and write the counts to this file when the context is freed (nothing is written for an empty string)
+        const char * expert_stats_file;
+
+        // when mmap-ed expert weights do not fit in RAM: start reading the weights of the selected experts as soon
+        // as the router has picked them (1), and also those of the experts of the next MoE layer that are most often
+        // selected together with them (2), so that the I/O overlaps with the computation
+        int32_t expert_prefetch;
+
+        // > 0: allocate the KV cache in blocks of this many cells, each owned by one sequence: the new tokens of a
+        // sequence go to its blocks or to a free block, so the cache never needs contiguous free space (0 = contiguous
+        // ring buffer). The attention of a ubatch only runs over the blocks that hold its sequences, gathered from the
+        // cache, and llama_decode() fails when no free block is left. Requires flash attention and a KV cache in host memory
+        uint32_t kv_block_size;
+
+        // > 0: move at most this many KV cells per llama_decode() when defragmenting the KV cache, the rest is moved
+        // by the next calls instead of stalling a single one (0 = defragment the whole cache at once)
+        uint32_t defrag_max_cells;
+
+        // false: the sliding-window attention layers (Gemma 2/3, Cohere2, gpt-oss) keep their K/V in a separate cache that
+        // only holds the window of each sequence, instead of n_ctx cells like the other layers; positions that have left
+        // the window cannot be kept by llama_kv_cache_seq_rm() then (true = full-size cache for all layers)
+        bool swa_full;
     };
 
     // model quantization parameters
@@ -509,6 +555,9 @@ extern "C" {
         int32_t n_sample;
         int32_t n_p_eval;
         int32_t n_eval;
+
+        double  t_defrag_ms; // KV cache defragmentation
+        int32_t n_defrag;    // number of defragmentation steps
     };
 
     // used in chat template
@@ -579,6 +628,7 @@ extern "C" {
     LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model);
     LLAMA_API int32_t llama_n_embd     (const struct llama_model * model);
     LLAMA_API int32_t llama_n_layer    (const struct llama_model * model);
+    LLAMA_API int32_t llama_n_expert   (const struct llama_model * model);
 
     // Compat
     static    int32_t     llama_model_n_embd(const struct llama_model * model) { return llama_n_embd(model); }
@@ -751,6 +801,13 @@ extern "C" {
                        llama_pos   p0,
                        llama_pos   p1);
 
+    // Returns true if the sequence can be continued from position p: the windowed cache of the sliding-window attention
+    // layers (swa_full = false) still holds the window before p. Always true without a windowed cache
+    LLAMA_API bool llama_kv_cache_seq_has_window(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p);
+
     // Copy all tokens that belong to the specified sequence to another sequence
     // Note that this does not allocate extra KV cache memory - it simply assigns the tokens to the new sequence
     // p0 < 0 : [0,  p1]
@@ -893,6 +950,21 @@ extern "C" {
                           size_t   size,
                     llama_seq_id   dest_seq_id);
 
+    // same as llama_state_seq_get_data and llama_state_seq_set_data, but the data is byte-shuffled and LZ-compressed in
+    // chunks as in llama_state_seq_save_file_compressed, using the n_threads of the context
+    // llama_state_seq_get_data_compressed returns the compressed size, 0 if it does not fit in size bytes
+    LLAMA_API size_t llama_state_seq_get_data_compressed(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id);
+
+    LLAMA_API size_t llama_state_seq_set_data_compressed(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id);
+
     LLAMA_API size_t llama_state_seq_save_file(
             struct llama_context * ctx,
                       const char * filepath,
@@ -900,6 +972,16 @@ extern "C" {
                const llama_token * tokens,
                           size_t   n_token_count);
 
+    // same as llama_state_seq_save_file, but the state data is byte-shuffled and LZ-compressed in chunks, using the
+    // n_threads of the context; llama_state_seq_load_file reads both formats and decompresses in parallel
+    LLAMA_API size_t llama_state_seq_save_file_compressed(
+            struct llama_context * ctx,
+                      const char * filepath,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                          size_t   n_token_count);
+
+    // uncompressed files are memory-mapped and the K/V rows are copied into the cache straight from the mapped pages
     LLAMA_API size_t llama_state_seq_load_file(
             struct llama_context * ctx,
                       const char * filepath,
@@ -908,6 +990,21 @@ extern "C" {
                           size_t   n_token_capacity,
                           size_t * n_token_count_out);
 
+    // keep an uncompressed sequence state file mapped read-only by the context, so that llama_state_seq_load_file
+    // of the same path restores from the mapping without opening and reading the file again
+    // the mapped pages are shared by all the contexts and processes using the file, which makes a snapshot of a
+    // common prefix cheap to restore into many sequences; the file must not be modified by others while it is mapped
+    // (saving to the same path with this context drops the mapping)
+    // Returns false if the file cannot be mapped
+    LLAMA_API bool llama_state_seq_map_file(
+            struct llama_context * ctx,
+                      const char * filepath);
+
+    // release the mapping of llama_state_seq_map_file, or all of them if filepath is NULL
+    LLAMA_API void llama_state_seq_unmap_file(
+            struct llama_context * ctx,
+                      const char * filepath);
+
     //
     // Decoding
     //
@@ -953,11 +1050,28 @@ extern "C" {
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Start decoding the batch on a background thread and return right away
+    // The batch must stay valid, and the context must not be used, until llama_decode_wait() returns,
+    // except for the functions that only read the model (e.g. tokenization); functions that read the outputs,
+    // like llama_get_logits_ith(), and llama_decode() wait for the batch to finish first
+    LLAMA_API int32_t llama_decode_async(
+            struct llama_context * ctx,
+              struct llama_batch   batch);
+
+    // Wait for the batch started by llama_decode_async() to finish, returns what llama_decode() would have
+    // Returns 0 if no batch was started
+    LLAMA_API int32_t llama_decode_wait(struct llama_context * ctx);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
     LLAMA_API void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch);
 
+    // Pause/resume the CPU worker threads of the context
+    // A paused pool still computes graphs, but its idle workers sleep right away instead of spinning for the next graph
+    LLAMA_API void llama_threadpool_pause (struct llama_context * ctx);
+    LLAMA_API void llama_threadpool_resume(struct llama_context * ctx);
+
     // Get the number of threads used for generation of a single token.
     LLAMA_API uint32_t llama_n_threads(struct llama_context * ctx);
 
@@ -991,6 +1105,8 @@ extern "C" {
     // llama_get_logits(ctx) + ctx->output_ids[i]*n_vocab
     // Negative indicies can be used to access logits in reverse order, -1 is the last logit.
     // returns NULL for invalid ids.
+    // Several threads may call it at once only after llama_synchronize() was called since the last llama_decode(),
+    // otherwise the first calls race to record the evaluation stats.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
     // Get all output token embeddings.
@@ -1013,6 +1129,20 @@ extern "C" {
     // shape: [n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
 
+    //
+    // Expert usage statistics (MoE models, requires llama_context_params.expert_stats_file)
+    //
+
+    // Number of tokens routed to each of the llama_n_expert() experts of layer il since the context was created
+    // or the counts were reset (all zeros for dense layers)
+    // Returns NULL if the statistics are not collected or il is out of range
+    LLAMA_API const uint64_t * llama_get_expert_counts(struct llama_context * ctx, int32_t il);
+
+    LLAMA_API void llama_reset_expert_counts(struct llama_context * ctx);
+
+    // Write the counts in the format expected by llama_model_params.hot_experts_file
+    LLAMA_API bool llama_save_expert_counts(struct llama_context * ctx, const char * fname);
+
     //
     // Vocab
     //
@@ -1433,6 +1563,15 @@ const std::vector<std::pair<std::string, struct ggml_tensor *>> & llama_internal
     struct llama_context * ctx
 );
 
+// Compares the KQ mask kept for the last small ubatch (see llama_set_inputs) with one rebuilt from the KV cells, for the
+// n_tokens tokens of that ubatch. Returns the number of differing elements, -1 if no mask is kept.
+int64_t llama_internal_kq_mask_cache_diff(
+    struct llama_context * ctx,
+    const llama_seq_id * seq_id,
+    const llama_pos    * pos,
+    int32_t              n_tokens
+);
+
 struct llama_partial_utf8 {
     uint32_t value;    // bit value so far (unshifted)
     int      n_remain; // num bytes remaining; -1 indicates invalid sequence
@@ -1473,6 +1612,12 @@ std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
 // This is a temporary workaround in order to fix race conditions when sampling with multiple sequences.
 llama_token llama_sample_token_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, std::mt19937 & rng);
 
+// Same as llama_sample_xtc, llama_sample_token_mirostat and llama_sample_token_mirostat_v2, drawing from the given std::mt19937,
+// so that sequences sampled in parallel each use their own RNG.
+void llama_sample_xtc_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, float probability, float threshold, size_t min_keep, std::mt19937 & rng);
+llama_token llama_sample_token_mirostat_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, float tau, float eta, int32_t m, float * mu, std::mt19937 & rng);
+llama_token llama_sample_token_mirostat_v2_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, float tau, float eta, float * mu, std::mt19937 & rng);
+
 #endif // LLAMA_API_INTERNAL
 
 #endif // LLAMA_H
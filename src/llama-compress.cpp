@@ -0,0 +1,615 @@
+#include "llama-compress.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+constexpr int    kHashLog   = 14;
+constexpr size_t kMinMatch  = 4;
+constexpr size_t kMaxOffset = 65535;
+constexpr size_t kLastLits  = 5;  // the data always ends with a few literals
+constexpr size_t kMatchEnd  = 12; // no match starts this close to the end
+
+inline uint32_t read_u32(const uint8_t * p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t read_u64(const uint8_t * p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash_u32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - kHashLog);
+}
+
+inline uint8_t * write_len(uint8_t * op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = uint8_t(len);
+    return op;
+}
+
+uint8_t * write_sequence(uint8_t * op, const uint8_t * lit, size_t n_lit, size_t offset, size_t n_match) {
+    uint8_t * token = op++;
+    *token = uint8_t((n_lit < 15 ? n_lit : 15) << 4);
+    if (n_lit >= 15) {
+        op = write_len(op, n_lit - 15);
+    }
+    if (n_lit > 0) {
+        std::memcpy(op, lit, n_lit);
+    }
+    op += n_lit;
+    if (n_match == 0) {
+        return op; // the last sequence only has literals
+    }
+    *op++ = uint8_t(offset);
+    *op++ = uint8_t(offset >> 8);
+    n_match -= kMinMatch;
+    *token |= uint8_t(n_match < 15 ? n_match : 15);
+    if (n_match >= 15) {
+        op = write_len(op, n_match - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(const uint8_t * src, size_t size, uint8_t * dst) {
+    thread_local std::vector<uint32_t> table;
+    table.assign(size_t(1) << kHashLog, 0);
+
+    uint8_t * op = dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+    if (size > kMatchEnd) {
+        const size_t match_limit = size - kLastLits;
+        while (ip + kMatchEnd <= size) {
+            const uint32_t seq = read_u32(src + ip);
+            const uint32_t h   = hash_u32(seq);
+            const size_t   ref = table[h];
+            table[h] = uint32_t(ip);
+            if (ref >= ip || ip - ref > kMaxOffset || read_u32(src + ref) != seq) {
+                // skip faster through data that does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            size_t n_match = kMinMatch;
+            while (ip + n_match < match_limit && src[ref + n_match] == src[ip + n_match]) {
+                ++n_match;
+            }
+            op = write_sequence(op, src + anchor, ip - anchor, ip - ref, n_match);
+            ip += n_match;
+            anchor = ip;
+        }
+    }
+    op = write_sequence(op, src + anchor, size - anchor, 0, 0);
+    return op - dst;
+}
+
+bool read_len(const uint8_t *& ip, const uint8_t * end, size_t & len) {
+    uint8_t b;
+    do {
+        if (ip >= end) {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz_decompress(const uint8_t * src, size_t size, uint8_t * dst, size_t dst_size) {
+    const uint8_t * ip  = src;
+    const uint8_t * end = src + size;
+    size_t op = 0;
+    while (ip < end) {
+        const uint8_t token = *ip++;
+        size_t n_lit = token >> 4;
+        if (n_lit == 15 && !read_len(ip, end, n_lit)) {
+            return false;
+        }
+        if (n_lit > size_t(end - ip) || n_lit > dst_size - op) {
+            return false;
+        }
+        if (n_lit > 0) {
+            std::memcpy(dst + op, ip, n_lit);
+        }
+        ip += n_lit;
+        op += n_lit;
+        if (ip == end) {
+            break;
+        }
+        if (end - ip < 2) {
+            return false;
+        }
+        const size_t offset = ip[0] | (size_t(ip[1]) << 8);
+        ip += 2;
+        size_t n_match = token & 15;
+        if (n_match == 15 && !read_len(ip, end, n_match)) {
+            return false;
+        }
+        n_match += kMinMatch;
+        if (offset == 0 || offset > op || n_match > dst_size - op) {
+            return false;
+        }
+        const uint8_t * ref = dst + op - offset;
+        if (offset >= n_match) {
+            std::memcpy(dst + op, ref, n_match);
+        } else {
+            for (size_t i = 0; i < n_match; ++i) {
+                dst[op + i] = ref[i]; // overlapping copy repeats the last `offset` bytes
+            }
+        }
+        op += n_match;
+    }
+    return op == dst_size;
+}
+
+// byte b of element i goes to dst[b*n + i], the bytes after the last whole element are copied as they are
+void shuffle(const uint8_t * src, size_t size, size_t stride, uint8_t * dst) {
+    const size_t n = size / stride;
+    for (size_t b = 0; b < stride; ++b) {
+        for (size_t i = 0; i < n; ++i) {
+            dst[b*n + i] = src[i*stride + b];
+        }
+    }
+    std::memcpy(dst + n*stride, src + n*stride, size - n*stride);
+}
+
+void unshuffle(const uint8_t * src, size_t size, size_t stride, uint8_t * dst) {
+    const size_t n = size / stride;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t b = 0; b < stride; ++b) {
+            dst[i*stride + b] = src[b*n + i];
+        }
+    }
+    std::memcpy(dst + n*stride, src + n*stride, size - n*stride);
+}
+
+// order-0 Huffman coding of one plane: 128 bytes of code lengths (4 bits per symbol, 0 = unused),
+// u32 size of the bit stream, then the codes, LSB first
+constexpr int kMaxBits = 12;
+
+void huff_lengths(const uint32_t * count, uint8_t * len) {
+    std::vector<uint32_t> c(count, count + 256);
+    while (true) {
+        // (weight, node), nodes >= 256 are internal, parent[] links them into the tree
+        std::priority_queue<std::pair<uint64_t, int>, std::vector<std::pair<uint64_t, int>>, std::greater<std::pair<uint64_t, int>>> q;
+        int parent[511];
+        for (int i = 0; i < 256; ++i) {
+            if (c[i]) {
+                q.push({c[i], i});
+            }
+        }
+        int n_node = 256;
+        while (q.size() > 1) {
+            auto a = q.top(); q.pop();
+            auto b = q.top(); q.pop();
+            parent[a.second] = parent[b.second] = n_node;
+            q.push({a.first + b.first, n_node++});
+        }
+        int max_len = 0;
+        for (int i = 0; i < 256; ++i) {
+            int l = 0;
+            if (c[i]) {
+                for (int j = i; j != n_node - 1 && n_node > 256; j = parent[j]) {
+                    ++l;
+                }
+                l = std::max(l, 1);
+            }
+            len[i] = uint8_t(l);
+            max_len = std::max(max_len, l);
+        }
+        if (max_len <= kMaxBits) {
+            return;
+        }
+        // flatten the distribution until the longest code fits
+        for (auto & x : c) {
+            x = x ? (x + 1)/2 : 0;
+        }
+    }
+}
+
+// canonical codes, bit-reversed for the LSB-first stream
+void huff_codes(const uint8_t * len, uint16_t * code) {
+    uint32_t next = 0;
+    for (int l = 1; l <= kMaxBits; ++l) {
+        for (int i = 0; i < 256; ++i) {
+            if (len[i] == l) {
+                uint32_t r = 0;
+                for (int b = 0; b < l; ++b) {
+                    r |= ((next >> b) & 1) << (l - 1 - b);
+                }
+                code[i] = uint16_t(r);
+                ++next;
+            }
+        }
+        next <<= 1;
+    }
+}
+
+size_t huff_compress(const uint8_t * src, size_t size, uint8_t * dst) {
+    uint32_t count[256] = {};
+    for (size_t i = 0; i < size; ++i) {
+        ++count[src[i]];
+    }
+    uint8_t  len[256];
+    uint16_t code[256] = {};
+    huff_lengths(count, len);
+    huff_codes(len, code);
+    for (int i = 0; i < 128; ++i) {
+        dst[i] = uint8_t(len[2*i] | (len[2*i + 1] << 4));
+    }
+    uint8_t * op = dst + 128 + sizeof(uint32_t);
+    uint64_t acc = 0;
+    int n_bits = 0;
+    for (size_t i = 0; i < size; ++i) {
+        acc |= uint64_t(code[src[i]]) << n_bits;
+        n_bits += len[src[i]];
+        while (n_bits >= 8) {
+            *op++ = uint8_t(acc);
+            acc >>= 8;
+            n_bits -= 8;
+        }
+    }
+    if (n_bits > 0) {
+        *op++ = uint8_t(acc);
+    }
+    const uint32_t n_bytes = uint32_t(op - dst - 128 - sizeof(uint32_t));
+    std::memcpy(dst + 128, &n_bytes, sizeof(n_bytes));
+    return op - dst;
+}
+
+// returns the number of bytes of src used, 0 if the data is corrupt
+size_t huff_decompress(const uint8_t * src, size_t size, uint8_t * dst, size_t dst_size) {
+    if (size < 128 + sizeof(uint32_t)) {
+        return 0;
+    }
+    uint8_t  len[256];
+    uint16_t code[256] = {};
+    for (int i = 0; i < 128; ++i) {
+        len[2*i] = src[i] & 15;
+        len[2*i + 1] = src[i] >> 4;
+    }
+    for (int i = 0; i < 256; ++i) {
+        if (len[i] > kMaxBits) {
+            return 0;
+        }
+    }
+    huff_codes(len, code);
+    uint16_t table[1 << kMaxBits] = {}; // symbol | length << 8, length 0 = invalid code
+    for (int i = 0; i < 256; ++i) {
+        if (len[i]) {
+            for (uint32_t j = code[i] & ((1u << len[i]) - 1); j < (1u << kMaxBits); j += 1u << len[i]) {
+                table[j] = uint16_t(i | (len[i] << 8));
+            }
+        }
+    }
+    uint32_t n_bytes;
+    std::memcpy(&n_bytes, src + 128, sizeof(n_bytes));
+    if (n_bytes > size - 128 - sizeof(uint32_t)) {
+        return 0;
+    }
+    const uint8_t * ip  = src + 128 + sizeof(uint32_t);
+    const uint8_t * end = ip + n_bytes;
+    uint64_t acc = 0;
+    int n_bits = 0;
+    int n_pad  = 0; // zero bits fed past the end of the stream
+    for (size_t i = 0; i < dst_size; ) {
+        if (end - ip >= 8) {
+            // whole bytes up to 56+ bits, the bits of the partial byte are or-ed in again by the next refill
+            acc |= read_u64(ip) << n_bits;
+            ip += (63 - n_bits) >> 3;
+            n_bits |= 56;
+        } else {
+            while (n_bits <= 56) {
+                if (ip < end) {
+                    acc |= uint64_t(*ip++) << n_bits;
+                } else {
+                    n_pad += 8;
+                }
+                n_bits += 8;
+            }
+        }
+        for (int k = 0; k < 56/kMaxBits && i < dst_size; ++k) {
+            const uint16_t e = table[acc & ((1u << kMaxBits) - 1)];
+            const int l = e >> 8;
+            if (l == 0) {
+                return 0;
+            }
+            dst[i++] = uint8_t(e);
+            acc >>= l;
+            n_bits -= l;
+        }
+    }
+    if (n_bits < n_pad) {
+        return 0; // the codes ran past the end of the stream
+    }
+    return end - src;
+}
+
+}
+
+uint32_t llama_compress_checksum(const uint8_t * data, size_t size) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        h = (h ^ read_u64(data + i)) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    for (; i < size; ++i) {
+        h = (h ^ data[i]) * 0x100000001b3ull;
+    }
+    h ^= h >> 29;
+    return uint32_t(h) ^ uint32_t(h >> 32);
+}
+
+size_t llama_compress_bound(size_t size) {
+    return size + size/255 + 16;
+}
+
+// a chunk starts with its method: LZ over the shuffled bytes, which wins when the data has repeats,
+// or Huffman coding of each plane, which wins for the skewed byte distributions of exponents and quants
+enum : uint8_t {
+    LLAMA_COMPRESS_LZ   = 1,
+    LLAMA_COMPRESS_HUFF = 2,
+};
+
+size_t llama_compress(const uint8_t * src, size_t size, size_t stride, uint8_t * dst) {
+    size_t n_plane = 1;
+    if (stride > 1 && size >= 2*stride) {
+        thread_local std::vector<uint8_t> tmp;
+        tmp.resize(size);
+        shuffle(src, size, stride, tmp.data());
+        src = tmp.data();
+        n_plane = stride;
+    }
+    dst[0] = LLAMA_COMPRESS_LZ;
+    size_t n = 1 + lz_compress(src, size, dst + 1);
+    if (n > size - size/8) {
+        thread_local std::vector<uint8_t> huff;
+        const size_t plane = size / n_plane;
+        huff.resize(1 + (n_plane + 1)*(128 + sizeof(uint32_t) + 8) + size*kMaxBits/8);
+        huff[0] = LLAMA_COMPRESS_HUFF;
+        size_t n_huff = 1;
+        for (size_t ip = 0; ip <= n_plane; ++ip) {
+            // the last plane has the bytes after the last whole element
+            const size_t n_src = ip < n_plane ? plane : size - plane*n_plane;
+            if (n_src > 0) {
+                n_huff += huff_compress(src + ip*plane, n_src, huff.data() + n_huff);
+            }
+        }
+        if (n_huff < n) {
+            std::memcpy(dst, huff.data(), n_huff);
+            n = n_huff;
+        }
+    }
+    return n < size ? n : 0;
+}
+
+bool llama_decompress(const uint8_t * src, size_t size, size_t stride, uint8_t * dst, size_t dst_size) {
+    if (size == 0) {
+        return false;
+    }
+    size_t n_plane = 1;
+    uint8_t * out = dst;
+    thread_local std::vector<uint8_t> tmp;
+    if (stride > 1 && dst_size >= 2*stride) {
+        tmp.resize(dst_size);
+        out = tmp.data();
+        n_plane = stride;
+    }
+    if (src[0] == LLAMA_COMPRESS_LZ) {
+        if (!lz_decompress(src + 1, size - 1, out, dst_size)) {
+            return false;
+        }
+    } else if (src[0] == LLAMA_COMPRESS_HUFF) {
+        const size_t plane = dst_size / n_plane;
+        size_t pos = 1;
+        for (size_t ip = 0; ip <= n_plane; ++ip) {
+            const size_t n_dst = ip < n_plane ? plane : dst_size - plane*n_plane;
+            if (n_dst > 0) {
+                const size_t n_src = huff_decompress(src + pos, size - pos, out + ip*plane, n_dst);
+                if (n_src == 0) {
+                    return false;
+                }
+                pos += n_src;
+            }
+        }
+        if (pos != size) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    if (out != dst) {
+        unshuffle(out, dst_size, stride, dst);
+    }
+    return true;
+}
+
+llama_compress_workers::llama_compress_workers(int n_threads) : n_threads(std::max(n_threads, 1)) {}
+
+llama_compress_workers::~llama_compress_workers() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv_start.notify_all();
+    for (auto & t : threads) {
+        t.join();
+    }
+}
+
+void llama_compress_workers::run(int n, const std::function<void(int)> & f) {
+    if (n > 1 && threads.empty()) {
+        for (int ith = 1; ith < n_threads; ++ith) {
+            threads.emplace_back([this, ith]() {
+                int gen_seen = 0;
+                while (true) {
+                    const std::function<void(int)> * f;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv_start.wait(lock, [&]() { return stop || gen != gen_seen; });
+                        if (stop) {
+                            return;
+                        }
+                        gen_seen = gen;
+                        if (ith >= n_job) {
+                            continue;
+                        }
+                        f = job;
+                    }
+                    (*f)(ith);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (--n_busy == 0) {
+                        cv_done.notify_one();
+                    }
+                }
+            });
+        }
+    }
+    if (n > 1) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job    = &f;
+            n_job  = n;
+            n_busy = n - 1;
+            ++gen;
+        }
+        cv_start.notify_all();
+    }
+    f(0);
+    if (n > 1) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this]() { return n_busy == 0; });
+    }
+}
+
+llama_compress_writer::llama_compress_writer(std::function<void(const void *, size_t)> write, int n_threads)
+    : write(std::move(write)), workers(n_threads), chunks(workers.n_threads) {}
+
+uint8_t * llama_compress_writer::append(size_t size, size_t stride, size_t & n) {
+    const size_t n_max = std::max(chunk_size / stride, size_t(1)) * stride;
+    llama_compress_chunk * c = n_chunks > 0 ? &chunks[n_chunks - 1] : nullptr;
+    if (!c || c->stride != stride || c->raw.size() >= n_max) {
+        if (n_chunks == workers.n_threads) {
+            flush();
+        }
+        c = &chunks[n_chunks++];
+        c->raw.clear();
+        c->stride = uint32_t(stride);
+    }
+    const size_t n0 = c->raw.size();
+    n = std::min(n_max - n0, size);
+    c->raw.resize(n0 + n);
+    return c->raw.data() + n0;
+}
+
+void llama_compress_writer::finish() {
+    if (n_chunks > 0) {
+        flush();
+    }
+}
+
+void llama_compress_writer::flush() {
+    workers.run(n_chunks, [this](int i) {
+        auto & c = chunks[i];
+        c.out.resize(llama_compress_bound(c.raw.size()));
+        c.n_out = llama_compress(c.raw.data(), c.raw.size(), c.stride, c.out.data());
+        c.checksum = llama_compress_checksum(c.raw.data(), c.raw.size());
+    });
+    for (int i = 0; i < n_chunks; ++i) {
+        const auto & c = chunks[i];
+        const uint32_t header[4] = { (uint32_t) c.raw.size(), (uint32_t) (c.n_out ? c.n_out : c.raw.size()), c.stride, c.checksum };
+        write(header, sizeof(header));
+        write(c.n_out ? c.out.data() : c.raw.data(), header[1]);
+    }
+    n_chunks = 0;
+}
+
+llama_compress_reader::llama_compress_reader(std::function<void(void *, size_t)> read, size_t size, int n_threads)
+    : size_left(size), read_src(std::move(read)), workers(n_threads), chunks(workers.n_threads) {}
+
+void llama_compress_reader::read_to(void * dst, size_t size) {
+    uint8_t * out = (uint8_t *) dst;
+    while (size > 0) {
+        if (pos == chunks[i_chunk].raw.size()) {
+            next_chunks();
+        }
+        const auto & raw = chunks[i_chunk].raw;
+        const size_t n = std::min(size, raw.size() - pos);
+        std::memcpy(out, raw.data() + pos, n);
+        out  += n;
+        pos  += n;
+        size -= n;
+    }
+}
+
+const uint8_t * llama_compress_reader::read(size_t size) {
+    if (n_chunks > 0 && pos + size <= chunks[i_chunk].raw.size()) {
+        // no copy when the data is within one chunk
+        const uint8_t * res = chunks[i_chunk].raw.data() + pos;
+        pos += size;
+        return res;
+    }
+    temp_buffer.resize(size);
+    read_to(temp_buffer.data(), size);
+    return temp_buffer.data();
+}
+
+void llama_compress_reader::next_chunks() {
+    pos = 0;
+    if (++i_chunk < n_chunks) {
+        return;
+    }
+    // read the next n_threads records and decompress them in parallel
+    i_chunk  = 0;
+    n_chunks = 0;
+    while (n_chunks < workers.n_threads && size_left > 0) {
+        uint32_t header[4];
+        if (size_left < sizeof(header)) {
+            throw std::runtime_error("truncated compressed state data");
+        }
+        read_src(header, sizeof(header));
+        size_left -= sizeof(header);
+        // no valid chunk is larger than chunk_size, or has a stride larger than its size
+        if (header[0] == 0 || header[0] > llama_compress_writer::chunk_size || header[1] > header[0] || header[1] > size_left ||
+            header[2] == 0 || header[2] > header[0]) {
+            throw std::runtime_error("invalid chunk in compressed state data");
+        }
+        auto & c = chunks[n_chunks++];
+        c.out.resize(header[1]);
+        c.raw.resize(header[0]);
+        c.stride   = header[2];
+        c.checksum = header[3];
+        read_src(c.out.data(), c.out.size());
+        size_left -= c.out.size();
+    }
+    if (n_chunks == 0) {
+        throw std::runtime_error("unexpected end of compressed state data");
+    }
+    workers.run(n_chunks, [this](int i) {
+        auto & c = chunks[i];
+        if (c.out.size() == c.raw.size()) {
+            c.raw.swap(c.out);
+            c.ok = true;
+        } else {
+            c.ok = llama_decompress(c.out.data(), c.out.size(), c.stride, c.raw.data(), c.raw.size());
+        }
+        c.ok = c.ok && llama_compress_checksum(c.raw.data(), c.raw.size()) == c.checksum;
+    });
+    for (int i = 0; i < n_chunks; ++i) {
+        if (!chunks[i].ok) {
+            throw std::runtime_error("corrupt compressed state data");
+        }
+    }
+}
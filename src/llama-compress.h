@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// lossless codec for the K/V data of compressed state files
+//
+// the data is first byte-shuffled: byte b of every element (or quant block) of `stride` bytes goes to plane b,
+// so that the exponent bytes of f16/f32 values and the scales of quant blocks end up next to each other,
+// then the planes are compressed with an LZ77 coder in the LZ4 block format (literal runs + 64 KiB matches),
+// or, when that does not gain much, with an order-0 Huffman code per plane
+
+// worst-case size of the compressed data of `size` bytes
+size_t llama_compress_bound(size_t size);
+
+// compress `size` bytes of src into dst (llama_compress_bound(size) bytes), returns the compressed size,
+// or 0 if the data does not shrink (the caller should then store it as is)
+size_t llama_compress(const uint8_t * src, size_t size, size_t stride, uint8_t * dst);
+
+// decompress `size` bytes of src into exactly dst_size bytes of dst, returns false if the data is corrupt
+bool llama_decompress(const uint8_t * src, size_t size, size_t stride, uint8_t * dst, size_t dst_size);
+
+// checksum of the uncompressed data of a chunk
+uint32_t llama_compress_checksum(const uint8_t * data, size_t size);
+
+// compressed state data is a series of records: u32 raw size, u32 stored size (== raw size if the chunk did not
+// compress), u32 shuffle stride, u32 checksum of the raw data, then the stored bytes
+
+struct llama_compress_chunk {
+    std::vector<uint8_t> raw;
+    std::vector<uint8_t> out; // the stored bytes of the record
+    uint32_t stride   = 1;
+    uint32_t checksum = 0;
+    size_t   n_out    = 0;
+    bool     ok       = false;
+};
+
+// the threads that (de)compress the chunks of one stream, they are started on the first batch with more than one
+// chunk and then wait for the next batch
+struct llama_compress_workers {
+    explicit llama_compress_workers(int n_threads);
+    ~llama_compress_workers();
+
+    // run f(0) .. f(n - 1) with n <= n_threads, f(0) on the calling thread
+    void run(int n, const std::function<void(int)> & f);
+
+    const int n_threads;
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+    const std::function<void(int)> * job = nullptr;
+    int  n_job   = 0;
+    int  n_busy  = 0;
+    int  gen     = 0;
+    bool stop    = false;
+};
+
+// cuts the data into chunks of about 1 MiB and writes them out as records through `write`,
+// up to n_threads chunks at a time are compressed in parallel
+struct llama_compress_writer {
+    static constexpr size_t chunk_size = 1u << 20;
+
+    llama_compress_writer(std::function<void(const void * src, size_t size)> write, int n_threads);
+
+    // append up to `size` bytes of elements (or quant blocks) of `stride` bytes, returns the buffer to copy the
+    // first n bytes into; consecutive pieces of data, like the rows of a transposed V cache, go into the same chunk
+    uint8_t * append(size_t size, size_t stride, size_t & n);
+
+    // write out what is still buffered, must be called after the last append
+    void finish();
+
+private:
+    void flush();
+
+    std::function<void(const void *, size_t)> write;
+    llama_compress_workers workers;
+    std::vector<llama_compress_chunk> chunks;
+    int n_chunks = 0;
+};
+
+// reads the records of `size` bytes of compressed data through `read`, up to n_threads chunks at a time are
+// decompressed in parallel; throws std::runtime_error if the data is truncated or corrupt
+struct llama_compress_reader {
+    llama_compress_reader(std::function<void(void * dst, size_t size)> read, size_t size, int n_threads);
+
+    void read_to(void * dst, size_t size);
+
+    // the returned data is valid until the next read
+    const uint8_t * read(size_t size);
+
+    size_t size_left; // of the compressed data
+
+private:
+    void next_chunks();
+
+    std::function<void(void *, size_t)> read_src;
+    llama_compress_workers workers;
+    std::vector<llama_compress_chunk> chunks;
+    std::vector<uint8_t> temp_buffer;
+    int    n_chunks = 0;
+    int    i_chunk  = 0;
+    size_t pos      = 0; // in the current chunk
+};
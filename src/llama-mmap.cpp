@@ -496,6 +496,17 @@ void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
 
+void llama_mmap::prefetch(const void * addr, size_t len) {
+#ifdef _POSIX_MAPPED_FILES
+    static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    const uintptr_t first = (uintptr_t) addr & ~(page_size - 1);
+    posix_madvise((void *) first, (uintptr_t) addr + len - first, POSIX_MADV_WILLNEED);
+#else
+    GGML_UNUSED(addr);
+    GGML_UNUSED(len);
+#endif
+}
+
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
 #else
@@ -44,6 +44,9 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // hint that [addr, addr + len) of a mapping will be needed soon, the OS starts reading it in the background
+    static void prefetch(const void * addr, size_t len);
+
     static const bool SUPPORTED;
 
 private:
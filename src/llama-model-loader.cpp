@@ -20,6 +20,8 @@
 #include <map>
 #include <array>
 #include <future>
+#include <cerrno>
+#include <cstring>
 
 #if defined(_WIN32)
     #define WIN32_LEAN_AND_MEAN
@@ -488,6 +490,14 @@ llama_model_loader::llama_model_loader(const std::string & fname, bool use_mmap,
     if (repack_tensors) {
         use_mmap = false;
     }
+    if (ggml_numa_partition_enabled()) {
+        // the memory policy of the pages of a file mapping does not govern where the page cache puts them
+        if (use_mmap) {
+            LLAMA_LOG_INFO("%s: --numa partition: loading the weights into anonymous memory instead of using mmap\n", __func__);
+        }
+        use_mmap = false;
+        numa_partition = true;
+    }
 
     this->use_mmap = use_mmap;
     this->check_tensors = check_tensors;
@@ -967,6 +977,17 @@ bool llama_model_loader::load_all_data(
             GGML_ASSERT(weight->idx < files.size());
             const auto & file = files.at(weight->idx);
             if (ggml_backend_buffer_is_host(cur->buffer)) {
+                if (numa_partition && ggml_numa_can_partition_rows(cur)) {
+                    // bind the blocks of rows before the pages are first touched, so that they are allocated on their node
+                    const size_t n_bound = ggml_numa_partition_rows(cur);
+                    if (n_bound > 0) {
+                        numa_partitioned.push_back(cur);
+                        numa_bytes_bound += n_bound;
+                    } else {
+                        LLAMA_LOG_WARN("%s: could not bind the rows of %s to the NUMA nodes: %s\n", __func__, ggml_get_name(cur), strerror(errno));
+                        numa_n_failed++;
+                    }
+                }
                 file->seek(weight->offs, SEEK_SET);
                 file->read_raw(cur->data, n_size);
                 if (check_tensors) {
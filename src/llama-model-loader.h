@@ -41,6 +41,7 @@ struct llama_model_loader {
     bool check_tensors;
     bool repack_tensors = false;
     bool use_thp = false;
+    bool numa_partition = false; // --numa partition: the rows of the host weights are bound to the nodes as they are loaded
 
     llama_files files;
     llama_ftype ftype;
@@ -159,6 +160,11 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    // the host weights whose rows were bound to the NUMA nodes, and those that could not be bound
+    std::vector<ggml_tensor *> numa_partitioned;
+    size_t numa_bytes_bound = 0;
+    int    numa_n_failed    = 0;
+
     // Returns false if cancelled by progress_callback
     bool load_all_data(
             struct ggml_context * ctx,
@@ -436,7 +436,7 @@ void llama_sample_temp_impl(struct llama_sampling * smpl, llama_token_data_array
     }
 }
 
-void llama_sample_xtc_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, float probability, float threshold, size_t min_keep) {
+void llama_sample_xtc_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, float probability, float threshold, size_t min_keep, std::mt19937 & rng) {
     if (probability <= 0 || threshold > 0.5f || candidates->size < 2) {
         return;
     }
@@ -444,7 +444,7 @@ void llama_sample_xtc_impl(struct llama_sampling * smpl, llama_token_data_array
     const int64_t t_start_sample_us = ggml_time_us();
     if (probability < 1) {
         std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-        float chance = distribution(smpl->rng);
+        float chance = distribution(rng);
         if (chance > probability) return;
     }
 
@@ -598,7 +598,7 @@ void llama_sample_apply_guidance_impl(
     smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
 }
 
-llama_token llama_sample_token_mirostat_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, float tau, float eta, int32_t m, float * mu) {
+llama_token llama_sample_token_mirostat_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, float tau, float eta, int32_t m, float * mu, std::mt19937 & rng) {
     GGML_ASSERT(smpl);
 
     const int32_t n_vocab = float(smpl->n_vocab);
@@ -626,7 +626,7 @@ llama_token llama_sample_token_mirostat_impl(struct llama_sampling * smpl, llama
     // Sample the next word X using top-k sampling
     llama_sample_top_k_impl((struct llama_sampling *) nullptr, candidates, int(k), 1);
     smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
-    llama_token X = llama_sample_token_impl(smpl, candidates);
+    llama_token X = llama_sample_token_with_rng_impl(smpl, candidates, rng);
     t_start_sample_us = ggml_time_us();
 
     // Compute error as the difference between observed surprise and target surprise value
@@ -643,7 +643,7 @@ llama_token llama_sample_token_mirostat_impl(struct llama_sampling * smpl, llama
     return X;
 }
 
-llama_token llama_sample_token_mirostat_v2_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, float tau, float eta, float * mu) {
+llama_token llama_sample_token_mirostat_v2_impl(struct llama_sampling * smpl, llama_token_data_array * candidates, float tau, float eta, float * mu, std::mt19937 & rng) {
     int64_t t_start_sample_us;
     t_start_sample_us = ggml_time_us();
 
@@ -666,7 +666,7 @@ llama_token llama_sample_token_mirostat_v2_impl(struct llama_sampling * smpl, ll
     llama_sample_softmax_impl(smpl, candidates);
 
     // Sample the next word X from the remaining words
-    llama_token X = llama_sample_token_impl(smpl, candidates);
+    llama_token X = llama_sample_token_with_rng_impl(smpl, candidates, rng);
     t_start_sample_us = ggml_time_us();
 
     // Compute error as the difference between observed surprise and target surprise value
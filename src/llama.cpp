@@ -12,6 +12,7 @@
 #include "llama-arch.h"
 #include "llama-mmap.h"
 #include "llama-model-loader.h"
+#include "llama-compress.h"
 
 #include "unicode.h"
 
@@ -96,6 +97,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <condition_variable>
 #include <ctime>
 #include <fstream>
 #include <functional>
@@ -2118,6 +2120,11 @@ struct llama_hparams {
         return n_embd_head_v * n_head_kv;
     }
 
+    // true if layer il uses sliding-window attention (the chunked attention of llama4 is not a sliding window)
+    bool is_swa(uint32_t il) const {
+        return n_swa > 0 && n_swa_pattern > 1 && n_attn_chunk == 0 && il % n_swa_pattern < n_swa_pattern - 1;
+    }
+
     uint32_t n_embd_k_s() const { // dimension of the rolling state embeddings
         // corresponds to Mamba's conv_states size
         // TODO: maybe support other convolution strides than 1
@@ -2163,6 +2170,9 @@ struct llama_cparams {
     bool fused_up_gate;
     int  min_experts;
     float thresh_experts;
+    uint32_t kv_block_size;
+    uint32_t defrag_max_cells;
+    bool     swa_full;
 
     enum llama_pooling_type pooling_type;
 
@@ -2312,27 +2322,149 @@ struct llama_layer {
     std::unique_ptr<ggml_tensor> computed_wkv_b;
 };
 
-struct llama_kv_cell {
-    llama_pos pos   = -1;
-    llama_pos delta = 0;
-    int32_t   src   = 0; // used by recurrent state models to copy states
+// metadata of the KV cache cells, kept as structure-of-arrays so that the KQ mask can be built with linear scans
+// the sequences of cell i are the set bits of seq[i*n_words, (i+1)*n_words), n_words grows with the largest seq_id
+struct llama_kv_cells {
+    std::vector<llama_pos> pos;   // -1 if the cell is free
+    std::vector<llama_pos> delta;
+    std::vector<int32_t>   src;   // used by recurrent state models to copy states
+    std::vector<uint64_t>  seq;
+
+    uint32_t n_words = 1;
+
+    // cells whose pos or sequences changed since the KQ mask was last built, see llama_set_inputs
+    std::vector<uint32_t> changed;
+    bool all_changed = true;
+
+    uint32_t size() const {
+        return pos.size();
+    }
+
+    void resize(uint32_t n, uint32_t n_seq) {
+        n_words = std::max(1u, (n_seq + 63)/64);
+        pos.assign(n, -1);
+        delta.assign(n, 0);
+        src.assign(n, 0);
+        seq.assign((size_t) n*n_words, 0);
+        changed.clear();
+        all_changed = true;
+    }
+
+    bool seq_has(uint32_t i, llama_seq_id s) const {
+        return (uint32_t) s < 64*n_words && (seq[(size_t) i*n_words + s/64] >> (s%64)) & 1;
+    }
+
+    bool is_empty(uint32_t i) const {
+        for (uint32_t w = 0; w < n_words; ++w) {
+            if (seq[(size_t) i*n_words + w]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool is_same_seq(uint32_t i, uint32_t j) const {
+        return std::equal(seq.begin() + (size_t) i*n_words, seq.begin() + (size_t) (i + 1)*n_words, seq.begin() + (size_t) j*n_words);
+    }
+
+    // calls f(seq_id) for the sequences of cell i in increasing order
+    template <typename F>
+    void seq_for_each(uint32_t i, F && f) const {
+        for (uint32_t w = 0; w < n_words; ++w) {
+            uint64_t bits = seq[(size_t) i*n_words + w];
+            for (uint32_t b = 0; bits; ++b, bits >>= 1) {
+                if (bits & 1) {
+                    f(llama_seq_id(64*w + b));
+                }
+            }
+        }
+    }
+
+    uint32_t seq_count(uint32_t i) const {
+        uint32_t n = 0;
+        seq_for_each(i, [&n](llama_seq_id) { ++n; });
+        return n;
+    }
+
+    // the smallest seq_id of cell i, -1 if the cell has none
+    llama_seq_id seq_first(uint32_t i) const {
+        llama_seq_id first = -1;
+        seq_for_each(i, [&first](llama_seq_id s) { if (first < 0) first = s; });
+        return first;
+    }
+
+    void seq_add(uint32_t i, llama_seq_id s) {
+        GGML_ASSERT(s >= 0);
+        if ((uint32_t) s >= 64*n_words) {
+            const uint32_t n_words_new = (s + 64)/64;
+            std::vector<uint64_t> seq_new((size_t) size()*n_words_new, 0);
+            for (uint32_t k = 0; k < size(); ++k) {
+                std::copy_n(seq.begin() + (size_t) k*n_words, n_words, seq_new.begin() + (size_t) k*n_words_new);
+            }
+            seq     = std::move(seq_new);
+            n_words = n_words_new;
+            all_changed = true;
+        }
+        seq[(size_t) i*n_words + s/64] |= uint64_t(1) << (s%64);
+        touch(i);
+    }
+
+    void seq_rm(uint32_t i, llama_seq_id s) {
+        if (seq_has(i, s)) {
+            seq[(size_t) i*n_words + s/64] &= ~(uint64_t(1) << (s%64));
+            touch(i);
+        }
+    }
+
+    void seq_clear(uint32_t i) {
+        std::fill_n(seq.begin() + (size_t) i*n_words, n_words, 0);
+        touch(i);
+    }
 
-    std::set<llama_seq_id> seq_id;
+    void pos_set(uint32_t i, llama_pos p) {
+        pos[i] = p;
+        touch(i);
+    }
 
-    bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+    // free cell i
+    void rm(uint32_t i) {
+        pos[i] = -1;
+        seq_clear(i);
     }
 
-    bool is_empty() const {
-        return seq_id.empty();
+    // move the metadata of cell i to cell j and reset cell i
+    void mv(uint32_t i, uint32_t j) {
+        pos[j]   = pos[i];
+        delta[j] = delta[i];
+        src[j]   = src[i];
+        std::copy_n(seq.begin() + (size_t) i*n_words, n_words, seq.begin() + (size_t) j*n_words);
+        touch(j);
+        delta[i] = 0;
+        src[i]   = 0;
+        rm(i);
     }
 
-    bool is_same_seq(const llama_kv_cell & other) const {
-        return seq_id == other.seq_id;
+    void touch(uint32_t i) {
+        if (all_changed) {
+            return;
+        }
+        if (changed.size() >= pos.size()) {
+            changed.clear();
+            all_changed = true;
+            return;
+        }
+        changed.push_back(i);
     }
 };
 
 // ring-buffer of cached KV data
+// the layers a KV cache holds the K/V of, the others have nullptr in k_l and v_l
+enum llama_kv_cache_layers {
+    LLAMA_KV_LAYERS_ALL,
+    LLAMA_KV_LAYERS_NON_SWA, // the sliding-window attention layers are in llama_context::kv_swa
+    LLAMA_KV_LAYERS_SWA,
+};
+
 struct llama_kv_cache {
     bool has_shift = false;
     bool do_defrag = false;
@@ -2353,7 +2485,22 @@ struct llama_kv_cache {
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
 
-    std::vector<llama_kv_cell> cells;
+    llama_kv_cells cells;
+
+    // paged allocation (see llama_context_params::kv_block_size): the cells are grouped into blocks of block_size
+    // cells, new tokens of a sequence go to free cells in the blocks it owns, and slot holds the cells that were
+    // allocated for the tokens of the current ubatch (head is not used)
+    uint32_t block_size = 0;
+
+    std::vector<llama_seq_id> block_owner; // -1 if the block is free
+    std::vector<uint32_t>     block_used;  // number of used cells in the block
+
+    std::vector<std::vector<uint32_t>> seq_blocks; // per seq_id, the blocks it owns, in increasing order
+
+    std::vector<uint32_t> slot;
+
+    // the cells the attention of the current ubatch runs over (n of them, -1 for padding), see llama_kv_cache_gather()
+    std::vector<int32_t> gather;
 
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
@@ -2471,6 +2618,7 @@ struct llama_model {
     // objects representing data potentially being locked in memory
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
+    llama_mlocks mlock_experts; // hot expert slices, see llama_model_params::hot_experts_file
 
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
@@ -2499,6 +2647,102 @@ struct llama_model {
     }
 };
 
+// Expert usage counts are stored as text: a header line with the number of layers and experts, then one line
+// per MoE layer with the layer index followed by the count of every expert.
+static bool llama_write_expert_counts(const char * fname, const std::vector<uint64_t> & counts, int n_layer, int n_expert) {
+    std::ofstream fout(fname);
+    if (!fout) {
+        LLAMA_LOG_ERROR("%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+    fout << n_layer << ' ' << n_expert << '\n';
+    for (int il = 0; il < n_layer; ++il) {
+        const uint64_t * c = counts.data() + size_t(il)*n_expert;
+        if (std::all_of(c, c + n_expert, [](uint64_t n) { return n == 0; })) {
+            continue;
+        }
+        fout << il;
+        for (int ie = 0; ie < n_expert; ++ie) {
+            fout << ' ' << c[ie];
+        }
+        fout << '\n';
+    }
+    return bool(fout);
+}
+
+static bool llama_read_expert_counts(const char * fname, std::vector<uint64_t> & counts, int n_layer, int n_expert) {
+    std::ifstream fin(fname);
+    int n_layer_file = 0, n_expert_file = 0;
+    if (!(fin >> n_layer_file >> n_expert_file) || n_layer_file != n_layer || n_expert_file != n_expert) {
+        return false;
+    }
+    counts.assign(size_t(n_layer)*n_expert, 0);
+    int il;
+    while (fin >> il) {
+        if (il < 0 || il >= n_layer) {
+            return false;
+        }
+        for (int ie = 0; ie < n_expert; ++ie) {
+            if (!(fin >> counts[size_t(il)*n_expert + ie])) {
+                return false;
+            }
+        }
+    }
+    return fin.eof();
+}
+
+// speculative readahead of mmap-ed expert weights, see llama_context_params::expert_prefetch
+struct llama_expert_prefetch {
+    struct layer {
+        llama_expert_prefetch * pf = nullptr;
+        int il      = -1; // -1 if the layer has no host expert tensors
+        int il_next = -1; // the next layer with experts
+        std::array<const ggml_tensor *, 3> exps = {}; // up, gate, down
+    };
+
+    int mode     = 0;
+    int n_expert = 0;
+    std::vector<layer> layers;
+
+    // how often expert i of layer il was selected together with expert j of layers[il].il_next, [n_layer][n_expert][n_expert]
+    std::vector<uint32_t> coact;
+
+    // the selection of the previous layer with experts in the current ubatch
+    int il_prev = -1;
+    std::vector<int32_t> ids_prev;
+
+    std::vector<uint8_t>  selected; // scratch
+    std::vector<uint64_t> score;    // scratch
+};
+
+// the graph of the last llama_decode() ubatch, reused by the next ubatch with the same topology
+// (see llama_graph_cache_reuse()); it lives in buf_compute_meta, so building any other graph invalidates it
+struct llama_graph_cache {
+    ggml_cgraph * gf = nullptr;
+
+    int32_t  n_tokens  = 0;
+    int32_t  n_outputs = 0;
+    uint32_t n_kv      = 0;
+    bool     embd      = false; // input is embeddings rather than tokens
+
+    // the sequence layout of the ubatch, see llama_graph_cache_seq_layout()
+    int32_t  n_seqs     = 0;
+    bool     equal_seqs = false;
+
+    // copies into the KV cache: the tensor (a view of a cache tensor) and its offset per cache cell
+    std::vector<std::pair<ggml_tensor *, size_t>> kv_stores;
+};
+
+// host copy of the causal KQ mask of the last small ubatch: when the next ubatch continues the same sequences, only the
+// columns of the cells that changed in between are recomputed (see llama_set_inputs())
+struct llama_kq_mask_cache {
+    int64_t n_kv = 0; // 0 if there is no valid mask
+
+    std::vector<float>        data; // [n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)]
+    std::vector<llama_seq_id> seq;  // [n_tokens] the sequence of each row
+    std::vector<llama_pos>    pos;  // [n_tokens] the position of each row, INT32_MAX if the sequence has cells past it
+};
+
 struct llama_context {
     llama_context(const llama_model & model)
         : model(model)
@@ -2507,12 +2751,28 @@ struct llama_context {
         , t_load_us(model.t_load_us) {}
 
     ~llama_context() {
+        if (decode_worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(decode_mutex);
+                decode_stop = true;
+            }
+            decode_cv.notify_all();
+            decode_worker.join();
+        }
+
         ggml_backend_sched_free(sched);
 
         for (ggml_backend_t backend : backends) {
             ggml_backend_free(backend);
         }
 
+        ggml_threadpool_free(threadpool);
+        ggml_profiler_free(profiler);
+
+        if (!expert_stats_file.empty()) {
+            llama_write_expert_counts(expert_stats_file.c_str(), expert_counts, model.hparams.n_layer, model.hparams.n_expert);
+        }
+
         ggml_backend_buffer_free(buf_output);
     }
 
@@ -2523,6 +2783,10 @@ struct llama_context {
     struct llama_kv_cache       kv_self;
     struct llama_control_vector cvec;
 
+    // K/V of the sliding-window attention layers when they are not in kv_self (see llama_context_params::swa_full):
+    // only the last n_swa positions of each sequence are kept, so it is much smaller than n_ctx (size == 0 if unused)
+    struct llama_kv_cache       kv_swa;
+
     std::vector<float> scale_data;
 
     std::unordered_map<struct llama_lora_adapter *, float> lora_adapters;
@@ -2536,18 +2800,41 @@ struct llama_context {
 #endif
     ggml_backend_t backend_cpu = nullptr;
 
+    // persistent CPU worker threads, sized for max(n_threads, n_threads_batch)
+    struct ggml_threadpool * threadpool = nullptr;
+
+    // per-op timing of sampled CPU graphs, see llama_context_params::profile_file
+    struct ggml_profiler * profiler = nullptr;
+
+    llama_graph_cache graph_cache;
+
+    // the copies into the KV cache of the last graph built by llama_build_graph, with the size of a cache cell
+    std::vector<std::pair<ggml_tensor *, size_t>> kv_store_views;
+
+    llama_kq_mask_cache kq_mask_cache;
+
+    // how often each expert was selected, [n_layer][n_expert], empty if not collected
+    std::vector<uint64_t> expert_counts;
+    std::string expert_stats_file;
+    // the selected experts of each MoE layer of the current graph
+    std::vector<std::pair<int, ggml_tensor *>> expert_ids;
+
+    llama_expert_prefetch expert_prefetch;
+
     bool has_evaluated_once = false;
 
     int64_t t_start_us;
     int64_t t_load_us;
     int64_t t_p_eval_us = 0;
     int64_t t_eval_us   = 0;
+    int64_t t_defrag_us = 0;
 
     int64_t t_compute_start_us = 0;
     int64_t n_queued_tokens = 0;
 
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
+    int32_t n_defrag = 0; // number of KV cache defragmentation steps
 
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_t buf_output = nullptr;
@@ -2585,6 +2872,19 @@ struct llama_context {
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    // sequence state files kept mapped with llama_state_seq_map_file, by path
+    std::map<std::string, std::unique_ptr<llama_mmap>> state_seq_maps;
+
+    // the batch started by llama_decode_async, and the result of the last one that finished
+    // it runs on a worker thread that is started on first use and lives as long as the context
+    std::thread             decode_worker;
+    std::mutex              decode_mutex;
+    std::condition_variable decode_cv;
+    llama_batch             decode_batch   = {};
+    bool                    decode_pending = false; // decode_batch was handed to the worker and is not finished yet
+    bool                    decode_stop    = false;
+    int                     decode_result  = 0;
+
     // input tensors
     struct ggml_tensor * inp_tokens;      // I32 [n_batch]
     struct ggml_tensor * inp_embd;        // F32 [n_embd, n_batch]
@@ -2593,6 +2893,7 @@ struct llama_context {
     struct ggml_tensor * inp_KQ_mask;     // F32 [kv_size, n_batch]
     struct ggml_tensor * inp_KQ_mask_swa; // F32 [kv_size, n_batch]
     struct ggml_tensor * inp_K_shift;     // I32 [kv_size]
+    struct ggml_tensor * inp_K_shift_swa = nullptr; // I32 [kv_swa.size]
     struct ggml_tensor * inp_mean;        // F32 [n_batch, n_batch]
     struct ggml_tensor * inp_cls;         // I32 [n_batch]
     struct ggml_tensor * inp_s_copy;      // I32 [kv_size]
@@ -2602,6 +2903,8 @@ struct llama_context {
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
     struct ggml_tensor * inp_scale = nullptr; // F32 [n_tokens]
+    struct ggml_tensor * inp_kv_cells = nullptr; // I32 [n_batch]
+    struct ggml_tensor * inp_kv_gather = nullptr; // I32 [n_kv]
 };
 
 struct llama_lora_weight {
@@ -2773,7 +3076,9 @@ static bool llama_kv_cache_init(
                          ggml_type   type_k,
                          ggml_type   type_v,
                           uint32_t   kv_size,
-                              bool   offload) {
+                              bool   offload,
+const llama_kv_cache_type_override * type_overrides = nullptr,
+       enum llama_kv_cache_layers    layers = LLAMA_KV_LAYERS_ALL) {
     const llama_model & model = ctx->model;
     const llama_cparams & cparams = ctx->cparams;
 
@@ -2794,24 +3099,49 @@ static bool llama_kv_cache_init(
     cache.type_k  = type_k;
     cache.type_v  = type_v;
 
-    cache.cells.clear();
-    cache.cells.resize(kv_size);
+    cache.cells.resize(kv_size, cparams.n_seq_max);
 
     if (cache.recurrent) {
         // init state copy sources
         for (uint32_t i = 0; i < cache.size; ++i) {
-            cache.cells[i].src = i;
+            cache.cells.src[i] = i;
         }
     }
 
+    auto has_layer = [&](int il) {
+        return layers == LLAMA_KV_LAYERS_ALL || hparams.is_swa(il) == (layers == LLAMA_KV_LAYERS_SWA);
+    };
+
     // count used buffer types
     std::map<ggml_backend_buffer_type_t, int> buft_layer_count;
-    if (offload) {
-        for (int64_t i = 0; i < n_layer; ++i) {
-            buft_layer_count[model.buft_layer[i].buft]++;
+    for (int64_t i = 0; i < n_layer; ++i) {
+        if (has_layer(i)) {
+            buft_layer_count[offload ? model.buft_layer[i].buft : llama_default_buffer_type_cpu(true)]++;
+        }
+    }
+
+    cache.block_size = 0;
+    cache.block_owner.clear();
+    cache.block_used.clear();
+    cache.seq_blocks.clear();
+    cache.slot.clear();
+    cache.gather.clear();
+    if (cparams.kv_block_size > 0 && layers != LLAMA_KV_LAYERS_SWA) {
+        // the KV data is scattered to the cells by a CPU op, and the transposed V cache has no contiguous rows
+        bool host = true;
+        for (auto & it : buft_layer_count) {
+            host = host && ggml_backend_buft_is_host(it.first);
+        }
+        if (cache.recurrent || cache.v_trans || cparams.mla_attn || !host) {
+            LLAMA_LOG_WARN("%s: paged KV cache requires flash attention, no MLA and a KV cache in host memory -> turning it off\n", __func__);
+        } else {
+            cache.block_size = std::min(cparams.kv_block_size, kv_size);
+            const uint32_t n_blocks = (kv_size + cache.block_size - 1)/cache.block_size;
+            cache.block_owner.resize(n_blocks, -1);
+            cache.block_used.resize(n_blocks, 0);
+            cache.seq_blocks.resize(cparams.n_seq_max);
+            LLAMA_LOG_INFO("%s: paged KV cache with %u blocks of %u cells\n", __func__, n_blocks, cache.block_size);
         }
-    } else {
-        buft_layer_count[llama_default_buffer_type_cpu(true)] = n_layer;
     }
 
     //if (cparams.fused_moe_up_gate) {
@@ -2883,6 +3213,21 @@ static bool llama_kv_cache_init(
     }
     if (needs_v_cache) cache.v_l.reserve(n_layer);
 
+    std::vector<std::pair<std::regex, ggml_type>> overrides;
+    for (auto * o = type_overrides; o && o->pattern; ++o) {
+        overrides.emplace_back(std::regex(o->pattern), o->type);
+    }
+    // the type of the cache tensor of layer il with the given name prefix
+    auto layer_type = [&](const char * prefix, int il, ggml_type type) {
+        const std::string name = prefix + std::to_string(il);
+        for (auto & o : overrides) {
+            if (std::regex_search(name, o.first)) {
+                return o.second;
+            }
+        }
+        return type;
+    };
+
     bool warn = true;
     int n_mla = 0;
     for (int i = 0; i < (int) n_layer; i++) {
@@ -2891,9 +3236,11 @@ static bool llama_kv_cache_init(
         const uint32_t n_head       = hparams.n_head(i);
         const uint32_t n_head_kv    = hparams.n_head_kv(i);
         const uint32_t n_embd_head_k= hparams.n_embd_head_k;
+        const ggml_type type_k_l = layer_type("cache_k_l", i, type_k);
+        const ggml_type type_v_l = layer_type("cache_v_l", i, type_v);
 
 
-        struct ggml_context * ctx = offload ? ctx_map.at(model.buft_layer[i].buft) : cache.ctxs.front();
+        struct ggml_context * ctx = !has_layer(i) ? nullptr : offload ? ctx_map.at(model.buft_layer[i].buft) : cache.ctxs.front();
         ggml_tensor * k;
         ggml_tensor * v;
         if (cparams.mla_attn) {
@@ -2903,25 +3250,42 @@ static bool llama_kv_cache_init(
             const uint32_t kv_lora_rank = hparams.n_lora_kv;
             //LLAMA_LOG_INFO("%s: layer %d: n_embd_head_qk_rope = %d, kv_lora_rank = %d\n", __func__, i, n_embd_head_qk_rope, kv_lora_rank);
             if (cparams.flash_attn) {
-                ggml_tensor * kv = ggml_new_tensor_2d(ctx, cache.type_k, kv_lora_rank + n_embd_head_qk_rope, kv_size);
+                ggml_tensor * kv = ggml_new_tensor_2d(ctx, type_k_l, kv_lora_rank + n_embd_head_qk_rope, kv_size);
                 ggml_format_name(kv, "cache_k_l%d", i);
                 cache.k_l.push_back(kv);
             } else {
-                auto kv_type = cparams.mla_attn == 1 ? cache.type_k : cache.type_v;
+                auto kv_type = cparams.mla_attn == 1 ? type_k_l : layer_type("cache_k_l", i, cache.type_v);
                 ggml_tensor * kv = ggml_new_tensor_2d(ctx, kv_type, kv_lora_rank + n_embd_head_qk_rope, kv_size);
                 ggml_format_name(kv, "cache_k_l%d", i);
                 cache.k_l.push_back(kv);
                 if (cparams.mla_attn == 1) {
-                    ggml_tensor * kvt = ggml_new_tensor_1d(ctx, cache.type_v, kv_lora_rank*kv_size);
+                    ggml_tensor * kvt = ggml_new_tensor_1d(ctx, type_v_l, kv_lora_rank*kv_size);
                     ggml_format_name(kvt, "cache_v_l%d", i);
                     cache.v_l.push_back(kvt);
                 }
             }
             n_mla++;
         }
+        else if (!has_layer(i)) {
+            cache.k_l.push_back(nullptr);
+            cache.v_l.push_back(nullptr);
+        }
         else {
-            k = ggml_new_tensor_2d(ctx, type_k, n_embd_head_k, n_head_kv*kv_size);
-            v = ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*kv_size);
+            if (n_embd_head_k % ggml_blck_size(type_k_l) != 0 || hparams.n_embd_head_v % ggml_blck_size(type_v_l) != 0) {
+                LLAMA_LOG_ERROR("%s: layer %d: KV cache types %s/%s do not fit the head size\n", __func__, i,
+                        ggml_type_name(type_k_l), ggml_type_name(type_v_l));
+                return false;
+            }
+            if (!cparams.flash_attn && type_v_l != type_v && ggml_is_quantized(type_v_l)) {
+                LLAMA_LOG_ERROR("%s: layer %d: V cache quantization requires flash_attn\n", __func__, i);
+                return false;
+            }
+            if (type_k_l != type_k || type_v_l != type_v) {
+                LLAMA_LOG_INFO("%s: layer %d: K cache type %s, V cache type %s\n", __func__, i,
+                        ggml_type_name(type_k_l), ggml_type_name(type_v_l));
+            }
+            k = ggml_new_tensor_2d(ctx, type_k_l, n_embd_head_k, n_head_kv*kv_size);
+            v = ggml_new_tensor_1d(ctx, type_v_l, n_embd_v_gqa*kv_size);
             ggml_format_name(k, "cache_k_l%d", i);
             ggml_format_name(v, "cache_v_l%d", i);
             cache.k_l.push_back(k);
@@ -2951,6 +3315,194 @@ static bool llama_kv_cache_init(
     return true;
 }
 
+// number of cells in block ib of a paged cache (the last block can be shorter)
+static uint32_t llama_kv_cache_block_cells(const struct llama_kv_cache & cache, uint32_t ib) {
+    return std::min(cache.block_size, cache.size - ib*cache.block_size);
+}
+
+// recompute the usage and the owner of block ib of a paged cache from its cells, and move the block to the table of
+// its new owner if it changed
+// a block stays with its owner as long as the owner has a cell in it, otherwise it goes to the first sequence found in it
+static void llama_kv_cache_update_block(struct llama_kv_cache & cache, uint32_t ib) {
+    const uint32_t i0 = ib*cache.block_size;
+    const uint32_t i1 = i0 + llama_kv_cache_block_cells(cache, ib);
+
+    const llama_seq_id owner_old = cache.block_owner[ib];
+
+    uint32_t     used      = 0;
+    bool         has_owner = false;
+    llama_seq_id first     = -1;
+    for (uint32_t i = i0; i < i1; ++i) {
+        if (cache.cells.pos[i] < 0) {
+            continue;
+        }
+        ++used;
+        if (first < 0) {
+            first = cache.cells.seq_first(i);
+        }
+        has_owner = has_owner || (owner_old >= 0 && cache.cells.seq_has(i, owner_old));
+    }
+
+    const llama_seq_id owner = used == 0 ? -1 : has_owner ? owner_old : first;
+
+    cache.block_used[ib]  = used;
+    cache.block_owner[ib] = owner;
+
+    if (owner == owner_old) {
+        return;
+    }
+    if (owner_old >= 0) {
+        auto & blocks = cache.seq_blocks[owner_old];
+        blocks.erase(std::lower_bound(blocks.begin(), blocks.end(), ib));
+    }
+    if (owner >= 0) {
+        if ((size_t) owner >= cache.seq_blocks.size()) {
+            cache.seq_blocks.resize(owner + 1);
+        }
+        auto & blocks = cache.seq_blocks[owner];
+        blocks.insert(std::upper_bound(blocks.begin(), blocks.end(), ib), ib);
+    }
+}
+
+// the seq ops walk the cells in order and collect the blocks of a paged cache whose cells they changed in dirty,
+// only those are updated afterwards
+static void llama_kv_cache_touch_block(const struct llama_kv_cache & cache, std::vector<uint32_t> & dirty, uint32_t i) {
+    if (cache.block_size > 0 && (dirty.empty() || dirty.back() != i/cache.block_size)) {
+        dirty.push_back(i/cache.block_size);
+    }
+}
+
+static void llama_kv_cache_update_blocks(struct llama_kv_cache & cache, const std::vector<uint32_t> & dirty) {
+    for (uint32_t ib : dirty) {
+        llama_kv_cache_update_block(cache, ib);
+    }
+}
+
+// recompute the usage and the owners of all the blocks of a paged cache from the cells (after a defragmentation or a
+// state restore, which move cells anywhere)
+static void llama_kv_cache_update_blocks(struct llama_kv_cache & cache) {
+    if (cache.block_size == 0) {
+        return;
+    }
+
+    for (auto & blocks : cache.seq_blocks) {
+        blocks.clear();
+    }
+
+    for (uint32_t ib = 0; ib < (uint32_t) cache.block_owner.size(); ++ib) {
+        const uint32_t i0 = ib*cache.block_size;
+        const uint32_t i1 = i0 + llama_kv_cache_block_cells(cache, ib);
+
+        uint32_t     used      = 0;
+        bool         has_owner = false;
+        llama_seq_id first     = -1;
+        for (uint32_t i = i0; i < i1; ++i) {
+            if (cache.cells.pos[i] < 0) {
+                continue;
+            }
+            ++used;
+            if (first < 0) {
+                first = cache.cells.seq_first(i);
+            }
+            has_owner = has_owner || cache.cells.seq_has(i, cache.block_owner[ib]);
+        }
+
+        const llama_seq_id owner = has_owner ? cache.block_owner[ib] : first;
+
+        cache.block_used[ib]  = used;
+        cache.block_owner[ib] = used > 0 ? owner : -1;
+
+        if (cache.block_owner[ib] >= 0) {
+            if ((size_t) owner >= cache.seq_blocks.size()) {
+                cache.seq_blocks.resize(owner + 1);
+            }
+            cache.seq_blocks[owner].push_back(ib);
+        }
+    }
+}
+
+// paged version of llama_kv_cache_find_slot: each token goes to a free cell in a block owned by its first sequence,
+// or else to a new block for the sequence, preferably the one following its last block
+// the cells are returned in cache.slot
+static bool llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch) {
+    const uint32_t n_tokens = batch.n_tokens;
+    const uint32_t n_blocks = cache.block_owner.size();
+
+    auto free_cell = [&cache](uint32_t ib) {
+        const uint32_t i0 = ib*cache.block_size;
+        const uint32_t i1 = i0 + llama_kv_cache_block_cells(cache, ib);
+        for (uint32_t i = i0; i < i1; ++i) {
+            if (cache.cells.pos[i] < 0) {
+                return i;
+            }
+        }
+        return cache.size;
+    };
+
+    cache.slot.resize(n_tokens);
+
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        const llama_seq_id seq_id = batch.n_seq_id[i] > 0 ? batch.seq_id[i][0] : 0;
+        if ((size_t) seq_id >= cache.seq_blocks.size()) {
+            cache.seq_blocks.resize(seq_id + 1);
+        }
+        auto & blocks = cache.seq_blocks[seq_id];
+
+        uint32_t cell = cache.size;
+        for (uint32_t ib : blocks) {
+            if (cache.block_used[ib] < llama_kv_cache_block_cells(cache, ib)) {
+                cell = free_cell(ib);
+                break;
+            }
+        }
+
+        if (cell == cache.size) {
+            uint32_t ib_new = n_blocks;
+            if (!blocks.empty() && blocks.back() + 1 < n_blocks && cache.block_owner[blocks.back() + 1] < 0) {
+                ib_new = blocks.back() + 1;
+            }
+            for (uint32_t ib = 0; ib < n_blocks && ib_new == n_blocks; ++ib) {
+                if (cache.block_owner[ib] < 0) {
+                    ib_new = ib;
+                }
+            }
+            if (ib_new < n_blocks) {
+                cache.block_owner[ib_new] = seq_id;
+                blocks.insert(std::upper_bound(blocks.begin(), blocks.end(), ib_new), ib_new);
+                cell = free_cell(ib_new);
+            }
+        }
+
+        if (cell == cache.size) {
+            // no free block left (the free cells in the blocks of other sequences are not used, so that the attention
+            // of a sequence never has to go through them), undo the allocation of the previous tokens
+            std::vector<uint32_t> dirty;
+            for (uint32_t j = 0; j < i; ++j) {
+                cache.cells.rm(cache.slot[j]);
+                dirty.push_back(cache.slot[j]/cache.block_size);
+            }
+            std::sort(dirty.begin(), dirty.end());
+            dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+            llama_kv_cache_update_blocks(cache, dirty);
+            cache.slot.clear();
+            return false;
+        }
+
+        cache.cells.pos_set(cell, batch.pos[i]);
+        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
+            cache.cells.seq_add(cell, batch.seq_id[i][j]);
+        }
+        cache.block_used[cell/cache.block_size]++;
+        cache.slot[i] = cell;
+    }
+
+    cache.used += n_tokens;
+
+    return true;
+}
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 // Note: On success, it's important that cache.head points
@@ -2979,16 +3531,16 @@ static bool llama_kv_cache_find_slot(
                         min = seq_id;
                     }
                     // Assuming the tokens are in-order
-                    if (batch.pos[i] != cache.cells[seq_id].pos + 1) {
+                    if (batch.pos[i] != cache.cells.pos[seq_id] + 1) {
                         // What should happen when the pos backtracks or skips a value?
                         // Clearing the state mid-batch would require special-casing which isn't done.
                         LLAMA_LOG_WARN("%s: non-consecutive token position %d after %d for sequence %d\n",
-                            __func__, batch.pos[i], cache.cells[seq_id].pos, seq_id);
+                            __func__, batch.pos[i], cache.cells.pos[seq_id], seq_id);
                     }
-                    if (cache.cells[seq_id].pos < 0 && 0 <= batch.pos[i]) {
+                    if (cache.cells.pos[seq_id] < 0 && 0 <= batch.pos[i]) {
                         cache.used += 1;
                     }
-                    cache.cells[seq_id].pos = batch.pos[i];
+                    cache.cells.pos_set(seq_id, batch.pos[i]);
                     // NOTE: seq_ids are not inserted here; they are handled when the input tensors are set
                 } else {
                     // too big seq_id
@@ -3013,6 +3565,10 @@ static bool llama_kv_cache_find_slot(
         return false;
     }
 
+    if (cache.block_size > 0) {
+        return llama_kv_cache_find_slot_paged(cache, batch);
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -3024,7 +3580,7 @@ static bool llama_kv_cache_find_slot(
 
         bool found = true;
         for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
+            if (cache.cells.pos[cache.head + i] >= 0) {
                 found = false;
                 cache.head += i + 1;
                 n_tested   += i + 1;
@@ -3043,10 +3599,10 @@ static bool llama_kv_cache_find_slot(
     }
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+        cache.cells.pos_set(cache.head + i, batch.pos[i]);
 
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            cache.cells.seq_add(cache.head + i, batch.seq_id[i][j]);
         }
     }
 
@@ -3058,9 +3614,7 @@ static bool llama_kv_cache_find_slot(
 // find how many cells are currently in use
 static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     for (uint32_t i = cache.size; i > 0; --i) {
-        const llama_kv_cell & cell = cache.cells[i - 1];
-
-        if (cell.pos >= 0 && !cell.is_empty()) {
+        if (cache.cells.pos[i - 1] >= 0 && !cache.cells.is_empty(i - 1)) {
             return i;
         }
     }
@@ -3068,14 +3622,64 @@ static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     return 0;
 }
 
+// paged cache: collect in cache.gather the cells of all the blocks that hold a cell of one of the ubatch sequences
+// (their own blocks, and the blocks they share with the sequences they were copied from), padded with -1 to cache.n
+// the attention only runs over these cells, so the blocks of the other sequences and the free blocks cost nothing
+static void llama_kv_cache_gather(struct llama_kv_cache & cache, const struct llama_batch & batch, uint32_t pad) {
+    const auto & cells = cache.cells;
+    const uint32_t nw = cells.n_words;
+
+    std::vector<uint64_t> want(nw, 0);
+    for (int32_t j = 0; j < batch.n_tokens; ++j) {
+        const llama_seq_id s = batch.seq_id[j][0];
+        if ((uint32_t) s < 64*nw) {
+            want[s/64] |= uint64_t(1) << (s%64);
+        }
+    }
+
+    auto in_want = [&](uint32_t i) {
+        for (uint32_t w = 0; w < nw; ++w) {
+            if (cells.seq[(size_t) i*nw + w] & want[w]) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    cache.gather.clear();
+
+    for (uint32_t ib = 0; ib < (uint32_t) cache.block_owner.size(); ++ib) {
+        if (cache.block_used[ib] == 0) {
+            continue;
+        }
+        const uint32_t i0 = ib*cache.block_size;
+        const uint32_t i1 = i0 + llama_kv_cache_block_cells(cache, ib);
+
+        const llama_seq_id owner = cache.block_owner[ib];
+        bool take = (uint32_t) owner < 64*nw && ((want[owner/64] >> (owner%64)) & 1);
+        for (uint32_t i = i0; i < i1 && !take; ++i) {
+            take = in_want(i);
+        }
+        if (take) {
+            for (uint32_t i = i0; i < i1; ++i) {
+                cache.gather.push_back(i);
+            }
+        }
+    }
+
+    cache.n = std::min(cache.size, std::max(pad, GGML_PAD((uint32_t) cache.gather.size(), pad)));
+    cache.gather.resize(cache.n, -1);
+}
+
 static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
-    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        cache.cells.rm(i);
     }
     cache.head = 0;
     cache.used = 0;
 
+    llama_kv_cache_update_blocks(cache);
+
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf, 0);
     }
@@ -3099,7 +3703,7 @@ static bool llama_kv_cache_seq_rm(
         }
         if (0 <= seq_id) {
             // partial intersection is invalid
-            if ((0 < p0 && p0 <= cache.cells[seq_id].pos) || (0 < p1 && p1 <= cache.cells[seq_id].pos)) {
+            if ((0 < p0 && p0 <= cache.cells.pos[seq_id]) || (0 < p1 && p1 <= cache.cells.pos[seq_id])) {
                 return false;
             }
         } else {
@@ -3110,20 +3714,23 @@ static bool llama_kv_cache_seq_rm(
         }
     }
 
+    std::vector<uint32_t> dirty;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+        if (cache.cells.pos[i] >= p0 && cache.cells.pos[i] < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                cache.cells.seq_clear(i);
+            } else if (cache.cells.seq_has(i, seq_id)) {
+                cache.cells.seq_rm(i, seq_id);
             } else {
                 continue;
             }
-            if (cache.cells[i].is_empty()) {
+            llama_kv_cache_touch_block(cache, dirty, i);
+            if (cache.cells.is_empty(i)) {
                 // keep count of the number of used cells
-                if (cache.cells[i].pos >= 0) cache.used--;
+                if (cache.cells.pos[i] >= 0) cache.used--;
 
-                cache.cells[i].pos = -1;
+                cache.cells.pos_set(i, -1);
                 if (new_head == cache.size) new_head = i;
             }
         }
@@ -3132,6 +3739,8 @@ static bool llama_kv_cache_seq_rm(
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 
+    llama_kv_cache_update_blocks(cache, dirty);
+
     return true;
 }
 
@@ -3146,22 +3755,22 @@ static void llama_kv_cache_seq_cp(
 
     if (cache.recurrent) {
         if ((uint32_t) seq_id_dst < cache.size && (uint32_t) seq_id_src < cache.size) {
-            seq_id_src = cache.cells[seq_id_src].src;
+            seq_id_src = cache.cells.src[seq_id_src];
             GGML_ASSERT((uint32_t) seq_id_src < cache.size);
             // intent to "copy from"
             // supports copy chains thanks to taking the source of the source
-            cache.cells[seq_id_dst].src = seq_id_src;
+            cache.cells.src[seq_id_dst] = seq_id_src;
 
             // preserve the "keep or clear" status of the copied sequence
-            if (cache.cells[seq_id_src].has_seq_id(seq_id_src)) {
-                cache.cells[seq_id_dst].seq_id.insert(seq_id_dst);
+            if (cache.cells.seq_has(seq_id_src, seq_id_src)) {
+                cache.cells.seq_add(seq_id_dst, seq_id_dst);
             } else {
-                cache.cells[seq_id_dst].seq_id.erase(seq_id_dst);
+                cache.cells.seq_rm(seq_id_dst, seq_id_dst);
             }
 
             cache.do_copy = true;
 
-            cache.cells[seq_id_dst].pos = cache.cells[seq_id_src].pos;
+            cache.cells.pos_set(seq_id_dst, cache.cells.pos[seq_id_src]);
         }
         return;
     }
@@ -3169,9 +3778,10 @@ static void llama_kv_cache_seq_cp(
 
     cache.head = 0;
 
+    // the copied cells are already used and keep their sequences, so the blocks of a paged cache do not change
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+        if (cache.cells.seq_has(i, seq_id_src) && cache.cells.pos[i] >= p0 && cache.cells.pos[i] < p1) {
+            cache.cells.seq_add(i, seq_id_dst);
         }
     }
 }
@@ -3179,20 +3789,27 @@ static void llama_kv_cache_seq_cp(
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
+    std::vector<uint32_t> dirty;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (!cache.cells[i].has_seq_id(seq_id)) {
-            if (cache.cells[i].pos >= 0) cache.used--;
-            cache.cells[i].pos = -1;
-            cache.cells[i].seq_id.clear();
+        if (!cache.cells.seq_has(i, seq_id)) {
+            if (cache.cells.pos[i] >= 0) {
+                cache.used--;
+                llama_kv_cache_touch_block(cache, dirty, i);
+            }
+            cache.cells.rm(i);
             if (new_head == cache.size) new_head = i;
         } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+            cache.cells.seq_clear(i);
+            cache.cells.seq_add(i, seq_id);
+            llama_kv_cache_touch_block(cache, dirty, i);
         }
     }
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    llama_kv_cache_update_blocks(cache, dirty);
 }
 
 static void llama_kv_cache_seq_add(
@@ -3202,6 +3819,7 @@ static void llama_kv_cache_seq_add(
                     llama_pos   p1,
                     llama_pos   delta) {
     uint32_t new_head = cache.size;
+    std::vector<uint32_t> dirty;
 
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
@@ -3211,26 +3829,25 @@ static void llama_kv_cache_seq_add(
     if (cache.recurrent) {
         // for Mamba-like models, only the pos needs to be shifted
         if (0 <= seq_id && seq_id < (int64_t) cache.size) {
-            llama_kv_cell & cell = cache.cells[seq_id];
-            if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                cell.pos += delta;
+            if (cache.cells.seq_has(seq_id, seq_id) && p0 <= cache.cells.pos[seq_id] && cache.cells.pos[seq_id] < p1) {
+                cache.cells.pos_set(seq_id, cache.cells.pos[seq_id] + delta);
             }
         }
         return;
     }
 
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+        if (cache.cells.seq_has(i, seq_id) && cache.cells.pos[i] >= p0 && cache.cells.pos[i] < p1) {
             cache.has_shift = true;
-            cache.cells[i].pos   += delta;
-            cache.cells[i].delta += delta;
+            cache.cells.pos_set(i, cache.cells.pos[i] + delta);
+            cache.cells.delta[i] += delta;
 
-            if (cache.cells[i].pos < 0) {
-                if (!cache.cells[i].is_empty()) {
+            if (cache.cells.pos[i] < 0) {
+                if (!cache.cells.is_empty(i)) {
                     cache.used--;
                 }
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
+                cache.cells.rm(i);
+                llama_kv_cache_touch_block(cache, dirty, i);
                 if (new_head == cache.size) {
                     new_head = i;
                 }
@@ -3241,6 +3858,8 @@ static void llama_kv_cache_seq_add(
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     cache.head = new_head != cache.size ? new_head : 0;
+
+    llama_kv_cache_update_blocks(cache, dirty);
 }
 
 static void llama_kv_cache_seq_div(
@@ -3257,22 +3876,21 @@ static void llama_kv_cache_seq_div(
     if (cache.recurrent) {
         // for Mamba-like models, only the pos needs to be changed
         if (0 <= seq_id && seq_id < (int64_t) cache.size) {
-            llama_kv_cell & cell = cache.cells[seq_id];
-            if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                cell.pos /= d;
+            if (cache.cells.seq_has(seq_id, seq_id) && p0 <= cache.cells.pos[seq_id] && cache.cells.pos[seq_id] < p1) {
+                cache.cells.pos_set(seq_id, cache.cells.pos[seq_id] / d);
             }
         }
         return;
     }
 
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+        if (cache.cells.seq_has(i, seq_id) && cache.cells.pos[i] >= p0 && cache.cells.pos[i] < p1) {
             cache.has_shift = true;
 
             {
-                llama_pos p_old = cache.cells[i].pos;
-                cache.cells[i].pos   /= d;
-                cache.cells[i].delta += cache.cells[i].pos - p_old;
+                llama_pos p_old = cache.cells.pos[i];
+                cache.cells.pos_set(i, p_old / d);
+                cache.cells.delta[i] += cache.cells.pos[i] - p_old;
             }
         }
     }
@@ -3282,8 +3900,8 @@ static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama
     llama_pos result = 0;
 
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cache.cells[i].pos);
+        if (cache.cells.seq_has(i, seq_id)) {
+            result = std::max(result, cache.cells.pos[i]);
         }
     }
 
@@ -3294,6 +3912,52 @@ static void llama_kv_cache_defrag(struct llama_kv_cache & cache) {
     cache.do_defrag = true;
 }
 
+// free the cells of the windowed SWA cache that the tokens of the batch cannot attend anymore: a sequence only needs
+// the n_swa - 1 positions before its first token in the batch
+static void llama_kv_cache_swa_prune(struct llama_kv_cache & kv_swa, const llama_batch & batch, uint32_t n_swa) {
+    std::map<llama_seq_id, llama_pos> pos_min;
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        for (int32_t j = 0; j < batch.n_seq_id[i]; ++j) {
+            auto it = pos_min.emplace(batch.seq_id[i][j], batch.pos[i]).first;
+            it->second = std::min(it->second, batch.pos[i]);
+        }
+    }
+    for (const auto & [seq_id, pos] : pos_min) {
+        if (pos >= (llama_pos) n_swa) {
+            llama_kv_cache_seq_rm(kv_swa, seq_id, -1, pos - (llama_pos) n_swa + 1);
+        }
+    }
+}
+
+// with a windowed SWA cache, the tokens that follow a removal of [p0, inf) attend the last n_swa - 1 positions before
+// p0, which may have been pruned from kv_swa already: returns false if kv_swa has fewer of them than kv_self
+static bool llama_kv_cache_swa_has_window(
+        const struct llama_kv_cache & kv_self,
+        const struct llama_kv_cache & kv_swa,
+                           uint32_t   n_swa,
+                       llama_seq_id   seq_id,
+                          llama_pos   p0,
+                          llama_pos   p1) {
+    if (p0 <= 0 || (p1 >= 0 && p1 != std::numeric_limits<llama_pos>::max())) {
+        return true;
+    }
+
+    const llama_pos w0 = std::max(0, p0 - (llama_pos) n_swa + 1);
+
+    auto n_cells = [&](const llama_kv_cache & cache) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            const llama_pos pos = cache.cells.pos[i];
+            if (pos >= w0 && pos < p0 && (seq_id < 0 ? !cache.cells.is_empty(i) : cache.cells.seq_has(i, seq_id))) {
+                n++;
+            }
+        }
+        return n;
+    };
+
+    return n_cells(kv_swa) >= n_cells(kv_self);
+}
+
 static uint32_t llama_kv_cache_get_padding(const struct llama_cparams & cparams) {
     // the FA kernels require padding to avoid extra runtime boundary checks
     return cparams.flash_attn ? 256u : 32u;
@@ -3999,6 +4663,7 @@ static void llm_load_hparams(
             } break;
         case LLM_ARCH_GEMMA2:
             {
+                hparams.n_swa_pattern = 2;
                 hparams.n_swa = 4096; // default value of gemma 2
                 ml.get_key(LLM_KV_ATTENTION_SLIDING_WINDOW, hparams.n_swa, false);
                 ml.get_key(LLM_KV_ATTENTION_LAYERNORM_RMS_EPS, hparams.f_norm_rms_eps);
@@ -4424,10 +5089,7 @@ static void llm_load_hparams(
                 ml.get_key(LLM_KV_ATTENTION_LAYERNORM_RMS_EPS, hparams.f_norm_rms_eps);
                 ml.get_key(LLM_KV_EXPERT_FEED_FORWARD_LENGTH,  hparams.n_ff_exp);
                 ml.get_key(LLM_KV_ATTENTION_SLIDING_WINDOW,    hparams.n_swa);
-
-                //TODO OAI_MOE: SWA
-                //hparams.swa_type = LLAMA_SWA_TYPE_STANDARD;
-                //hparams.set_swa_pattern(2);
+                hparams.n_swa_pattern = 2;
 
                 // TODO: switch (hparams.n_layer)
 
@@ -7491,6 +8153,30 @@ static bool llm_load_tensors(
         if (n_repacked > 0) printf("============ Repacked %d tensors\n", n_repacked);
     }
 
+    if (ml.numa_partition) {
+        // with --numa partition the rows of the host weights are split across the nodes as they are loaded (see
+        // llama_model_loader::load_all_data) instead of being replicated; the cost is that the weights are in anonymous
+        // memory rather than in the page cache pages that a mmap load would share with other processes
+        size_t n_local = 0;
+        for (const auto * t : ml.numa_partitioned) {
+            n_local += ggml_numa_rows_local_bytes(t);
+        }
+        size_t n_anon = 0;
+        for (auto * buf : model.bufs) {
+            if (ggml_backend_buffer_is_host(buf)) {
+                n_anon += ggml_backend_buffer_get_size(buf);
+            }
+        }
+        LLAMA_LOG_INFO("%s: NUMA partition: %zu tensors, %.2f MiB bound to their node, %.2f MiB of them resident there\n",
+                __func__, ml.numa_partitioned.size(), ml.numa_bytes_bound/1024.0/1024.0, n_local/1024.0/1024.0);
+        LLAMA_LOG_INFO("%s: NUMA partition: %.2f MiB extra memory (host weights in anonymous memory instead of the page cache)\n",
+                __func__, n_anon/1024.0/1024.0);
+        if (ml.numa_n_failed > 0) {
+            LLAMA_LOG_WARN("%s: NUMA partition: the rows of %d tensors could not be bound, their mat-muls are not split by node\n",
+                    __func__, ml.numa_n_failed);
+        }
+    }
+
     if (model.arch == LLM_ARCH_BITNET) {
         auto set_scale = [] (ggml_tensor * w, ggml_tensor * s) {
             if (!s) {
@@ -7523,15 +8209,62 @@ static bool llm_load_tensors(
     return true;
 }
 
-// Returns 0 on success, -1 on error, and -2 on cancellation via llama_progress_callback
-static int llama_model_load(const std::string & fname, llama_model & model, llama_model_params & params) {
-    try {
-        llama_model_loader ml(fname, params.use_mmap, params.check_tensors,
-                params.repack_tensors, params.use_thp, params.kv_overrides, params.tensor_buft_overrides);
-
-        model.hparams.vocab_only = params.vocab_only;
-
-        try {
+// mlock the slices of the n_hot most used experts of every MoE layer, the others stay pageable
+static void llama_lock_hot_experts(llama_model & model, const char * fname, int n_hot) {
+    const int n_layer  = model.hparams.n_layer;
+    const int n_expert = model.hparams.n_expert;
+    if (n_expert == 0) {
+        return;
+    }
+    std::vector<uint64_t> counts;
+    if (!llama_read_expert_counts(fname, counts, n_layer, n_expert)) {
+        LLAMA_LOG_WARN("%s: %s does not contain expert counts for this model\n", __func__, fname);
+        return;
+    }
+    if (!llama_mlock::SUPPORTED) {
+        LLAMA_LOG_WARN("%s: mlock not supported on this system\n", __func__);
+        return;
+    }
+
+    // mlock() wants page aligned addresses, this covers all page sizes in use
+    constexpr uintptr_t k_align = 65536;
+
+    n_hot = std::min(n_hot, n_expert);
+    std::vector<int> order(n_expert);
+    int    n_locked = 0;
+    size_t n_bytes  = 0;
+    for (int il = 0; il < n_layer; ++il) {
+        const uint64_t * c = counts.data() + size_t(il)*n_expert;
+        std::iota(order.begin(), order.end(), 0);
+        std::partial_sort(order.begin(), order.begin() + n_hot, order.end(), [c](int a, int b) { return c[a] > c[b]; });
+        const auto & layer = model.layers[il];
+        for (ggml_tensor * t : { layer.ffn_up_exps, layer.ffn_gate_exps, layer.ffn_down_exps }) {
+            if (!t || !t->buffer || !ggml_backend_buffer_is_host(t->buffer) || t->ne[2] != n_expert) {
+                continue;
+            }
+            for (int i = 0; i < n_hot && c[order[i]] > 0; ++i) {
+                const uintptr_t first = ((uintptr_t)t->data + order[i]*t->nb[2]) & ~(k_align - 1);
+                const uintptr_t last  =  (uintptr_t)t->data + (order[i] + 1)*t->nb[2];
+                model.mlock_experts.emplace_back(new llama_mlock);
+                model.mlock_experts.back()->init((void *)first);
+                model.mlock_experts.back()->grow_to(last - first);
+                ++n_locked;
+                n_bytes += last - first;
+            }
+        }
+    }
+    LLAMA_LOG_INFO("%s: locked %d hot expert slices (%.2f MiB) in RAM\n", __func__, n_locked, n_bytes/1024.0/1024.0);
+}
+
+// Returns 0 on success, -1 on error, and -2 on cancellation via llama_progress_callback
+static int llama_model_load(const std::string & fname, llama_model & model, llama_model_params & params) {
+    try {
+        llama_model_loader ml(fname, params.use_mmap, params.check_tensors,
+                params.repack_tensors, params.use_thp, params.kv_overrides, params.tensor_buft_overrides);
+
+        model.hparams.vocab_only = params.vocab_only;
+
+        try {
             llm_load_arch(ml, model);
         } catch(const std::exception & e) {
             throw std::runtime_error("error loading model architecture: " + std::string(e.what()));
@@ -7584,6 +8317,10 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
         )) {
             return -2;
         }
+
+        if (params.hot_experts_file && params.n_hot_experts > 0 && !params.use_mlock) {
+            llama_lock_hot_experts(model, params.hot_experts_file, params.n_hot_experts);
+        }
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error loading model: %s\n", __func__, err.what());
         return -1;
@@ -7650,8 +8387,96 @@ static struct ggml_tensor * llm_build_inp_embd(
     return inpL;
 }
 
+// paged KV cache: scatter the rows of the K or V data (b) of the ubatch tokens to their cells (c) of the cache (a)
+static void llama_kv_store_op(ggml_tensor * dst, const ggml_tensor * a, const ggml_tensor * b, const ggml_tensor * c,
+        int ith, int nth, void * /*userdata*/) {
+    GGML_ASSERT(b->type == GGML_TYPE_F32 && b->nb[0] == sizeof(float));
+    GGML_ASSERT(c->type == GGML_TYPE_I32);
+
+    const ggml_from_float_t from_float = ggml_internal_get_type_traits(a->type).from_float;
+    GGML_ASSERT(a->type == GGML_TYPE_F32 || from_float);
+
+    // a cell holds the rows of one token back to back (e.g. one row per KV head)
+    const int64_t nrows          = ggml_nrows(b);
+    const int64_t rows_per_token = nrows/c->ne[0];
+    GGML_ASSERT(rows_per_token*c->ne[0] == nrows);
+
+    const size_t row_size  = ggml_row_size(a->type, b->ne[0]);
+    const size_t cell_size = row_size*rows_per_token;
+
+    const int32_t * cells = (const int32_t *)c->data;
+
+    const int64_t dr  = (nrows + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = std::min(ir0 + dr, nrows);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i1 = ir%b->ne[1];
+        const int64_t i2 = (ir/b->ne[1])%b->ne[2];
+        const int64_t i3 = ir/(b->ne[1]*b->ne[2]);
+        const float * x = (const float *)((const char *)b->data + i1*b->nb[1] + i2*b->nb[2] + i3*b->nb[3]);
+        char * y = (char *)dst->data + cells[ir/rows_per_token]*cell_size + (ir%rows_per_token)*row_size;
+        if (a->type == GGML_TYPE_F32) {
+            memcpy(y, x, b->ne[0]*sizeof(float));
+        } else {
+            from_float(x, y, b->ne[0]);
+        }
+    }
+}
+
+// paged KV cache: gather the cells c (-1 for padding, which gets zeros) of the cache b into the rows of dst, which has
+// the shape of a ([n_embd_gqa, n_kv]), so that the attention reads them as a contiguous K or V
+static void llama_kv_gather_op(ggml_tensor * dst, const ggml_tensor * /*a*/, const ggml_tensor * b, const ggml_tensor * c,
+        int ith, int nth, void * /*userdata*/) {
+    GGML_ASSERT(c->type == GGML_TYPE_I32 && c->ne[0] == dst->ne[1] && dst->type == b->type);
+
+    const size_t cell_size = ggml_row_size(b->type, dst->ne[0]);
+    GGML_ASSERT(dst->nb[1] == cell_size);
+
+    const int32_t * cells = (const int32_t *)c->data;
+
+    const int64_t n_kv = dst->ne[1];
+    const int64_t dr   = (n_kv + nth - 1)/nth;
+    const int64_t i0   = dr*ith;
+    const int64_t i1   = std::min(i0 + dr, n_kv);
+
+    // the cells of a block are consecutive, copy each run at once
+    for (int64_t i = i0; i < i1; ) {
+        int64_t n = 1;
+        if (cells[i] < 0) {
+            while (i + n < i1 && cells[i + n] < 0) {
+                ++n;
+            }
+            memset((char *)dst->data + i*cell_size, 0, n*cell_size);
+        } else {
+            while (i + n < i1 && cells[i + n] == cells[i] + n) {
+                ++n;
+            }
+            memcpy((char *)dst->data + i*cell_size, (const char *)b->data + cells[i]*cell_size, n*cell_size);
+        }
+        i += n;
+    }
+}
+
+// copy src into a view of a cache tensor at kv_head, and record the copy and the view with the size of a cache cell,
+// so that a cached graph can be moved to another kv_head (cell_size 0: the view cannot be moved)
+static void llm_build_kv_store_view(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+         struct ggml_cgraph * graph,
+         struct ggml_tensor * src,
+         struct ggml_tensor * view,
+                     size_t   cell_size) {
+    ggml_tensor * cpy = ggml_cpy(ctx, src, view);
+    ggml_build_forward_expand(graph, cpy);
+
+    lctx.kv_store_views.emplace_back(cpy,  cell_size);
+    lctx.kv_store_views.emplace_back(view, cell_size);
+}
+
 static void llm_build_kv_store(
         struct ggml_context * ctx,
+       struct llama_context & lctx,
         const llama_hparams & hparams,
         const llama_cparams & cparams,
        const llama_kv_cache & kv,
@@ -7661,8 +8486,15 @@ static void llm_build_kv_store(
                     int32_t   n_tokens,
                     int32_t   kv_head,
          const llm_build_cb & cb,
-                    int64_t   il) {
-    const int64_t n_ctx = cparams.n_ctx;
+                    int64_t   il,
+         struct ggml_tensor * kv_cells = nullptr) {
+    if (kv.block_size > 0) {
+        // the tokens of a paged cache are not at kv_head, but in the cells of kv_cells
+        GGML_ASSERT(kv_cells && !kv.v_trans);
+        ggml_build_forward_expand(graph, ggml_map_custom3_inplace(ctx, kv.k_l[il], k_cur, kv_cells, llama_kv_store_op, GGML_N_TASKS_MAX, nullptr));
+        ggml_build_forward_expand(graph, ggml_map_custom3_inplace(ctx, kv.v_l[il], v_cur, kv_cells, llama_kv_store_op, GGML_N_TASKS_MAX, nullptr));
+        return;
+    }
 
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
     const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
@@ -7672,8 +8504,6 @@ static void llm_build_kv_store(
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
     const int64_t n_embd_head_v = hparams.n_embd_head_v;
 
-    GGML_ASSERT(kv.size == n_ctx);
-
     //struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa,
     //        (ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa))*kv_head);
     //cb(k_cache_view, "k_cache_view", il);
@@ -7683,24 +8513,28 @@ static void llm_build_kv_store(
             k_row_size, k_row_size*n_head_kv*kv_head);
 
     // note: storing RoPE-ed version of K in the KV cache
-    ggml_build_forward_expand(graph, ggml_cpy(ctx, k_cur, k_cache_view));
+    llm_build_kv_store_view(ctx, lctx, graph, k_cur, k_cache_view, k_row_size*n_head_kv);
 
     struct ggml_tensor * v_cache_view = nullptr;
+    size_t v_cell_size;
 
     if (cparams.flash_attn) {
         v_cache_view = ggml_view_1d(ctx, kv.v_l[il], n_tokens*n_embd_v_gqa,
                 (kv_head)*ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa));
+        v_cell_size = ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa);
     } else {
         // note: the V cache is transposed when not using flash attention
         v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_v_gqa,
-                (  n_ctx)*ggml_element_size(kv.v_l[il]),
+                (kv.size)*ggml_element_size(kv.v_l[il]),
                 (kv_head)*ggml_element_size(kv.v_l[il]));
+        // a transposed quantized cache has no fixed cell size
+        v_cell_size = ggml_is_quantized(kv.v_l[il]->type) ? 0 : ggml_element_size(kv.v_l[il]);
 
         v_cur = ggml_transpose(ctx, v_cur);
     }
     cb(v_cache_view, "v_cache_view", il);
 
-    ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur, v_cache_view));
+    llm_build_kv_store_view(ctx, lctx, graph, v_cur, v_cache_view, v_cell_size);
 }
 
 // do mat_mul, while optionally apply lora
@@ -7958,6 +8792,126 @@ static struct ggml_tensor * llm_build_ffn(
     return cur;
 }
 
+static void llama_expert_prefetch_init(llama_expert_prefetch & pf, const llama_model & model, int mode) {
+    const int n_layer = model.hparams.n_layer;
+    pf.mode     = mode;
+    pf.n_expert = model.hparams.n_expert;
+    pf.layers.resize(n_layer);
+    int il_next = -1;
+    for (int il = n_layer - 1; il >= 0; --il) {
+        auto & layer = pf.layers[il];
+        const auto & ml = model.layers[il];
+        layer.pf = &pf;
+        layer.il_next = il_next;
+        layer.exps = { ml.ffn_up_exps, ml.ffn_gate_exps, ml.ffn_down_exps };
+        bool ok = ml.ffn_up_exps && ml.ffn_down_exps;
+        for (const ggml_tensor * t : layer.exps) {
+            ok = ok && (!t || (t->buffer && ggml_backend_buffer_is_host(t->buffer) && t->ne[2] == pf.n_expert));
+        }
+        if (ok) {
+            layer.il = il;
+            il_next  = il;
+        }
+    }
+    if (mode > 1) {
+        pf.coact.assign(size_t(n_layer)*pf.n_expert*pf.n_expert, 0);
+    }
+}
+
+// readahead of the slices of the selected experts, adjacent experts are merged into one range
+static void llama_expert_prefetch_layer(const llama_expert_prefetch::layer & layer, const std::vector<uint8_t> & selected) {
+    const int n_expert = layer.pf->n_expert;
+    for (const ggml_tensor * t : layer.exps) {
+        if (!t) {
+            continue;
+        }
+        for (int ie = 0; ie < n_expert; ) {
+            if (!selected[ie]) {
+                ++ie;
+                continue;
+            }
+            int ie_end = ie + 1;
+            while (ie_end < n_expert && selected[ie_end]) ++ie_end;
+            llama_mmap::prefetch((const char *)t->data + ie*t->nb[2], (ie_end - ie)*t->nb[2]);
+            ie = ie_end;
+        }
+    }
+}
+
+// custom op inserted after the router: passes the selection through and prefetches the experts it needs. With
+// mode 2 it also learns which experts of the next layer follow the selected ones, and prefetches the most likely
+// of them so that the reads overlap with the attention of the next layer.
+static void llama_expert_prefetch_op(ggml_tensor * dst, const ggml_tensor * a, int ith, int nth, void * userdata) {
+    GGML_UNUSED(nth);
+    if (ith != 0) {
+        return;
+    }
+    const auto & layer = *(const llama_expert_prefetch::layer *)userdata;
+    auto & pf = *layer.pf;
+    const int     n_expert = pf.n_expert;
+    const int64_t n_used   = a->ne[0];
+    const int64_t n_tokens = a->ne[1];
+
+    for (int64_t it = 0; it < n_tokens; ++it) {
+        memcpy((char *)dst->data + it*dst->nb[1], (const char *)a->data + it*a->nb[1], n_used*sizeof(int32_t));
+    }
+    const int32_t * ids = (const int32_t *)dst->data;
+
+    pf.selected.assign(n_expert, 0);
+    int n_selected = 0;
+    for (int64_t i = 0; i < n_tokens*n_used; ++i) {
+        if (ids[i] >= 0 && ids[i] < n_expert && !pf.selected[ids[i]]) {
+            pf.selected[ids[i]] = 1;
+            ++n_selected;
+        }
+    }
+    llama_expert_prefetch_layer(layer, pf.selected);
+
+    if (pf.mode < 2) {
+        return;
+    }
+
+    if (pf.il_prev >= 0 && pf.layers[pf.il_prev].il_next == layer.il && pf.ids_prev.size() % n_tokens == 0) {
+        const int64_t n_used_prev = pf.ids_prev.size()/n_tokens;
+        uint32_t * coact = pf.coact.data() + size_t(pf.il_prev)*n_expert*n_expert;
+        for (int64_t it = 0; it < n_tokens; ++it) {
+            for (int64_t i = 0; i < n_used_prev; ++i) {
+                const int32_t ie = pf.ids_prev[it*n_used_prev + i];
+                if (ie < 0 || ie >= n_expert) continue;
+                for (int64_t j = 0; j < n_used; ++j) {
+                    const int32_t je = ids[it*n_used + j];
+                    if (je >= 0 && je < n_expert) ++coact[ie*n_expert + je];
+                }
+            }
+        }
+    }
+    pf.il_prev = layer.il;
+    pf.ids_prev.assign(ids, ids + n_tokens*n_used);
+
+    if (layer.il_next < 0) {
+        return;
+    }
+    const uint32_t * coact = pf.coact.data() + size_t(layer.il)*n_expert*n_expert;
+    pf.score.assign(n_expert, 0);
+    for (int ie = 0; ie < n_expert; ++ie) {
+        if (!pf.selected[ie]) continue;
+        for (int je = 0; je < n_expert; ++je) {
+            pf.score[je] += coact[ie*n_expert + je];
+        }
+    }
+    // as many experts as selected in this layer, among those seen together with them at least once
+    pf.selected.assign(n_expert, 0);
+    for (int n = 0; n < n_selected; ++n) {
+        const int je = std::max_element(pf.score.begin(), pf.score.end()) - pf.score.begin();
+        if (pf.score[je] == 0) {
+            break;
+        }
+        pf.selected[je] = 1;
+        pf.score[je] = 0;
+    }
+    llama_expert_prefetch_layer(pf.layers[layer.il_next], pf.selected);
+}
+
 static ggml_tensor * llm_build_moe_ffn(
         ggml_context * ctx,
        llama_context & lctx,
@@ -8029,6 +8983,12 @@ llm_expert_gating_func_type   gating_op,
     cb(selected_experts->src[0], "ffn_moe_argsort", il);
     cb(selected_experts, "ffn_moe_topk", il);
 
+    if (!lctx.expert_counts.empty()) {
+        // keep the selection alive until llama_update_expert_counts() has read it
+        ggml_set_output(selected_experts->view_src ? selected_experts->view_src : selected_experts);
+        lctx.expert_ids.emplace_back(il, selected_experts);
+    }
+
     ggml_tensor * weights = ggml_get_rows(ctx,
             ggml_reshape_3d(ctx, probs, 1, n_expert, n_tokens), selected_experts); // [1, n_expert_used, n_tokens]
     cb(weights, "ffn_moe_weights", il);
@@ -8037,6 +8997,11 @@ llm_expert_gating_func_type   gating_op,
         ggml_build_forward_expand(graph, weights);
     }
 
+    if (lctx.expert_prefetch.mode > 0 && il >= 0 && lctx.expert_prefetch.layers[il].il == il) {
+        selected_experts = ggml_map_custom1(ctx, selected_experts, llama_expert_prefetch_op, 1, &lctx.expert_prefetch.layers[il]);
+        cb(selected_experts, "ffn_moe_prefetch", il);
+    }
+
     if (gating_op == LLM_EXPERT_GATING_FUNC_TYPE_SOFTMAX_WEIGHT) {
         weights = ggml_reshape_2d(ctx, weights, n_expert_used, n_tokens);
         weights = ggml_soft_max(ctx, weights); // [n_expert_used, n_tokens]
@@ -8177,6 +9142,20 @@ llm_expert_gating_func_type   gating_op,
             gating_op, cb, il, graph);
 }
 
+// the cells of a paged KV cache that the attention of the ubatch runs over, see llama_kv_cache_gather()
+static struct ggml_tensor * llm_build_inp_kv_gather(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+                    int32_t   n_kv,
+         const llm_build_cb & cb) {
+    if (!lctx.inp_kv_gather) {
+        lctx.inp_kv_gather = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_kv);
+        cb(lctx.inp_kv_gather, "inp_kv_gather", -1);
+        ggml_set_input(lctx.inp_kv_gather);
+    }
+    return lctx.inp_kv_gather;
+}
+
 static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
        struct llama_context & lctx,
@@ -8196,7 +9175,6 @@ static struct ggml_tensor * llm_build_kqv(
     const llama_hparams & hparams = lctx.model.hparams;
     const llama_cparams & cparams = lctx.cparams;
 
-    const int64_t n_ctx         = cparams.n_ctx;
     const int64_t n_head        = hparams.n_head(il);
     const int64_t n_head_kv     = hparams.n_head_kv(il);
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
@@ -8207,11 +9185,27 @@ static struct ggml_tensor * llm_build_kqv(
     struct ggml_tensor * q = ggml_permute(ctx, q_cur, 0, 2, 1, 3);
     cb(q, "q", il);
 
+    struct ggml_tensor * k_cache = kv.k_l[il];
+    struct ggml_tensor * v_cache = kv.v_l[il];
+    if (kv.block_size > 0) {
+        // the cells of a paged cache that the ubatch attends are scattered over its blocks, gather them first
+        // (the cache tensors are read after the KV store of this layer, which was added to the graph before)
+        struct ggml_tensor * cells = llm_build_inp_kv_gather(ctx, lctx, n_kv, cb);
+        k_cache = ggml_map_custom3(ctx,
+                ggml_view_2d(ctx, kv.k_l[il], n_embd_k_gqa, n_kv, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa), 0),
+                kv.k_l[il], cells, llama_kv_gather_op, GGML_N_TASKS_MAX, nullptr);
+        cb(k_cache, "k_gather", il);
+        v_cache = ggml_map_custom3(ctx,
+                ggml_view_2d(ctx, kv.v_l[il], n_embd_v_gqa, n_kv, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa), 0),
+                kv.v_l[il], cells, llama_kv_gather_op, GGML_N_TASKS_MAX, nullptr);
+        cb(v_cache, "v_gather", il);
+    }
+
     struct ggml_tensor * k =
-        ggml_view_3d(ctx, kv.k_l[il],
+        ggml_view_3d(ctx, k_cache,
                 n_embd_head_k, n_kv, n_head_kv,
-                ggml_row_size(kv.k_l[il]->type, n_embd_head_k)*n_head_kv, //n_embd_k_gqa),
-                ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
+                ggml_row_size(k_cache->type, n_embd_head_k)*n_head_kv, //n_embd_k_gqa),
+                ggml_row_size(k_cache->type, n_embd_head_k),
                 0);
     cb(k, "k", il);
 
@@ -8225,14 +9219,13 @@ static struct ggml_tensor * llm_build_kqv(
 
     if (cparams.flash_attn) {
         GGML_UNUSED(model);
-        GGML_UNUSED(n_ctx);
 
         // split cached v into n_head heads (not transposed)
         struct ggml_tensor * v =
-            ggml_view_3d(ctx, kv.v_l[il],
+            ggml_view_3d(ctx, v_cache,
                     n_embd_head_v, n_kv, n_head_kv,
-                    ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
-                    ggml_row_size(kv.v_l[il]->type, n_embd_head_v),
+                    ggml_row_size(v_cache->type, n_embd_v_gqa),
+                    ggml_row_size(v_cache->type, n_embd_head_v),
                     0);
         cb(v, "v", il);
 
@@ -8259,8 +9252,8 @@ static struct ggml_tensor * llm_build_kqv(
         struct ggml_tensor * v =
             ggml_view_3d(ctx, kv.v_l[il],
                     n_kv, n_embd_head_v, n_head_kv,
-                    ggml_element_size(kv.v_l[il])*n_ctx,
-                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
+                    ggml_element_size(kv.v_l[il])*kv.size,
+                    ggml_element_size(kv.v_l[il])*kv.size*n_embd_head_v,
                     0);
         cb(v, "v", il);
 
@@ -8304,8 +9297,6 @@ static struct ggml_tensor * llm_build_kqv(
             }
             cb(kq, "kq_soft_max_ext", il);
 
-            GGML_ASSERT(kv.size == n_ctx);
-
             struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
             cb(kqv, "kqv", il);
 
@@ -8382,6 +9373,21 @@ static struct ggml_tensor * llm_build_kqv(
     return cur;
 }
 
+// the cells of the ubatch tokens in a paged KV cache, nullptr for a contiguous one
+static struct ggml_tensor * llm_build_inp_kv_cells(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+       const llama_kv_cache & kv,
+                    int32_t   n_tokens,
+         const llm_build_cb & cb) {
+    if (kv.block_size > 0 && !lctx.inp_kv_cells) {
+        lctx.inp_kv_cells = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_tokens);
+        cb(lctx.inp_kv_cells, "inp_kv_cells", -1);
+        ggml_set_input(lctx.inp_kv_cells);
+    }
+    return lctx.inp_kv_cells;
+}
+
 static struct ggml_tensor * llm_build_kv(
         struct ggml_context * ctx,
        struct llama_context & lctx,
@@ -8409,7 +9415,7 @@ static struct ggml_tensor * llm_build_kv(
     ggml_build_forward_expand(graph, k_cur);
     ggml_build_forward_expand(graph, v_cur);
 
-    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, n_tokens, kv_head, cb, il);
+    llm_build_kv_store(ctx, lctx, hparams, cparams, kv, graph, k_cur, v_cur, n_tokens, kv_head, cb, il, llm_build_inp_kv_cells(ctx, lctx, kv, n_tokens, cb));
 
     struct ggml_tensor * cur;
 
@@ -8427,6 +9433,7 @@ struct llm_build_context {
     const llama_cparams  & cparams;
     const llama_batch    & batch;
     const llama_kv_cache & kv_self;
+    const llama_kv_cache & kv_swa;
 
     const int64_t n_embd;
     const int64_t n_layer;
@@ -8455,6 +9462,8 @@ struct llm_build_context {
     const int32_t n_outputs;
     const int32_t n_outputs_enc;
     const int32_t kv_head;  // index of where we store new KV data in the cache
+    const int32_t n_kv_swa;    // same as n_kv and kv_head for lctx.kv_swa
+    const int32_t kv_head_swa;
     const int32_t n_ctx_orig;
 
     const bool flash_attn;
@@ -8487,6 +9496,7 @@ struct llm_build_context {
         cparams          (lctx.cparams),
         batch            (batch),
         kv_self          (lctx.kv_self),
+        kv_swa           (lctx.kv_swa),
         n_embd           (hparams.n_embd),
         n_layer          (hparams.n_layer),
         n_rot            (hparams.n_rot),
@@ -8512,6 +9522,8 @@ struct llm_build_context {
         n_outputs        (worst_case ? n_tokens : lctx.n_outputs),
         n_outputs_enc    (worst_case ? n_tokens : lctx.embd_enc.size() / hparams.n_embd),
         kv_head          (worst_case ? (kv_self.recurrent ? 0 : kv_self.size - n_tokens) : kv_self.head),
+        n_kv_swa         (worst_case ? kv_swa.size : kv_swa.n),
+        kv_head_swa      (worst_case && kv_swa.size > 0 ? kv_swa.size - n_tokens : kv_swa.head),
         n_ctx_orig       (cparams.n_ctx_orig_yarn),
         flash_attn       (cparams.flash_attn),
         mla_attn         (cparams.mla_attn),
@@ -8536,6 +9548,10 @@ struct llm_build_context {
 
         ctx0 = ggml_init(params);
 
+        // the new graph overwrites the cached one
+        lctx.graph_cache.gf = nullptr;
+        lctx.expert_ids.clear();
+
         lctx.inp_tokens      = nullptr;
         lctx.inp_embd        = nullptr;
         lctx.inp_pos         = nullptr;
@@ -8543,6 +9559,7 @@ struct llm_build_context {
         lctx.inp_KQ_mask     = nullptr;
         lctx.inp_KQ_mask_swa = nullptr;
         lctx.inp_K_shift     = nullptr;
+        lctx.inp_K_shift_swa = nullptr;
         lctx.inp_mean        = nullptr;
         lctx.inp_cls         = nullptr;
         lctx.inp_s_copy      = nullptr;
@@ -8551,6 +9568,8 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        lctx.inp_kv_cells      = nullptr;
+        lctx.inp_kv_gather     = nullptr;
     }
 
     void free() {
@@ -8563,21 +9582,32 @@ struct llm_build_context {
     struct ggml_cgraph * build_k_shift() {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
-        GGML_ASSERT(kv_self.size == n_ctx);
+        lctx.inp_K_shift = build_k_shift(gf, kv_self, "K_shift");
+        if (kv_swa.size > 0) {
+            lctx.inp_K_shift_swa = build_k_shift(gf, kv_swa, "K_shift_swa");
+        }
+
+        return gf;
+    }
 
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
-        cb(lctx.inp_K_shift, "K_shift", -1);
-        ggml_set_input(lctx.inp_K_shift);
+    // rotate the keys of the layers held by kv by the deltas of its cells, returns the input tensor for the deltas
+    struct ggml_tensor * build_k_shift(struct ggml_cgraph * gf, const llama_kv_cache & kv, const char * name) {
+        struct ggml_tensor * inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, kv.size);
+        cb(inp_K_shift, name, -1);
+        ggml_set_input(inp_K_shift);
 
         for (int il = 0; il < n_layer; ++il) {
+            if (!kv.k_l[il]) {
+                continue;
+            }
             const int64_t n_head_kv = hparams.n_head_kv(il);
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             struct ggml_tensor * rope_factors = build_rope_factors(il);
             struct ggml_tensor * k =
-                ggml_view_3d(ctx0, kv_self.k_l[il],
-                    n_embd_head_k, n_head_kv, n_ctx,
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                ggml_view_3d(ctx0, kv.k_l[il],
+                    n_embd_head_k, n_head_kv, kv.size,
+                    ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
                     0);
 
             struct ggml_tensor * tmp;
@@ -8593,21 +9623,21 @@ struct llm_build_context {
                     }
                 }
                 tmp = ggml_rope_ext_inplace(ctx0, tmp,
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(tmp, "K_shifted_f32", il);
                 tmp = ggml_cpy(ctx0, tmp, k);
             } else {
                 // we rotate only the first n_rot dimensions
                 tmp = ggml_rope_ext_inplace(ctx0, k,
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
             }
             cb(tmp, "K_shifted", il);
             ggml_build_forward_expand(gf, tmp);
         }
 
-        return gf;
+        return inp_K_shift;
     }
 
     struct ggml_cgraph * build_s_copy() {
@@ -8633,7 +9663,7 @@ struct llm_build_context {
         return gf;
     }
 
-    struct ggml_cgraph * build_defrag(const std::vector<uint32_t> & ids) {
+    struct ggml_cgraph * build_defrag(const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
         for (uint32_t i = 0; i < ids.size(); ++i) {
@@ -8650,45 +9680,49 @@ struct llm_build_context {
             }
 
             for (int il = 0; il < n_layer; ++il) {
+                if (!kv.k_l[il]) {
+                    continue;
+                }
+
                 const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
                 const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
-                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
+                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv.k_l[il],
                         n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*i));
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*i));
 
-                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self.k_l[il],
+                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv.k_l[il],
                         n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*id));
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*id));
 
                 ggml_tensor * view_v_src = nullptr;
                 ggml_tensor * view_v_dst = nullptr;
 
-                if (kv_self.v_l.size() > il) {
+                if (kv.v_l.size() > il && kv.v_l[il]) {
                     // Note: with MLA the V cache may not be present.
                     if (flash_attn) {
                         // NOTE: the V cache is not transposed when using flash attention
-                        view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
                                 n_embd_v_gqa, nm,
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*i));
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*i));
 
-                        view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
                                 n_embd_v_gqa, nm,
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*id));
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*id));
                     } else {
-                        view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
                                 nm, n_embd_v_gqa,
-                                ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                                ggml_row_size(kv_self.v_l[il]->type, i));
+                                ggml_row_size(kv.v_l[il]->type, kv.size),
+                                ggml_row_size(kv.v_l[il]->type, i));
 
-                        view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
                                 nm, n_embd_v_gqa,
-                                ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                                ggml_row_size(kv_self.v_l[il]->type, id));
+                                ggml_row_size(kv.v_l[il]->type, kv.size),
+                                ggml_row_size(kv.v_l[il]->type, id));
                     }
                 }
 
@@ -8757,8 +9791,9 @@ struct llm_build_context {
     struct ggml_tensor * build_inp_KQ_mask_swa(bool causal = true) {
         GGML_ASSERT(hparams.n_swa > 0);
 
+        // with lctx.kv_swa, all the layers that use this mask attend its cells
         lctx.inp_KQ_mask_swa = causal
-            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
+            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, kv_swa.size > 0 ? n_kv_swa : n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
             : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         cb(lctx.inp_KQ_mask_swa, "KQ_mask_swa", -1);
         ggml_set_input(lctx.inp_KQ_mask_swa);
@@ -8766,6 +9801,20 @@ struct llm_build_context {
         return flash_attn ? ggml_cast(ctx0, lctx.inp_KQ_mask_swa, GGML_TYPE_F16) : lctx.inp_KQ_mask_swa;
     }
 
+    // llm_build_kv for layer il of a model with sliding-window attention: the K/V of the SWA layers are in lctx.kv_swa
+    // when it is allocated, otherwise n_swa tells flash attention that only the last cells of kv_self can be in the window
+    struct ggml_tensor * build_kv_swa(struct ggml_cgraph * gf, ggml_tensor * wo, ggml_tensor * wo_b,
+            ggml_tensor * k_cur, ggml_tensor * v_cur, ggml_tensor * q_cur, ggml_tensor * kq_mask, float kq_scale, int il,
+            ggml_tensor * sinks = nullptr) {
+        const bool is_swa = hparams.is_swa(il);
+        if (is_swa && kv_swa.size > 0) {
+            return llm_build_kv(ctx0, lctx, kv_swa, gf, wo, wo_b, k_cur, v_cur, q_cur, kq_mask, n_tokens, kv_head_swa, n_kv_swa,
+                    kq_scale, cb, il, sinks);
+        }
+        return llm_build_kv(ctx0, lctx, kv_self, gf, wo, wo_b, k_cur, v_cur, q_cur, kq_mask, n_tokens, kv_head, n_kv,
+                kq_scale, cb, il, sinks, is_swa ? hparams.n_swa : 0);
+    }
+
     struct ggml_tensor * build_inp_mean() {
         lctx.inp_mean = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, n_tokens);
         cb(lctx.inp_mean, "inp_mean", -1);
@@ -12375,10 +13424,7 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf,
-                        model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f, cb, il, nullptr,
-                        KQ_mask_l == KQ_mask_swa ? hparams.n_swa : 0);
+                cur = build_kv_swa(gf, model.layers[il].wo, NULL, Kcur, Vcur, Qcur, KQ_mask_l, 1.0f, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams,
@@ -12508,9 +13554,7 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf, model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, hparams.f_attention_scale, cb, il, nullptr,
-                        KQ_mask_l == KQ_mask_swa ? hparams.n_swa : 0);
+                cur = build_kv_swa(gf, model.layers[il].wo, NULL, Kcur, Vcur, Qcur, KQ_mask_l, hparams.f_attention_scale, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams, model.layers[il].attn_post_norm, NULL, LLM_NORM_RMS, cb, il);
@@ -13598,7 +14642,8 @@ struct llm_build_context {
                         cb(kv_cache_trans_view, "kv_cache_trans_view", il);
 
                         // note: storing transposed c^KV in the transposed KV cache
-                        ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_transpose(ctx0, kv_compressed), kv_cache_trans_view));
+                        llm_build_kv_store_view(ctx0, lctx, gf, ggml_transpose(ctx0, kv_compressed), kv_cache_trans_view,
+                                ggml_is_quantized(kv_self.v_l[il]->type) ? 0 : ggml_row_size(kv_self.v_l[il]->type, 1));
 
                         kv_cache_trans = ggml_view_2d(ctx0, kv_self.v_l[il],
                                 n_kv, kv_lora_rank,
@@ -13614,7 +14659,7 @@ struct llm_build_context {
                     auto row_size = ggml_row_size(kv_self.k_l[il]->type, kv_lora_rank + n_embd_head_qk_rope);
                     ggml_tensor * kv_cache_view = ggml_view_2d(ctx0, kv_self.k_l[il], kv_self.k_l[il]->ne[0], n_tokens,
                             row_size, row_size*kv_head);
-                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, kvr, kv_cache_view));
+                    llm_build_kv_store_view(ctx0, lctx, gf, kvr, kv_cache_view, row_size);
                     ggml_tensor * kv_cache = ggml_view_2d(ctx0, kv_self.k_l[il],
                             kv_lora_rank + n_embd_head_qk_rope, n_kv,
                             ggml_row_size(kv_self.k_l[il]->type, kv_lora_rank + n_embd_head_qk_rope), 0);
@@ -14479,9 +15524,8 @@ struct llm_build_context {
                     cb(Kcur, "Kcur", il);
                 }
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf, model.layers[il].wo, model.layers[il].bo, Kcur, Vcur, Qcur,
-                                   KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f / sqrtf(float(n_embd_head)), cb, il, nullptr,
-                                   is_sliding ? hparams.n_swa : 0);
+                cur = build_kv_swa(gf, model.layers[il].wo, model.layers[il].bo, Kcur, Vcur, Qcur,
+                                   KQ_mask_l, 1.0f / sqrtf(float(n_embd_head)), il);
             }
 
             if (il == n_layer - 1) {
@@ -14697,7 +15741,8 @@ struct llm_build_context {
                                                                          model.layers[il].wk, nullptr,
                                                                          model.layers[il].wv, nullptr, 0, il);
 
-                llm_build_kv_store(ctx0, hparams, cparams, kv_self, gf, Kcur, Vcur, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, lctx, hparams, cparams, kv_self, gf, Kcur, Vcur, n_tokens, kv_head, cb, il,
+                        llm_build_inp_kv_cells(ctx0, lctx, kv_self, n_tokens, cb));
 
                 struct ggml_tensor * k =
                     ggml_view_3d(ctx0, kv_self.k_l[il],
@@ -15821,9 +16866,8 @@ struct llm_build_context {
                                     attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf, model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, kq_scale, cb, il, model.layers[il].attn_sinks,
-                        is_sliding ? hparams.n_swa : 0);
+                cur = build_kv_swa(gf, model.layers[il].wo, model.layers[il].bo,
+                        Kcur, Vcur, Qcur, KQ_mask_l, kq_scale, il, model.layers[il].attn_sinks);
 
                 cb(cur, "attn_out", il);
             }
@@ -15880,7 +16924,7 @@ struct llm_build_context {
     }
 };
 
-static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const std::vector<uint32_t> & ids) {
+static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
     llama_batch dummy;
     dummy.n_tokens = 0;
 
@@ -15890,7 +16934,7 @@ static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const
 
     llm.init();
 
-    struct ggml_cgraph * result = llm.build_defrag(ids);
+    struct ggml_cgraph * result = llm.build_defrag(kv, ids);
 
     llm.free();
 
@@ -15941,6 +16985,8 @@ static struct ggml_cgraph * llama_build_graph(
     auto tim1 = ggml_time_us();
 #endif
 
+    lctx.kv_store_views.clear();
+
     // this callback allows us to apply custom logic to each tensor (e.g. ggml-alloc, offloading, etc.)
     llm_build_cb cb = [&](struct ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -16228,7 +17274,13 @@ static void llama_set_k_shift(llama_context & lctx) {
     int32_t * data = (int32_t *) lctx.inp_K_shift->data;
 
     for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].delta;
+        data[i] = lctx.kv_self.cells.delta[i];
+    }
+
+    if (lctx.inp_K_shift_swa) {
+        assert(ggml_backend_buffer_is_host(lctx.inp_K_shift_swa->buffer));
+
+        std::copy_n(lctx.kv_swa.cells.delta.begin(), lctx.kv_swa.size, (int32_t *) lctx.inp_K_shift_swa->data);
     }
 }
 
@@ -16240,7 +17292,7 @@ static void llama_set_s_copy(llama_context & lctx) {
     int32_t * data = (int32_t *) lctx.inp_s_copy->data;
 
     for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].src;
+        data[i] = lctx.kv_self.cells.src[i];
     }
 }
 
@@ -16268,6 +17320,45 @@ static int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t
     return relative_bucket;
 }
 
+// causal KQ mask row of a token of sequence seq_id at position pos over the first n_kv cells
+// returns false if the sequence has cells past pos
+static bool llama_kq_mask_row(const llama_kv_cells & cells, llama_seq_id seq_id, llama_pos pos, bool alibi, int64_t n_kv, float * row) {
+    if ((uint32_t) seq_id >= 64*cells.n_words) {
+        std::fill_n(row, n_kv, -INFINITY);
+        return true;
+    }
+
+    // branch-free, so that the compiler can vectorize it
+    const uint64_t  * seq   = cells.seq.data() + seq_id/64;
+    const llama_pos * cpos  = cells.pos.data();
+    const uint32_t    nw    = cells.n_words;
+    const uint32_t    shift = seq_id%64;
+
+    int n_past = 0;
+    for (int64_t i = 0; i < n_kv; ++i) {
+        const int in_seq = (seq[i*nw] >> shift) & 1;
+        const int past   = cpos[i] > pos;
+        n_past += in_seq & past;
+        const float f = alibi ? -std::abs(cpos[i] - pos) : 0.0f;
+        row[i] = in_seq & !past ? f : -INFINITY;
+    }
+
+    return n_past == 0;
+}
+
+// causal KQ mask row over the cells ids[0..n_kv) gathered from a paged cache (-1: padding)
+static void llama_kq_mask_row_gather(const llama_kv_cells & cells, const int32_t * ids, llama_seq_id seq_id, llama_pos pos, bool alibi,
+        int64_t n_kv, float * row) {
+    for (int64_t i = 0; i < n_kv; ++i) {
+        const int32_t c = ids[i];
+        if (c < 0 || cells.pos[c] > pos || !cells.seq_has(c, seq_id)) {
+            row[i] = -INFINITY;
+        } else {
+            row[i] = alibi ? -std::abs(cells.pos[c] - pos) : 0.0f;
+        }
+    }
+}
+
 static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
     //
     // set input data
@@ -16321,6 +17412,16 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
         ggml_backend_tensor_set(lctx.inp_scale, lctx.scale_data.data(), 0, n_tokens*n_pos_per_token*ggml_element_size(lctx.inp_scale));
     }
 
+    if (lctx.inp_kv_cells) {
+        GGML_ASSERT(lctx.kv_self.slot.size() == (size_t) batch.n_tokens);
+        ggml_backend_tensor_set(lctx.inp_kv_cells, lctx.kv_self.slot.data(), 0, batch.n_tokens*ggml_element_size(lctx.inp_kv_cells));
+    }
+
+    if (lctx.inp_kv_gather) {
+        GGML_ASSERT(lctx.kv_self.gather.size() == (size_t) ggml_nelements(lctx.inp_kv_gather));
+        ggml_backend_tensor_set(lctx.inp_kv_gather, lctx.kv_self.gather.data(), 0, ggml_nbytes(lctx.inp_kv_gather));
+    }
+
     if (hparams.causal_attn || cparams.pooling_type == LLAMA_POOLING_TYPE_NONE) {
         GGML_ASSERT(lctx.inp_out_ids && "every model that can must skip unused outputs");
         const int64_t n_tokens = batch.n_tokens;
@@ -16361,7 +17462,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
         if (cparams.causal_attn && !lctx.is_encoding) {
             const int64_t n_kv     = kv_self.n;
             const int64_t n_tokens = batch.n_tokens;
-
+            const int64_t n_rows   = GGML_PAD(n_tokens, GGML_KQ_MASK_PAD);
 
             float * data     = nullptr;
             float * data_swa = nullptr;
@@ -16376,62 +17477,122 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
                 data_swa = (float *) lctx.inp_KQ_mask_swa->data;
             }
 
+            auto & cells = lctx.kv_self.cells;
+            auto & cache = lctx.kq_mask_cache;
+
+            // the columns of a paged cache are the gathered cells, which change with every ubatch
+            const int32_t * ids = kv_self.block_size > 0 ? kv_self.gather.data() : nullptr;
+
             // For causal attention, use only the previous KV cells
             // of the correct sequence for each token of the batch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const llama_pos    pos    = batch.pos[j];
-                    const llama_seq_id seq_id = batch.seq_id[j][0];
+            //
+            // The mask of small ubatches (token generation) is kept in lctx.kq_mask_cache. If every token of the
+            // next ubatch continues the sequence of the same row, and that sequence had no cells past the previous
+            // position, the mask only differs in the columns of the cells that changed in between.
+            const bool use_cache = n_tokens <= GGML_KQ_MASK_PAD && !hparams.use_alibi && !ids;
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        float f;
-                        if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
-                            f = -INFINITY;
-                        } else {
-                            if (hparams.use_alibi) {
-                                f = -std::abs(lctx.kv_self.cells[i].pos - pos);
-                            } else {
-                                f = 0.0f;
-                            }
-                        }
+            bool incremental = use_cache && !cells.all_changed && cache.n_kv == n_kv && (int64_t) cache.seq.size() == n_tokens;
+            for (int64_t j = 0; j < n_tokens && incremental; ++j) {
+                incremental = batch.seq_id[j][0] == cache.seq[j] && batch.pos[j] >= cache.pos[j];
+            }
 
-                        if (data) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = f;
-                        }
+            float * mask = nullptr;
 
-                        // may need to cut off old tokens for sliding window
-                        if (data_swa) {
-                            if (hparams.n_attn_chunk) {
-                                llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (lctx.kv_self.cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
-                                    f = -INFINITY;
-                                }
-                            } else {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                            }
-                            data_swa[h*(n_kv*n_tokens) + j*n_kv + i] = f;
+            if (incremental) {
+                mask = cache.data.data();
+                std::copy_n(batch.pos, n_tokens, cache.pos.begin());
+                for (const uint32_t i : cells.changed) {
+                    if (i >= n_kv) {
+                        continue;
+                    }
+                    for (int64_t j = 0; j < n_tokens; ++j) {
+                        const bool in_seq = cells.seq_has(i, cache.seq[j]);
+                        const bool past   = cells.pos[i] > batch.pos[j];
+                        mask[j*n_kv + i] = in_seq && !past ? 0.0f : -INFINITY;
+                        if (in_seq && past) {
+                            cache.pos[j] = std::numeric_limits<llama_pos>::max();
                         }
                     }
                 }
+            } else {
+                if (use_cache) {
+                    cache.data.resize(n_kv*n_rows);
+                    cache.seq.resize(n_tokens);
+                    cache.pos.resize(n_tokens);
+                    mask = cache.data.data();
+                } else {
+                    mask = data ? data : data_swa;
+                }
+                for (int64_t j = 0; j < n_tokens; ++j) {
+                    const llama_pos    pos    = batch.pos[j];
+                    const llama_seq_id seq_id = batch.seq_id[j][0];
 
-                if (data) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                        }
+                    if (ids) {
+                        llama_kq_mask_row_gather(cells, ids, seq_id, pos, hparams.use_alibi, n_kv, mask + j*n_kv);
+                        continue;
+                    }
+
+                    const bool complete = llama_kq_mask_row(cells, seq_id, pos, hparams.use_alibi, n_kv, mask + j*n_kv);
+
+                    if (use_cache) {
+                        cache.seq[j] = seq_id;
+                        cache.pos[j] = complete ? pos : std::numeric_limits<llama_pos>::max();
                     }
                 }
+                std::fill(mask + n_tokens*n_kv, mask + n_rows*n_kv, -INFINITY);
+            }
+
+            cache.n_kv = use_cache ? n_kv : 0;
+            cells.changed.clear();
+            cells.all_changed = false;
+
+            if (data && data != mask) {
+                memcpy(data, mask, n_kv*n_rows*sizeof(float));
+            }
+
+            if (data_swa && lctx.kv_swa.size > 0) {
+                // the sliding-window layers attend the cells of the windowed cache instead
+                const int64_t n_kv_swa = lctx.kv_swa.n;
+                const auto & cells_swa = lctx.kv_swa.cells;
 
-                if (data_swa) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data_swa[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
+                for (int64_t j = 0; j < n_tokens; ++j) {
+                    const llama_pos    pos    = batch.pos[j];
+                    const llama_seq_id seq_id = batch.seq_id[j][0];
+
+                    for (int64_t i = 0; i < n_kv_swa; ++i) {
+                        const llama_pos p = cells_swa.pos[i];
+                        const bool in_window = p >= 0 && p <= pos && pos - p < (llama_pos) hparams.n_swa;
+                        data_swa[j*n_kv_swa + i] = in_window && cells_swa.seq_has(i, seq_id) ? 0.0f : -INFINITY;
+                    }
+                }
+                std::fill(data_swa + n_tokens*n_kv_swa, data_swa + n_rows*n_kv_swa, -INFINITY);
+            } else if (data_swa) {
+                // may need to cut off old tokens for sliding window
+                for (int64_t j = 0; j < n_tokens; ++j) {
+                    const llama_pos pos = batch.pos[j];
+
+                    for (int64_t i = 0; i < n_kv; ++i) {
+                        float f = mask[j*n_kv + i];
+                        // (the padding of the gathered cells is masked already)
+                        const llama_pos p = ids ? cells.pos[std::max(ids[i], 0)] : cells.pos[i];
+                        if (hparams.n_attn_chunk) {
+                            llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
+                            if (p < pos_chunk_start || pos < pos_chunk_start) {
+                                f = -INFINITY;
+                            }
+                        } else {
+                            if (pos - p >= (int32_t)hparams.n_swa) {
+                                f = -INFINITY;
+                            }
                         }
+                        data_swa[j*n_kv + i] = f;
                     }
                 }
+
+                if (data_swa != mask) {
+                    std::fill(data_swa + n_tokens*n_kv, data_swa + n_rows*n_kv, -INFINITY);
+                }
             }
         } else {
             // when using kv cache, the mask needs to match the kv cache size
@@ -16563,15 +17724,15 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
 
             // states which are not affected by the current batch are left untouched
             for (int i = 0; i < n_kv; ++i) {
-                llama_seq_id    seq_id       = i + lctx.kv_self.head;
-                llama_kv_cell & kv_cell      = lctx.kv_self.cells[seq_id];
-                bool            has_self_seq = kv_cell.has_seq_id(seq_id);
+                llama_seq_id     seq_id       = i + lctx.kv_self.head;
+                llama_kv_cells & kv_cells     = lctx.kv_self.cells;
+                bool             has_self_seq = kv_cells.seq_has(seq_id, seq_id);
 
                 data[i] = (float) has_self_seq;
 
                 // ensure current sequences will be kept
-                if (!has_self_seq && kv_cell.pos >= 0) {
-                    kv_cell.seq_id.insert(seq_id);
+                if (!has_self_seq && kv_cells.pos[seq_id] >= 0) {
+                    kv_cells.seq_add(seq_id, seq_id);
                 }
             }
         }
@@ -16613,7 +17774,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
             for (int h = 0; h < 1; ++h) {
                 for (int j = 0; j < n_tokens; ++j) {
                     for (int i = 0; i < n_kv; ++i) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells[i].pos, batch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
+                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells.pos[i], batch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
                     }
                 }
             }
@@ -16763,6 +17924,129 @@ static void llama_graph_compute(
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
 }
 
+// count the experts selected by the graph that was just computed
+static void llama_update_expert_counts(llama_context & lctx) {
+    const int n_expert = lctx.model.hparams.n_expert;
+    std::vector<int32_t> ids;
+    for (const auto & [il, selected] : lctx.expert_ids) {
+        const int64_t n_used   = selected->ne[0];
+        const int64_t n_tokens = selected->ne[1];
+        const int64_t stride   = selected->nb[1]/sizeof(int32_t);
+        ids.resize(ggml_nbytes(selected)/sizeof(int32_t));
+        ggml_backend_tensor_get(selected, ids.data(), 0, ggml_nbytes(selected));
+        uint64_t * counts = lctx.expert_counts.data() + size_t(il)*n_expert;
+        for (int64_t it = 0; it < n_tokens; ++it) {
+            for (int64_t j = 0; j < n_used; ++j) {
+                const int32_t ie = ids[it*stride + j];
+                if (ie >= 0 && ie < n_expert) { // SER may leave some slots unused
+                    ++counts[ie];
+                }
+            }
+        }
+    }
+}
+
+// the number of distinct sequences of a ubatch, and whether they all have the same number of tokens
+static void llama_graph_cache_seq_layout(const llama_batch & batch, int32_t & n_seqs, bool & equal_seqs) {
+    // a ubatch has few sequences, so a linear search is fine
+    std::vector<std::pair<llama_seq_id, int32_t>> counts;
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        for (int32_t j = 0; j < batch.n_seq_id[i]; ++j) {
+            const llama_seq_id seq_id = batch.seq_id[i][j];
+            auto it = std::find_if(counts.begin(), counts.end(), [seq_id](const auto & c) { return c.first == seq_id; });
+            if (it == counts.end()) {
+                counts.emplace_back(seq_id, 1);
+            } else {
+                ++it->second;
+            }
+        }
+    }
+    n_seqs     = counts.size();
+    equal_seqs = std::all_of(counts.begin(), counts.end(), [&](const auto & c) { return c.second == counts[0].second; });
+}
+
+// remember the graph that was just built and allocated for the next ubatch, if it can be reused at all
+static void llama_graph_cache_store(llama_context & lctx, ggml_cgraph * gf, const llama_batch & batch) {
+    const auto & kv_self = lctx.kv_self;
+    auto & cache = lctx.graph_cache;
+
+    // the KV store offsets are derived from kv_head below, so they cannot be recovered from a graph built for kv_head = 0
+    // (n_eval == 0 also excludes the warmup graph, which uses all experts)
+    // a paged KV cache has no KV store offsets, its cells are an input of the graph
+    // (the cells of the windowed SWA cache are not at kv_head)
+    if (kv_self.recurrent || lctx.kv_swa.size > 0 || !lctx.cparams.causal_attn || llama_model_has_encoder(&lctx.model) ||
+        lctx.n_eval == 0 || (kv_self.head == 0 && kv_self.block_size == 0) || ggml_backend_sched_get_n_copies(lctx.sched) > 1) {
+        return;
+    }
+
+    // every copy into a cache tensor writes the new tokens at kv_head, at an offset of kv_head times the size of a cache cell,
+    // which llm_build_kv_store_view recorded
+    cache.kv_stores.clear();
+    if (kv_self.block_size == 0) {
+        for (const auto & [t, cell_size] : lctx.kv_store_views) {
+            if (cell_size == 0) {
+                return;
+            }
+        }
+
+        // a graph that copies into the cache some other way cannot be moved
+        size_t n_stores = 0;
+        for (int i = 0; i < gf->n_nodes; ++i) {
+            const ggml_tensor * node = gf->nodes[i];
+            if (node->op == GGML_OP_CPY && node->view_src &&
+                (std::find(kv_self.k_l.begin(), kv_self.k_l.end(), node->view_src) != kv_self.k_l.end() ||
+                 std::find(kv_self.v_l.begin(), kv_self.v_l.end(), node->view_src) != kv_self.v_l.end())) {
+                ++n_stores;
+            }
+        }
+        if (2*n_stores != lctx.kv_store_views.size()) {
+            return;
+        }
+
+        cache.kv_stores = lctx.kv_store_views;
+    }
+
+    cache.gf        = gf;
+    cache.n_tokens  = batch.n_tokens;
+    cache.n_outputs = lctx.n_outputs;
+    cache.n_kv      = kv_self.n;
+    cache.embd      = batch.embd != nullptr;
+    llama_graph_cache_seq_layout(batch, cache.n_seqs, cache.equal_seqs);
+}
+
+// the cached graph with its KV stores moved to the current kv_head if the ubatch has the same topology, nullptr otherwise
+// the graph stays allocated, only the inputs have to be set
+static ggml_cgraph * llama_graph_cache_reuse(llama_context & lctx, const llama_batch & batch) {
+    auto & cache = lctx.graph_cache;
+    if (!cache.gf || cache.n_tokens != batch.n_tokens || cache.n_outputs != lctx.n_outputs ||
+        cache.n_kv != lctx.kv_self.n || cache.embd != (batch.embd != nullptr)) {
+        return nullptr;
+    }
+
+    int32_t n_seqs;
+    bool    equal_seqs;
+    llama_graph_cache_seq_layout(batch, n_seqs, equal_seqs);
+    if (cache.n_seqs != n_seqs || cache.equal_seqs != equal_seqs) {
+        return nullptr;
+    }
+
+    for (auto & [t, cell_size] : cache.kv_stores) {
+        t->view_offs = cell_size*lctx.kv_self.head;
+        t->data      = (char *)t->view_src->data + t->view_offs;
+    }
+
+    return cache.gf;
+}
+
+// wait for the batch started by llama_decode_async, if any, and keep its result for llama_decode_wait
+static void llama_decode_join(llama_context & lctx) {
+    if (!lctx.decode_worker.joinable()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(lctx.decode_mutex);
+    lctx.decode_cv.wait(lock, [&] { return !lctx.decode_pending; });
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -16794,12 +18078,24 @@ static int llama_decode_internal(
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
 
+    if (batch_all.seq_id) {
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            for (int32_t s = 0; s < batch_all.n_seq_id[i]; ++s) {
+                if (batch_all.seq_id[i][s] < 0) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id[%u][%d] = %d < 0\n", __func__, i, s, batch_all.seq_id[i][s]);
+                    return -1;
+                }
+            }
+        }
+    }
+
     if (lctx.t_compute_start_us == 0) {
         lctx.t_compute_start_us = ggml_time_us();
     }
     lctx.n_queued_tokens += n_tokens_all;
 
     auto & kv_self = lctx.kv_self;
+    auto & kv_swa  = lctx.kv_swa;
 
     const int64_t n_embd  = hparams.n_embd;
     const int64_t n_vocab = hparams.n_vocab;
@@ -16928,7 +18224,29 @@ static int llama_decode_internal(
                 kv_self.head = 0;
             }
 
+            if (kv_swa.size > 0) {
+                llama_kv_cache_swa_prune(kv_swa, u_batch, hparams.n_swa);
+
+                if (!llama_kv_cache_find_slot(kv_swa, u_batch)) {
+                    // the free cells of the windowed cache are scattered, compact it and try again
+                    do {
+                        llama_kv_cache_defrag(kv_swa);
+                        llama_kv_cache_update(&lctx);
+                    } while (kv_swa.do_defrag);
+
+                    if (!llama_kv_cache_find_slot(kv_swa, u_batch)) {
+                        return 1;
+                    }
+                }
+            }
+
             if (!llama_kv_cache_find_slot(kv_self, u_batch)) {
+                if (kv_swa.size > 0) {
+                    for (uint32_t i = 0; i < n_tokens; ++i) {
+                        kv_swa.cells.rm(kv_swa.head + i);
+                    }
+                    kv_swa.used -= n_tokens;
+                }
                 return 1;
             }
 
@@ -16937,17 +18255,29 @@ static int llama_decode_internal(
                 // after enough generations, the benefit from this heuristic disappears
                 // if we start defragmenting the cache, the benefit from this will be more important
                 const uint32_t pad = llama_kv_cache_get_padding(cparams);
-                kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
+                if (kv_self.block_size > 0) {
+                    llama_kv_cache_gather(kv_self, u_batch, pad);
+                } else {
+                    kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
+                }
                 //kv_self.n = llama_kv_cache_cell_max(kv_self);
+                if (kv_swa.size > 0) {
+                    kv_swa.n = std::min(kv_swa.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_swa), pad)));
+                }
             }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched);
-        ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+        ggml_cgraph * gf = llama_graph_cache_reuse(lctx, u_batch);
+        const bool graph_reused = gf != nullptr;
 
-        ggml_cgraph * gf = llama_build_graph(lctx, u_batch, false);
+        if (!graph_reused) {
+            ggml_backend_sched_reset(lctx.sched);
+            ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+
+            gf = llama_build_graph(lctx, u_batch, false);
+        }
 
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = gf->nodes[gf->n_nodes - 1];
@@ -16973,14 +18303,21 @@ static int llama_decode_internal(
         }
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
-        ggml_backend_sched_alloc_graph(lctx.sched, gf);
+        if (!graph_reused) {
+            ggml_backend_sched_alloc_graph(lctx.sched, gf);
+            llama_graph_cache_store(lctx, gf, u_batch);
+        }
 
         llama_set_inputs(lctx, u_batch);
 
         llama_graph_compute(lctx, gf, n_threads);
 
+        if (!lctx.expert_ids.empty()) {
+            llama_update_expert_counts(lctx);
+        }
+
         // update the kv ring buffer
-        {
+        if (kv_self.block_size == 0) {
             kv_self.head += n_tokens;
 
             // Ensure kv cache head points to a valid index.
@@ -16988,6 +18325,12 @@ static int llama_decode_internal(
                 kv_self.head = 0;
             }
         }
+        if (kv_swa.size > 0) {
+            kv_swa.head += n_tokens;
+            if (kv_swa.head >= kv_swa.size) {
+                kv_swa.head = 0;
+            }
+        }
 
         // plot the computation graph in dot format (for debugging purposes)
         //if (n_past%100 == 0) {
@@ -17062,7 +18405,8 @@ static int llama_decode_internal(
     //llama_synchronize(&lctx);
 
     // decide if we need to defrag the kv cache
-    if (cparams.causal_attn && cparams.defrag_thold >= 0.0f) {
+    // (a paged cache does not need contiguous free cells, and its attention only runs over the blocks of the ubatch sequences)
+    if (cparams.causal_attn && cparams.defrag_thold >= 0.0f && kv_self.block_size == 0) {
         const float fragmentation = kv_self.n >= 128 ? 1.0f - float(kv_self.used)/float(kv_self.n) : 0.0f;
 
         // queue defragmentation for next llama_kv_cache_update
@@ -17075,7 +18419,10 @@ static int llama_decode_internal(
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched);
+    // (a cached graph has to stay allocated)
+    if (!lctx.graph_cache.gf) {
+        ggml_backend_sched_reset(lctx.sched);
+    }
 
     return 0;
 }
@@ -17262,9 +18609,65 @@ static int llama_encode_internal(
     return 0;
 }
 
+// move the K and V rows of the KV cells directly in host memory, cell i moves to ids[i] (see build_defrag)
+// unlike the graph defrag, this does not need the scheduler, so the cached decode graph stays valid
+static void llama_kv_cache_defrag_host(struct llama_context & lctx, const struct llama_kv_cache & kv_self, const std::vector<uint32_t> & ids) {
+    const auto & hparams = lctx.model.hparams;
+
+    const uint32_t n_kv = ids.size();
+
+    for (uint32_t i = 0; i < n_kv; ++i) {
+        const uint32_t id = ids[i];
+
+        if (i == id || id == n_kv) {
+            continue;
+        }
+
+        uint32_t nm = 1;
+
+        while (i + nm < n_kv && ids[i + nm] == id + nm) {
+            nm++;
+        }
+
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            if (!kv_self.k_l[il]) {
+                continue;
+            }
+
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            ggml_tensor * k = kv_self.k_l[il];
+
+            const size_t k_size_row = ggml_row_size(k->type, n_embd_k_gqa);
+            memcpy((char *) k->data + id*k_size_row, (const char *) k->data + i*k_size_row, nm*k_size_row);
+
+            // note: with MLA the V cache may not be present
+            if (kv_self.v_l.size() > il && kv_self.v_l[il]) {
+                ggml_tensor * v = kv_self.v_l[il];
+
+                if (lctx.cparams.flash_attn) {
+                    const size_t v_size_row = ggml_row_size(v->type, n_embd_v_gqa);
+                    memcpy((char *) v->data + id*v_size_row, (const char *) v->data + i*v_size_row, nm*v_size_row);
+                } else {
+                    // the V cache is transposed
+                    const size_t v_stride = ggml_row_size(v->type, kv_self.size);
+                    for (int64_t j = 0; j < n_embd_v_gqa; ++j) {
+                        memcpy((char *) v->data + j*v_stride + ggml_row_size(v->type, id),
+                               (const char *) v->data + j*v_stride + ggml_row_size(v->type, i), ggml_row_size(v->type, nm));
+                    }
+                }
+            }
+        }
+
+        i += nm - 1;
+    }
+}
+
 // find holes from the beginning of the KV cache and fill them by moving data from the end of the cache
-static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
-    auto & kv_self = lctx.kv_self;
+// at most max_cells cells are moved per call (0 = no limit), returns true if the cache is not fully defragmented yet
+// sets need_reserve when the moves were done with a graph (the compute buffers then have to be reserved again)
+static bool llama_kv_cache_defrag_internal(struct llama_context & lctx, struct llama_kv_cache & kv_self, uint32_t max_cells, bool & need_reserve) {
 
     const auto & hparams = lctx.model.hparams;
 
@@ -17275,7 +18678,18 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
     assert(n_used <= n_kv);
 
-    //const int64_t t_start = ggml_time_us();
+    const int64_t t_start_us = ggml_time_us();
+
+    // with the cache in host memory the rows are moved with memcpy instead of a graph
+    bool host = true;
+    for (uint32_t il = 0; il < n_layer; ++il) {
+        if (kv_self.k_l[il]) {
+            host = host && ggml_backend_buffer_is_host(kv_self.k_l[il]->buffer);
+        }
+        if (kv_self.v_l.size() > il && kv_self.v_l[il]) {
+            host = host && ggml_backend_buffer_is_host(kv_self.v_l[il]->buffer);
+        }
+    }
 
     // number of cells moved
     uint32_t n_moves = 0;
@@ -17285,7 +18699,14 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     //   - x2 for keys and values
     //const uint32_t max_moves = llama_model_max_nodes(model)/(6*n_layer);
     // TODO: tmp fix https://github.com/ggerganov/llama.cpp/issues/6685#issuecomment-2057579516
-    const uint32_t max_moves = (llama_model_max_nodes(lctx.model) - 2*n_layer)/(6*n_layer);
+    const uint32_t max_moves = host ? n_kv : (llama_model_max_nodes(lctx.model) - 2*n_layer)/(6*n_layer);
+
+    // bound on the cells moved by this call, the next ones continue from where it stopped
+    if (max_cells == 0) {
+        max_cells = n_kv;
+    }
+
+    uint32_t n_cells = 0;
 
     // determine which KV cells to move where
     //
@@ -17295,10 +18716,10 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     //
     std::vector<uint32_t> ids(n_kv, n_kv);
 
-    for (uint32_t i0 = 0; i0 < n_used; ++i0) {
-        const auto & cell0 = kv_self.cells[i0];
+    bool stop = false;
 
-        if (!cell0.is_empty()) {
+    for (uint32_t i0 = 0; i0 < n_used; ++i0) {
+        if (!kv_self.cells.is_empty(i0)) {
             ids[i0] = i0;
 
             continue;
@@ -17309,7 +18730,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
         uint32_t nh = 1;
 
         // determine the size of the hole
-        while (i0 + nh < n_used && kv_self.cells[i0 + nh].is_empty()) {
+        while (i0 + nh < n_used && kv_self.cells.is_empty(i0 + nh)) {
             nh++;
         }
 
@@ -17318,9 +18739,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
         // starting from the end, find nh non-empty cells
         for (; is > i0; --is) {
-            const auto & cell1 = kv_self.cells[is];
-
-            if (cell1.is_empty() || ids[is] != n_kv) {
+            if (kv_self.cells.is_empty(is) || ids[is] != n_kv) {
                 continue;
             }
 
@@ -17342,14 +18761,9 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
         // are we moving a continuous block of memory?
         bool cont = false;
 
-        // should we stop searching for the next move?
-        bool stop = false;
-
         // go back and move the nf cells to the hole
         for (; i1 < n_kv; ++i1) {
-            auto & cell1 = kv_self.cells[i1];
-
-            if (cell1.is_empty() || ids[i1] != n_kv) {
+            if (kv_self.cells.is_empty(i1) || ids[i1] != n_kv) {
                 if (n_moves == max_moves) {
                     stop = true;
                     break;
@@ -17359,14 +18773,16 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
                 continue;
             }
 
+            if (n_cells == max_cells || (!cont && n_moves == max_moves)) {
+                stop = true;
+                break;
+            }
+
             // this cell goes to (i0 + nf)
             ids[i1] = i0 + nf;
 
-            // move the cell meta data
-            kv_self.cells[i0 + nf] = cell1;
-
-            // clear the old cell and move the head there
-            cell1 = llama_kv_cell();
+            // move the cell meta data and clear the old cell, then move the head there
+            kv_self.cells.mv(i1, i0 + nf);
             kv_self.head = n_used;
 
             if (!cont) {
@@ -17375,13 +18791,14 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
             }
 
             nf++;
+            n_cells++;
 
             if (nf == nh) {
                 break;
             }
         }
 
-        if (stop || n_moves == max_moves) {
+        if (stop) {
             break;
         }
 
@@ -17391,7 +18808,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     }
 
     if (n_moves == 0) {
-        return;
+        return false;
     }
 
     //LLAMA_LOG_INFO("(tmp log) KV defrag cell moves: %u\n", n_moves);
@@ -17469,25 +18886,32 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
         ggml_backend_tensor_set(kv_self.v_l[il], buf_v.data(), 0, buf_v.size());
     }
 #else
-    // ggml_graph defrag
+    if (host) {
+        llama_kv_cache_defrag_host(lctx, kv_self, ids);
+    } else {
+        // ggml_graph defrag
 
-    ggml_backend_sched_reset(lctx.sched);
+        ggml_backend_sched_reset(lctx.sched);
+
+        ggml_cgraph * gf = llama_build_graph_defrag(lctx, kv_self, ids);
 
-    ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
+        llama_graph_compute(lctx, gf, lctx.cparams.n_threads);
 
-    llama_graph_compute(lctx, gf, lctx.cparams.n_threads);
+        need_reserve = true;
+    }
 #endif
 
-    //const int64_t t_end = ggml_time_us();
+    lctx.t_defrag_us += ggml_time_us() - t_start_us;
+    lctx.n_defrag++;
 
-    //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
+    return stop;
 }
 
 static int32_t llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
     // apply K-shift if needed
-    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
+    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && (lctx.kv_self.has_shift || lctx.kv_swa.has_shift)) {
         if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
             return 1;
         }
@@ -17506,14 +18930,10 @@ static int32_t llama_kv_cache_update_internal(struct llama_context & lctx) {
             need_reserve = true;
         }
 
-        {
-            auto & kv_self = lctx.kv_self;
+        for (auto * kv : { &lctx.kv_self, &lctx.kv_swa }) {
+            kv->has_shift = false;
 
-            kv_self.has_shift = false;
-
-            for (uint32_t i = 0; i < kv_self.size; ++i) {
-                kv_self.cells[i].delta = 0;
-            }
+            std::fill(kv->cells.delta.begin(), kv->cells.delta.end(), 0);
         }
     }
 
@@ -17538,18 +18958,19 @@ static int32_t llama_kv_cache_update_internal(struct llama_context & lctx) {
             kv_self.do_copy = false;
 
             for (uint32_t i = 0; i < kv_self.size; ++i) {
-                kv_self.cells[i].src = i;
+                kv_self.cells.src[i] = i;
             }
         }
     }
 
     // defragment the KV cache if needed
     if (lctx.kv_self.do_defrag) {
-        llama_kv_cache_defrag_internal(lctx);
-
-        need_reserve = true;
-
-        lctx.kv_self.do_defrag = false;
+        // with cparams.defrag_max_cells, keep going on the next update until the cache is compact
+        lctx.kv_self.do_defrag = llama_kv_cache_defrag_internal(lctx, lctx.kv_self, lctx.cparams.defrag_max_cells, need_reserve);
+        llama_kv_cache_update_blocks(lctx.kv_self);
+    }
+    if (lctx.kv_swa.do_defrag) {
+        lctx.kv_swa.do_defrag = llama_kv_cache_defrag_internal(lctx, lctx.kv_swa, lctx.cparams.defrag_max_cells, need_reserve);
     }
 
     // reserve a worst case graph again
@@ -19233,6 +20654,7 @@ int32_t llama_lora_adapter_set(
         return -1;
     }
     ctx->lora_adapters[adapter] = scale;
+    ctx->graph_cache.gf = nullptr;
     return 0;
 }
 
@@ -19242,6 +20664,7 @@ int32_t llama_lora_adapter_remove(
     auto pos = ctx->lora_adapters.find(adapter);
     if (pos != ctx->lora_adapters.end()) {
         ctx->lora_adapters.erase(pos);
+        ctx->graph_cache.gf = nullptr;
         return 0;
     }
     return -1;
@@ -19249,6 +20672,7 @@ int32_t llama_lora_adapter_remove(
 
 void llama_lora_adapter_clear(struct llama_context * ctx) {
     ctx->lora_adapters.clear();
+    ctx->graph_cache.gf = nullptr;
 }
 
 void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
@@ -19270,6 +20694,8 @@ struct llama_model_params llama_model_default_params() {
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
         /*.tensor_buft_overrides       =*/ nullptr,
+        /*.hot_experts_file            =*/ nullptr,
+        /*.n_hot_experts               =*/ 16,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
@@ -19310,6 +20736,7 @@ struct llama_context_params llama_context_default_params() {
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.kv_type_overrides           =*/ nullptr,
         /*.logits_all                  =*/ false,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
@@ -19324,6 +20751,13 @@ struct llama_context_params llama_context_default_params() {
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
         /*.offload_policy              =*/ nullptr,
+        /*.profile_file                =*/ nullptr,
+        /*.profile_sample              =*/ 1,
+        /*.expert_stats_file           =*/ nullptr,
+        /*.expert_prefetch             =*/ 0,
+        /*.kv_block_size               =*/ 0,
+        /*.defrag_max_cells            =*/ 0,
+        /*.swa_full                    =*/ true,
     };
 
     return result;
@@ -19529,6 +20963,9 @@ struct llama_context * llama_new_context_with_model(
     cparams.fused_up_gate    = params.fused_up_gate;
     cparams.min_experts      = params.min_experts;
     cparams.thresh_experts   = params.thresh_experts;
+    cparams.kv_block_size    = params.kv_block_size;
+    cparams.defrag_max_cells = params.defrag_max_cells;
+    cparams.swa_full         = params.swa_full;
 
     cparams.pooling_type     = params.pooling_type;
 
@@ -19622,6 +21059,7 @@ struct llama_context * llama_new_context_with_model(
     uint32_t kv_size = cparams.n_ctx;
     ggml_type type_k = params.type_k;
     ggml_type type_v = params.type_v;
+    const llama_kv_cache_type_override * kv_type_overrides = params.kv_type_overrides;
 
     // Mamba only needs a constant number of KV cache cells per sequence
     if (model->arch == LLM_ARCH_MAMBA) {
@@ -19630,6 +21068,7 @@ struct llama_context * llama_new_context_with_model(
         // it's probably best to keep as much precision as possible for the states
         type_k = GGML_TYPE_F32; // required by ggml_ssm_conv for Mamba's conv_states
         type_v = GGML_TYPE_F32; // required by ggml_ssm_scan for Mamba's ssm_states
+        kv_type_overrides = nullptr;
     }
 
     GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
@@ -19782,22 +21221,79 @@ struct llama_context * llama_new_context_with_model(
         }
         ctx->backends.push_back(ctx->backend_cpu);
 
-        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv)) {
+        ctx->threadpool = ggml_threadpool_new(std::max(cparams.n_threads, cparams.n_threads_batch));
+        ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+
+        if (params.profile_file) {
+            ctx->profiler = ggml_profiler_new(params.profile_file, params.profile_sample);
+            if (ctx->profiler) {
+                LLAMA_LOG_INFO("%s: profiling 1 in %d CPU graphs to %s\n", __func__, std::max(1, params.profile_sample), params.profile_file);
+            }
+            ggml_backend_cpu_set_profiler(ctx->backend_cpu, ctx->profiler);
+        }
+
+        if (params.expert_stats_file && hparams.n_expert > 0) {
+            ctx->expert_counts.assign(size_t(hparams.n_layer)*hparams.n_expert, 0);
+            ctx->expert_stats_file = params.expert_stats_file;
+        }
+
+        if (params.expert_prefetch > 0 && hparams.n_expert > 0 && !model->mappings.empty()) {
+            llama_expert_prefetch_init(ctx->expert_prefetch, *model, params.expert_prefetch);
+        }
+
+        // the sliding-window layers only need the last n_swa positions of each sequence and the tokens of a ubatch
+        uint32_t kv_size_swa = 0;
+        bool has_swa = false;
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            has_swa = has_swa || hparams.is_swa(il);
+        }
+        if (has_swa && !cparams.swa_full && cparams.causal_attn && model->arch != LLM_ARCH_MAMBA) {
+            kv_size_swa = GGML_PAD(cparams.n_seq_max*(hparams.n_swa + cparams.n_ubatch), llama_kv_cache_get_padding(cparams));
+            if (kv_size_swa >= kv_size) {
+                kv_size_swa = 0;
+            }
+        }
+
+        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv, kv_type_overrides,
+                    kv_size_swa > 0 ? LLAMA_KV_LAYERS_NON_SWA : LLAMA_KV_LAYERS_ALL)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
+        if (kv_size_swa > 0) {
+            if (!llama_kv_cache_init(ctx->kv_swa, ctx, type_k, type_v, kv_size_swa, cparams.offload_kqv, kv_type_overrides,
+                        LLAMA_KV_LAYERS_SWA)) {
+                LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for sliding-window attention cache\n", __func__);
+                llama_free(ctx);
+                return nullptr;
+            }
+            LLAMA_LOG_INFO("%s: SWA cache with %u cells for the sliding-window layers (n_swa = %u)\n", __func__, kv_size_swa, hparams.n_swa);
+        }
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
+            // the size with type_k/type_v for all layers, to report what the per-layer overrides save
+            size_t memory_size_k_base = 0;
+            size_t memory_size_v_base = 0;
+            const char * name_k = ggml_type_name(type_k);
+            const char * name_v = ggml_type_name(type_v);
+
+            for (auto * kv : { &ctx->kv_self, &ctx->kv_swa }) {
+                for (auto & k : kv->k_l) {
+                    if (!k) continue;
+                    memory_size_k      += ggml_nbytes(k);
+                    memory_size_k_base += ggml_row_size(type_k, ggml_nelements(k));
+                    name_k = k->type == type_k ? name_k : "mixed";
+                }
 
-            for (auto & k : ctx->kv_self.k_l) {
-                memory_size_k += ggml_nbytes(k);
-            }
-
-            for (auto & v : ctx->kv_self.v_l) {
-                memory_size_v += ggml_nbytes(v);
+                for (auto & v : kv->v_l) {
+                    if (!v) continue;
+                    memory_size_v      += ggml_nbytes(v);
+                    memory_size_v_base += ggml_row_size(type_v, ggml_nelements(v));
+                    name_v = v->type == type_v ? name_v : "mixed";
+                }
             }
 
             if (memory_size_k + memory_size_v > 0) {
@@ -19813,8 +21309,15 @@ struct llama_context * llama_new_context_with_model(
                 } else {
                     LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
                             (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
-                            ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
-                            ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+                            name_k, (float)memory_size_k / (1024.0f * 1024.0f),
+                            name_v, (float)memory_size_v / (1024.0f * 1024.0f));
+                    if (memory_size_k + memory_size_v != memory_size_k_base + memory_size_v_base) {
+                        const float base = (float)(memory_size_k_base + memory_size_v_base) / (1024.0f * 1024.0f);
+                        LLAMA_LOG_INFO("%s: KV cache type overrides: %7.2f MiB instead of %7.2f MiB with %s/%s for all layers (%+.2f MiB)\n", __func__,
+                                (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f), base,
+                                ggml_type_name(type_k), ggml_type_name(type_v),
+                                (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f) - base);
+                    }
 		}
             }
         }
@@ -20060,6 +21563,10 @@ int32_t llama_n_layer(const struct llama_model * model) {
     return model->hparams.n_layer;
 }
 
+int32_t llama_n_expert(const struct llama_model * model) {
+    return model->hparams.n_expert;
+}
+
 int32_t llama_n_head(const struct llama_model * model) {
     return model->hparams.n_head();
 }
@@ -20262,6 +21769,8 @@ int32_t llama_control_vector_apply(struct llama_context * lctx, const float * da
     const llama_model & model = lctx->model;
     llama_control_vector & cvec = lctx->cvec;
 
+    lctx->graph_cache.gf = nullptr;
+
     if (data == nullptr) {
         // disable the current control vector (but leave allocated for later)
         cvec.layer_start = -1;
@@ -20331,7 +21840,7 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         view->cells_sequences = (llama_seq_id *)p;
     }
 
-    const std::vector<llama_kv_cell> & kv_cells = ctx->kv_self.cells;
+    const llama_kv_cells & kv_cells = ctx->kv_self.cells;
     llama_kv_cache_view_cell * c_curr = view->cells;
     llama_seq_id * cs_curr = view->cells_sequences;
     int32_t used_cells = 0;
@@ -20341,9 +21850,9 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
     int32_t max_contig_idx = -1;
 
     for (int32_t i = 0; i < int32_t(ctx->kv_self.size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
+        const size_t curr_size = kv_cells.seq_count(i);
         token_count += curr_size;
-        c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
+        c_curr->pos = kv_cells.pos[i] + kv_cells.delta[i];
 
         if (curr_size > 0) {
             if (curr_contig_idx >= 0 && uint32_t(i - curr_contig_idx) > max_contig) {
@@ -20356,13 +21865,11 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
-            if (seq_idx >= view->n_seq_max) {
-                break;
+        kv_cells.seq_for_each(i, [&](llama_seq_id it) {
+            if (seq_idx < view->n_seq_max) {
+                cs_curr[seq_idx++] = it;
             }
-            cs_curr[seq_idx] = it;
-            seq_idx++;
-        }
+        });
         if (seq_idx != 0) {
             used_cells++;
         }
@@ -20388,7 +21895,7 @@ int32_t llama_get_kv_cache_token_count(const struct llama_context * ctx) {
     int result = 0;
 
     for (uint32_t i = 0; i < ctx->kv_self.size; i++) {
-        result += ctx->kv_self.cells[i].seq_id.size();
+        result += ctx->kv_self.cells.seq_count(i);
     }
 
     return result;
@@ -20400,21 +21907,43 @@ int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
 
 void llama_kv_cache_clear(struct llama_context * ctx) {
     llama_kv_cache_clear(ctx->kv_self);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_clear(ctx->kv_swa);
+    }
 }
 
 bool llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    if (ctx->kv_swa.size > 0) {
+        if (!llama_kv_cache_swa_has_window(ctx->kv_self, ctx->kv_swa, ctx->model.hparams.n_swa, seq_id, p0, p1)) {
+            return false;
+        }
+        llama_kv_cache_seq_rm(ctx->kv_swa, seq_id, p0, p1);
+    }
     return llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
 }
 
+bool llama_kv_cache_seq_has_window(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p) {
+    if (ctx->kv_swa.size == 0) {
+        return true;
+    }
+    return llama_kv_cache_swa_has_window(ctx->kv_self, ctx->kv_swa, ctx->model.hparams.n_swa, seq_id, p, -1);
+}
+
 void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
     if (seq_id_src == seq_id_dst) {
         return;
     }
     llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_cp(ctx->kv_swa, seq_id_src, seq_id_dst, p0, p1);
+    }
 }
 
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_keep(ctx->kv_swa, seq_id);
+    }
 }
 
 void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
@@ -20423,6 +21952,9 @@ void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, lla
     }
 
     llama_kv_cache_seq_add(ctx->kv_self, seq_id, p0, p1, delta);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_add(ctx->kv_swa, seq_id, p0, p1, delta);
+    }
 }
 
 void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
@@ -20431,6 +21963,9 @@ void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, lla
     }
 
     llama_kv_cache_seq_div(ctx->kv_self, seq_id, p0, p1, d);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_div(ctx->kv_swa, seq_id, p0, p1, d);
+    }
 }
 
 llama_pos llama_kv_cache_seq_pos_max(struct llama_context * ctx, llama_seq_id seq_id) {
@@ -20439,6 +21974,9 @@ llama_pos llama_kv_cache_seq_pos_max(struct llama_context * ctx, llama_seq_id se
 
 void llama_kv_cache_defrag(struct llama_context * ctx) {
     llama_kv_cache_defrag(ctx->kv_self);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_defrag(ctx->kv_swa);
+    }
 }
 
 int32_t llama_kv_cache_update(struct llama_context * ctx) {
@@ -20552,24 +22090,22 @@ struct llama_data_write {
 
         for (const auto & range : cell_ranges) {
             for (uint32_t i = range.first; i < range.second; ++i) {
-                const auto & cell = kv_self.cells[i];
-                const llama_pos pos      = cell.pos;
-                const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+                const llama_pos pos      = kv_self.cells.pos[i];
+                const uint32_t  n_seq_id = seq_id == -1 ? kv_self.cells.seq_count(i) : 0;
 
                 write(&pos,      sizeof(pos));
                 write(&n_seq_id, sizeof(n_seq_id));
 
                 if (n_seq_id) {
-                    for (auto seq_id : cell.seq_id) {
+                    kv_self.cells.seq_for_each(i, [this](llama_seq_id seq_id) {
                         write(&seq_id, sizeof(seq_id));
-                    }
+                    });
                 }
             }
         }
     }
 
-    void write_kv_cache_data(const struct llama_context * ctx, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache_data(const struct llama_context * ctx, const struct llama_kv_cache & kv_self, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
         const struct llama_hparams & hparams = ctx->model.hparams;
 
         // v_state: 0 -> not transposed V cache
@@ -20578,14 +22114,21 @@ struct llama_data_write {
         const uint32_t v_state = kv_self.v_l.empty() ? 2 : kv_self.v_trans ? 1 : 0;
         const uint32_t n_layer = hparams.n_layer;
 
-        write(&v_state, sizeof(v_state));
-        write(&n_layer, sizeof(n_layer));
+        // the layers held by this cache (see llama_kv_cache_layers)
+        const uint32_t n_layer_kv = std::count_if(kv_self.k_l.begin(), kv_self.k_l.end(), [](const ggml_tensor * k) { return k != nullptr; });
+
+        write(&v_state,    sizeof(v_state));
+        write(&n_layer_kv, sizeof(n_layer_kv));
 
         std::vector<uint8_t> tmp_buf;
 
         // Iterate and write all the keys first, each row is a cell
         // Get whole range at a time
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (!kv_self.k_l[il]) {
+                continue;
+            }
+
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
             const uint32_t n_embd_head_qk_rope = hparams.n_rot;
             const uint32_t kv_lora_rank = hparams.n_lora_kv;
@@ -20608,6 +22151,10 @@ struct llama_data_write {
 
         if (v_state == 0) {
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv_self.v_l[il]) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
@@ -20630,6 +22177,10 @@ struct llama_data_write {
             // When v is transposed, we also need the element size and get the element ranges from each row
             const uint32_t kv_size = kv_self.size;
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv_self.v_l[il]) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
@@ -20658,7 +22209,15 @@ struct llama_data_write {
     }
 
     void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+        write_kv_cache(ctx, ctx->kv_self, seq_id);
+
+        // the windowed cache of the sliding-window layers follows as a second section
+        if (ctx->kv_swa.size > 0) {
+            write_kv_cache(ctx, ctx->kv_swa, seq_id);
+        }
+    }
+
+    void write_kv_cache(const struct llama_context * ctx, const struct llama_kv_cache & kv_self, llama_seq_id seq_id) {
         std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
         uint32_t cell_count = 0;
 
@@ -20666,8 +22225,7 @@ struct llama_data_write {
         // Find all the ranges of cells with this seq id (or all, when -1)
         uint32_t cell_range_begin = kv_self.size;
         for (uint32_t i = 0; i < kv_self.size; ++i) {
-            const auto & cell = kv_self.cells[i];
-            if ((seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id)) {
+            if ((seq_id == -1 && !kv_self.cells.is_empty(i)) || kv_self.cells.seq_has(i, seq_id)) {
                 ++cell_count;
                 if (cell_range_begin == kv_self.size) {
                     cell_range_begin = i;
@@ -20693,7 +22251,7 @@ struct llama_data_write {
         write(&cell_count, sizeof(cell_count));
 
         write_kv_cache_meta(kv_self, cell_ranges, seq_id);
-        write_kv_cache_data(ctx, cell_ranges);
+        write_kv_cache_data(ctx, kv_self, cell_ranges);
     }
 };
 
@@ -20785,8 +22343,7 @@ struct llama_data_read {
         }
     }
 
-    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
-        struct llama_kv_cache & kv_self = ctx->kv_self;
+    bool read_kv_cache_meta(struct llama_context * ctx, struct llama_kv_cache & kv_self, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
 
         if (dest_seq_id != -1) {
             // single sequence
@@ -20819,12 +22376,14 @@ struct llama_data_read {
             }
 
             // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-            // Assume that this is one contiguous block of cells
-            GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            // Assume that this is one contiguous block of cells (a paged cache has them in kv_self.slot)
+            const uint32_t cell_first = kv_self.block_size > 0 ? kv_self.slot.front() : kv_self.head;
+            const uint32_t cell_last  = kv_self.block_size > 0 ? kv_self.slot.back()  : kv_self.head + cell_count - 1;
+            GGML_ASSERT(cell_last < kv_self.size);
+            GGML_ASSERT(kv_self.cells.pos[cell_first] == batch.pos[0]);
+            GGML_ASSERT(kv_self.cells.pos[cell_last] == batch.pos[cell_count - 1]);
+            GGML_ASSERT(kv_self.cells.seq_has(cell_first, dest_seq_id));
+            GGML_ASSERT(kv_self.cells.seq_has(cell_last, dest_seq_id));
 
             // Cleanup
             llama_batch_free(batch);
@@ -20839,15 +22398,13 @@ struct llama_data_read {
             llama_kv_cache_clear(kv_self);
 
             for (uint32_t i = 0; i < cell_count; ++i) {
-                llama_kv_cell & cell = kv_self.cells[i];
-
                 llama_pos pos;
                 uint32_t  n_seq_id;
 
                 read_to(&pos,      sizeof(pos));
                 read_to(&n_seq_id, sizeof(n_seq_id));
 
-                cell.pos = pos;
+                kv_self.cells.pos_set(i, pos);
 
                 for (uint32_t j = 0; j < n_seq_id; ++j) {
                     llama_seq_id seq_id;
@@ -20858,31 +22415,58 @@ struct llama_data_read {
                         return false;
                     }
 
-                    cell.seq_id.insert(seq_id);
+                    kv_self.cells.seq_add(i, seq_id);
                 }
             }
 
             kv_self.head = 0;
             kv_self.used = cell_count;
+
+            if (kv_self.block_size > 0) {
+                llama_kv_cache_update_blocks(kv_self);
+                kv_self.slot.resize(cell_count);
+                std::iota(kv_self.slot.begin(), kv_self.slot.end(), 0);
+            }
         }
 
         return true;
     }
 
-    bool read_kv_cache_data(struct llama_context * ctx, uint32_t cell_count) {
+    // set the rows of the restored cells, starting at kv_self.head, or in the cells of kv_self.slot for a paged cache
+    void read_kv_rows(const struct llama_kv_cache & kv_self, struct ggml_tensor * t, size_t row_size, uint32_t cell_count) {
+        const uint8_t * src = read(cell_count * row_size);
+        if (kv_self.block_size == 0) {
+            ggml_backend_tensor_set(t, src, kv_self.head * row_size, cell_count * row_size);
+            return;
+        }
+        for (uint32_t j = 0; j < cell_count; ) {
+            // one call per run of consecutive cells
+            uint32_t n = 1;
+            while (j + n < cell_count && kv_self.slot[j + n] == kv_self.slot[j] + n) {
+                ++n;
+            }
+            ggml_backend_tensor_set(t, src + j * row_size, kv_self.slot[j] * row_size, n * row_size);
+            j += n;
+        }
+    }
+
+    bool read_kv_cache_data(struct llama_context * ctx, struct llama_kv_cache & kv_self, uint32_t cell_count) {
         const struct llama_hparams & hparams = ctx->model.hparams;
-        struct llama_kv_cache & kv_self = ctx->kv_self;
 
         // v_state: 0 -> not transposed V cache
         //          1 -> transposed V cache
         //          2 -> no V cache (as it may be the case with MLA)
         uint32_t v_state;
-        uint32_t n_layer;
-        read_to(&v_state, sizeof(v_state));
-        read_to(&n_layer, sizeof(n_layer));
-
-        if (n_layer != hparams.n_layer) {
-            LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer, hparams.n_layer);
+        uint32_t n_layer_ref;
+        read_to(&v_state,     sizeof(v_state));
+        read_to(&n_layer_ref, sizeof(n_layer_ref));
+
+        // the layers held by this cache (see llama_kv_cache_layers), the state of a context with a different
+        // llama_context_params::swa_full does not have the same layers in its sections
+        const uint32_t n_layer    = hparams.n_layer;
+        const uint32_t n_layer_kv = std::count_if(kv_self.k_l.begin(), kv_self.k_l.end(), [](const ggml_tensor * k) { return k != nullptr; });
+        if (n_layer_ref != n_layer_kv) {
+            LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer_ref, n_layer_kv);
             return false;
         }
         if (cell_count > kv_self.size) {
@@ -20898,6 +22482,10 @@ struct llama_data_read {
 
         // For each layer, read the keys for each cell, one row is one cell, read as one contiguous block
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (!kv_self.k_l[il]) {
+                continue;
+            }
+
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
             const uint32_t n_embd_head_qk_rope = hparams.n_rot;
             const uint32_t kv_lora_rank = hparams.n_lora_kv;
@@ -20923,12 +22511,16 @@ struct llama_data_read {
 
             if (cell_count) {
                 // Read and set the keys for the whole cell range
-                ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
+                read_kv_rows(kv_self, kv_self.k_l[il], k_size_row, cell_count);
             }
         }
 
         if (v_state == 0) {
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv_self.v_l[il]) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
@@ -20951,13 +22543,17 @@ struct llama_data_read {
 
                 if (cell_count) {
                     // Read and set the values for the whole cell range
-                    ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
+                    read_kv_rows(kv_self, kv_self.v_l[il], v_size_row, cell_count);
                 }
             }
         }
         else if (v_state == 1) {
             // For each layer, read the values for each cell (transposed)
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv_self.v_l[il]) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
@@ -20999,10 +22595,11 @@ struct llama_data_read {
     }
 
     void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        uint32_t cell_count;
-        read_to(&cell_count, sizeof(cell_count));
+        bool res = read_kv_cache(ctx, ctx->kv_self, seq_id);
 
-        bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
+        if (res && ctx->kv_swa.size > 0) {
+            res = read_kv_cache(ctx, ctx->kv_swa, seq_id);
+        }
 
         if (!res) {
             if (seq_id == -1) {
@@ -21013,6 +22610,13 @@ struct llama_data_read {
             throw std::runtime_error("failed to restore kv cache");
         }
     }
+
+    bool read_kv_cache(struct llama_context * ctx, struct llama_kv_cache & kv_self, llama_seq_id seq_id) {
+        uint32_t cell_count;
+        read_to(&cell_count, sizeof(cell_count));
+
+        return read_kv_cache_meta(ctx, kv_self, cell_count, seq_id) && read_kv_cache_data(ctx, kv_self, cell_count);
+    }
 };
 
 struct llama_data_write_dummy : llama_data_write {
@@ -21138,6 +22742,63 @@ struct llama_data_read_file : llama_data_read {
     }
 };
 
+// compressed state data (of a sequence state file or a buffer) is written as the records of llama_compress_writer
+struct llama_data_write_compressed : llama_data_write {
+    llama_compress_writer writer;
+    size_t size_written = 0;
+
+    llama_data_write_compressed(std::function<void(const void * src, size_t size)> write, int n_threads)
+        : writer(std::move(write), n_threads) {}
+
+    void write(const void * src, size_t size) override {
+        for (size_t i = 0, n; i < size; i += n) {
+            uint8_t * dst = writer.append(size - i, 1, n);
+            std::memcpy(dst, (const uint8_t *) src + i, n);
+        }
+        size_written += size;
+    }
+
+    void write_tensor_data(const struct ggml_tensor * tensor, size_t offset, size_t size) override {
+        const size_t stride = ggml_type_size(tensor->type);
+        for (size_t i = 0, n; i < size; i += n) {
+            uint8_t * dst = writer.append(size - i, stride, n);
+            ggml_backend_tensor_get(tensor, dst, offset + i, n);
+        }
+        size_written += size;
+    }
+
+    size_t get_size_written() override {
+        return size_written;
+    }
+
+    // write out what is still buffered, must be called after the last write
+    void finish() {
+        writer.finish();
+    }
+};
+
+struct llama_data_read_compressed : llama_data_read {
+    llama_compress_reader reader;
+    size_t size_read = 0;
+
+    llama_data_read_compressed(std::function<void(void * dst, size_t size)> read, size_t size, int n_threads)
+        : reader(std::move(read), size, n_threads) {}
+
+    void read_to(void * dst, size_t size) override {
+        reader.read_to(dst, size);
+        size_read += size;
+    }
+
+    const uint8_t * read(size_t size) override {
+        size_read += size;
+        return reader.read(size);
+    }
+
+    size_t get_size_read() override {
+        return size_read;
+    }
+};
+
 /** copy state data into either a buffer or file depending on the passed in context
  *
  * file context:
@@ -21337,71 +22998,200 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
     }
 }
 
-static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
+size_t llama_state_seq_get_data_compressed(struct llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id) {
+    size_t n_out = 0;
+    bool   fits  = true;
+    try {
+        llama_data_write_compressed data_ctx([&](const void * src, size_t n) {
+            if (n > size - n_out) {
+                fits = false;
+            }
+            if (fits) {
+                memcpy(dst + n_out, src, n);
+                n_out += n;
+            }
+        }, ctx->cparams.n_threads);
+        llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
+        data_ctx.finish();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error saving sequence state: %s\n", __func__, err.what());
+        return 0;
+    }
+    return fits ? n_out : 0;
+}
+
+size_t llama_state_seq_set_data_compressed(struct llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id) {
+    size_t n_in = 0;
+    try {
+        llama_data_read_compressed data_ctx([&](void * dst, size_t n) {
+            if (n > size - n_in) {
+                throw std::runtime_error("unexpectedly reached end of buffer");
+            }
+            memcpy(dst, src + n_in, n);
+            n_in += n;
+        }, size, ctx->cparams.n_threads);
+        if (!llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id)) {
+            return 0;
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error loading sequence state: %s\n", __func__, err.what());
+        return 0;
+    }
+    return n_in;
+}
+
+static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count, bool compress) {
+    // the file is truncated below, a mapping of it would no longer be backed
+    ctx->state_seq_maps.erase(filepath);
+
     llama_file file(filepath, "wb");
 
     file.write_u32(LLAMA_STATE_SEQ_MAGIC);
     file.write_u32(LLAMA_STATE_SEQ_VERSION);
+    file.write_u32(compress ? LLAMA_STATE_SEQ_FLAG_COMPRESSED : 0);
 
     // save the prompt
     file.write_u32((uint32_t) n_token_count);
     file.write_raw(tokens, sizeof(llama_token) * n_token_count);
 
+    if (compress) {
+        llama_data_write_compressed data_ctx([&file](const void * src, size_t size) { file.write_raw(src, size); }, ctx->cparams.n_threads);
+        llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
+        data_ctx.finish();
+        return file.tell();
+    }
+
     // save the context state using stream saving
     llama_data_write_file data_ctx(&file);
     llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
 
     const size_t res = file.tell();
-    GGML_ASSERT(res == sizeof(uint32_t) * 3 + sizeof(llama_token) * n_token_count + data_ctx.get_size_written());
+    GGML_ASSERT(res == sizeof(uint32_t) * 4 + sizeof(llama_token) * n_token_count + data_ctx.get_size_written());
     return res;
 }
 
-static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
-    llama_file file(filepath, "rb");
-
+// read the header and the prompt of a sequence state file, version 2 files have no flags
+static bool llama_state_seq_read_header(llama_data_read & data_ctx, uint32_t & flags, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     // version checks
     {
-        const uint32_t magic   = file.read_u32();
-        const uint32_t version = file.read_u32();
+        uint32_t magic;
+        uint32_t version;
+        data_ctx.read_to(&magic,   sizeof(magic));
+        data_ctx.read_to(&version, sizeof(version));
 
-        if (magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION) {
+        if (magic != LLAMA_STATE_SEQ_MAGIC || (version != LLAMA_STATE_SEQ_VERSION && version != 2)) {
             LLAMA_LOG_ERROR("%s: unknown (magic, version) for sequence state file: %08x, %08x\n", __func__, magic, version);
-            return 0;
+            return false;
+        }
+        flags = 0;
+        if (version > 2) {
+            data_ctx.read_to(&flags, sizeof(flags));
+        }
+        if (flags & ~LLAMA_STATE_SEQ_FLAG_COMPRESSED) {
+            LLAMA_LOG_ERROR("%s: unknown flags for sequence state file: %08x\n", __func__, flags);
+            return false;
         }
     }
 
     // load the prompt
     {
-        const uint32_t n_token_count = file.read_u32();
+        uint32_t n_token_count;
+        data_ctx.read_to(&n_token_count, sizeof(n_token_count));
 
         if (n_token_count > n_token_capacity) {
             LLAMA_LOG_ERROR("%s: token count in sequence state file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
-            return 0;
+            return false;
         }
 
-        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
+        if (n_token_count > 0) {
+            data_ctx.read_to(tokens_out, sizeof(llama_token) * n_token_count);
+        }
         *n_token_count_out = n_token_count;
     }
 
-    // restore the context state
+    return true;
+}
+
+// restore a sequence from a mapped, uncompressed state file: the K/V rows of a layer are stored in the row layout of
+// the cache tensors, so they are set straight from the mapped pages without a staging buffer
+static size_t llama_state_seq_load_mapping(struct llama_context * ctx, const llama_mmap & mapping, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_data_read_buffer data_ctx((const uint8_t *) mapping.addr(), mapping.size());
+
+    uint32_t flags;
+    if (!llama_state_seq_read_header(data_ctx, flags, tokens_out, n_token_capacity, n_token_count_out)) {
+        return 0;
+    }
+    if (flags & LLAMA_STATE_SEQ_FLAG_COMPRESSED) {
+        LLAMA_LOG_ERROR("%s: compressed sequence state files cannot be restored from a mapping\n", __func__);
+        return 0;
+    }
+
+    if (!llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id)) {
+        LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
+        return 0;
+    }
+
+    return data_ctx.get_size_read();
+}
+
+static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    // a file kept mapped by llama_state_seq_map_file is restored from the pages that are already mapped
+    const auto it = ctx->state_seq_maps.find(filepath);
+    if (it != ctx->state_seq_maps.end()) {
+        return llama_state_seq_load_mapping(ctx, *it->second, dest_seq_id, tokens_out, n_token_capacity, n_token_count_out);
+    }
+
+    llama_file file(filepath, "rb");
+
+    uint32_t flags;
     {
-        const size_t state_size = file.size() - file.tell();
-        llama_data_read_file data_ctx(&file);
-        const size_t nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
-        if (!nread) {
+        llama_data_read_file header_ctx(&file);
+        if (!llama_state_seq_read_header(header_ctx, flags, tokens_out, n_token_capacity, n_token_count_out)) {
+            return 0;
+        }
+    }
+
+    // restore the context state
+    if (flags & LLAMA_STATE_SEQ_FLAG_COMPRESSED) {
+        llama_data_read_compressed data_ctx([&file](void * dst, size_t size) { file.read_raw(dst, size); }, file.size() - file.tell(), ctx->cparams.n_threads);
+        if (!llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id)) {
             LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
             return 0;
         }
-        GGML_ASSERT(nread <= state_size);
-        GGML_ASSERT(nread + sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out == file.tell());
+        return file.tell();
+    }
+
+    if (llama_mmap::SUPPORTED) {
+        llama_mmap mapping(&file);
+        return llama_state_seq_load_mapping(ctx, mapping, dest_seq_id, tokens_out, n_token_capacity, n_token_count_out);
+    }
+
+    const size_t header_size = file.tell();
+    const size_t state_size  = file.size() - header_size;
+    llama_data_read_file data_ctx(&file);
+    const size_t nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
+    if (!nread) {
+        LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
+        return 0;
     }
+    GGML_ASSERT(nread <= state_size);
+    GGML_ASSERT(nread + header_size == file.tell());
 
     return file.tell();
 }
 
 size_t llama_state_seq_save_file(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
     try {
-        return llama_state_seq_save_file_internal(ctx, filepath, seq_id, tokens, n_token_count);
+        return llama_state_seq_save_file_internal(ctx, filepath, seq_id, tokens, n_token_count, false);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error saving sequence state file: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
+size_t llama_state_seq_save_file_compressed(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
+    try {
+        return llama_state_seq_save_file_internal(ctx, filepath, seq_id, tokens, n_token_count, true);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error saving sequence state file: %s\n", __func__, err.what());
         return 0;
@@ -21417,9 +23207,65 @@ size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepa
     }
 }
 
+bool llama_state_seq_map_file(struct llama_context * ctx, const char * filepath) {
+    if (!llama_mmap::SUPPORTED) {
+        LLAMA_LOG_ERROR("%s: mmap is not supported on this platform\n", __func__);
+        return false;
+    }
+    try {
+        llama_file file(filepath, "rb");
+
+        const uint32_t magic   = file.read_u32();
+        const uint32_t version = file.read_u32();
+        if (magic != LLAMA_STATE_SEQ_MAGIC || (version != LLAMA_STATE_SEQ_VERSION && version != 2)) {
+            LLAMA_LOG_ERROR("%s: unknown (magic, version) for sequence state file: %08x, %08x\n", __func__, magic, version);
+            return false;
+        }
+        const uint32_t flags = version > 2 ? file.read_u32() : 0;
+        if (flags & LLAMA_STATE_SEQ_FLAG_COMPRESSED) {
+            LLAMA_LOG_ERROR("%s: %s is compressed, only uncompressed sequence state files can be mapped\n", __func__, filepath);
+            return false;
+        }
+
+        ctx->state_seq_maps[filepath] = std::make_unique<llama_mmap>(&file);
+        return true;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error mapping sequence state file: %s\n", __func__, err.what());
+        return false;
+    }
+}
+
+void llama_state_seq_unmap_file(struct llama_context * ctx, const char * filepath) {
+    if (filepath) {
+        ctx->state_seq_maps.erase(filepath);
+    } else {
+        ctx->state_seq_maps.clear();
+    }
+}
+
 void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
     ctx->cparams.n_threads       = n_threads;
     ctx->cparams.n_threads_batch = n_threads_batch;
+
+    // the pool serves any thread count up to its size, it only needs to be rebuilt when it has to grow
+    const int n_threads_max = std::max(n_threads, n_threads_batch);
+    if (ctx->threadpool && n_threads_max > ggml_threadpool_get_n_threads(ctx->threadpool)) {
+        ggml_threadpool_free(ctx->threadpool);
+        ctx->threadpool = ggml_threadpool_new(n_threads_max);
+        ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+    }
+}
+
+void llama_threadpool_pause(struct llama_context * ctx) {
+    if (ctx->threadpool) {
+        ggml_threadpool_pause(ctx->threadpool);
+    }
+}
+
+void llama_threadpool_resume(struct llama_context * ctx) {
+    if (ctx->threadpool) {
+        ggml_threadpool_resume(ctx->threadpool);
+    }
 }
 
 uint32_t llama_n_threads(struct llama_context * ctx) {
@@ -21437,10 +23283,12 @@ void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)
 
 void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
     ctx->cparams.embeddings = embeddings;
+    ctx->graph_cache.gf = nullptr;
 }
 
 void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
+    ctx->graph_cache.gf = nullptr;
 }
 
 struct llama_batch llama_batch_get_one(
@@ -21501,6 +23349,8 @@ void llama_batch_free(struct llama_batch batch) {
 int32_t llama_encode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
+    llama_decode_join(*ctx);
+
     const int ret = llama_encode_internal(*ctx, batch);
     if (ret < 0) {
         LLAMA_LOG_ERROR("%s: failed to encode, ret = %d\n", __func__, ret);
@@ -21509,9 +23359,22 @@ int32_t llama_encode(
     return ret;
 }
 
+// the result of a batch started by llama_decode_async that nobody waited for would be lost, so it is logged here
+static void llama_decode_drop_result(llama_context & lctx, const char * func) {
+    if (lctx.decode_result < 0) {
+        LLAMA_LOG_ERROR("%s: the previous llama_decode_async batch failed, ret = %d, and was not waited for\n", func, lctx.decode_result);
+    } else if (lctx.decode_result > 0) {
+        LLAMA_LOG_WARN("%s: the previous llama_decode_async batch returned %d and was not waited for\n", func, lctx.decode_result);
+    }
+    lctx.decode_result = 0;
+}
+
 int32_t llama_decode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
+    llama_decode_join(*ctx);
+    llama_decode_drop_result(*ctx, __func__);
+
     const int ret = llama_decode_internal(*ctx, batch);
     if (ret < 0) {
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
@@ -21520,9 +23383,66 @@ int32_t llama_decode(
     return ret;
 }
 
+int32_t llama_decode_async(
+        struct llama_context * ctx,
+          struct llama_batch   batch) {
+    llama_decode_join(*ctx);
+    llama_decode_drop_result(*ctx, __func__);
+
+    if (!ctx->decode_worker.joinable()) {
+        ctx->decode_worker = std::thread([ctx]() {
+            std::unique_lock<std::mutex> lock(ctx->decode_mutex);
+            while (true) {
+                ctx->decode_cv.wait(lock, [ctx] { return ctx->decode_pending || ctx->decode_stop; });
+                if (!ctx->decode_pending) {
+                    return;
+                }
+
+                const llama_batch batch = ctx->decode_batch;
+                lock.unlock();
+                const int ret = llama_decode_internal(*ctx, batch);
+                lock.lock();
+
+                ctx->decode_result  = ret;
+                ctx->decode_pending = false;
+                ctx->decode_cv.notify_all();
+            }
+        });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(ctx->decode_mutex);
+        ctx->decode_batch   = batch;
+        ctx->decode_pending = true;
+    }
+    ctx->decode_cv.notify_all();
+
+    return 0;
+}
+
+int32_t llama_decode_wait(struct llama_context * ctx) {
+    llama_decode_join(*ctx);
+
+    const int ret = ctx->decode_result;
+    if (ret < 0) {
+        LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
+    }
+    ctx->decode_result = 0;
+
+    return ret;
+}
+
 void llama_synchronize(struct llama_context * ctx) {
+    llama_decode_join(*ctx);
+
     ggml_backend_sched_synchronize(ctx->sched);
 
+    // nothing was evaluated since the last call, the context is not written to, so that the outputs
+    // can be read (e.g. by llama_get_logits_ith) from several threads at once
+    if (ctx->n_queued_tokens == 0 && ctx->t_compute_start_us == 0) {
+        return;
+    }
+
     // FIXME: if multiple single tokens are evaluated without a synchronization,
     // the stats will be added to the prompt evaluation stats
     // this should only happen when using batch size 1 to evaluate a batch
@@ -21646,6 +23566,24 @@ float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id
     return it->second.data();
 }
 
+const uint64_t * llama_get_expert_counts(struct llama_context * ctx, int32_t il) {
+    if (ctx->expert_counts.empty() || il < 0 || il >= (int32_t)ctx->model.hparams.n_layer) {
+        return nullptr;
+    }
+    return ctx->expert_counts.data() + size_t(il)*ctx->model.hparams.n_expert;
+}
+
+void llama_reset_expert_counts(struct llama_context * ctx) {
+    std::fill(ctx->expert_counts.begin(), ctx->expert_counts.end(), 0);
+}
+
+bool llama_save_expert_counts(struct llama_context * ctx, const char * fname) {
+    if (ctx->expert_counts.empty()) {
+        return false;
+    }
+    return llama_write_expert_counts(fname, ctx->expert_counts, ctx->model.hparams.n_layer, ctx->model.hparams.n_expert);
+}
+
 //
 // vocab
 //
@@ -22548,7 +24486,12 @@ void llama_sample_temp(struct llama_context * ctx, llama_token_data_array * cand
 
 void llama_sample_xtc(struct llama_context * ctx, llama_token_data_array * candidates_p,
                            float   probability, float threshold, size_t min_keep) {
-    llama_sample_xtc_impl(ctx ? &ctx->sampling : nullptr, candidates_p, probability, threshold, min_keep);
+    llama_sample_xtc_impl(&ctx->sampling, candidates_p, probability, threshold, min_keep, ctx->sampling.rng);
+}
+
+void llama_sample_xtc_with_rng(struct llama_context * ctx, llama_token_data_array * candidates_p,
+                           float   probability, float threshold, size_t min_keep, std::mt19937 & rng) {
+    llama_sample_xtc_impl(&ctx->sampling, candidates_p, probability, threshold, min_keep, rng);
 }
 
 void llama_sample_top_n_sigma(struct llama_context * ctx, llama_token_data_array * candidates_p, float top_n_sigma) {
@@ -22580,11 +24523,19 @@ void llama_sample_apply_guidance(
 }
 
 llama_token llama_sample_token_mirostat(struct llama_context * ctx, llama_token_data_array * candidates, float tau, float eta, int32_t m, float * mu) {
-    return llama_sample_token_mirostat_impl(&ctx->sampling, candidates, tau, eta, m, mu);
+    return llama_sample_token_mirostat_impl(&ctx->sampling, candidates, tau, eta, m, mu, ctx->sampling.rng);
 }
 
 llama_token llama_sample_token_mirostat_v2(struct llama_context * ctx, llama_token_data_array * candidates, float tau, float eta, float * mu) {
-    return llama_sample_token_mirostat_v2_impl(ctx ? &ctx->sampling : nullptr, candidates, tau, eta, mu);
+    return llama_sample_token_mirostat_v2_impl(&ctx->sampling, candidates, tau, eta, mu, ctx->sampling.rng);
+}
+
+llama_token llama_sample_token_mirostat_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, float tau, float eta, int32_t m, float * mu, std::mt19937 & rng) {
+    return llama_sample_token_mirostat_impl(&ctx->sampling, candidates, tau, eta, m, mu, rng);
+}
+
+llama_token llama_sample_token_mirostat_v2_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, float tau, float eta, float * mu, std::mt19937 & rng) {
+    return llama_sample_token_mirostat_v2_impl(&ctx->sampling, candidates, tau, eta, mu, rng);
 }
 
 llama_token llama_sample_token_greedy(struct llama_context * ctx, llama_token_data_array * candidates) {
@@ -22675,9 +24626,12 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.t_p_eval_ms =*/ 1e-3 * ctx->t_p_eval_us,
         /*.t_eval_ms   =*/ 1e-3 * ctx->t_eval_us,
 
-        /*.n_sample =*/ std::max(1, ctx->sampling.n_sample),
+        /*.n_sample =*/ std::max(1, ctx->sampling.n_sample.load()),
         /*.n_p_eval =*/ std::max(0, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
+
+        /*.t_defrag_ms =*/ 1e-3 * ctx->t_defrag_us,
+        /*.n_defrag    =*/ ctx->n_defrag,
     };
 
     return result;
@@ -22694,6 +24648,10 @@ void llama_print_timings(struct llama_context * ctx) {
             __func__, timings.t_p_eval_ms, timings.n_p_eval, timings.t_p_eval_ms / timings.n_p_eval, 1e3 / timings.t_p_eval_ms * timings.n_p_eval);
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, timings.t_eval_ms, timings.n_eval, timings.t_eval_ms / timings.n_eval, 1e3 / timings.t_eval_ms * timings.n_eval);
+    if (timings.n_defrag > 0) {
+        LLAMA_LOG_INFO("%s:      defrag time = %10.2f ms / %5d steps  (%8.2f ms per step)\n",
+                __func__, timings.t_defrag_ms, timings.n_defrag, timings.t_defrag_ms / timings.n_defrag);
+    }
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (timings.t_end_ms - timings.t_start_ms), (timings.n_p_eval + timings.n_eval));
 }
 
@@ -22701,6 +24659,7 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_start_us  = ggml_time_us();
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+    ctx->t_defrag_us = ctx->n_defrag = 0;
 
     ctx->sampling.reset_timings();
 }
@@ -22745,20 +24704,20 @@ void llama_dump_timing_info_yaml(FILE * stream, const llama_context * ctx) {
     fprintf(stream, "mst_p_eval: %.2f  # ms / token during prompt processing\n",
             1.0e-3 * ctx->t_p_eval_us / ctx->n_p_eval);
     fprintf(stream, "mst_sample: %.2f  # ms / token during sampling\n",
-            1.0e-3 * ctx->sampling.t_sample_us / ctx->sampling.n_sample);
+            1.0e-3 * ctx->sampling.t_sample_us / ctx->sampling.n_sample.load());
     fprintf(stream, "n_eval: %d  # number of tokens generated (excluding the first one)\n", ctx->n_eval);
     fprintf(stream, "n_p_eval: %d  # number of tokens processed in batches at the beginning\n", ctx->n_p_eval);
-    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->sampling.n_sample);
+    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->sampling.n_sample.load());
     fprintf(stream, "t_eval_us: %" PRId64 "  # total microseconds spent generating tokens\n", ctx->t_eval_us);
     fprintf(stream, "t_load_us: %" PRId64 "  # total microseconds spent loading the model\n", ctx->t_load_us);
     fprintf(stream, "t_p_eval_us: %" PRId64 "  # total microseconds spent prompt processing\n", ctx->t_p_eval_us);
-    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->sampling.t_sample_us);
+    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->sampling.t_sample_us.load());
     fprintf(stream, "ts_eval: %.2f  # tokens / second during generation\n",
             1.0e6 * ctx->n_eval / ctx->t_eval_us);
     fprintf(stream, "ts_p_eval: %.2f  # tokens / second during prompt processing\n",
             1.0e6 * ctx->n_p_eval / ctx->t_p_eval_us);
     fprintf(stream, "ts_sample: %.2f  # tokens / second during sampling\n",
-            1.0e6 * ctx->sampling.n_sample / ctx->sampling.t_sample_us);
+            1.0e6 * ctx->sampling.n_sample / ctx->sampling.t_sample_us.load());
 }
 
 // For internal test use
@@ -22768,6 +24727,39 @@ const std::vector<std::pair<std::string, struct ggml_tensor *>> & llama_internal
     return ctx->model.tensors_by_name;
 }
 
+int64_t llama_internal_kq_mask_cache_diff(
+    struct llama_context * ctx,
+    const llama_seq_id * seq_id,
+    const llama_pos    * pos,
+    int32_t              n_tokens
+) {
+    const auto & cache = ctx->kq_mask_cache;
+    const auto & cells = ctx->kv_self.cells;
+
+    if (cache.n_kv == 0) {
+        return -1;
+    }
+
+    GGML_ASSERT((int64_t) cache.seq.size() == n_tokens);
+
+    std::vector<float> row(cache.n_kv);
+
+    int64_t n_diff = 0;
+    for (int32_t j = 0; j < n_tokens; ++j) {
+        if (cache.seq[j] != seq_id[j]) {
+            n_diff += cache.n_kv;
+            continue;
+        }
+        llama_kq_mask_row(cells, seq_id[j], pos[j], false, cache.n_kv, row.data());
+        const float * cached = cache.data.data() + j*cache.n_kv;
+        for (int64_t i = 0; i < cache.n_kv; ++i) {
+            n_diff += cached[i] != row[i];
+        }
+    }
+
+    return n_diff;
+}
+
 void llama_log_set(ggml_log_callback log_callback, void * user_data) {
     g_state.log_callback = log_callback ? log_callback : llama_log_callback_default;
     g_state.log_callback_user_data = user_data;
@@ -22816,4 +24808,5 @@ void llama_set_offload_policy(struct llama_context * lctx, int op, bool on_or_of
     const char * op_name = op < 0 || op >= int(GGML_OP_COUNT) ? "all ops" : ggml_op_name(ggml_op(op));
     printf("XXXXXXXXXXXXXXXXXXXXXXXXXXXX offload(%s) = %d\n", op_name, on_or_off);
     ggml_backend_sched_set_op_offload(lctx->sched, ggml_op(op), on_or_off);
+    lctx->graph_cache.gf = nullptr;
 }
@@ -1656,16 +1656,25 @@ struct test_flash_attn_ext : public test_case {
 
     const ggml_type type_KV;
 
+    // n_seq > 1: the batch holds the tokens of n_seq sequences, and the mask leaves each of them only the KV cells of
+    // its own sequence (with a causal limit), like a batch of several server slots
+    // the KV cells of a sequence are contiguous, or with kv_block > 0 the sequences own blocks of kv_block cells in turn
+    const int64_t n_seq;
+    const int64_t kv_block;
+
+    ggml_tensor * m = nullptr;
+
     std::string vars() override {
-        return VARS_TO_STR8(hs, nh, kv, nb, mask, max_bias, softcap, type_KV);
+        return VARS_TO_STR10(hs, nh, kv, nb, mask, max_bias, softcap, type_KV, n_seq, kv_block);
     }
 
     double max_nmse_err() override {
         return 5e-4;
     }
 
-    test_flash_attn_ext(int64_t hs = 128, int64_t nh = 32, int64_t kv = 96, int64_t nb = 8, bool mask = true, float max_bias = 0.0f, float softcap = 0.0f, ggml_type type_KV = GGML_TYPE_F16)
-        : hs(hs), nh(nh), kv(kv), nb(nb), mask(mask), max_bias(max_bias), softcap(softcap), type_KV(type_KV) {}
+    test_flash_attn_ext(int64_t hs = 128, int64_t nh = 32, int64_t kv = 96, int64_t nb = 8, bool mask = true, float max_bias = 0.0f, float softcap = 0.0f, ggml_type type_KV = GGML_TYPE_F16,
+            int64_t n_seq = 1, int64_t kv_block = 0)
+        : hs(hs), nh(nh), kv(kv), nb(nb), mask(mask), max_bias(max_bias), softcap(softcap), type_KV(type_KV), n_seq(n_seq), kv_block(kv_block) {}
 
     ggml_tensor * build_graph(ggml_context * ctx) override {
         const int64_t hs_padded = GGML_PAD(hs, ggml_blck_size(type_KV));
@@ -1673,10 +1682,42 @@ struct test_flash_attn_ext : public test_case {
         ggml_tensor * q = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, hs_padded, nb, nh, 1);
         ggml_tensor * k = ggml_new_tensor_4d(ctx, type_KV,       hs_padded, kv, nh, 1);
         ggml_tensor * v = ggml_new_tensor_4d(ctx, type_KV,       hs_padded, kv, nh, 1);
-        ggml_tensor * m = mask ? ggml_new_tensor_4d(ctx, GGML_TYPE_F16, kv, GGML_PAD(nb, GGML_KQ_MASK_PAD), 1, 1) : nullptr;
+        m = mask ? ggml_new_tensor_4d(ctx, GGML_TYPE_F16, kv, GGML_PAD(nb, GGML_KQ_MASK_PAD), 1, 1) : nullptr;
         ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, m, 1.0f/sqrtf(hs), max_bias, softcap);
         return out;
     }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (t != m || n_seq <= 1) {
+                init_tensor_uniform(t);
+                continue;
+            }
+
+            // sequence of each KV cell and the number of cells of each sequence
+            std::vector<int64_t> cell_seq(kv);
+            std::vector<int64_t> seq_cells(n_seq, 0);
+            for (int64_t i = 0; i < kv; ++i) {
+                cell_seq[i] = kv_block > 0 ? (i/kv_block) % n_seq : std::min(n_seq - 1, i*n_seq/kv);
+                seq_cells[cell_seq[i]]++;
+            }
+
+            // the rows of a sequence are its last tokens: the j-th of n rows sees all but the last n-1-j of its cells
+            const int64_t nb_seq = (nb + n_seq - 1)/n_seq;
+            std::vector<ggml_fp16_t> data(ggml_nelements(m), ggml_fp32_to_fp16(0.0f));
+            for (int64_t j = 0; j < nb; ++j) {
+                const int64_t s     = j/nb_seq;
+                const int64_t n_row = std::min(nb_seq, nb - s*nb_seq);
+                const int64_t n_vis = seq_cells[s] - (n_row - 1 - j%nb_seq);
+                int64_t n_seen = 0;
+                for (int64_t i = 0; i < kv; ++i) {
+                    const bool visible = cell_seq[i] == s && n_seen++ < n_vis;
+                    data[j*kv + i] = ggml_fp32_to_fp16(visible ? 0.0f : -INFINITY);
+                }
+            }
+            ggml_backend_tensor_set(m, data.data(), 0, data.size()*sizeof(ggml_fp16_t));
+        }
+    }
 };
 
 enum llm_norm_type {
@@ -2451,6 +2492,23 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
         }
     }
 
+    // batches of several sequences with a block-diagonal mask: the CPU backend splits the rows into runs per sequence
+    // (and repacks K when a run has at least 8 rows) and skips the fully masked K blocks. kv is not always a multiple
+    // of the K steps (32, 64, 128) of the kernels
+    for (int hs : { 64, 128, }) {
+        for (int kv : { 512, 544, 576, 1000, }) {
+            for (int nb : { 8, 32, }) {
+                for (int n_seq : { 2, 4, }) {
+                    for (int kv_block : { 0, 32, 128, }) {
+                        for (ggml_type type_KV : {GGML_TYPE_F16, GGML_TYPE_Q8_0}) {
+                            test_cases.emplace_back(new test_flash_attn_ext(hs, 32, kv, nb, true, 0.0f, 0.0f, type_KV, n_seq, kv_block));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
     // these tests are disabled to save execution time, but they can be handy for debugging
 #if 0
     test_cases.emplace_back(new test_llama(1));
@@ -0,0 +1,141 @@
+// Checks that llama_decode_async() + llama_decode_wait() produce the same logits as llama_decode(),
+// and that the result of a failed asynchronous batch is returned by llama_decode_wait()
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "llama.h"
+#include "get-model.h"
+
+// greedy generation of n_gen tokens after the prompt, returns the logits of every step
+static std::vector<float> generate(llama_context * ctx, const std::vector<llama_token> & prompt, int n_gen, bool async) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    auto decode = [&](llama_batch & batch) {
+        if (async) {
+            if (llama_decode_async(ctx, batch) != 0) {
+                return false;
+            }
+            return llama_decode_wait(ctx) == 0;
+        }
+        return llama_decode(ctx, batch) == 0;
+    };
+
+    std::vector<float> logits;
+    llama_batch batch = llama_batch_init(prompt.size(), 0, 1);
+    for (size_t i = 0; i < prompt.size(); ++i) {
+        batch.token   [i]    = prompt[i];
+        batch.pos     [i]    = i;
+        batch.n_seq_id[i]    = 1;
+        batch.seq_id  [i][0] = 0;
+        batch.logits  [i]    = i == prompt.size() - 1;
+    }
+    batch.n_tokens = prompt.size();
+
+    llama_pos pos = prompt.size();
+    for (int i = 0; i < n_gen; ++i) {
+        if (!decode(batch)) {
+            fprintf(stderr, "%s: decode failed at step %d\n", __func__, i);
+            logits.clear();
+            break;
+        }
+        const float * l = llama_get_logits_ith(ctx, batch.n_tokens - 1);
+        logits.insert(logits.end(), l, l + n_vocab);
+
+        llama_token next = 0;
+        for (int j = 1; j < n_vocab; ++j) {
+            if (l[j] > l[next]) {
+                next = j;
+            }
+        }
+
+        batch.n_tokens       = 1;
+        batch.token   [0]    = next;
+        batch.pos     [0]    = pos++;
+        batch.n_seq_id[0]    = 1;
+        batch.seq_id  [0][0] = 0;
+        batch.logits  [0]    = true;
+    }
+    llama_batch_free(batch);
+
+    return logits;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto * model = llama_load_model_from_file(model_path, llama_model_default_params());
+    if (!model) {
+        fprintf(stderr, "failed to load %s\n", model_path);
+        return 1;
+    }
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 256;
+    cparams.n_threads = 2;
+
+    const char * text = "The quick brown fox jumps over the lazy dog";
+    std::vector<llama_token> prompt(64);
+    const int n_prompt = llama_tokenize(model, text, strlen(text), prompt.data(), prompt.size(), true, false);
+    if (n_prompt <= 0) {
+        fprintf(stderr, "failed to tokenize the prompt\n");
+        return 1;
+    }
+    prompt.resize(n_prompt);
+
+    const int n_gen = 16;
+
+    int n_failed = 0;
+
+    std::vector<float> logits_sync;
+    std::vector<float> logits_async;
+    {
+        auto * ctx = llama_new_context_with_model(model, cparams);
+        logits_sync = generate(ctx, prompt, n_gen, false);
+        llama_free(ctx);
+    }
+    {
+        auto * ctx = llama_new_context_with_model(model, cparams);
+        logits_async = generate(ctx, prompt, n_gen, true);
+
+        // a batch without tokens fails, llama_decode_wait() has to report it
+        llama_batch empty = llama_batch_init(1, 0, 1);
+        empty.n_tokens = 0;
+        if (llama_decode_async(ctx, empty) != 0 || llama_decode_wait(ctx) >= 0) {
+            fprintf(stderr, "the failure of an asynchronous batch was not reported\n");
+            ++n_failed;
+        }
+        if (llama_decode_wait(ctx) != 0) {
+            fprintf(stderr, "llama_decode_wait() without a batch did not return 0\n");
+            ++n_failed;
+        }
+        llama_batch_free(empty);
+        llama_free(ctx);
+    }
+
+    if (logits_sync.empty() || logits_sync.size() != logits_async.size()) {
+        fprintf(stderr, "generation failed\n");
+        ++n_failed;
+    } else {
+        float max_diff = 0.0f;
+        for (size_t i = 0; i < logits_sync.size(); ++i) {
+            max_diff = std::max(max_diff, std::fabs(logits_sync[i] - logits_async[i]));
+        }
+        printf("%d steps, max logit difference %g\n", n_gen, (double)max_diff);
+        if (max_diff > 1e-4f) {
+            fprintf(stderr, "the logits of llama_decode_async() differ from llama_decode()\n");
+            ++n_failed;
+        }
+    }
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    return n_failed > 0 ? 1 : 0;
+}
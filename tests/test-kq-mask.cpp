@@ -0,0 +1,153 @@
+// Decodes random multi-sequence ubatches, with llama_kv_cache_seq_rm/cp/add in between, and checks after each small
+// ubatch that the incrementally updated KQ mask matches one rebuilt from the KV cells
+
+#define LLAMA_API_INTERNAL
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "ggml.h"
+#include "llama.h"
+#include "get-model.h"
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto * model = llama_load_model_from_file(model_path, llama_model_default_params());
+    if (!model) {
+        fprintf(stderr, "failed to load %s\n", model_path);
+        return 1;
+    }
+
+    const int n_seq   = 4;
+    const int n_steps = 400;
+    const int n_max   = 192; // positions per sequence before it is cut back
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 1024;
+    cparams.n_batch   = 256;
+    cparams.n_seq_max = n_seq;
+    cparams.n_threads = 2;
+
+    auto * ctx = llama_new_context_with_model(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "failed to create the context\n");
+        return 1;
+    }
+
+    const int n_vocab = llama_n_vocab(model);
+
+    std::mt19937 rng(1234);
+    auto rand_int = [&rng](int n) { return (int) (rng() % n); };
+
+    std::vector<llama_pos> n_past(n_seq, 0);
+    std::vector<bool>      active(n_seq, true);
+
+    llama_batch batch = llama_batch_init(cparams.n_batch, 0, 1);
+
+    auto add_token = [&](llama_seq_id s) {
+        const int j = batch.n_tokens++;
+        batch.token   [j]    = rand_int(n_vocab);
+        batch.pos     [j]    = n_past[s]++;
+        batch.n_seq_id[j]    = 1;
+        batch.seq_id  [j][0] = s;
+        batch.logits  [j]    = false;
+    };
+
+    int n_checked = 0;
+    int n_failed  = 0;
+
+    for (int step = 0; step < n_steps && n_failed == 0; ++step) {
+        // change the KV cache between ubatches
+        const int op = rand_int(16);
+        const llama_seq_id s = rand_int(n_seq);
+        if (op == 0 && n_past[s] > 1) {
+            // drop the tail of a sequence
+            const llama_pos keep = 1 + rand_int(n_past[s] - 1);
+            if (llama_kv_cache_seq_rm(ctx, s, keep, -1)) {
+                n_past[s] = keep;
+            }
+        } else if (op == 1) {
+            // fork a sequence
+            const llama_seq_id dst = (s + 1 + rand_int(n_seq - 1)) % n_seq;
+            llama_kv_cache_seq_rm(ctx, dst, -1, -1);
+            llama_kv_cache_seq_cp(ctx, s, dst, -1, -1);
+            n_past[dst] = n_past[s];
+        } else if (op == 2 && n_past[s] > 8) {
+            // context shift: discard a few tokens in the middle and move the rest back
+            const llama_pos p0 = n_past[s]/2;
+            const llama_pos d  = 1 + rand_int(4);
+            if (llama_kv_cache_seq_rm(ctx, s, p0, p0 + d)) {
+                llama_kv_cache_seq_add(ctx, s, p0 + d, -1, -d);
+                n_past[s] -= d;
+            }
+        } else if (op == 3) {
+            // pause or resume a sequence, which changes the rows of the ubatch
+            active[s] = !active[s];
+        }
+
+        for (llama_seq_id k = 0; k < n_seq; ++k) {
+            if (n_past[k] >= n_max) {
+                llama_kv_cache_seq_rm(ctx, k, -1, -1);
+                n_past[k] = 0;
+            }
+        }
+
+        batch.n_tokens = 0;
+        if (rand_int(32) == 0) {
+            // a prompt too large to keep its mask
+            llama_kv_cache_seq_rm(ctx, s, -1, -1);
+            n_past[s] = 0;
+            for (int i = 0; i < GGML_KQ_MASK_PAD + 8; ++i) {
+                add_token(s);
+            }
+        } else {
+            for (llama_seq_id k = 0; k < n_seq; ++k) {
+                if (active[k]) {
+                    add_token(k);
+                }
+            }
+        }
+        if (batch.n_tokens == 0) {
+            continue;
+        }
+        batch.logits[batch.n_tokens - 1] = true;
+
+        if (llama_decode(ctx, batch) != 0) {
+            fprintf(stderr, "step %d: decode failed\n", step);
+            ++n_failed;
+            break;
+        }
+
+        std::vector<llama_seq_id> seq_ids(batch.n_tokens);
+        for (int j = 0; j < batch.n_tokens; ++j) {
+            seq_ids[j] = batch.seq_id[j][0];
+        }
+
+        const int64_t n_diff = llama_internal_kq_mask_cache_diff(ctx, seq_ids.data(), batch.pos, batch.n_tokens);
+        if (batch.n_tokens > GGML_KQ_MASK_PAD) {
+            if (n_diff != -1) {
+                fprintf(stderr, "step %d: the mask of a %d-token ubatch was kept\n", step, batch.n_tokens);
+                ++n_failed;
+            }
+            continue;
+        }
+        if (n_diff != 0) {
+            fprintf(stderr, "step %d: %lld elements of the kept KQ mask differ from the rebuilt one\n", step, (long long) n_diff);
+            ++n_failed;
+        }
+        ++n_checked;
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+
+    printf("%d ubatches checked\n", n_checked);
+
+    return n_failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+//  Tests the codec and the record format of compressed state files (src/llama-compress.h).
+
+#include "../src/llama-compress.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct test_data {
+    std::string name;
+    std::vector<uint8_t> data;
+    size_t stride;
+};
+
+// a pattern of small writes and tensor data, like the state of a sequence
+static std::vector<uint8_t> compress(const test_data & t, int n_threads) {
+    std::vector<uint8_t> out;
+    llama_compress_writer writer([&](const void * src, size_t size) {
+        out.insert(out.end(), (const uint8_t *) src, (const uint8_t *) src + size);
+    }, n_threads);
+
+    const uint32_t header[2] = { 0x12345678, (uint32_t) t.data.size() };
+    for (size_t i = 0, n; i < sizeof(header); i += n) {
+        uint8_t * dst = writer.append(sizeof(header) - i, 1, n);
+        std::memcpy(dst, (const uint8_t *) header + i, n);
+    }
+    for (size_t i = 0, n; i < t.data.size(); i += n) {
+        uint8_t * dst = writer.append(t.data.size() - i, t.stride, n);
+        std::memcpy(dst, t.data.data() + i, n);
+    }
+    writer.finish();
+    return out;
+}
+
+// decompress the whole input, the source callback fails the test on any read past its end
+static std::vector<uint8_t> decompress(const std::vector<uint8_t> & in, size_t size, int n_threads) {
+    size_t pos = 0;
+    llama_compress_reader reader([&](void * dst, size_t n) {
+        if (pos + n > in.size()) {
+            fprintf(stderr, "read past the end of the compressed data\n");
+            exit(1);
+        }
+        if (n > 0) {
+            std::memcpy(dst, in.data() + pos, n);
+            pos += n;
+        }
+    }, in.size(), n_threads);
+
+    uint32_t header[2];
+    reader.read_to(header, sizeof(header));
+    if (header[0] != 0x12345678 || header[1] != size) {
+        throw std::runtime_error("wrong header");
+    }
+    std::vector<uint8_t> out(size);
+    for (size_t i = 0; i < size; ) {
+        // mix both ways of reading
+        const size_t n = std::min(size - i, size_t(1000 + i % 77777));
+        if (i % 2) {
+            std::memcpy(out.data() + i, reader.read(n), n);
+        } else {
+            reader.read_to(out.data() + i, n);
+        }
+        i += n;
+    }
+    return out;
+}
+
+static uint16_t to_f16(float f) {
+    // round towards zero, good enough for the distribution of the test data
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const int      exp  = int((x >> 23) & 0xff) - 127 + 15;
+    if (exp <= 0) {
+        return uint16_t(sign);
+    }
+    return uint16_t(sign | (std::min(exp, 30) << 10) | ((x >> 13) & 0x3ff));
+}
+
+int main() {
+    std::mt19937 rng(1234);
+    std::vector<test_data> tests;
+
+    {
+        test_data t = { "random", std::vector<uint8_t>(3*llama_compress_writer::chunk_size + 12345), 1 };
+        for (auto & b : t.data) {
+            b = uint8_t(rng());
+        }
+        tests.push_back(std::move(t));
+    }
+    tests.push_back({ "zeros", std::vector<uint8_t>(5*llama_compress_writer::chunk_size + 7), 1 });
+    tests.push_back({ "empty", {}, 1 });
+    {
+        // f16 K/V rows: small values with a smooth distribution
+        std::normal_distribution<float> dist(0.0f, 0.5f);
+        test_data t = { "kv f16", std::vector<uint8_t>(2*(1u << 21)), 2 };
+        for (size_t i = 0; i < t.data.size(); i += 2) {
+            const uint16_t h = to_f16(dist(rng));
+            std::memcpy(t.data.data() + i, &h, 2);
+        }
+        tests.push_back(std::move(t));
+    }
+    {
+        // q8_0 blocks: a f16 scale and 32 int8 values
+        std::normal_distribution<float> dist(0.0f, 40.0f);
+        test_data t = { "kv q8_0", std::vector<uint8_t>(34*40000), 34 };
+        for (size_t i = 0; i < t.data.size(); i += 34) {
+            const uint16_t d = to_f16(0.01f + 0.001f*(rng() % 16));
+            std::memcpy(t.data.data() + i, &d, 2);
+            for (int j = 0; j < 32; ++j) {
+                t.data[i + 2 + j] = uint8_t(int8_t(std::max(-127.0f, std::min(127.0f, dist(rng)))));
+            }
+        }
+        tests.push_back(std::move(t));
+    }
+
+    int n_failed = 0;
+    for (const auto & t : tests) {
+        for (int n_threads : { 1, 3 }) {
+            const auto in = compress(t, n_threads);
+            const size_t n_chunks = t.data.size()/(llama_compress_writer::chunk_size/2) + 2;
+            printf("%-8s n_threads = %d: %8zu -> %8zu bytes\n", t.name.c_str(), n_threads, t.data.size(), in.size());
+
+            // round trip, with any number of threads
+            if (decompress(in, t.data.size(), 4 - n_threads) != t.data) {
+                printf("  FAIL: round trip\n");
+                ++n_failed;
+            }
+            // at most the record headers are added to data that does not compress
+            if (in.size() > t.data.size() + 8 + 16*n_chunks) {
+                printf("  FAIL: stored size %zu larger than the raw size plus the record headers\n", in.size());
+                ++n_failed;
+            }
+            if (t.name != "random" && t.name != "empty" && in.size() >= t.data.size()) {
+                printf("  FAIL: no compression\n");
+                ++n_failed;
+            }
+
+            // truncated data is rejected
+            for (size_t n : { size_t(0), size_t(7), size_t(16), size_t(17), in.size()/3, in.size()/2, in.size() - 1 }) {
+                if (n >= in.size()) {
+                    continue;
+                }
+                try {
+                    decompress(std::vector<uint8_t>(in.begin(), in.begin() + n), t.data.size(), n_threads);
+                    printf("  FAIL: data truncated to %zu bytes was accepted\n", n);
+                    ++n_failed;
+                } catch (const std::runtime_error &) {
+                }
+            }
+
+            // a flipped bit either is rejected, or does not change the data (e.g. the stride of a stored chunk)
+            const int n_flips = t.data.size() < (1u << 20) ? 100 : 20;
+            for (int i = 0; i < n_flips; ++i) {
+                auto bad = in;
+                // half of the flips hit the first record header
+                const size_t pos = i % 2 ? rng() % bad.size() : rng() % std::min(bad.size(), size_t(16));
+                bad[pos] ^= uint8_t(1u << (rng() % 8));
+                try {
+                    if (decompress(bad, t.data.size(), n_threads) != t.data) {
+                        printf("  FAIL: flipped bit at %zu was not detected\n", pos);
+                        ++n_failed;
+                    }
+                } catch (const std::runtime_error &) {
+                }
+            }
+        }
+    }
+
+    if (n_failed > 0) {
+        printf("%d checks failed\n", n_failed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}